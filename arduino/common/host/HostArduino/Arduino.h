@@ -0,0 +1,161 @@
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+// Part of the Arduino core for host builds (PlatformIO native) of the shared libraries:
+// time since start on a clock that can be swapped for a virtual one and a Serial stream on a tty or pty, driven by the caller's event loop,
+// and pins wired to whatever a simulation attaches (the firmware against a simulated plant)
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+#include <functional>
+#include <vector>
+
+#define HOST_SERIAL_RX_SIZE 4096
+
+#define HIGH 0x1
+#define LOW  0x0
+
+#define INPUT        0x0
+#define OUTPUT       0x1
+#define INPUT_PULLUP 0x2
+
+// no separate flash address space
+#define PROGMEM
+#define memcpy_P memcpy
+
+typedef bool    boolean;
+typedef uint8_t byte;
+
+// the time base of millis(), micros() and delay()
+class Clock
+{
+public:
+    virtual ~Clock() {}
+    virtual uint64_t getUs() = 0;
+    virtual void sleep(uint64_t us) = 0;
+};
+
+// the monotonic clock of the host from the first reading, like a board at reset
+class MonotonicClock : public Clock
+{
+public:
+    MonotonicClock();
+    uint64_t getUs() override;
+    void sleep(uint64_t us) override;
+
+private:
+    uint64_t _start_us;
+};
+
+// time that only moves when it is advanced, by the caller or by delay(): a simulation then runs
+// as fast as it can be computed, with the same result on every run
+class VirtualClock : public Clock
+{
+public:
+    VirtualClock(uint64_t start_us = 0) { _us = start_us; }
+    uint64_t getUs() override { return _us; }
+    void sleep(uint64_t us) override { _us += us; }
+    void advance(uint64_t us) { _us += us; }
+
+private:
+    uint64_t _us;
+};
+
+// the clock in use: monotonic, or built with HOST_VIRTUAL_CLOCK a virtual one from 0 so that
+// even the global constructors of a firmware see virtual time
+Clock &getClock();
+// another clock from now on, nullptr for the default one
+void setClock(Clock *clock);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+// single threaded, there is nothing to mask
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+// what the pins of a host board are wired to, none by default: inputs read 0 and outputs go nowhere
+class HostPins
+{
+public:
+    virtual ~HostPins() {}
+    virtual void pinMode(uint8_t /*pin*/, uint8_t /*mode*/) {}
+    virtual void digitalWrite(uint8_t pin, uint8_t level) = 0;
+    virtual int  digitalRead(uint8_t pin) = 0;
+    virtual int  analogRead(uint8_t pin) = 0;
+    // PWM duty cycle in the resolution of the board
+    virtual void analogWrite(uint8_t pin, int value) = 0;
+};
+
+void setHostPins(HostPins *pins);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+int  digitalRead(uint8_t pin);
+int  analogRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+
+class Stream
+{
+public:
+    virtual ~Stream() {}
+    virtual int available() = 0;
+    virtual int peek() = 0;
+    virtual int read() = 0;
+    virtual int availableForWrite() = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size) = 0;
+    size_t write(uint8_t c) { return write(&c, 1); }
+    // never blocks, only returns the bytes already available
+    size_t readBytes(uint8_t *buffer, size_t length);
+    size_t readBytes(char *buffer, size_t length) { return readBytes(reinterpret_cast<uint8_t *>(buffer), length); }
+};
+
+// non-blocking file descriptor, read ahead into a buffer and written through a backlog
+class HardwareSerial : public Stream
+{
+public:
+    HardwareSerial();
+    ~HardwareSerial();
+
+    bool open(const char *path);
+    void attach(int fd);
+    void close();
+    int  getFd() { return _fd; }
+    bool isOpen() { return _fd >= 0; }
+    // raw 8N1 at the given speed, ignored if the fd is not a tty
+    void begin(unsigned long baudrate);
+    operator bool() { return _fd >= 0; }
+
+    int available() override;
+    int peek() override;
+    int read() override;
+    int availableForWrite() override;
+    size_t write(const uint8_t *buffer, size_t size) override;
+    using Stream::write;
+
+    // bytes still waiting for the fd to become writable, sent by flushBacklog
+    size_t getBacklog() { return _tx.size(); }
+    bool   flushBacklog();
+    // false once the other end has gone away
+    bool   isConnected() { return _connected; }
+    // sees every chunk read from (transmit false) and written to the fd, e.g. to record the link
+    typedef std::function<void(bool transmit, const uint8_t *data, size_t size)> Tap;
+    void   setTap(Tap tap) { _tap = tap; }
+
+private:
+    bool fill();
+
+    int      _fd;
+    bool     _connected;
+    uint8_t  _rx[HOST_SERIAL_RX_SIZE];
+    size_t   _rx_head;
+    size_t   _rx_tail;
+    std::vector<uint8_t> _tx;
+    Tap      _tap;
+};
+
+extern HardwareSerial Serial;
+
+#endif
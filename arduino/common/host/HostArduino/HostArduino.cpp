@@ -0,0 +1,257 @@
+#include "Arduino.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+// a writer that stalls for longer than this loses its output, as a full UART would
+#define HOST_SERIAL_TX_LIMIT 65536
+
+HardwareSerial Serial;
+
+static HostPins *host_pins = nullptr;
+static Clock    *host_clock = nullptr;
+
+static uint64_t getMonotonicUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+MonotonicClock::MonotonicClock()
+{
+    _start_us = getMonotonicUs();
+}
+
+uint64_t MonotonicClock::getUs()
+{
+    return getMonotonicUs() - _start_us;
+}
+
+void MonotonicClock::sleep(uint64_t us)
+{
+    timespec ts;
+    ts.tv_sec  = static_cast<time_t>(us / 1000000);
+    ts.tv_nsec = static_cast<long>(us % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+// made on first use, normally from a global constructor
+static Clock &getDefaultClock()
+{
+#ifdef HOST_VIRTUAL_CLOCK
+    static VirtualClock clock;
+#else
+    static MonotonicClock clock;
+#endif
+    return clock;
+}
+
+Clock &getClock()
+{
+    return host_clock ? *host_clock : getDefaultClock();
+}
+
+void setClock(Clock *clock)
+{
+    host_clock = clock;
+}
+
+unsigned long millis()
+{
+    return static_cast<unsigned long>(getClock().getUs() / 1000);
+}
+
+unsigned long micros()
+{
+    return static_cast<unsigned long>(getClock().getUs());
+}
+
+void delay(unsigned long ms)
+{
+    getClock().sleep(static_cast<uint64_t>(ms) * 1000);
+}
+
+void setHostPins(HostPins *pins)
+{
+    host_pins = pins;
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    if (host_pins)
+        host_pins->pinMode(pin, mode);
+}
+
+void digitalWrite(uint8_t pin, uint8_t level)
+{
+    if (host_pins)
+        host_pins->digitalWrite(pin, level);
+}
+
+int digitalRead(uint8_t pin)
+{
+    return host_pins ? host_pins->digitalRead(pin) : LOW;
+}
+
+int analogRead(uint8_t pin)
+{
+    return host_pins ? host_pins->analogRead(pin) : 0;
+}
+
+void analogWrite(uint8_t pin, int value)
+{
+    if (host_pins)
+        host_pins->analogWrite(pin, value);
+}
+
+size_t Stream::readBytes(uint8_t *buffer, size_t length)
+{
+    size_t count = 0;
+    while (count < length) {
+        int c = read();
+        if (c < 0)
+            break;
+        buffer[count++] = static_cast<uint8_t>(c);
+    }
+    return count;
+}
+
+HardwareSerial::HardwareSerial()
+{
+    _fd = -1;
+    _connected = false;
+    _rx_head = 0;
+    _rx_tail = 0;
+}
+
+HardwareSerial::~HardwareSerial()
+{
+    close();
+}
+
+bool HardwareSerial::open(const char *path)
+{
+    int fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    attach(fd);
+    return true;
+}
+
+void HardwareSerial::attach(int fd)
+{
+    close();
+    _fd = fd;
+    _connected = true;
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+}
+
+void HardwareSerial::close()
+{
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+    _connected = false;
+    _rx_head = _rx_tail = 0;
+    _tx.clear();
+}
+
+static speed_t getSpeed(unsigned long baudrate)
+{
+    switch (baudrate) {
+        case 9600:    return B9600;
+        case 19200:   return B19200;
+        case 38400:   return B38400;
+        case 57600:   return B57600;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 921600:  return B921600;
+        default:      return B115200;
+    }
+}
+
+void HardwareSerial::begin(unsigned long baudrate)
+{
+    termios tio;
+    if (_fd < 0 || tcgetattr(_fd, &tio) != 0)
+        return;
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cflag &= ~(CSTOPB | CRTSCTS);
+    cfsetispeed(&tio, getSpeed(baudrate));
+    cfsetospeed(&tio, getSpeed(baudrate));
+    tcsetattr(_fd, TCSANOW, &tio);
+}
+
+// refill the read ahead once it is empty, false if nothing could be read
+bool HardwareSerial::fill()
+{
+    if (_rx_head < _rx_tail)
+        return true;
+    _rx_head = _rx_tail = 0;
+    if (_fd < 0)
+        return false;
+    ssize_t n = ::read(_fd, _rx, sizeof(_rx));
+    if (n > 0) {
+        _rx_tail = static_cast<size_t>(n);
+        if (_tap)
+            _tap(false, _rx, _rx_tail);
+        return true;
+    }
+    // a pty reports EIO once its other side has been closed
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        _connected = false;
+    return false;
+}
+
+int HardwareSerial::available()
+{
+    fill();
+    return static_cast<int>(_rx_tail - _rx_head);
+}
+
+int HardwareSerial::peek()
+{
+    return fill() ? _rx[_rx_head] : -1;
+}
+
+int HardwareSerial::read()
+{
+    return fill() ? _rx[_rx_head++] : -1;
+}
+
+int HardwareSerial::availableForWrite()
+{
+    return (_fd < 0) ? 0 : static_cast<int>(HOST_SERIAL_TX_LIMIT - _tx.size());
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    if (_fd < 0 || _tx.size() + size > HOST_SERIAL_TX_LIMIT)
+        return 0;
+    if (_tap)
+        _tap(true, buffer, size);
+    size_t sent = 0;
+    if (_tx.empty()) {
+        ssize_t n = ::write(_fd, buffer, size);
+        if (n > 0)
+            sent = static_cast<size_t>(n);
+    }
+    _tx.insert(_tx.end(), buffer + sent, buffer + size);
+    return size;
+}
+
+bool HardwareSerial::flushBacklog()
+{
+    while (!_tx.empty()) {
+        ssize_t n = ::write(_fd, _tx.data(), _tx.size());
+        if (n <= 0)
+            return false;
+        _tx.erase(_tx.begin(), _tx.begin() + n);
+    }
+    return true;
+}
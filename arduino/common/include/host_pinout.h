@@ -0,0 +1,36 @@
+// Host build (PlatformIO native), the pins wired to the simulated plant of hev_prototype_v1/sim
+#define BOARD "HOST"
+#define HEV_FULL_SYSTEM
+    // digital pins
+const int pin_valve_air_in        = 2;
+const int pin_valve_o2_in         = 3;
+const int pin_valve_purge         = 4;
+const int pin_valve_atmosphere    = 5;
+
+    // pwm pins
+const int pin_valve_inhale        = 6;
+const int pin_valve_exhale        = 7;
+
+    // adcs, 12 bit as on the ESP32
+const int pin_pressure_air_supply       = 20;
+const int pin_pressure_air_regulated    = 21;
+const int pin_pressure_buffer           = 22;
+const int pin_pressure_inhale           = 23;
+const int pin_pressure_patient          = 24;
+const int pin_temperature_buffer        = 25;
+const int pin_pressure_o2_supply        = 26;
+const int pin_pressure_o2_regulated     = 27;
+const int pin_pressure_diff_patient     = 28;
+
+    // leds
+const int pin_led_green        = 10;
+const int pin_led_yellow       = 11;
+const int pin_led_red          = 12;
+
+    // buzzer
+const int pin_buzzer         =  8;
+
+    // buttons
+const int pin_button_0       = 13;
+
+const int pwm_resolution = 8; // 8 bit resolution
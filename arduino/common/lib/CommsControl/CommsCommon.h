@@ -6,10 +6,16 @@
 #define CONST_TIMEOUT_ALARM 5
 #define CONST_TIMEOUT_DATA  10
 #define CONST_TIMEOUT_CMD   50
+#define CONST_TIMEOUT_REPORT 20
 
 
+// host builds queue more, e.g. all frames of a settings transaction
+#ifndef CONST_MAX_SIZE_RB_RECEIVING
 #define CONST_MAX_SIZE_RB_RECEIVING 10
+#endif
+#ifndef CONST_MAX_SIZE_RB_SENDING
 #define CONST_MAX_SIZE_RB_SENDING 5
+#endif
 #define CONST_MAX_SIZE_PACKET 64
 #define CONST_MAX_SIZE_BUFFER 128
 #define CONST_MIN_SIZE_PACKET 7
@@ -30,14 +36,22 @@
 #define PACKET_CMD   0x80
 #define PACKET_DATA  0x40
 #define PACKET_SET   0x20 //set vs get ?
+#define PACKET_REPORT (PACKET_DATA | PACKET_SET) // controller state read out on request
+#define PACKET_SETTINGS (PACKET_CMD | PACKET_SET) // bulk settings transaction
+#define PACKET_WAVEFORM (PACKET_ALARM | PACKET_SET) // breath waveform upload
 
-#define HEV_FORMAT_VERSION 0xA1
+#define REPORT_DATA_SIZE 48
+#define SETTINGS_FRAME_VALUES 5
+#define WAVEFORM_FRAME_POINTS 12
+
+// first byte of every payload, bump on any change of a layout so that hosts reject what they would misparse
+#define HEV_FORMAT_VERSION 0xA3
 
 // struct for all data sent
 struct data_format {
     uint8_t  version                = HEV_FORMAT_VERSION;
     uint8_t  fsm_state              = 0;
-    uint16_t dummy                  = 0;
+    uint16_t breath_timing_error    = 0; // us, worst late state transition of the last breath
     uint32_t timestamp              = 0;
     uint16_t pressure_air_supply    = 0;
     uint16_t pressure_air_regulated = 0;
@@ -69,34 +83,87 @@ struct alarm_format {
     uint32_t timestamp  = 0;
     uint8_t  alarm_type = 0;
     uint8_t  alarm_code = 0;
+    uint16_t latency    = 0; // us, from the first reading beyond the threshold to the enqueue
     uint32_t param      = 0;
 };
 
+// variable length read out, only the header and the first size bytes of data are sent
+struct report_format {
+    uint8_t  version     = HEV_FORMAT_VERSION;
+    uint8_t  report_type = 0;
+    uint8_t  report_code = 0;
+    uint8_t  size        = 0; // bytes used in data
+    uint32_t timestamp   = 0;
+    uint8_t  data[REPORT_DATA_SIZE];
+};
+
+// one setting, addressed like the single SET_* commands
+struct setting_value {
+    uint8_t  cmd_type = 0; // CMD_TYPE, 0 for an unused entry
+    uint8_t  cmd_code = 0;
+    uint16_t reserved = 0;
+    uint32_t param    = 0;
+};
+
+// frame of a bulk settings transaction, a transaction spans chunks frames sent in order.
+// the controller replies once, with the same format and no values, when the transaction is applied or rejected
+struct settings_format {
+    uint8_t  version  = HEV_FORMAT_VERSION;
+    uint8_t  txn      = 0; // chosen by the sender, echoed in the reply
+    uint8_t  chunk    = 0; // index of this frame within the transaction
+    uint8_t  chunks   = 0; // frames in the transaction
+    uint8_t  count    = 0; // values used in this frame
+    uint8_t  status   = 0; // reply only, SETTINGS_STATUS
+    uint16_t reserved = 0;
+    uint32_t epoch    = 0; // reply only, settings epoch in which the transaction was applied
+    setting_value values[SETTINGS_FRAME_VALUES];
+};
+
+// one point of the inhale waveform, the setpoint is interpolated linearly between points
+struct waveform_point {
+    uint16_t time  = 0; // ms from the start of INHALE
+    uint16_t value = 0; // inhale valve opening, 1/1000 of fully open
+};
+
+// frame of a waveform upload, sent in order like a settings transaction.
+// the points of all chunks make up the table, in increasing time; an empty table restores the fixed opening.
+// the controller replies once, with the same format and no points, when the table is swapped in or rejected
+struct waveform_format {
+    uint8_t  version  = HEV_FORMAT_VERSION;
+    uint8_t  txn      = 0; // chosen by the sender, echoed in the reply
+    uint8_t  chunk    = 0; // index of this frame within the upload
+    uint8_t  chunks   = 0; // frames in the upload
+    uint8_t  count    = 0; // points used in this frame
+    uint8_t  status   = 0; // reply only, SETTINGS_STATUS
+    uint16_t reserved = 0;
+    waveform_point points[WAVEFORM_FRAME_POINTS];
+};
+
 // enum of all transfer types
 enum PAYLOAD_TYPE {
     DATA,
     CMD,
     ALARM,
+    REPORT,
+    SETTINGS,
+    WAVEFORM,
     UNSET
 };
 
 // payload consists of type and information
 // type is set as address in the protocol
 // information is set as information in the protocol
+// only one information type is used at a time, so they share the storage
 class Payload {
 public:
-    Payload(PAYLOAD_TYPE type = PAYLOAD_TYPE::UNSET)  {_type = type; } //data_ = nullptr; cmd_ = nullptr; alarm_ = nullptr; }
+    Payload(PAYLOAD_TYPE type = PAYLOAD_TYPE::UNSET)  {_type = type; memset(_information, 0, sizeof(_information)); }
     Payload(const Payload &other) {
         _type = other._type;
-        memcpy(& _data, &other. _data, sizeof( data_format));
-        memcpy(&  _cmd, &other.  _cmd, sizeof(  cmd_format));
-        memcpy(&_alarm, &other._alarm, sizeof(alarm_format));
+        memcpy(_information, other._information, sizeof(_information));
     }
     Payload& operator=(const Payload& other) {
         _type = other._type;
-        memcpy(& _data, &other. _data, sizeof( data_format));
-        memcpy(&  _cmd, &other.  _cmd, sizeof(  cmd_format));
-        memcpy(&_alarm, &other._alarm, sizeof(alarm_format));
+        memcpy(_information, other._information, sizeof(_information));
         return *this;
     }
 
@@ -106,19 +173,28 @@ public:
     PAYLOAD_TYPE getType() {return _type; }
 
     // requires argument as new struct
-    void setData (data_format   *data) { _type = PAYLOAD_TYPE::DATA;  memcpy(& _data,  data, sizeof( data_format)); }
-    void setCmd  (cmd_format     *cmd) { _type = PAYLOAD_TYPE::CMD;   memcpy(&  _cmd,   cmd, sizeof(  cmd_format)); }
-    void setAlarm(alarm_format *alarm) { _type = PAYLOAD_TYPE::ALARM; memcpy(&_alarm, alarm, sizeof(alarm_format)); }
+    void setData  (data_format     *data) { _type = PAYLOAD_TYPE::DATA;   memcpy(_information,   data, sizeof(  data_format)); }
+    void setCmd   (cmd_format       *cmd) { _type = PAYLOAD_TYPE::CMD;    memcpy(_information,    cmd, sizeof(   cmd_format)); }
+    void setAlarm (alarm_format   *alarm) { _type = PAYLOAD_TYPE::ALARM;  memcpy(_information,  alarm, sizeof( alarm_format)); }
+    void setReport(report_format *report) { _type = PAYLOAD_TYPE::REPORT; memcpy(_information, report, sizeof(report_format)); }
+    void setSettings(settings_format *settings) { _type = PAYLOAD_TYPE::SETTINGS; memcpy(_information, settings, sizeof(settings_format)); }
+    void setWaveform(waveform_format *waveform) { _type = PAYLOAD_TYPE::WAVEFORM; memcpy(_information, waveform, sizeof(waveform_format)); }
 
     // get pointers to particular payload types
-    data_format  *getData () {return & _data; }
-    cmd_format   *getCmd  () {return &  _cmd; }
-    alarm_format *getAlarm() {return &_alarm; }
+    data_format   *getData  () {return reinterpret_cast<  data_format*>(_information); }
+    cmd_format    *getCmd   () {return reinterpret_cast<   cmd_format*>(_information); }
+    alarm_format  *getAlarm () {return reinterpret_cast< alarm_format*>(_information); }
+    report_format *getReport() {return reinterpret_cast<report_format*>(_information); }
+    settings_format *getSettings() {return reinterpret_cast<settings_format*>(_information); }
+    waveform_format *getWaveform() {return reinterpret_cast<waveform_format*>(_information); }
 
-    void unsetAll()   { unsetData(); unsetAlarm(); unsetCmd(); _type = PAYLOAD_TYPE::UNSET; }
-    void unsetData()  { memset(& _data, 0, sizeof( data_format)); }
-    void unsetCmd()   { memset(&  _cmd, 0, sizeof(  cmd_format)); }
-    void unsetAlarm() { memset(&_alarm, 0, sizeof(alarm_format)); }
+    void unsetAll()    { memset(_information, 0, sizeof(_information)); _type = PAYLOAD_TYPE::UNSET; }
+    void unsetData()   { memset(_information, 0, sizeof(  data_format)); }
+    void unsetCmd()    { memset(_information, 0, sizeof(   cmd_format)); }
+    void unsetAlarm()  { memset(_information, 0, sizeof( alarm_format)); }
+    void unsetReport() { memset(_information, 0, sizeof(report_format)); }
+    void unsetSettings() { memset(_information, 0, sizeof(settings_format)); }
+    void unsetWaveform() { memset(_information, 0, sizeof(waveform_format)); }
 
     void setPayload(PAYLOAD_TYPE type, void* information) {
         setType(type);
@@ -128,13 +204,22 @@ public:
     void setInformation(void* information) {
         switch (_type) {
             case PAYLOAD_TYPE::DATA:
-                setData (reinterpret_cast< data_format*>(information));
+                setData  (reinterpret_cast<  data_format*>(information));
                 break;
             case PAYLOAD_TYPE::CMD:
-                setCmd  (reinterpret_cast<  cmd_format*>(information));
+                setCmd   (reinterpret_cast<   cmd_format*>(information));
                 break;
             case PAYLOAD_TYPE::ALARM:
-                setAlarm(reinterpret_cast<alarm_format*>(information));
+                setAlarm (reinterpret_cast< alarm_format*>(information));
+                break;
+            case PAYLOAD_TYPE::REPORT:
+                setReport(reinterpret_cast<report_format*>(information));
+                break;
+            case PAYLOAD_TYPE::SETTINGS:
+                setSettings(reinterpret_cast<settings_format*>(information));
+                break;
+            case PAYLOAD_TYPE::WAVEFORM:
+                setWaveform(reinterpret_cast<waveform_format*>(information));
                 break;
             default:
                 break;
@@ -145,11 +230,12 @@ public:
     void *getInformation() {
         switch (_type) {
             case PAYLOAD_TYPE::DATA:
-                return reinterpret_cast<void*>(getData ());
             case PAYLOAD_TYPE::CMD:
-                return reinterpret_cast<void*>(getCmd  ());
             case PAYLOAD_TYPE::ALARM:
-                return reinterpret_cast<void*>(getAlarm());
+            case PAYLOAD_TYPE::REPORT:
+            case PAYLOAD_TYPE::SETTINGS:
+            case PAYLOAD_TYPE::WAVEFORM:
+                return reinterpret_cast<void*>(_information);
             default:
                 return nullptr;
         }
@@ -159,11 +245,17 @@ public:
     uint8_t getSize()  {
         switch (_type) {
             case PAYLOAD_TYPE::DATA:
-                return static_cast<uint8_t>(sizeof( data_format));
+                return static_cast<uint8_t>(sizeof(  data_format));
             case PAYLOAD_TYPE::CMD:
-                return static_cast<uint8_t>(sizeof(  cmd_format));
+                return static_cast<uint8_t>(sizeof(   cmd_format));
             case PAYLOAD_TYPE::ALARM:
-                return static_cast<uint8_t>(sizeof(alarm_format));
+                return static_cast<uint8_t>(sizeof( alarm_format));
+            case PAYLOAD_TYPE::REPORT:
+                return static_cast<uint8_t>(offsetof(report_format, data) + getReport()->size);
+            case PAYLOAD_TYPE::SETTINGS:
+                return static_cast<uint8_t>(sizeof(settings_format));
+            case PAYLOAD_TYPE::WAVEFORM:
+                return static_cast<uint8_t>(sizeof(waveform_format));
             default:
                 return 0;
         }
@@ -172,9 +264,8 @@ public:
 private:
     PAYLOAD_TYPE _type;
 
-    data_format   _data;
-    cmd_format     _cmd;
-    alarm_format _alarm;
+    // sized for the largest information type (report_format, waveform_format), uint32_t for the alignment of the formats
+    uint32_t _information[(sizeof(report_format) + 3) / 4];
 };
 
 #endif
@@ -1,9 +1,14 @@
 #include "CommsControl.h"
 
-CommsControl::CommsControl(uint32_t baudrate) {
+CommsControl::CommsControl(uint32_t baudrate, Stream &serial) {
     _baudrate = baudrate;
+    _serial   = &serial;
 
-    _last_trans_time = static_cast<uint32_t>(millis());
+    uint32_t tnow = static_cast<uint32_t>(millis());
+    _last_trans_time_alarm  = tnow;
+    _last_trans_time_data   = tnow;
+    _last_trans_time_cmd    = tnow;
+    _last_trans_time_report = tnow;
 
     _start_trans_index   = 0xFF;
     _last_trans_index    = 0;
@@ -18,6 +23,8 @@ CommsControl::CommsControl(uint32_t baudrate) {
     _ring_buff_alarm = new RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING>();
     _ring_buff_data  = new RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING>();
     _ring_buff_cmd   = new RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING>();
+    _ring_buff_report= new RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING>();
+    _ring_buff_next  = nullptr;
 
     _ring_buff_received = new RingBuf<Payload, CONST_MAX_SIZE_RB_RECEIVING>();
 
@@ -28,6 +35,15 @@ CommsControl::CommsControl(uint32_t baudrate) {
 
     _sequence_send    = 0;
     _sequence_receive = 0;
+
+    _acked_alarm  = 0;
+    _acked_data   = 0;
+    _acked_cmd    = 0;
+    _acked_report = 0;
+
+    _alarm_resend_limit = 0;
+    _alarm_sends        = 0;
+    _alarm_dropped      = 0;
 }
 
 // WIP
@@ -36,24 +52,37 @@ CommsControl::~CommsControl() {
 }
 
 void CommsControl::beginSerial() {
-    Serial.begin(_baudrate);
+    if (_serial == &Serial) {
+        Serial.begin(_baudrate);
+    }
 }
 
 // main function to always call and try and send data
 // TODO: needs switch on data type with global timeouts on data pushing
 void CommsControl::sender() {
+    // the timeouts are there not to resend before the ACK could arrive, each queue
+    // times its own head so that a busy queue never holds back the others.
+    // the payload after an ACKed one is sent right away, also if it is only queued later
+    if (_ring_buff_next != nullptr && !_ring_buff_next->isEmpty()) {
+        sendQueue(_ring_buff_next);
+    }
+
     uint32_t tnow = static_cast<uint32_t>(millis());
-    if (tnow - _last_trans_time > CONST_TIMEOUT_ALARM) {
+    if (tnow - _last_trans_time_alarm > CONST_TIMEOUT_ALARM) {
         sendQueue(_ring_buff_alarm);
     }
 
-    if (tnow - _last_trans_time > CONST_TIMEOUT_CMD) {
+    if (tnow - _last_trans_time_cmd > CONST_TIMEOUT_CMD) {
         sendQueue(_ring_buff_cmd);
     }
 
-    if (tnow - _last_trans_time > CONST_TIMEOUT_DATA) {
+    if (tnow - _last_trans_time_data > CONST_TIMEOUT_DATA) {
         sendQueue(_ring_buff_data);
     }
+
+    if (tnow - _last_trans_time_report > CONST_TIMEOUT_REPORT) {
+        sendQueue(_ring_buff_report);
+    }
 }
 
 // main function to always try to receive data
@@ -62,13 +91,13 @@ void CommsControl::receiver() {
     uint8_t currentTransIndex;
 
     // check if any data in waiting
-    if (Serial.available()) {
+    if (_serial->available()) {
         // while able to read data (unable == -1)
-        while (Serial.peek() >= 0) {
+        while (_serial->peek() >= 0) {
             // read byte by byte, just in case the transmission is somehow blocked
 
             // WARNING: for mkrvidor4000, readbytes takes char* not uchar*
-            _last_trans_index += Serial.readBytes(_last_trans + _last_trans_index, 1);
+            _last_trans_index += _serial->readBytes(_last_trans + _last_trans_index, 1);
 
             // if managed to read at least 1 byte
             if (_last_trans_index > 0 && _last_trans_index < CONST_MAX_SIZE_BUFFER) {
@@ -152,6 +181,15 @@ bool CommsControl::writePayload(Payload &pl) {
         case CMD:
             tmpComms = CommsFormat::generateCMD(&pl);
             break;
+        case REPORT:
+            tmpComms = CommsFormat::generateREPORT(&pl);
+            break;
+        case SETTINGS:
+            tmpComms = CommsFormat::generateSETTINGS(&pl);
+            break;
+        case WAVEFORM:
+            tmpComms = CommsFormat::generateWAVEFORM(&pl);
+            break;
         default:
             return false;
     }
@@ -162,6 +200,9 @@ bool CommsControl::writePayload(Payload &pl) {
         CommsFormat *tmpCommsRm;
         if (queue->pop(tmpCommsRm)) {
             delete tmpCommsRm;
+            if (queue == _ring_buff_alarm) {
+                _alarm_sends = 0;
+            }
         }
     }
 
@@ -171,6 +212,32 @@ bool CommsControl::writePayload(Payload &pl) {
     return false;
 }
 
+// true if the next payload of this type would push out the oldest queued one
+bool CommsControl::isQueueFull(PAYLOAD_TYPE type) {
+    RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *queue = getQueue(type);
+    return (queue == nullptr) || queue->isFull();
+}
+
+// true once every payload of this type has been ACKed
+bool CommsControl::isQueueEmpty(PAYLOAD_TYPE type) {
+    RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *queue = getQueue(type);
+    return (queue == nullptr) || queue->isEmpty();
+}
+
+// the queue is first in first out, so the n-th payload written to it is ACKed once this passes n
+uint32_t CommsControl::getAckedCount(PAYLOAD_TYPE type) {
+    uint32_t *counter = getAckedCounter(type);
+    return (counter == nullptr) ? 0 : *counter;
+}
+
+void CommsControl::setAlarmResendLimit(uint8_t limit) {
+    _alarm_resend_limit = limit;
+}
+
+uint32_t CommsControl::getAlarmDroppedCount() {
+    return _alarm_dropped;
+}
+
 bool CommsControl::readPayload( Payload &pl) {
     if ( !_ring_buff_received->isEmpty()) {
         if (_ring_buff_received->pop(pl)) {
@@ -231,21 +298,38 @@ bool CommsControl::decoder(uint8_t* data, uint8_t dataStart, uint8_t dataStop) {
 
 // sending anything of commsDATA format
 void CommsControl::sendQueue(RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *queue) {
+    // an alarm nobody ACKs would hold back the ones behind it for good
+    if (queue == _ring_buff_alarm && _alarm_resend_limit != 0 && _alarm_sends >= _alarm_resend_limit) {
+        CommsFormat *tmpCommsRm;
+        if (queue->pop(tmpCommsRm)) {
+            delete tmpCommsRm;
+            _alarm_dropped++;
+        }
+        _alarm_sends = 0;
+    }
+
     // if have data to send
     if (!queue->isEmpty()) {
+        if (queue == _ring_buff_alarm) {
+            _alarm_sends++;
+        }
         queue->operator [](0)->setSequenceSend(_sequence_send);
         sendPacket(queue->operator [](0));
+        // from now on the head is only resent after the timeout
+        if (queue == _ring_buff_next) {
+            _ring_buff_next = nullptr;
+        }
 
-        // reset sending counter
-        _last_trans_time = static_cast<uint32_t>(millis());
+        // reset sending counter of this queue
+        *getLastTransTime(queue) = static_cast<uint32_t>(millis());
     }
 }
 
 void CommsControl::sendPacket(CommsFormat *packet) {
     // if encoded and able to write data
     if (encoder(packet->getData(), packet->getSize()) ) {
-        if (Serial.availableForWrite() >= _comms_send_size) {
-            Serial.write(_comms_send, _comms_send_size);
+        if (_serial->availableForWrite() >= _comms_send_size) {
+            _serial->write(_comms_send, _comms_send_size);
         } 
     }
 }
@@ -253,7 +337,7 @@ void CommsControl::sendPacket(CommsFormat *packet) {
 // resending the packet, can lower the timeout since either NACK or wrong FCS already checked
 //WIP
 void CommsControl::resendPacket(RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *queue) {
-    ;
+    (void)queue;
 }
 
 
@@ -263,7 +347,7 @@ bool CommsControl::receivePacket(PAYLOAD_TYPE &type) {
     _payload_tmp.setType(type);
     void *tmpInformation = _payload_tmp.getInformation();
     // if type is definet, copy information from comms to payload
-    if (tmpInformation != nullptr) {
+    if (tmpInformation != nullptr && _comms_tmp.getInfoSize() <= sizeof(report_format)) {
         memcpy(tmpInformation, _comms_tmp.getInformation(), _comms_tmp.getInfoSize());
 
         // remove first entry if queue is full
@@ -290,12 +374,26 @@ void CommsControl::finishPacket(PAYLOAD_TYPE &type) {
             CommsFormat * tmpComms;
             if (tmpQueue->pop(tmpComms)) {
                 delete tmpComms;
+                (*getAckedCounter(type))++;
+                if (tmpQueue == _ring_buff_alarm) {
+                    _alarm_sends = 0;
+                }
+                _ring_buff_next = tmpQueue;
             }
         }
     }
 }
 
 PAYLOAD_TYPE CommsControl::getInfoType(uint8_t *address) {
+    if ((*address & (PACKET_TYPE | PACKET_SET)) == PACKET_REPORT) {
+        return PAYLOAD_TYPE::REPORT;
+    }
+    if ((*address & (PACKET_TYPE | PACKET_SET)) == PACKET_SETTINGS) {
+        return PAYLOAD_TYPE::SETTINGS;
+    }
+    if ((*address & (PACKET_TYPE | PACKET_SET)) == PACKET_WAVEFORM) {
+        return PAYLOAD_TYPE::WAVEFORM;
+    }
     switch (*address & PACKET_TYPE) {
         case PACKET_ALARM:
             return PAYLOAD_TYPE::ALARM;
@@ -314,9 +412,44 @@ RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *CommsControl::getQueue(PAYLOA
         case PAYLOAD_TYPE::ALARM:
             return _ring_buff_alarm;
         case PAYLOAD_TYPE::CMD:
+        case PAYLOAD_TYPE::SETTINGS:
+        case PAYLOAD_TYPE::WAVEFORM:
+            // settings and waveform replies are rare, they share the command queue
             return _ring_buff_cmd;
         case PAYLOAD_TYPE::DATA:
             return _ring_buff_data;
+        case PAYLOAD_TYPE::REPORT:
+            return _ring_buff_report;
+        default:
+            return nullptr;
+    }
+}
+
+// get link to the time the head of the queue was last sent
+uint32_t *CommsControl::getLastTransTime(RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *queue) {
+    if (queue == _ring_buff_alarm) {
+        return &_last_trans_time_alarm;
+    } else if (queue == _ring_buff_cmd) {
+        return &_last_trans_time_cmd;
+    } else if (queue == _ring_buff_data) {
+        return &_last_trans_time_data;
+    }
+    return &_last_trans_time_report;
+}
+
+// get link to the ACK counter of the queue according to packet format
+uint32_t *CommsControl::getAckedCounter(PAYLOAD_TYPE &type) {
+    switch (type) {
+        case PAYLOAD_TYPE::ALARM:
+            return &_acked_alarm;
+        case PAYLOAD_TYPE::CMD:
+        case PAYLOAD_TYPE::SETTINGS:
+        case PAYLOAD_TYPE::WAVEFORM:
+            return &_acked_cmd;
+        case PAYLOAD_TYPE::DATA:
+            return &_acked_data;
+        case PAYLOAD_TYPE::REPORT:
+            return &_acked_report;
         default:
             return nullptr;
     }
@@ -14,19 +14,31 @@
 // class to provide simple communication protocol based on the data format
 class CommsControl {
 public:
-    CommsControl(uint32_t baudrate = 115200);
+    // serial is the link to the other side, a host may run several links side by side
+    CommsControl(uint32_t baudrate = 115200, Stream &serial = Serial);
     ~CommsControl();
 
+    // begins Serial, any other stream is begun by its owner as Stream has no begin()
     void beginSerial();
 
     bool writePayload(Payload &pl);
     bool readPayload (Payload &pl);
+    bool isQueueFull (PAYLOAD_TYPE type);
+    bool isQueueEmpty(PAYLOAD_TYPE type);
+    // payloads of the queue of this type ACKed so far, wraps around
+    uint32_t getAckedCount(PAYLOAD_TYPE type);
+    // the head of the alarm queue is dropped after this many sends without an ACK, 0 never does
+    void setAlarmResendLimit(uint8_t limit);
+    // alarm payloads dropped that way so far, wraps around
+    uint32_t getAlarmDroppedCount();
 
     void sender();
     void receiver();
 
 private:
     RingBuf<CommsFormat *,CONST_MAX_SIZE_RB_SENDING> *getQueue(PAYLOAD_TYPE &type);
+    uint32_t *getLastTransTime(RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *queue);
+    uint32_t *getAckedCounter(PAYLOAD_TYPE &type);
     PAYLOAD_TYPE getInfoType(uint8_t *address);
 
     void sendQueue    (RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *queue);
@@ -40,6 +52,8 @@ private:
     void sendPacket(CommsFormat* packet);
 
 private:
+    Stream *_serial;
+
     uint8_t _sequence_send;
     uint8_t _sequence_receive;
 
@@ -49,15 +63,31 @@ private:
     RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *_ring_buff_alarm;
     RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *_ring_buff_data;
     RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *_ring_buff_cmd;
+    RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *_ring_buff_report;
+    // queue whose head was ACKed, its next payload has not been sent yet and can go at once
+    RingBuf<CommsFormat *, CONST_MAX_SIZE_RB_SENDING> *_ring_buff_next;
 
     RingBuf<Payload, CONST_MAX_SIZE_RB_RECEIVING> *_ring_buff_received;
 
+    uint32_t _acked_alarm;
+    uint32_t _acked_data;
+    uint32_t _acked_cmd;
+    uint32_t _acked_report;
+
+    uint8_t  _alarm_resend_limit;
+    uint8_t  _alarm_sends;      // of the head of the alarm queue
+    uint32_t _alarm_dropped;
+
     Payload     _payload_tmp;
     CommsFormat _comms_tmp;
 
     uint32_t _baudrate;
 
-    uint32_t _last_trans_time;
+    // when the head of each queue was last sent, each queue waits for its own ACK
+    uint32_t _last_trans_time_alarm;
+    uint32_t _last_trans_time_data;
+    uint32_t _last_trans_time_cmd;
+    uint32_t _last_trans_time_report;
 
     uint8_t _comms_received[CONST_MAX_SIZE_BUFFER];
     uint8_t _comms_received_size;
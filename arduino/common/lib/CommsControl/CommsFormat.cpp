@@ -108,4 +108,18 @@ CommsFormat* CommsFormat::generateDATA (Payload *pl) {
     tmpComms->setInformation(pl);
     return tmpComms;
 }
-
+CommsFormat* CommsFormat::generateREPORT(Payload *pl) {
+    CommsFormat *tmpComms = new CommsFormat(pl->getSize(), PACKET_REPORT);
+    tmpComms->setInformation(pl);
+    return tmpComms;
+}
+CommsFormat* CommsFormat::generateSETTINGS(Payload *pl) {
+    CommsFormat *tmpComms = new CommsFormat(pl->getSize(), PACKET_SETTINGS);
+    tmpComms->setInformation(pl);
+    return tmpComms;
+}
+CommsFormat* CommsFormat::generateWAVEFORM(Payload *pl) {
+    CommsFormat *tmpComms = new CommsFormat(pl->getSize(), PACKET_WAVEFORM);
+    tmpComms->setInformation(pl);
+    return tmpComms;
+}
@@ -65,6 +65,9 @@ public:
     static CommsFormat* generateALARM(Payload *pl);
     static CommsFormat* generateCMD  (Payload *pl);
     static CommsFormat* generateDATA (Payload *pl);
+    static CommsFormat* generateREPORT(Payload *pl);
+    static CommsFormat* generateSETTINGS(Payload *pl);
+    static CommsFormat* generateWAVEFORM(Payload *pl);
 
 private:
     uint8_t  _data[CONST_MAX_SIZE_PACKET];
@@ -0,0 +1,182 @@
+#include "Plant.h"
+
+#define PLANT_ATMOSPHERE 1013.25f  // mbar
+
+// the sensors, adc counts = offset + gain * value. offsets are what the calibration finds
+#define SENSOR_SUPPLY        200, 0.45f    // 0-8 bar
+#define SENSOR_REGULATED     300, 1.5f     // 0-2.5 bar
+#define SENSOR_BUFFER        300, 3.0f     // 0-1.2 bar
+#define SENSOR_INHALE        250, 30.0f    // 0-120 mbar
+#define SENSOR_PATIENT       260, 30.0f
+#define SENSOR_FLOW         2048, 800.0f   // flow sensor, signed around mid scale, per L/s
+#define SENSOR_TEMPERATURE   310, 0.0f     // 25 C
+
+Plant::Plant(const plant_parameters &parameters)
+{
+    _parameters = parameters;
+    memset(&_state, 0, sizeof(_state));
+    _time_us = 0;
+    _inhale.command = _inhale.position = 0;
+    _exhale.command = _exhale.position = 0;
+    _air_in = false;
+    _o2_in = false;
+    _purge = false;
+    _random = parameters.seed ? parameters.seed : 1;
+    // the supplies are on, the regulators settled
+    _state.air_regulated = parameters.regulated;
+    _state.o2_regulated = parameters.regulated;
+}
+
+Plant::~Plant()
+{;}
+
+void Plant::advance(uint64_t time_us)
+{
+    if (_time_us == 0)
+        _time_us = time_us;
+    while (time_us - _time_us >= PLANT_STEP_US) {
+        _time_us += PLANT_STEP_US;
+        step(PLANT_STEP_US * 1e-6f);
+    }
+}
+
+// k * dp / sqrt(|dp| + laminar): turbulent at large pressure drops, linear close to none
+float Plant::getOrifice(float k, float dp)
+{
+    return k * dp / sqrtf(fabsf(dp) + _parameters.valve_laminar);
+}
+
+// half a sine of effort while breathing in, relaxed for the rest of the cycle
+float Plant::getMuscle()
+{
+    if (_parameters.effort <= 0 || _parameters.effort_rate <= 0)
+        return 0;
+    float period = 60.0f / _parameters.effort_rate;
+    float phase = fmodf(static_cast<float>(_time_us * 1e-6), period) / period;
+    if (phase >= _parameters.effort_fraction)
+        return 0;
+    return _parameters.effort * sinf(static_cast<float>(M_PI) * phase / _parameters.effort_fraction);
+}
+
+void Plant::moveValve(valve_drive &valve, float dt)
+{
+    while (!valve.commands.empty() && valve.commands.front().first <= _time_us) {
+        valve.command = valve.commands.front().second;
+        valve.commands.pop_front();
+    }
+    valve.position += (valve.command - valve.position) * dt / (_parameters.valve_tau + dt);
+}
+
+void Plant::step(float dt)
+{
+    const plant_parameters &p = _parameters;
+    plant_state &s = _state;
+    moveValve(_inhale, dt);
+    moveValve(_exhale, dt);
+    s.opening_inhale = _inhale.position;
+    s.opening_exhale = _exhale.position;
+    float crack = p.valve_crack;
+    float inhale = (s.opening_inhale > crack) ? (s.opening_inhale - crack) / (1 - crack) : 0;
+    float exhale = (s.opening_exhale > crack) ? (s.opening_exhale - crack) / (1 - crack) : 0;
+
+    // flows, the valves are non return
+    float flow_air = _air_in ? fmaxf(0, getOrifice(p.valve_in, s.air_regulated - s.buffer)) : 0;
+    float flow_o2  = _o2_in  ? fmaxf(0, getOrifice(p.valve_in, s.o2_regulated - s.buffer)) : 0;
+    float flow_purge = _purge ? fmaxf(0, getOrifice(p.valve_purge, s.buffer)) : 0;
+    s.flow_inhale  = fmaxf(0, getOrifice(p.valve_inhale * inhale, s.buffer - s.circuit));
+    s.flow_exhale  = fmaxf(0, getOrifice(p.valve_exhale * exhale, s.circuit));
+    s.muscle       = getMuscle();
+    float alveolar = s.lung_volume / p.compliance - s.muscle;
+    s.flow_patient = (s.circuit - alveolar) / p.resistance;
+
+    // regulators droop with the flow drawn and follow their set point, capped by the supply
+    float air_target = fminf(p.supply_air, p.regulated - p.regulator_droop * flow_air);
+    float o2_target  = fminf(p.supply_o2,  p.regulated - p.regulator_droop * flow_o2);
+    s.air_regulated += (air_target - s.air_regulated) * dt / (p.regulator_tau + dt);
+    s.o2_regulated  += (o2_target  - s.o2_regulated ) * dt / (p.regulator_tau + dt);
+
+    // isothermal buffer, the circuit and the lung as compliances
+    s.buffer      += PLANT_ATMOSPHERE / p.buffer_volume * (flow_air + flow_o2 - flow_purge - s.flow_inhale) * dt;
+    s.circuit     += (s.flow_inhale - s.flow_exhale - s.flow_patient) / p.circuit_compliance * dt;
+    s.lung_volume += s.flow_patient * dt;
+    if (s.buffer < 0)
+        s.buffer = 0;
+    s.inhale = s.circuit + p.line_resistance * s.flow_inhale;
+}
+
+void Plant::setValve(valve_drive &valve, float command)
+{
+    uint64_t at_us = static_cast<uint64_t>(micros()) + static_cast<uint64_t>(_parameters.valve_delay * 1e6f);
+    valve.commands.push_back(std::make_pair(at_us, command));
+}
+
+void Plant::digitalWrite(uint8_t pin, uint8_t level)
+{
+    if (pin == pin_valve_air_in)
+        _air_in = (level == HIGH);
+    else if (pin == pin_valve_o2_in)
+        _o2_in = (level == HIGH);
+    else if (pin == pin_valve_purge)
+        _purge = (level == HIGH);
+}
+
+int Plant::digitalRead(uint8_t /*pin*/)
+{
+    // the button is never pressed
+    return LOW;
+}
+
+void Plant::analogWrite(uint8_t pin, int value)
+{
+    float opening = static_cast<float>(value) / ((1 << pwm_resolution) - 1);
+    if (pin == pin_valve_inhale)
+        setValve(_inhale, opening);
+    else if (pin == pin_valve_exhale)
+        setValve(_exhale, opening);
+}
+
+// gaussian, from a xorshift generator so that a seed gives the same run everywhere
+float Plant::getNoise()
+{
+    float sum = 0;
+    for (int i = 0; i < 4; i++) {
+        _random ^= _random << 13;
+        _random ^= _random >> 17;
+        _random ^= _random << 5;
+        sum += static_cast<float>(_random) / 4294967296.0f;
+    }
+    // the sum of 4 uniforms has a variance of 1/3
+    return (sum - 2) * 1.7320508f;
+}
+
+int Plant::getCounts(float value, float offset, float gain)
+{
+    float counts = offset + gain * value + _parameters.noise * getNoise();
+    int rounded = static_cast<int>(lroundf(counts));
+    return (rounded < 0) ? 0 : (rounded > PLANT_ADC_MAX) ? PLANT_ADC_MAX : rounded;
+}
+
+int Plant::analogRead(uint8_t pin)
+{
+    advance(static_cast<uint64_t>(micros()));
+    const plant_state &s = _state;
+    if (pin == pin_pressure_air_supply)
+        return getCounts(_parameters.supply_air, SENSOR_SUPPLY);
+    if (pin == pin_pressure_o2_supply)
+        return getCounts(_parameters.supply_o2, SENSOR_SUPPLY);
+    if (pin == pin_pressure_air_regulated)
+        return getCounts(s.air_regulated, SENSOR_REGULATED);
+    if (pin == pin_pressure_o2_regulated)
+        return getCounts(s.o2_regulated, SENSOR_REGULATED);
+    if (pin == pin_pressure_buffer)
+        return getCounts(s.buffer, SENSOR_BUFFER);
+    if (pin == pin_pressure_inhale)
+        return getCounts(s.inhale, SENSOR_INHALE);
+    if (pin == pin_pressure_patient)
+        return getCounts(s.circuit, SENSOR_PATIENT);
+    if (pin == pin_pressure_diff_patient)
+        return getCounts(s.flow_patient, SENSOR_FLOW);
+    if (pin == pin_temperature_buffer)
+        return getCounts(0, SENSOR_TEMPERATURE);
+    return 0;
+}
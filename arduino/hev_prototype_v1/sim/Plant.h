@@ -0,0 +1,111 @@
+#ifndef PLANT_H
+#define PLANT_H
+
+// Lung and pneumatics of the prototype for host builds of the firmware: the gas supplies and
+// their regulators, the inlet, purge, inhale and exhale valves, the buffer, the patient circuit
+// and a lung of given resistance and compliance, optionally breathing on its own. It answers
+// analogRead with the quantised readings of the sensors and follows the valve outputs.
+//
+// Pressures are in mbar above the atmosphere, volumes in L and flows in L/s at the atmosphere.
+
+#include <Arduino.h>
+#include <deque>
+#include <utility>
+#include "common.h"
+
+// integration step, well within the fastest time constant of the circuit
+#define PLANT_STEP_US 100
+#define PLANT_ADC_MAX 4095
+
+struct plant_parameters {
+    // supplies and the regulators after them
+    float supply_air       = 4000;
+    float supply_o2        = 4000;
+    float regulated        = 600;    // set point of both regulators
+    float regulator_droop  = 50;     // mbar per L/s drawn
+    float regulator_tau    = 0.02f;  // s
+    float buffer_volume    = 2.0f;   // L
+    // valves, flow in L/s for 1 mbar across when open: k * dp / sqrt(|dp| + laminar)
+    float valve_in         = 0.04f;  // each of the air and o2 inlets
+    float valve_purge      = 0.1f;
+    float valve_inhale     = 0.05f;  // fully open
+    float valve_exhale     = 0.6f;   // fully open
+    float valve_laminar    = 1;      // mbar, below which orifice flow is linear in the pressure
+    float valve_crack      = 0.15f;  // proportional valves pass nothing below this opening
+    float valve_tau        = 0.005f; // s, response of the proportional valves
+    float valve_delay      = 0.010f; // s, from a command to the valve starting to move
+    // patient circuit
+    float circuit_compliance = 0.002f; // L/mbar, tubing
+    float line_resistance  = 2;      // mbar per L/s, from the inhale valve to the circuit
+    // lung
+    float resistance       = 5;      // mbar per L/s, airways
+    float compliance       = 0.05f;  // L/mbar
+    // spontaneous breathing, as a muscle pressure lowering the alveolar pressure
+    float effort           = 0;      // mbar at the peak, 0 for a passive lung
+    float effort_rate      = 12;     // per minute
+    float effort_fraction  = 0.35f;  // part of the cycle spent breathing in
+    // sensors
+    float noise            = 1;      // adc counts rms
+    uint32_t seed          = 1;
+};
+
+// state of the plant, for traces and the checks of a soak test
+struct plant_state {
+    float air_regulated;
+    float o2_regulated;
+    float buffer;
+    float circuit;         // pressure at the patient
+    float inhale;          // pressure after the inhale valve
+    float lung_volume;     // above the relaxed volume
+    float flow_inhale;
+    float flow_exhale;
+    float flow_patient;    // into the lung
+    float opening_inhale;  // 0-1
+    float opening_exhale;
+    float muscle;          // pressure of the breathing effort
+};
+
+class Plant : public HostPins
+{
+
+public:
+    Plant(const plant_parameters &parameters);
+    ~Plant();
+    // integrates up to the given time, in us of micros()
+    void advance(uint64_t time_us);
+    const plant_state &getState() { return _state; }
+    const plant_parameters &getParameters() { return _parameters; }
+
+    void pinMode(uint8_t /*pin*/, uint8_t /*mode*/) override {}
+    void digitalWrite(uint8_t pin, uint8_t level) override;
+    int  digitalRead(uint8_t pin) override;
+    int  analogRead(uint8_t pin) override;
+    void analogWrite(uint8_t pin, int value) override;
+
+private:
+    struct valve_drive {
+        // openings asked for, 0-1, and when they take effect after the delay of the valve
+        std::deque<std::pair<uint64_t, float> > commands;
+        float    command;
+        float    position;    // opening of the valve
+    };
+    void  step(float dt);
+    void  setValve(valve_drive &valve, float command);
+    void  moveValve(valve_drive &valve, float dt);
+    float getOrifice(float k, float dp);
+    float getMuscle();
+    float getNoise();
+    int   getCounts(float value, float offset, float gain);
+
+    plant_parameters _parameters;
+    plant_state      _state;
+    uint64_t         _time_us;
+    valve_drive      _inhale;
+    valve_drive      _exhale;
+    bool             _air_in;
+    bool             _o2_in;
+    bool             _purge;
+    uint32_t         _random;
+};
+
+#endif
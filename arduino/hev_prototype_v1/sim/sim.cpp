@@ -0,0 +1,312 @@
+// Hardware in the loop without the hardware: setup() and loop() of the firmware on the host,
+// the valves driving the simulated lung and pneumatics of Plant.h and the sensors read back
+// from it. The time is a virtual clock stepped by the simulation, so thousands of breaths run
+// in seconds and a day of ventilation in minutes, and a run gives the same digest every time.
+// The simulation is the data server at the other end of Serial: it starts ventilation and
+// counts the DATA and ALARM payloads, while it checks every breath of the plant.
+//
+//   pio run -e native_sim && .pio/build/native_sim/program [options]
+//
+// With --pty the firmware is served on a pty in real time instead, for hevdaemon or hevserver.py.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+
+#include "BreathingLoop.h"
+#include "CommsControl.h"
+#include "Plant.h"
+
+// of the firmware, main.cpp
+void setup();
+void loop();
+extern BreathingLoop breathing_loop;
+
+// a state machine not moving for this long has stalled
+#define SIM_STALL_US 60000000ULL
+#define SIM_TRACE_US 10000
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+struct Options {
+    uint32_t breaths = 1000;
+    double   hours = 0;         // of simulated time instead of a number of breaths
+    uint32_t step_us = 500;     // simulated time per loop()
+    bool     pty = false;
+    std::string trace_path;
+    plant_parameters plant;
+};
+
+// the plant over the breaths delivered
+struct BreathStats {
+    uint32_t count = 0;
+    float    tidal_min = 1e9f, tidal_max = 0, tidal_sum = 0;    // L
+    float    peak_min = 1e9f, peak_max = 0;                     // mbar at the patient
+    float    peep_min = 1e9f, peep_max = 0;
+    uint64_t period_min = ~0ULL, period_max = 0;                // us between inhales
+    uint16_t timing_error_max = 0;                              // us, reported by the firmware
+};
+
+static uint64_t getWallUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// FNV-1a, over what the firmware sent and the plant did, to compare runs
+static void addDigest(uint64_t &digest, const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++) {
+        digest ^= bytes[i];
+        digest *= FNV_PRIME;
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--breaths N | --hours H] [--step US] [--compliance ML_PER_MBAR] [--resistance MBAR_S_PER_L]\n"
+                    "          [--effort MBAR] [--effort-rate PER_MIN] [--regulated MBAR] [--noise COUNTS] [--seed N]\n"
+                    "          [--trace FILE] [--pty]\n"
+                    "  --breaths     breaths to run (1000)\n"
+                    "  --hours       of simulated time to run instead\n"
+                    "  --step        simulated us per loop() (500)\n"
+                    "  --compliance  of the lung (50 mL/mbar)\n"
+                    "  --resistance  of the airways (5 mbar s/L)\n"
+                    "  --effort      peak muscle pressure of spontaneous breaths (0, a passive lung)\n"
+                    "  --effort-rate spontaneous breaths per minute (12)\n"
+                    "  --regulated   set point of the supply regulators (600 mbar)\n"
+                    "  --noise       of the sensors (1 adc count rms)\n"
+                    "  --seed        of the sensor noise (1)\n"
+                    "  --trace       CSV of the plant every 10 ms\n"
+                    "  --pty         serve the firmware on a pty in real time, for a data server\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool value = i + 1 < argc;
+        if (arg == "--breaths" && value) {
+            options.breaths = static_cast<uint32_t>(atol(argv[++i]));
+        } else if (arg == "--hours" && value) {
+            options.hours = atof(argv[++i]);
+        } else if (arg == "--step" && value) {
+            options.step_us = static_cast<uint32_t>(atol(argv[++i]));
+        } else if (arg == "--compliance" && value) {
+            options.plant.compliance = static_cast<float>(atof(argv[++i]) / 1000);
+        } else if (arg == "--resistance" && value) {
+            options.plant.resistance = static_cast<float>(atof(argv[++i]));
+        } else if (arg == "--effort" && value) {
+            options.plant.effort = static_cast<float>(atof(argv[++i]));
+        } else if (arg == "--effort-rate" && value) {
+            options.plant.effort_rate = static_cast<float>(atof(argv[++i]));
+        } else if (arg == "--regulated" && value) {
+            options.plant.regulated = static_cast<float>(atof(argv[++i]));
+        } else if (arg == "--noise" && value) {
+            options.plant.noise = static_cast<float>(atof(argv[++i]));
+        } else if (arg == "--seed" && value) {
+            options.plant.seed = static_cast<uint32_t>(atol(argv[++i]));
+        } else if (arg == "--trace" && value) {
+            options.trace_path = argv[++i];
+        } else if (arg == "--pty") {
+            options.pty = true;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (options.step_us == 0 || options.plant.compliance <= 0 || options.plant.resistance <= 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // virtual from time 0, before the constructors of the firmware read it
+    VirtualClock *clock = dynamic_cast<VirtualClock *>(&getClock());
+    if (clock == nullptr) {
+        fprintf(stderr, "built without HOST_VIRTUAL_CLOCK\n");
+        return 1;
+    }
+    Plant plant(options.plant);
+    setHostPins(&plant);
+
+    // the firmware's Serial, to the simulation or to a data server on the pty
+    HardwareSerial ui_serial;
+    CommsControl ui(115200, ui_serial);
+    if (options.pty) {
+        int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+            perror("posix_openpt");
+            return 1;
+        }
+        // raw before the data server opens it
+        int slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+        termios tio;
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        close(slave);
+        Serial.attach(master);
+        printf("firmware on %s\n", ptsname(master));
+        fflush(stdout);
+    } else {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+            perror("socketpair");
+            return 1;
+        }
+        Serial.attach(pair[0]);
+        ui_serial.attach(pair[1]);
+    }
+
+    FILE *trace = nullptr;
+    if (!options.trace_path.empty()) {
+        trace = fopen(options.trace_path.c_str(), "w");
+        if (trace == nullptr) {
+            perror(options.trace_path.c_str());
+            return 1;
+        }
+        fprintf(trace, "time,fsm_state,buffer,inhale,patient,flow,volume,opening_inhale,opening_exhale,muscle\n");
+    }
+
+    setup();
+    if (!options.pty) {
+        cmd_format cmd;
+        cmd.cmd_type = CMD_TYPE::GENERAL;
+        cmd.cmd_code = CMD_GENERAL::START;
+        Payload pl;
+        pl.setCmd(&cmd);
+        ui.writePayload(pl);
+    }
+
+    uint64_t start_us = micros();
+    uint64_t end_us = (options.hours > 0) ? start_us + static_cast<uint64_t>(options.hours * 3600e6) : ~0ULL;
+    uint64_t wall_start_us = getWallUs();
+    uint64_t loops = 0, data_received = 0, alarms_received = 0;
+    uint64_t digest = FNV_OFFSET;
+    uint32_t alarm_counts[ALARM_CODES::ARDUINO_FAIL + 1] = {0};
+    uint8_t  state = breathing_loop.getFsmState();
+    uint64_t state_us = start_us, inhale_us = 0, trace_us = 0;
+    float    breath_volume = 0, breath_volume_max = 0, breath_peak = 0;
+    bool     in_breath = false, stalled = false;
+    BreathStats stats;
+    Payload pl;
+
+    while (micros() < end_us && (options.hours > 0 || stats.count < options.breaths)) {
+        loop();
+        loops++;
+        Serial.flushBacklog();
+        if (!options.pty) {
+            while (ui_serial.available() > 0) {
+                ui.receiver();
+                while (ui.readPayload(pl)) {
+                    if (pl.getType() == PAYLOAD_TYPE::DATA) {
+                        data_received++;
+                        addDigest(digest, pl.getData(), sizeof(data_format));
+                    } else if (pl.getType() == PAYLOAD_TYPE::ALARM) {
+                        alarms_received++;
+                        addDigest(digest, pl.getAlarm(), sizeof(alarm_format));
+                        uint8_t code = pl.getAlarm()->alarm_code;
+                        if (code <= ALARM_CODES::ARDUINO_FAIL)
+                            alarm_counts[code]++;
+                    }
+                }
+            }
+            ui.sender();
+            ui_serial.flushBacklog();
+        }
+
+        uint64_t now_us = micros();
+        plant.advance(now_us);
+        const plant_state &s = plant.getState();
+        uint8_t next = breathing_loop.getFsmState();
+        if (next != state) {
+            // a breath runs from the start of INHALE to the end of EXHALE
+            if (next == BreathingLoop::BL_STATES::INHALE) {
+                if (inhale_us != 0) {
+                    uint64_t period = now_us - inhale_us;
+                    stats.period_min = std::min(stats.period_min, period);
+                    stats.period_max = std::max(stats.period_max, period);
+                }
+                inhale_us = now_us;
+                in_breath = true;
+                breath_volume = breath_volume_max = s.lung_volume;
+                breath_peak = s.circuit;
+            } else if (state == BreathingLoop::BL_STATES::EXHALE && in_breath) {
+                float tidal = breath_volume_max - breath_volume;
+                stats.count++;
+                stats.tidal_min = std::min(stats.tidal_min, tidal);
+                stats.tidal_max = std::max(stats.tidal_max, tidal);
+                stats.tidal_sum += tidal;
+                stats.peak_min = std::min(stats.peak_min, breath_peak);
+                stats.peak_max = std::max(stats.peak_max, breath_peak);
+                stats.peep_min = std::min(stats.peep_min, s.circuit);
+                stats.peep_max = std::max(stats.peep_max, s.circuit);
+                stats.timing_error_max = std::max(stats.timing_error_max, breathing_loop.getBreathTimingError());
+                addDigest(digest, &s, sizeof(s));
+                in_breath = false;
+            }
+            state = next;
+            state_us = now_us;
+        } else if (now_us - state_us > SIM_STALL_US) {
+            stalled = true;
+            break;
+        }
+        if (in_breath) {
+            breath_volume_max = std::max(breath_volume_max, s.lung_volume);
+            breath_peak = std::max(breath_peak, s.circuit);
+        }
+        if (trace && now_us - trace_us >= SIM_TRACE_US) {
+            trace_us = now_us;
+            fprintf(trace, "%.3f,%u,%.1f,%.2f,%.2f,%.4f,%.4f,%.3f,%.3f,%.2f\n", (now_us - start_us) * 1e-6, state,
+                    s.buffer, s.inhale, s.circuit, s.flow_patient, s.lung_volume, s.opening_inhale, s.opening_exhale, s.muscle);
+        }
+
+        clock->advance(options.step_us);
+        if (options.pty) {
+            // real time for the data server
+            int64_t ahead = static_cast<int64_t>(micros() - start_us) - static_cast<int64_t>(getWallUs() - wall_start_us);
+            if (ahead > 1000)
+                usleep(static_cast<useconds_t>(ahead));
+        }
+    }
+    if (trace)
+        fclose(trace);
+
+    double simulated = (micros() - start_us) * 1e-6;
+    double wall = (getWallUs() - wall_start_us) * 1e-6;
+    printf("%.0f s simulated in %.2f s (x%.0f), %llu loops of %u us\n", simulated, wall, simulated / wall,
+           static_cast<unsigned long long>(loops), options.step_us);
+    printf("breaths        %u, %.0f per second\n", stats.count, stats.count / wall);
+    if (stats.count > 0) {
+        printf("tidal volume   %.0f mL (%.0f - %.0f)\n", stats.tidal_sum / stats.count * 1000, stats.tidal_min * 1000,
+               stats.tidal_max * 1000);
+        printf("peak pressure  %.1f - %.1f mbar, PEEP %.1f - %.1f mbar\n", stats.peak_min, stats.peak_max,
+               stats.peep_min, stats.peep_max);
+        printf("breath period  %.1f - %.1f ms, worst late transition %u us\n", stats.period_min / 1e3,
+               stats.period_max / 1e3, stats.timing_error_max);
+    }
+    if (!options.pty) {
+        printf("payloads       %llu DATA, %llu ALARM\n", static_cast<unsigned long long>(data_received),
+               static_cast<unsigned long long>(alarms_received));
+        for (uint8_t code = 1; code <= ALARM_CODES::ARDUINO_FAIL; code++) {
+            if (alarm_counts[code])
+                printf("  alarm %2u     %u\n", code, alarm_counts[code]);
+        }
+    }
+    printf("digest         %016llx\n", static_cast<unsigned long long>(digest));
+    if (stalled) {
+        printf("state machine stalled in state %u\n", state);
+        return 1;
+    }
+    return 0;
+}
@@ -1,14 +1,215 @@
 #include "AlarmLoop.h"
 
-AlarmLoop::AlarmLoop()
+// priority of each alarm code, from the ALARM_CODES table
+static const ALARM_TYPE alarm_priority[ALARM_COUNT] = {
+    ALARM_TYPE::HP,  // APNEA
+    ALARM_TYPE::HP,  // CHECK_VALVE_EXHALE
+    ALARM_TYPE::HP,  // CHECK_P_PATIENT
+    ALARM_TYPE::MP,  // EXPIRATION_SENSE_FAULT_OR_LEAK
+    ALARM_TYPE::MP,  // EXPIRATION_VALVE_Leak
+    ALARM_TYPE::MP,  // HIGH_FIO2
+    ALARM_TYPE::HP,  // HIGH_PRESSURE
+    ALARM_TYPE::MP,  // HIGH_RR
+    ALARM_TYPE::MP,  // HIGH_VTE
+    ALARM_TYPE::MP,  // LOW_VTE
+    ALARM_TYPE::MP,  // HIGH_VTI
+    ALARM_TYPE::MP,  // LOW_VTI
+    ALARM_TYPE::HP,  // INTENTIONAL_STOP
+    ALARM_TYPE::HP,  // LOW_BATTERY
+    ALARM_TYPE::HP,  // LOW_FIO2
+    ALARM_TYPE::HP,  // OCCLUSION
+    ALARM_TYPE::HP,  // HIGH_PEEP
+    ALARM_TYPE::HP,  // LOW_PEEP
+    ALARM_TYPE::MP,  // AC_POWER_DISCONNECTION
+    ALARM_TYPE::MP,  // BATTERY_FAULT_SRVC
+    ALARM_TYPE::MP,  // BATTERY_CHARGE
+    ALARM_TYPE::HP,  // AIR_FAIL
+    ALARM_TYPE::HP,  // O2_FAIL
+    ALARM_TYPE::HP,  // PRESSURE_SENSOR_FAULT
+    ALARM_TYPE::HP   // ARDUINO_FAIL
+};
+
+static inline uint32_t alarmBit(uint8_t code)
 {
-    ;
+    return 1UL << (code - 1);
+}
+
+AlarmLoop::AlarmLoop(BreathingLoop *bl, CommsControl *comms)
+{
+    _breathing_loop = bl;
+    _comms = comms;
+
+    memset(_values, 0, sizeof(_values));
+    memset(_crossing_time, 0, sizeof(_crossing_time));
+    memset(_debounce, 0, sizeof(_debounce));
+    _checked = 0;
+    _active  = 0;
+    _latched = 0;
+    _acked   = 0;
+    _latency_max = 0;
+    memset(_sent_bits, 0, sizeof(_sent_bits));
+    _sent_head  = 0;
+    _sent_count = 0;
+    _sent       = 0;
+    _sent_acked = 0;
+    _sent_dropped = 0;
+    _comms->setAlarmResendLimit(ALARM_RESEND_LIMIT);
+
+    memset(_priority_masks, 0, sizeof(_priority_masks));
+    for (uint8_t bit = 0; bit < ALARM_COUNT; bit++)
+        _priority_masks[ALARM_TYPE::HP - alarm_priority[bit]] |= 1UL << bit;
 }
 
 AlarmLoop::~AlarmLoop()
 {;}
 
+// enqueue an alarm payload, the alarm queue is sent ahead of cmd and data.
+// a full queue would drop its oldest alarm, so the payload is refused instead
 int AlarmLoop::doAlarm(alarm_format *af)
 {
-    return 0;
-}
\ No newline at end of file
+    if (_comms->isQueueFull(PAYLOAD_TYPE::ALARM))
+        return -1;
+    _payload.setAlarm(af);
+    return _comms->writePayload(_payload) ? 0 : -1;
+}
+
+// latch the alarms ACKed since the last call, the queue is first in first out.
+// when comms dropped some since, which of the others were ACKed is not known, so
+// none of them latch: still active, they are raised again
+void AlarmLoop::updateSent()
+{
+    uint32_t acked   = _comms->getAckedCount(PAYLOAD_TYPE::ALARM);
+    uint32_t dropped = _comms->getAlarmDroppedCount();
+    uint32_t done    = (acked - _sent_acked) + (dropped - _sent_dropped);
+    bool delivered   = (dropped == _sent_dropped);
+    while (done > 0 && _sent_count > 0) {
+        uint32_t mask = 1UL << _sent_bits[_sent_head];
+        _sent_head = (_sent_head + 1) % CONST_MAX_SIZE_RB_SENDING;
+        _sent_count--;
+        _sent &= ~mask;
+        if (delivered)
+            _latched |= mask;
+        done--;
+    }
+    _sent_acked   = acked;
+    _sent_dropped = dropped;
+}
+
+// fill _values from the readings, alarms without a source stay out of _checked
+void AlarmLoop::updateValues()
+{
+    readings<uint16_t> readings_avgs = _breathing_loop->getReadingAverages();
+    uint8_t state = _breathing_loop->getFsmState();
+
+    _checked = 0;
+    _values[ALARM_CODES::CHECK_P_PATIENT  - 1] = readings_avgs.pressure_patient;
+    _values[ALARM_CODES::HIGH_PRESSURE    - 1] = readings_avgs.pressure_patient;
+    _values[ALARM_CODES::OCCLUSION        - 1] = readings_avgs.pressure_inhale;
+    _values[ALARM_CODES::AIR_FAIL         - 1] = readings_avgs.pressure_air_supply;
+    _values[ALARM_CODES::ARDUINO_FAIL     - 1] = _breathing_loop->getBreathTimingError();
+    _checked |= alarmBit(ALARM_CODES::CHECK_P_PATIENT) | alarmBit(ALARM_CODES::HIGH_PRESSURE)
+              | alarmBit(ALARM_CODES::OCCLUSION)       | alarmBit(ALARM_CODES::AIR_FAIL)
+              | alarmBit(ALARM_CODES::ARDUINO_FAIL);
+#ifdef HEV_FULL_SYSTEM
+    _values[ALARM_CODES::O2_FAIL          - 1] = readings_avgs.pressure_o2_supply;
+    _checked |= alarmBit(ALARM_CODES::O2_FAIL);
+#endif
+    // PEEP is the patient pressure at the end of the breath
+    if (state == BreathingLoop::BL_STATES::EXHALE) {
+        _values[ALARM_CODES::HIGH_PEEP    - 1] = readings_avgs.pressure_patient;
+        _values[ALARM_CODES::LOW_PEEP     - 1] = readings_avgs.pressure_patient;
+        _checked |= alarmBit(ALARM_CODES::HIGH_PEEP) | alarmBit(ALARM_CODES::LOW_PEEP);
+    }
+}
+
+// called on every new reading average, a fixed pass over all alarm codes
+void AlarmLoop::checkAlarms()
+{
+    uint32_t tnow = static_cast<uint32_t>(micros());
+    updateValues();
+
+    // all fields of alarm_thresholds are uint32_t in ALARM_CODES order
+    const uint32_t *threshold_min = reinterpret_cast<const uint32_t *>(&settings.threshold_min);
+    const uint32_t *threshold_max = reinterpret_cast<const uint32_t *>(&settings.threshold_max);
+
+    updateSent();
+    for (uint8_t bit = 0; bit < ALARM_COUNT; bit++) {
+        uint32_t mask = 1UL << bit;
+        if (!(_checked & mask))
+            continue;
+        // a threshold of 0 disables that side
+        uint32_t value = _values[bit];
+        uint32_t tmin  = threshold_min[bit];
+        uint32_t tmax  = threshold_max[bit];
+        bool beyond = (tmin && value < tmin) || (tmax && value > tmax);
+
+        if (beyond) {
+            if (_debounce[bit] == 0)
+                _crossing_time[bit] = tnow;
+            if (_debounce[bit] < ALARM_DEBOUNCE)
+                _debounce[bit]++;
+            if (_debounce[bit] >= ALARM_DEBOUNCE)
+                _active |= mask;
+        } else {
+            _debounce[bit] = 0;
+            bool inside = (!tmin || value >= tmin + (tmin >> ALARM_HYSTERESIS_SHIFT))
+                       && (!tmax || value <= tmax - (tmax >> ALARM_HYSTERESIS_SHIFT));
+            if (inside)
+                _active &= ~mask;
+        }
+    }
+    // acknowledged alarms unlatch once their condition has gone
+    _latched &= ~(_acked & ~_active);
+    _acked   &= _latched;
+
+    // highest priority first into the free places of the alarm queue, the rest are
+    // raised on a later reading once the queue has room
+    uint32_t raised = _active & ~_latched & ~_sent;
+    for (uint8_t p = 0; p < 3; p++) {
+        uint32_t pending = raised & _priority_masks[p];
+        while (pending) {
+            uint8_t bit = static_cast<uint8_t>(__builtin_ctzl(pending));
+            pending &= pending - 1;
+            if (!raiseAlarm(bit))
+                return;
+        }
+    }
+}
+
+// false if the alarm queue is full
+bool AlarmLoop::raiseAlarm(uint8_t bit)
+{
+    alarm_format af;
+    af.timestamp  = static_cast<uint32_t>(millis());
+    af.alarm_type = alarm_priority[bit];
+    af.alarm_code = bit + 1;
+    af.param      = _values[bit];
+
+    uint32_t latency = static_cast<uint32_t>(micros()) - _crossing_time[bit];
+    af.latency    = static_cast<uint16_t>(latency > 0xFFFF ? 0xFFFF : latency);
+    if (doAlarm(&af) != 0)
+        return false;
+    if (latency > _latency_max)
+        _latency_max = latency;
+
+    _sent_bits[(_sent_head + _sent_count) % CONST_MAX_SIZE_RB_SENDING] = bit;
+    _sent_count++;
+    _sent |= 1UL << bit;
+    return true;
+}
+
+void AlarmLoop::ackAlarm(ALARM_CODES alarm)
+{
+    if (alarm >= 1 && alarm <= ALARM_COUNT)
+        _acked |= alarmBit(alarm);
+}
+
+uint32_t AlarmLoop::getActiveAlarms()
+{
+    return _active;
+}
+
+uint32_t AlarmLoop::getAlarmLatency()
+{
+    return _latency_max;
+}
@@ -2,17 +2,59 @@
 #define ALARM_LOOP_H
 
 #include <Arduino.h>
-#include "CommsFormat.h"
+#include "common.h"
+#include "CommsControl.h"
+#include "BreathingLoop.h"
+
+// alarm codes 1-25, alarm code n is bit n-1 of the alarm bitsets
+#define ALARM_COUNT 25
+// consecutive readings beyond a threshold before an alarm is raised
+#define ALARM_DEBOUNCE 3
+// a raised alarm clears once back inside the limits by threshold >> ALARM_HYSTERESIS_SHIFT
+#define ALARM_HYSTERESIS_SHIFT 4
+// sends of an alarm payload without an ACK before comms drops it and it is raised again,
+// at least 1 s with CONST_TIMEOUT_ALARM between them
+#define ALARM_RESEND_LIMIT 200
 
 class AlarmLoop
 {
 
 public:
-    AlarmLoop();
+    AlarmLoop(BreathingLoop *bl, CommsControl *comms);
     ~AlarmLoop();
     int doAlarm(alarm_format *af);
+    void checkAlarms();
+    void ackAlarm(ALARM_CODES alarm);
+    uint32_t getActiveAlarms();
+    uint32_t getAlarmLatency();
 private:
-    // BreathingLoop *_breathing_loop;
+    void updateValues();
+    void updateSent();
+    bool raiseAlarm(uint8_t bit);
+
+    BreathingLoop *_breathing_loop;
+    CommsControl  *_comms;
+    Payload        _payload;
+
+    // latest value checked against settings.threshold_min/max, indexed like them
+    uint32_t _values[ALARM_COUNT];
+    uint32_t _crossing_time[ALARM_COUNT];  // us, first reading beyond the threshold
+    uint8_t  _debounce[ALARM_COUNT];
+
+    uint32_t _checked;  // alarms with a value this tick
+    uint32_t _active;   // condition present
+    uint32_t _latched;  // delivered and not yet acknowledged once cleared
+    uint32_t _acked;
+    uint32_t _priority_masks[3];  // HP, MP, LP
+    uint32_t _latency_max;  // us, worst threshold crossing to enqueue
+
+    // alarms in the comms queue, oldest first, latched once the controller on the other end ACKs them
+    uint8_t  _sent_bits[CONST_MAX_SIZE_RB_SENDING];
+    uint8_t  _sent_head;
+    uint8_t  _sent_count;
+    uint32_t _sent;         // as a bitset
+    uint32_t _sent_acked;   // ACKed alarm payloads accounted for
+    uint32_t _sent_dropped; // and those comms gave up on
 };
 
-#endif
\ No newline at end of file
+#endif
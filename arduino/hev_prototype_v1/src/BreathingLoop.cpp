@@ -1,5 +1,26 @@
 #include "BreathingLoop.h"
 #include "common.h"
+#include <uCRC16Lib.h>
+
+// survives resets other than power on, validated by magic and crc
+#if defined(CHIP_ESP32)
+static RTC_NOINIT_ATTR warm_state _warm_state;
+#elif defined(ARDUINO_ARCH_AVR)
+#include <avr/wdt.h>
+static warm_state _warm_state __attribute__((section(".noinit")));
+
+// the reset cause, copied before the core's init code runs. Optiboot clears MCUSR before
+// starting the sketch, so behind it WDRF/BORF always read 0 and every reset starts cold
+uint8_t mcusr_mirror __attribute__((section(".noinit")));
+void saveMcusr(void) __attribute__((naked, used, section(".init3")));
+void saveMcusr(void)
+{
+    mcusr_mirror = MCUSR;
+    MCUSR = 0;
+    // after a watchdog reset it stays enabled, at its shortest timeout
+    wdt_disable();
+}
+#endif
 /*
 The Idea of this code is to unfold the FSM in two: one to assign the transitions and the second one to program the states.
 */
@@ -8,12 +29,30 @@ BreathingLoop::BreathingLoop()
 {
     uint32_t tnow = static_cast<uint32_t>(millis());
     _calib_time = tnow;
-    _fsm_time = tnow;
+    _fsm_time = static_cast<uint32_t>(micros());
     _fsm_timeout = 1000;
+    _fsm_lead = 0;
+    _fsm_carry = 0;
+    _breath_late_max = 0;
+    _breath_timing_error = 0;
+    _warm_resumes = 0;
+#ifdef CHIP_ESP32
+    _fsm_timer = nullptr;
+    _fsm_lock  = nullptr;
+    _fsm_armed_deadline = 0;
+#endif
     _ventilation_mode = VENTILATION_MODES::LAB_MODE_BREATHE;
     _bl_state = BL_STATES::IDLE;
     _running = false;
     _reset = false;
+    memset(&_calibration, 0, sizeof(_calibration));
+    _calibrated = false;
+    _store = nullptr;
+    _calibration_pending = false;
+    _settings_pending = nullptr;
+    _settings_epoch = 0;
+    _waveform_active = 0;
+    _waveform_pending = false;
 
     initCalib();
     resetReadingSums();
@@ -34,7 +73,20 @@ uint8_t BreathingLoop::getFsmState()
     return static_cast<uint8_t>(_bl_state);
 }
 
-void BreathingLoop::updateReadings()
+// BUFF_LOADED to EXHALE make up one breath, the settings it uses must not change within it
+static inline bool isBreathState(uint8_t state)
+{
+    return (state >= BreathingLoop::BL_STATES::BUFF_LOADED) && (state <= BreathingLoop::BL_STATES::EXHALE);
+}
+
+// readings at or below the zero offset are clamped to 0
+static inline uint16_t subtractOffset(uint16_t value, uint16_t offset)
+{
+    return (value > offset) ? value - offset : 0;
+}
+
+// true when new averages are available
+bool BreathingLoop::updateReadings()
 {
     // calc pressure every 1ms
     // create averages every 10ms
@@ -58,15 +110,22 @@ void BreathingLoop::updateReadings()
     }
 
     // to make sure the readings correspond only to the same fsm mode
+    bool updated = false;
     if (_readings_reset) {
         resetReadingSums();
     } else if (tnow - _readings_avgs_time > _readings_avgs_timeout) {
+        updated = true;
         _readings_avgs.timestamp                = static_cast<uint32_t>(_readings_sums.timestamp                / _readings_N);
         _readings_avgs.pressure_air_supply      = static_cast<uint16_t>(_readings_sums.pressure_air_supply      / _readings_N);
         _readings_avgs.pressure_air_regulated   = static_cast<uint16_t>(_readings_sums.pressure_air_regulated   / _readings_N);
         _readings_avgs.pressure_buffer          = static_cast<uint16_t>(_readings_sums.pressure_buffer          / _readings_N);
         _readings_avgs.pressure_inhale          = static_cast<uint16_t>(_readings_sums.pressure_inhale          / _readings_N);
         _readings_avgs.pressure_patient         = static_cast<uint16_t>(_readings_sums.pressure_patient         / _readings_N);
+        if (_calibrated) {
+            _readings_avgs.pressure_buffer      = subtractOffset(_readings_avgs.pressure_buffer,  _calibration.pressure_buffer );
+            _readings_avgs.pressure_inhale      = subtractOffset(_readings_avgs.pressure_inhale,  _calibration.pressure_inhale );
+            _readings_avgs.pressure_patient     = subtractOffset(_readings_avgs.pressure_patient, _calibration.pressure_patient);
+        }
         _readings_avgs.temperature_buffer       = static_cast<uint16_t>(_readings_sums.temperature_buffer       / _readings_N);
 #ifdef HEV_FULL_SYSTEM
         _readings_avgs.pressure_o2_supply       = static_cast<uint16_t>(_readings_sums.pressure_o2_supply       / _readings_N);
@@ -75,6 +134,7 @@ void BreathingLoop::updateReadings()
 #endif
         resetReadingSums();
     }
+    return updated;
 }
 
 readings<uint16_t> BreathingLoop::getReadingAverages()
@@ -106,23 +166,41 @@ void BreathingLoop::resetReadingSums()
     _readings_sums.pressure_diff_patient    = 0;
 }
 
+// time in us from the start of the current state to its transition
+uint32_t BreathingLoop::getFsmWait()
+{
+    // the transition is issued _fsm_lead early to cover the valve actuation delay,
+    // and a state entered early by the previous lead is extended by as much
+    uint64_t wait = static_cast<uint64_t>(_fsm_timeout) + _fsm_carry;
+    wait = (wait > _fsm_lead) ? wait - _fsm_lead : 0;
+    // in us, within the signed range the deadline timer is armed with
+    wait *= 1000;
+    return (wait > FSM_MAX_WAIT_US) ? FSM_MAX_WAIT_US : static_cast<uint32_t>(wait);
+}
+
 //This is used to assign the transitions of the fsm
 void BreathingLoop::FSM_assignment( ) {
-    uint32_t tnow = static_cast<uint32_t>(millis());
-    if (tnow - _fsm_time > _fsm_timeout) {
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreTakeRecursive(_fsm_lock, portMAX_DELAY);
+#endif
+    uint32_t tnow = static_cast<uint32_t>(micros());
+    uint32_t wait = getFsmWait();
+    if (tnow - _fsm_time >= wait) {
         BL_STATES next_state;
         switch (_bl_state)
         {
         case BL_STATES::IDLE:
             if (_running == true) {
                 // FSM_time = millis();
-                next_state = BL_STATES::BUFF_PREFILL;
+                // calibrate once, afterwards the offsets are restored from the store at boot
+                next_state = _calibrated ? BL_STATES::BUFF_PREFILL : BL_STATES::CALIBRATION;
             } else {
                 next_state = BL_STATES::IDLE;
             }
             _reset = false;
             break;
         case BL_STATES::CALIBRATION:
+            finishCalibration();
             next_state = BL_STATES::BUFF_PREFILL;
             break;
         case BL_STATES::BUFF_PREFILL:
@@ -183,15 +261,46 @@ void BreathingLoop::FSM_assignment( ) {
         default:
             next_state = _bl_state;
         }
+        // the next state starts at the deadline rather than when it was noticed,
+        // unless the transition was so late that catching up would skip the next state
+        uint32_t late = tnow - _fsm_time - wait;
+        _fsm_time = (late < FSM_MAX_CATCHUP_US) ? _fsm_time + wait : tnow;
+
+        if (late > _breath_late_max)
+            _breath_late_max = late;
+        if (next_state == BL_STATES::BUFF_LOADED && _bl_state == BL_STATES::EXHALE)
+            _warm_resumes = 0;
+        if (next_state == BL_STATES::INHALE) {
+            _breath_timing_error = static_cast<uint16_t>(_breath_late_max > 0xFFFF ? 0xFFFF : _breath_late_max);
+            _breath_late_max = 0;
+        }
+
+        // the breath boundary, staged settings and waveforms take effect for the whole of the next breath
+        if (next_state == BL_STATES::BUFF_LOADED || !isBreathState(next_state)) {
+            if (_settings_pending)
+                applySettings();
+            if (_waveform_pending) {
+                _waveform_active ^= 1;
+                _waveform_pending = false;
+            }
+        }
+
         _bl_state = next_state;
-        _fsm_time = tnow;
+        _fsm_carry = _fsm_lead;
+        _fsm_lead = 0;
         // set flag to discard readings due to the mode change
         _readings_reset = true;
     }
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreGiveRecursive(_fsm_lock);
+#endif
 }
 
 void BreathingLoop::FSM_breathCycle()
 {
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreTakeRecursive(_fsm_lock, portMAX_DELAY);
+#endif
     // basic cycle for testing hardware
     // start = digitalRead(pin_button_0);
     switch (_bl_state) {
@@ -209,29 +318,27 @@ void BreathingLoop::FSM_breathCycle()
             break;
         case BL_STATES::CALIBRATION : 
             _valves_controller.setValves(VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, 0.9 * VALVE_STATE::OPEN, 0.9 * VALVE_STATE::OPEN, VALVE_STATE::OPEN);
+            // lines downstream of the closed inlets are vented through the purge valve,
+            // so P_buffer, P_inhale and P_patient read their zero offsets
             calibrate();
-            // TODO
-            // do calib - measure P_regulated for 10 s and calc mean
-            // P_patient, P_buffer and P_inhale shoudl be equal
-            // WHERE do I call getCalibrationOffset()?
-            _fsm_timeout = _states_timeouts.calibration;
+            _fsm_timeout = settings.timeouts.calibration;
             break;
         case BL_STATES::BUFF_PREFILL:
             // TODO - exhale settable; timeout expert settable
             _valves_controller.setValves(VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, 0.8 * VALVE_STATE::OPEN, VALVE_STATE::CLOSED);
-            _fsm_timeout = _states_timeouts.buff_prefill;
+            _fsm_timeout = settings.timeouts.buff_prefill;
             break;
         case BL_STATES::BUFF_FILL:
             // TODO - exhale settable; timeout settable
             _valves_controller.setValves(VALVE_STATE::OPEN, VALVE_STATE::OPEN, VALVE_STATE::CLOSED, 0.8 * VALVE_STATE::OPEN, VALVE_STATE::CLOSED);
-            _fsm_timeout = _states_timeouts.buff_fill;
+            _fsm_timeout = settings.timeouts.buff_fill;
             break;
         case BL_STATES::BUFF_LOADED:
             // TODO - exhale settable
             // Calc pressure and stay in loaded if not ok
             // pressure settable by expert
             _valves_controller.setValves(VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, 0.8 * VALVE_STATE::OPEN, VALVE_STATE::CLOSED);
-            _fsm_timeout = _states_timeouts.buff_loaded;
+            _fsm_timeout = settings.timeouts.buff_loaded;
             break;
         case BL_STATES::BUFF_PRE_INHALE:
             // TODO spontaneous trigger can be enabled
@@ -253,8 +360,10 @@ void BreathingLoop::FSM_breathCycle()
                     
                     break;
                 default:
-                    _fsm_timeout = _states_timeouts.buff_pre_inhale;
+                    _fsm_timeout = settings.timeouts.buff_pre_inhale;
             }
+            // open the inhale valve ahead of the inhale edge
+            _fsm_lead = _valves_controller.getLatency(CMD_SET_VALVE_LATENCY::INHALE_OPEN);
         
             break;
         case BL_STATES::INHALE:
@@ -264,32 +373,35 @@ void BreathingLoop::FSM_breathCycle()
             // TODO : spontaneous trigger
             // if p_inhale > max thresh pressure(def: 50?)
             // go to exhale fill
-            _valves_controller.setValves(VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, 0.8*VALVE_STATE::OPEN, VALVE_STATE::CLOSED, VALVE_STATE::CLOSED);
-            _fsm_timeout = _states_timeouts.inhale;
+            _valves_controller.setValves(VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, getInhaleOpening(), VALVE_STATE::CLOSED, VALVE_STATE::CLOSED);
+            _fsm_timeout = settings.timeouts.inhale;
+            _fsm_lead = _valves_controller.getLatency(CMD_SET_VALVE_LATENCY::INHALE_CLOSE);
             
             break;
         case BL_STATES::PAUSE:
             _valves_controller.setValves(VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, VALVE_STATE::CLOSED);
-            _fsm_timeout = _states_timeouts.pause;
+            _fsm_timeout = settings.timeouts.pause;
+            // open the exhale valve ahead of the exhale edge
+            _fsm_lead = _valves_controller.getLatency(CMD_SET_VALVE_LATENCY::EXHALE_OPEN);
             break;
         case BL_STATES::EXHALE_FILL:
             _valves_controller.setValves(VALVE_STATE::OPEN, VALVE_STATE::OPEN, VALVE_STATE::CLOSED, 0.9 * VALVE_STATE::OPEN, VALVE_STATE::CLOSED);
-            _fsm_timeout = _states_timeouts.exhale_fill;
+            _fsm_timeout = settings.timeouts.exhale_fill;
             break;
         case BL_STATES::EXHALE:
             // TODO: exhale timeout based on 
             // (inhale_time* (Exhale/Inhale ratio))  -  fill time
-            _states_timeouts.exhale = calculateTimeoutExhale();
             _valves_controller.setValves(VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, 0.9 * VALVE_STATE::OPEN, VALVE_STATE::CLOSED);
-            _fsm_timeout = _states_timeouts.exhale;
+            // derived every breath, settings.timeouts.exhale keeps what was set so that it is not stored again
+            _fsm_timeout = calculateTimeoutExhale();
             break;
         case BL_STATES::BUFF_PURGE:
             _valves_controller.setValves(VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, 0.9 * VALVE_STATE::OPEN, VALVE_STATE::OPEN);
-            _fsm_timeout = _states_timeouts.buff_purge;
+            _fsm_timeout = settings.timeouts.buff_purge;
             break;
         case BL_STATES::BUFF_FLUSH:
             _valves_controller.setValves(VALVE_STATE::CLOSED, VALVE_STATE::CLOSED, 0.9 * VALVE_STATE::OPEN, 0.9 * VALVE_STATE::OPEN, VALVE_STATE::CLOSED);
-            _fsm_timeout = _states_timeouts.buff_flush;
+            _fsm_timeout = settings.timeouts.buff_flush;
             break;
         case BL_STATES::STOP: 
             // TODO : require a reset command to go back to idle
@@ -298,6 +410,132 @@ void BreathingLoop::FSM_breathCycle()
             break;
     }
 
+    saveWarmState();
+    scheduleFsmDeadline();
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreGiveRecursive(_fsm_lock);
+#endif
+}
+
+// rewritten only when something in it changes, mostly on state transitions
+void BreathingLoop::saveWarmState()
+{
+#if defined(CHIP_ESP32) || defined(ARDUINO_ARCH_AVR)
+    if ((_warm_state.magic == WARM_STATE_MAGIC)
+     && (_warm_state.bl_state         == _bl_state)
+     && (_warm_state.ventilation_mode == _ventilation_mode)
+     && (_warm_state.running          == _running)
+     && (_warm_state.resumes          == _warm_resumes)
+     && (_warm_state.fsm_timeout      == _fsm_timeout)
+     && (_warm_state.fsm_carry        == _fsm_carry))
+        return;
+    _warm_state.magic            = WARM_STATE_MAGIC;
+    _warm_state.bl_state         = static_cast<uint8_t>(_bl_state);
+    _warm_state.ventilation_mode = static_cast<uint8_t>(_ventilation_mode);
+    _warm_state.running          = _running;
+    _warm_state.resumes          = _warm_resumes;
+    _warm_state.fsm_timeout      = _fsm_timeout;
+    _warm_state.fsm_carry        = _fsm_carry;
+    _warm_state.crc = uCRC16Lib::calculate(reinterpret_cast<char *>(&_warm_state), offsetof(warm_state, crc));
+#endif
+}
+
+// called from setup() before the FSM timer starts, true if ventilation was resumed
+bool BreathingLoop::resumeWarmState()
+{
+    // only a reset that cut a running cycle short resumes it, a power on always starts in IDLE.
+    // a panic is a crash that would likely recur in the same state, so it starts cold
+#if defined(CHIP_ESP32)
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool warm = (reason == ESP_RST_BROWNOUT) || (reason == ESP_RST_INT_WDT)
+             || (reason == ESP_RST_TASK_WDT) || (reason == ESP_RST_WDT);
+#elif defined(ARDUINO_ARCH_AVR)
+    bool warm = (mcusr_mirror & (_BV(WDRF) | _BV(BORF))) != 0;
+#endif
+#if defined(CHIP_ESP32) || defined(ARDUINO_ARCH_AVR)
+    bool valid = (_warm_state.magic == WARM_STATE_MAGIC)
+              && (_warm_state.crc == uCRC16Lib::calculate(reinterpret_cast<char *>(&_warm_state), offsetof(warm_state, crc)))
+              && (_warm_state.bl_state <= BL_STATES::BUFF_FLUSH);
+    _warm_state.magic = 0;
+    // resetting again and again before a breath completes is a loop, not a glitch
+    if (!warm || !valid || !_warm_state.running || _warm_state.resumes >= WARM_RESUME_MAX)
+        return false;
+
+    _bl_state         = static_cast<BL_STATES>(_warm_state.bl_state);
+    _ventilation_mode = static_cast<VENTILATION_MODES>(_warm_state.ventilation_mode);
+    _running          = true;
+    _fsm_timeout      = _warm_state.fsm_timeout;
+    _fsm_carry        = _warm_state.fsm_carry;
+    _fsm_lead         = 0;
+    _warm_resumes     = _warm_state.resumes + 1;
+    // the state starts over, it was saved on entry
+    _fsm_time         = static_cast<uint32_t>(micros());
+    _readings_reset   = true;
+    return true;
+#else
+    // no reset cause to tell a warm start by on these boards
+    return false;
+#endif
+}
+
+void BreathingLoop::scheduleFsmDeadline()
+{
+#ifdef CHIP_ESP32
+    if (_fsm_timer == nullptr)
+        return;
+    uint32_t deadline = _fsm_time + getFsmWait();
+    if (deadline == _fsm_armed_deadline)
+        return;
+    _fsm_armed_deadline = deadline;
+
+    esp_timer_stop(_fsm_timer);
+    int32_t remaining = static_cast<int32_t>(deadline - static_cast<uint32_t>(micros()));
+    esp_timer_start_once(_fsm_timer, remaining > 0 ? remaining : 0);
+#endif
+}
+
+#ifdef CHIP_ESP32
+void BreathingLoop::onFsmTimer(void *arg)
+{
+    BreathingLoop *bl = static_cast<BreathingLoop *>(arg);
+    xSemaphoreTakeRecursive(bl->_fsm_lock, portMAX_DELAY);
+    // force a re-arm for the new state even if its deadline happens to match
+    bl->_fsm_armed_deadline = bl->_fsm_time - 1;
+    bl->FSM_assignment();
+    bl->FSM_breathCycle();
+    xSemaphoreGiveRecursive(bl->_fsm_lock);
+}
+#endif
+
+void BreathingLoop::beginFsmTimer()
+{
+#ifdef CHIP_ESP32
+    // esp_timer fires from the hardware timer with us resolution, so state edges
+    // do not wait for loop() to come round
+    _fsm_lock = xSemaphoreCreateRecursiveMutex();
+    esp_timer_create_args_t args;
+    args.callback = &BreathingLoop::onFsmTimer;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "fsm_deadline";
+    esp_timer_create(&args, &_fsm_timer);
+    _fsm_armed_deadline = _fsm_time - 1;
+    scheduleFsmDeadline();
+#endif
+}
+
+void BreathingLoop::lock()
+{
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreTakeRecursive(_fsm_lock, portMAX_DELAY);
+#endif
+}
+
+void BreathingLoop::unlock()
+{
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreGiveRecursive(_fsm_lock);
+#endif
 }
 
 void BreathingLoop::doStart()
@@ -320,39 +558,219 @@ bool BreathingLoop::getRunning()
     return _running;
 }
 
+uint16_t BreathingLoop::getBreathTimingError()
+{
+    return _breath_timing_error;
+}
+
+void BreathingLoop::doCalibrate()
+{
+    // the next start goes through CALIBRATION again
+    _calibrated = false;
+}
+
+bool BreathingLoop::getCalibrated()
+{
+    return _calibrated;
+}
+
+const pressure_calibration &BreathingLoop::getCalibration()
+{
+    return _calibration;
+}
+
+void BreathingLoop::loadCalibration(PersistentStore *store)
+{
+    _store = store;
+    if (_store->load(STORE_SLOT::CALIBRATION_SLOT, CALIBRATION_VERSION, &_calibration, sizeof(_calibration))) {
+        _calibrated = true;
+        _valves_controller.setLatency(CMD_SET_VALVE_LATENCY::INHALE_OPEN, _calibration.latency_inhale_open);
+    }
+}
+
 void BreathingLoop::calibrate()
 {
-    // get pressure_air_regulated over 10s calc mean
+    // learn the opening delay of the inhale valve from the first pressure rise after the open command
     uint32_t tnow = static_cast<uint32_t>(millis());
-    if (tnow - _calib_time > _calib_timeout) {
+    if (_latency_learn) {
+        uint16_t pressure = static_cast<uint16_t>(analogRead(pin_pressure_inhale));
+        if (_latency_baseline == 0xFFFF) {
+            _latency_baseline = pressure;
+            _latency_time = tnow;
+        } else if (pressure > _latency_baseline + LATENCY_PRESSURE_RISE) {
+            _valves_controller.setLatency(CMD_SET_VALVE_LATENCY::INHALE_OPEN, static_cast<uint16_t>(tnow - _latency_time));
+            _latency_learn = false;
+        } else if (tnow - _latency_time > LATENCY_MAX_WAIT) {
+            _latency_learn = false;
+        }
+        // the rise is the buffer venting through the lines, which biases the zero offsets
+        _calib_settled_time = tnow + CALIB_SETTLE_TIME;
+        return;
+    }
+
+    // then sample all pressure channels together every _calib_timeout ms for the rest of the state
+    if (static_cast<int32_t>(tnow - _calib_settled_time) >= 0 && tnow - _calib_time > _calib_timeout) {
+        _calib_time = tnow;
         _calib_N++;
-        _calib_sum_pressure += static_cast<uint32_t>(analogRead(pin_pressure_air_regulated));
-        _calib_avg_pressure  = static_cast<float   >(_calib_sum_pressure / _calib_N);
+        _calib_sums.pressure_air_regulated  += static_cast<uint32_t>(analogRead(pin_pressure_air_regulated));
+        _calib_sums.pressure_buffer         += static_cast<uint32_t>(analogRead(pin_pressure_buffer)       );
+        _calib_sums.pressure_inhale         += static_cast<uint32_t>(analogRead(pin_pressure_inhale)       );
+        _calib_sums.pressure_patient        += static_cast<uint32_t>(analogRead(pin_pressure_patient)      );
+#ifdef HEV_FULL_SYSTEM
+        _calib_sums.pressure_o2_regulated   += static_cast<uint32_t>(analogRead(pin_pressure_o2_regulated) );
+        _calib_sums.pressure_diff_patient   += static_cast<uint32_t>(analogRead(pin_pressure_diff_patient) );
+#endif
     }
 }
 
+uint16_t BreathingLoop::calcCalibrationMean(uint32_t sum)
+{
+    return static_cast<uint16_t>(static_cast<float>(sum) / static_cast<float>(_calib_N) + 0.5f);
+}
+
+void BreathingLoop::finishCalibration()
+{
+    // state left before the first sample, keep the previous calibration
+    if (_calib_N == 0)
+        return;
+
+    _calibration.pressure_air_regulated = calcCalibrationMean(_calib_sums.pressure_air_regulated);
+    _calibration.pressure_buffer        = calcCalibrationMean(_calib_sums.pressure_buffer       );
+    _calibration.pressure_inhale        = calcCalibrationMean(_calib_sums.pressure_inhale       );
+    _calibration.pressure_patient       = calcCalibrationMean(_calib_sums.pressure_patient      );
+    _calibration.pressure_o2_regulated  = calcCalibrationMean(_calib_sums.pressure_o2_regulated );
+    _calibration.pressure_diff_patient  = calcCalibrationMean(_calib_sums.pressure_diff_patient );
+    _calibration.latency_inhale_open    = _valves_controller.getLatency(CMD_SET_VALVE_LATENCY::INHALE_OPEN);
+    _calibrated = true;
+    // saved from loop(), the store is not shared with the FSM timer
+    _calibration_pending = true;
+}
+
+void BreathingLoop::saveCalibration()
+{
+    if (!_calibration_pending)
+        return;
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreTakeRecursive(_fsm_lock, portMAX_DELAY);
+#endif
+    pressure_calibration calibration = _calibration;
+    _calibration_pending = false;
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreGiveRecursive(_fsm_lock);
+#endif
+    if (_store)
+        _store->save(STORE_SLOT::CALIBRATION_SLOT, CALIBRATION_VERSION, &calibration, sizeof(calibration));
+}
 
 void BreathingLoop::initCalib()
 {
     _calib_timeout = 10;
     _calib_time = static_cast<uint32_t>(millis());
-    _calib_sum_pressure = 0;
-    _calib_avg_pressure = 0;
+    _calib_sums = readings<uint32_t>();
     _calib_N = 0;
+    _latency_learn = true;
+    _latency_baseline = 0xFFFF;
+    _latency_time = _calib_time;
+    _calib_settled_time = _calib_time;
+}
+
+states_timeouts &BreathingLoop::getTimeouts() {
+    return settings.timeouts;
 }
 
-float BreathingLoop::getCalibrationOffset()
+void BreathingLoop::commitSettings(const settings_shadow *shadow)
 {
-    return _calib_avg_pressure;
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreTakeRecursive(_fsm_lock, portMAX_DELAY);
+#endif
+    _settings_pending = shadow;
+    if (!isBreathState(_bl_state))
+        applySettings();
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreGiveRecursive(_fsm_lock);
+#endif
 }
 
-states_timeouts &BreathingLoop::getTimeouts() {
-    return _states_timeouts;
+bool BreathingLoop::getSettingsPending()
+{
+    return _settings_pending != nullptr;
+}
+
+uint32_t BreathingLoop::getSettingsEpoch()
+{
+    return _settings_epoch;
+}
+
+// copy the staged settings, already checked against the registry
+void BreathingLoop::applySettings()
+{
+    uint32_t *values = getSettingValues(settings);
+    const uint32_t *staged = reinterpret_cast<const uint32_t *>(&_settings_pending->values);
+    for (uint8_t id = 0; id < SETTINGS_COUNT; id++) {
+        if (_settings_pending->staged[id / 32] & (1UL << (id % 32)))
+            values[id] = staged[id];
+    }
+    _settings_epoch++;
+    _settings_pending = nullptr;
+}
+
+waveform_table *BreathingLoop::getWaveformStaging()
+{
+    return &_waveforms[_waveform_active ^ 1];
+}
+
+void BreathingLoop::commitWaveform()
+{
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreTakeRecursive(_fsm_lock, portMAX_DELAY);
+#endif
+    if (isBreathState(_bl_state)) {
+        _waveform_pending = true;
+    } else {
+        _waveform_active ^= 1;
+    }
+#ifdef CHIP_ESP32
+    if (_fsm_lock) xSemaphoreGiveRecursive(_fsm_lock);
+#endif
+}
+
+bool BreathingLoop::getWaveformPending()
+{
+    return _waveform_pending;
+}
+
+// setpoint of the active waveform at the time since the start of INHALE,
+// held at the first and last points outside the table
+float BreathingLoop::getInhaleOpening()
+{
+    const waveform_table &waveform = _waveforms[_waveform_active];
+    if (waveform.count == 0)
+        return static_cast<float>(WAVEFORM_DEFAULT) / WAVEFORM_VALUE_MAX;
+
+    uint32_t elapsed = (static_cast<uint32_t>(micros()) - _fsm_time) / 1000;
+    const waveform_point *points = waveform.points;
+    uint16_t value = points[waveform.count - 1].value;
+    if (elapsed <= points[0].time) {
+        value = points[0].value;
+    } else {
+        for (uint8_t i = 1; i < waveform.count; i++) {
+            if (elapsed < points[i].time) {
+                int32_t lo = points[i - 1].value;
+                int32_t hi = points[i].value;
+                value = static_cast<uint16_t>(lo + ((hi - lo) * static_cast<int32_t>(elapsed - points[i - 1].time))
+                                                   / (points[i].time - points[i - 1].time));
+                break;
+            }
+        }
+    }
+    return static_cast<float>(value) / WAVEFORM_VALUE_MAX;
 }
 
 // FIXME 1/1 has to be replaced using exhale/inhale ratio
 uint32_t BreathingLoop::calculateTimeoutExhale() {
-    return static_cast<uint32_t>(_states_timeouts.inhale * ( 1/ 1) ) - _states_timeouts.buff_fill;
+    uint32_t inhale = static_cast<uint32_t>(settings.timeouts.inhale * ( 1/ 1) );
+    // the registry accepts a fill longer than the inhale, exhale is then skipped rather than wrapping
+    return (inhale > settings.timeouts.buff_fill) ? inhale - settings.timeouts.buff_fill : 0;
 }
 
 ValvesController* BreathingLoop::getValvesController()
@@ -9,6 +9,68 @@
 #include <Arduino.h>
 #include "common.h"
 #include "ValvesController.h"
+#include "PersistentStore.h"
+#include "CommsCommon.h"
+#ifdef CHIP_ESP32
+#include <esp_timer.h>
+#include <esp_system.h>
+#include <freertos/semphr.h>
+#endif
+
+// a late transition shortens the next state by up to this much, so that errors do not accumulate
+const uint32_t FSM_MAX_CATCHUP_US = 5000;
+// longest time to a transition, us, so that micros() deadlines compare the right way round
+const uint32_t FSM_MAX_WAIT_US    = 0x7FFFFFFF;
+
+// learning of the inhale valve opening delay during calibration
+const uint16_t LATENCY_PRESSURE_RISE = 20;  // adc counts above the pressure at the open command
+const uint32_t LATENCY_MAX_WAIT      = 200; // ms, give up and keep the configured delay
+// the lines vent after the learning, the zero offsets are only averaged from then on
+const uint32_t CALIB_SETTLE_TIME     = 500; // ms
+
+// inhale waveform uploaded by the host, up to WAVEFORM_POINTS points in increasing time
+const uint8_t  WAVEFORM_POINTS    = 32;
+const uint16_t WAVEFORM_VALUE_MAX = 1000;  // fully open
+// inhale valve opening while no waveform is loaded
+const uint16_t WAVEFORM_DEFAULT   = 800;
+
+struct waveform_table {
+    uint8_t count = 0;  // points used, 0 plays WAVEFORM_DEFAULT
+    waveform_point points[WAVEFORM_POINTS];
+};
+
+// bump when the layout of pressure_calibration changes, older records are then ignored
+const uint8_t CALIBRATION_VERSION = 1;
+
+// result of the CALIBRATION state, kept in the persistent store so that boots skip it.
+// offsets are the adc counts of the vented lines, subtracted from the readings
+struct pressure_calibration {
+    uint16_t pressure_buffer;
+    uint16_t pressure_inhale;
+    uint16_t pressure_patient;
+    uint16_t pressure_diff_patient;   // zero flow level, not subtracted as the flow is signed
+    uint16_t pressure_air_regulated;  // mean of the regulated supply, which stays pressurised
+    uint16_t pressure_o2_regulated;
+    uint16_t latency_inhale_open;     // ms
+};
+
+// FSM position kept in RAM that is not cleared at reset (RTC memory on ESP32, .noinit on AVR),
+// so that a watchdog or brownout reset resumes the breath cycle without waiting for the host
+const uint32_t WARM_STATE_MAGIC = 0x48455657;  // "HEVW"
+// resets in a row, without a whole breath in between, that are resumed. the next one starts cold
+const uint8_t  WARM_RESUME_MAX  = 3;
+
+// saved when the state or its parameters change, a resumed state starts over
+struct warm_state {
+    uint32_t magic;
+    uint8_t  bl_state;
+    uint8_t  ventilation_mode;
+    uint8_t  running;
+    uint8_t  resumes;       // resets resumed since the last whole breath
+    uint32_t fsm_timeout;   // ms
+    uint32_t fsm_carry;     // ms
+    uint16_t crc;           // of the fields above
+};
 
 class BreathingLoop
 {
@@ -23,12 +85,33 @@ public:
     void doStart();
     void doStop();
     void doReset();
+    void doCalibrate();
+    void loadCalibration(PersistentStore *store);
+    // hands a finished calibration to the store, from loop() which runs the store
+    void saveCalibration();
+    bool resumeWarmState();
+    bool getCalibrated();
+    const pressure_calibration &getCalibration();
     bool getRunning();
-    void updateReadings();
+    uint16_t getBreathTimingError();
+    void beginFsmTimer();
+    // on ESP32 the FSM runs from its deadline timer, loop() holds this lock
+    // while it touches state shared with the FSM. does nothing elsewhere
+    void lock();
+    void unlock();
+    bool updateReadings();
     readings<uint16_t> getReadingAverages();
     ValvesController * getValvesController();
 
     states_timeouts &getTimeouts();
+    // bulk settings are applied before the next breath starts, or right away between breaths
+    void commitSettings(const settings_shadow *shadow);
+    bool getSettingsPending();
+    uint32_t getSettingsEpoch();
+    // waveforms are written to the inactive table and swapped in at the same boundaries
+    waveform_table *getWaveformStaging();
+    void commitWaveform();
+    bool getWaveformPending();
 
     // states
     enum BL_STATES : uint8_t {
@@ -57,8 +140,26 @@ public:
     };
 
 private:
-    uint32_t            _fsm_time ;
-    uint32_t            _fsm_timeout;
+    uint32_t getFsmWait();
+    void scheduleFsmDeadline();
+    void saveWarmState();
+    void applySettings();
+    float getInhaleOpening();
+
+    uint32_t            _fsm_time ;    // us, start of the current state
+    uint32_t            _fsm_timeout;  // ms
+    uint32_t            _fsm_lead;   // ms the transition out of this state is issued early
+    uint32_t            _fsm_carry;  // ms this state was entered early
+    uint32_t            _breath_late_max;      // us, worst transition delay in the current breath
+    uint16_t            _breath_timing_error;  // us, worst transition delay in the last breath
+#ifdef CHIP_ESP32
+    // state deadlines are met by a one shot esp_timer running the FSM
+    static void onFsmTimer(void *arg);
+    esp_timer_handle_t  _fsm_timer;
+    SemaphoreHandle_t   _fsm_lock;
+    uint32_t            _fsm_armed_deadline;
+#endif
+    uint8_t             _warm_resumes;
     VENTILATION_MODES   _ventilation_mode;
     BL_STATES           _bl_state;
     bool                _running;
@@ -69,16 +170,30 @@ private:
     // calibration
     void calibrate();
     void initCalib();
-    float getCalibrationOffset();
+    void finishCalibration();
+    uint16_t calcCalibrationMean(uint32_t sum);
     uint32_t _calib_N;
     uint32_t _calib_time;
     uint32_t _calib_timeout;
-    uint32_t _calib_sum_pressure; // 32 bit due to possible analog read overflow
-    float _calib_avg_pressure;
-
-    // timeouts
+    readings<uint32_t> _calib_sums; // 32 bit due to possible analog read overflow
+    pressure_calibration _calibration;
+    bool     _calibrated;
+    PersistentStore *_store;
+    volatile bool _calibration_pending;   // finished, not yet saved
+    bool     _latency_learn;
+    uint16_t _latency_baseline;
+    uint32_t _latency_time;
+    uint32_t _calib_settled_time;   // ms, the offsets are sampled from here on
+
+    // timeouts, in settings.timeouts
     uint32_t calculateTimeoutExhale();
-    states_timeouts _states_timeouts = {10000, 600, 600, 100, 600, 100, 100, 1000, 500, 600, 400};
+    const settings_shadow *_settings_pending;
+    uint32_t _settings_epoch;   // bulk transactions applied since boot
+
+    // inhale waveform, double buffered so that an upload never touches the table being played
+    waveform_table _waveforms[2];
+    uint8_t        _waveform_active;
+    bool           _waveform_pending;
 
     // readings
     void resetReadingSums();
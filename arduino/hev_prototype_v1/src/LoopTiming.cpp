@@ -0,0 +1,86 @@
+#include "LoopTiming.h"
+
+#ifdef HEV_PROFILING
+
+LoopTiming loop_timing;
+
+LoopTiming::LoopTiming()
+{
+    reset();
+}
+
+LoopTiming::~LoopTiming()
+{;}
+
+uint32_t LoopTiming::now()
+{
+#if defined(CHIP_ESP32)
+    return static_cast<uint32_t>(XTHAL_GET_CCOUNT());
+#elif defined(ARDUINO_SAM_DUE)
+    return DWT->CYCCNT;
+#elif defined(ARDUINO_ARCH_SAMD)
+    // the Cortex-M0+ has no cycle counter. SysTick counts down at F_CPU and wraps every ms,
+    // read together with millis() the way the core's micros() does
+    uint32_t ticks = SysTick->VAL;
+    uint32_t pend  = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+    uint32_t ms    = millis();
+    uint32_t ticks2, pend2, ms2;
+    do {
+        ticks2 = ticks;
+        pend2  = pend;
+        ms2    = ms;
+        ticks  = SysTick->VAL;
+        pend   = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+        ms     = millis();
+    } while ((pend != pend2) || (ms != ms2) || (ticks > ticks2));
+    uint32_t load = SysTick->LOAD;
+    return (ms + (pend ? 1 : 0)) * (load + 1) + (load - ticks);
+#else
+    return static_cast<uint32_t>(micros());
+#endif
+}
+
+void LoopTiming::reset()
+{
+    memset(_stages, 0, sizeof(_stages));
+#if defined(ARDUINO_SAM_DUE)
+    // the cycle counter is off after reset
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#endif
+}
+
+void LoopTiming::record(LOOP_STAGE stage, uint32_t ticks)
+{
+    if (stage >= LOOP_STAGE_COUNT)
+        return;
+    loop_timing_stage &s = _stages[stage];
+
+    uint32_t scaled = ticks >> LOOP_TIMING_SHIFT;
+    uint8_t bucket = (scaled == 0) ? 0 : static_cast<uint8_t>(32 - __builtin_clzl(scaled));
+    if (bucket >= LOOP_TIMING_BUCKETS)
+        bucket = LOOP_TIMING_BUCKETS - 1;
+
+    s.count++;
+    if (ticks > s.worst)
+        s.worst = ticks;
+    if (s.buckets[bucket] != 0xFFFF)
+        s.buckets[bucket]++;
+}
+
+// write the report of one stage into data, returns the number of bytes used
+uint8_t LoopTiming::fillReport(LOOP_STAGE stage, uint8_t *data)
+{
+    loop_timing_report report;
+    report.stage        = stage;
+    report.shift        = LOOP_TIMING_SHIFT;
+    report.ticks_per_us = LOOP_TIMING_TICKS_PER_US;
+    report.count        = _stages[stage].count;
+    report.worst        = _stages[stage].worst;
+    memcpy(report.buckets, _stages[stage].buckets, sizeof(report.buckets));
+    memcpy(data, &report, sizeof(report));
+    return static_cast<uint8_t>(sizeof(report));
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef LOOP_TIMING_H
+#define LOOP_TIMING_H
+
+// Duration histograms of the stages of loop(), read out with a LOOP_TIMING report.
+// Only built with -DHEV_PROFILING, otherwise the LOOP_TIMING_* macros expand to nothing.
+
+#include <Arduino.h>
+#include "common.h"
+
+#ifdef HEV_PROFILING
+
+#define LOOP_TIMING_BUCKETS 16
+
+// durations are in ticks of the fastest counter of the board, shifted right by
+// LOOP_TIMING_SHIFT before bucketing so that the top bucket covers a few ms.
+// CPU cycles on ESP32, SAM and SAMD. AVR uses micros(), which only moves in steps of
+// 4 us at 16 MHz: timer 1 could count cycles, but it runs the PWM of pins 9 and 10
+#if defined(CHIP_ESP32)
+#include <xtensa/core-macros.h>
+#define LOOP_TIMING_TICKS_PER_US (F_CPU / 1000000)
+#define LOOP_TIMING_SHIFT 7
+#elif defined(ARDUINO_SAM_DUE) || defined(ARDUINO_ARCH_SAMD)
+#define LOOP_TIMING_TICKS_PER_US (F_CPU / 1000000)
+#define LOOP_TIMING_SHIFT 5
+#else
+#define LOOP_TIMING_TICKS_PER_US 1
+#define LOOP_TIMING_SHIFT 0
+#endif
+
+// bucket b holds durations with (ticks >> LOOP_TIMING_SHIFT) in [2^(b-1), 2^b), bucket 0 holds 0
+struct loop_timing_stage {
+    uint32_t count;
+    uint32_t worst;   // ticks
+    uint16_t buckets[LOOP_TIMING_BUCKETS];  // saturate at 0xFFFF
+};
+
+// LOOP_TIMING report payload, one report per stage with report_code = LOOP_STAGE
+struct loop_timing_report {
+    uint8_t  stage;
+    uint8_t  shift;
+    uint16_t ticks_per_us;
+    uint32_t count;
+    uint32_t worst;
+    uint16_t buckets[LOOP_TIMING_BUCKETS];
+};
+
+class LoopTiming
+{
+
+public:
+    LoopTiming();
+    ~LoopTiming();
+    static uint32_t now();
+    void record(LOOP_STAGE stage, uint32_t ticks);
+    void reset();
+    uint8_t fillReport(LOOP_STAGE stage, uint8_t *data);
+
+private:
+    loop_timing_stage _stages[LOOP_STAGE_COUNT];
+};
+
+extern LoopTiming loop_timing;
+
+#define LOOP_TIMING_START(name)        uint32_t loop_timing_##name = LoopTiming::now()
+#define LOOP_TIMING_STOP(name, stage)  loop_timing.record(stage, LoopTiming::now() - loop_timing_##name)
+
+#else
+
+#define LOOP_TIMING_START(name)
+#define LOOP_TIMING_STOP(name, stage)
+
+#endif
+
+#endif
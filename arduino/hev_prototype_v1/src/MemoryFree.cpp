@@ -4,6 +4,23 @@
 #include <WProgram.h>
 #endif
 
+#include "MemoryFree.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <esp_heap_caps.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#elif defined(ARDUINO_ARCH_SAMD) || defined(ARDUINO_ARCH_SAM)
+#include <malloc.h>
+extern "C" char *sbrk(int incr);
+#endif
+
+// fill of the free stack, overwritten as the stack or heap grow into it
+#define MEMORY_STACK_PAINT  0xC5
+// bytes below the current stack pointer left unpainted
+#define MEMORY_STACK_MARGIN 32
+
+#if defined(ARDUINO_ARCH_AVR)
 extern unsigned int __heap_start;
 extern void *__brkval;
 
@@ -20,8 +37,6 @@ struct __freelist
 /* The head of the free list structure */
 extern struct __freelist *__flp;
 
-#include "MemoryFree.h"
-
 /* Calculates the size of the free list */
 int freeListSize()
 {
@@ -36,6 +51,24 @@ int freeListSize()
   return total;
 }
 
+/* Size of the largest block in the free list */
+static uint32_t largestFreeListBlock()
+{
+  struct __freelist* current;
+  uint32_t largest = 0;
+  for (current = __flp; current; current = current->nx)
+  {
+    if (current->sz > largest)
+      largest = current->sz;
+  }
+  return largest;
+}
+
+static uint8_t *heapEnd()
+{
+  return (__brkval == 0) ? reinterpret_cast<uint8_t *>(&__heap_start) : reinterpret_cast<uint8_t *>(__brkval);
+}
+
 int freeMemory()
 {
   int free_memory;
@@ -50,3 +83,94 @@ int freeMemory()
   }
   return free_memory;
 }
+#elif defined(ARDUINO_ARCH_SAMD) || defined(ARDUINO_ARCH_SAM)
+static uint8_t *heapEnd()
+{
+  return reinterpret_cast<uint8_t *>(sbrk(0));
+}
+
+int freeMemory()
+{
+  uint8_t top;
+  // gap between heap and stack, plus the chunks freed inside the heap
+  return static_cast<int>(&top - heapEnd()) + mallinfo().fordblks;
+}
+#elif defined(ARDUINO_ARCH_ESP32)
+int freeMemory()
+{
+  return static_cast<int>(heap_caps_get_free_size(MALLOC_CAP_8BIT));
+}
+#else
+int freeMemory()
+{
+  return 0;
+}
+#endif
+
+#if defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_SAMD) || defined(ARDUINO_ARCH_SAM)
+// heap and stack share one region, the stack grows down towards the heap
+static uint8_t *memory_paint_top = nullptr;
+static uint32_t memory_min_free = 0xFFFFFFFF;
+
+void beginMemoryStats()
+{
+  uint8_t top;
+  memory_paint_top = &top - MEMORY_STACK_MARGIN;
+  // an interrupt taken while painting would have its frame overwritten
+  noInterrupts();
+  for (uint8_t *p = heapEnd(); p < memory_paint_top; p++)
+    *p = MEMORY_STACK_PAINT;
+  interrupts();
+}
+
+// untouched paint above the heap, i.e. the closest the stack has come to the heap
+static uint32_t stackFree()
+{
+  if (memory_paint_top == nullptr)
+    return 0;
+  uint8_t *p = heapEnd();
+  while (p < memory_paint_top && *p == MEMORY_STACK_PAINT)
+    p++;
+  return static_cast<uint32_t>(p - heapEnd());
+}
+#endif
+
+void getMemoryStats(struct memory_stats *stats)
+{
+#if defined(ARDUINO_ARCH_ESP32)
+  stats->free_heap     = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+  stats->largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+  stats->min_free_heap = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+  // of the task running loop(), in bytes on ESP-IDF
+  stats->stack_free    = uxTaskGetStackHighWaterMark(NULL);
+#elif defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_SAMD) || defined(ARDUINO_ARCH_SAM)
+  uint8_t top;
+  uint32_t gap = static_cast<uint32_t>(&top - heapEnd());
+  stats->free_heap     = static_cast<uint32_t>(freeMemory());
+#if defined(ARDUINO_ARCH_AVR)
+  uint32_t fragment = largestFreeListBlock();
+  stats->largest_block = (fragment > gap) ? fragment : gap;
+#else
+  // newlib does not expose its free chunks, blocks beyond the gap may exist
+  stats->largest_block = gap;
+#endif
+  // sampled on each call, the stack paint catches the peaks in between
+  if (stats->free_heap < memory_min_free)
+    memory_min_free = stats->free_heap;
+  stats->min_free_heap = memory_min_free;
+  stats->stack_free    = stackFree();
+#else
+  memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+void beginMemoryStats()
+{
+  // heap_caps and FreeRTOS keep their own watermarks
+}
+#elif !defined(ARDUINO_ARCH_AVR) && !defined(ARDUINO_ARCH_SAMD) && !defined(ARDUINO_ARCH_SAM)
+void beginMemoryStats()
+{
+}
+#endif
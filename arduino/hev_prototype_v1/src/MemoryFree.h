@@ -1,15 +1,29 @@
 // MemoryFree library based on code posted here:
 // http://www.arduino.cc/cgi-bin/yabb2/YaBB.pl?num=1213583720/15
 // Extended by Matthew Murdoch to include walking of the free list.
+// Extended with heap and stack statistics for AVR, SAM/SAMD (sbrk) and ESP32 (heap_caps).
 
 #ifndef	MEMORY_FREE_H
 #define MEMORY_FREE_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// all in bytes
+struct memory_stats {
+    uint32_t free_heap;       // free memory, fragments included
+    uint32_t largest_block;   // largest single allocation that can succeed
+    uint32_t min_free_heap;   // lowest free_heap seen since boot
+    uint32_t stack_free;      // stack never touched since boot (high-water mark)
+};
+
 int freeMemory();
+// call first thing in setup(), marks the free stack so that its high-water mark can be found
+void beginMemoryStats();
+void getMemoryStats(struct memory_stats *stats);
 
 #ifdef  __cplusplus
 }
@@ -0,0 +1,302 @@
+#include "PersistentStore.h"
+#include <uCRC16Lib.h>
+
+PersistentStore::PersistentStore()
+{
+    _begun = false;
+    _settings = nullptr;
+    _slot_pending = false;
+#ifdef HEV_STORE_EEPROM
+    _log_size = 0;
+    _write_length = 0;
+    _write_pos = 0;
+#endif
+}
+
+PersistentStore::~PersistentStore()
+{;}
+
+void PersistentStore::begin()
+{
+#ifdef HEV_STORE_NVS
+    _begun = _prefs.begin("hev", false);
+#elif defined(HEV_STORE_EEPROM)
+    _begun = true;
+#endif
+}
+
+uint16_t PersistentStore::calcCRC(const void *data, uint8_t size)
+{
+    return uCRC16Lib::calculate(reinterpret_cast<char *>(const_cast<void *>(data)), static_cast<uint16_t>(size));
+}
+
+// copy the record into data, false if it is missing, of another version or corrupted
+bool PersistentStore::load(STORE_SLOT slot, uint8_t version, void *data, uint8_t size)
+{
+    if (!_begun || size > STORE_SLOT_SIZE - sizeof(store_header))
+        return false;
+
+    uint8_t buffer[STORE_SLOT_SIZE];
+    store_header *header = reinterpret_cast<store_header *>(buffer);
+    uint8_t *record = buffer + sizeof(store_header);
+    uint8_t length = static_cast<uint8_t>(sizeof(store_header) + size);
+
+#if defined(HEV_STORE_NVS)
+    char key[8];
+    snprintf(key, sizeof(key), "slot%u", slot);
+    if (_prefs.getBytes(key, buffer, length) != length)
+        return false;
+#elif defined(HEV_STORE_EEPROM)
+    uint16_t address = static_cast<uint16_t>(slot) * STORE_SLOT_SIZE;
+    for (uint8_t i = 0; i < length; i++)
+        buffer[i] = EEPROM.read(address + i);
+#else
+    // no store on this board
+    (void)slot;
+    (void)length;
+    return false;
+#endif
+
+    if (header->magic != STORE_MAGIC || header->version != version || header->size != size)
+        return false;
+    if (header->crc != calcCRC(record, size))
+        return false;
+
+    memcpy(data, record, size);
+    return true;
+}
+
+// a save while the previous record of the slot is still being written writes it again afterwards
+bool PersistentStore::save(STORE_SLOT slot, uint8_t version, const void *data, uint8_t size)
+{
+#if defined(HEV_STORE_NVS) || defined(HEV_STORE_EEPROM)
+    if (!_begun || size > STORE_SLOT_SIZE - sizeof(store_header))
+        return false;
+
+    store_header *header = reinterpret_cast<store_header *>(_slot_buffer);
+    header->magic   = STORE_MAGIC;
+    header->version = version;
+    header->size    = size;
+    header->crc     = calcCRC(data, size);
+    memcpy(_slot_buffer + sizeof(store_header), data, size);
+    _slot_length  = static_cast<uint8_t>(sizeof(store_header) + size);
+    _slot         = slot;
+    _slot_pending = true;
+    return true;
+#else
+    // no store on this board
+    (void)slot;
+    (void)version;
+    (void)data;
+    (void)size;
+    return false;
+#endif
+}
+
+bool PersistentStore::writeSlot()
+{
+    _slot_pending = false;
+#if defined(HEV_STORE_NVS)
+    char key[8];
+    snprintf(key, sizeof(key), "slot%u", _slot);
+    return _prefs.putBytes(key, _slot_buffer, _slot_length) == _slot_length;
+#elif defined(HEV_STORE_EEPROM)
+    startWrite(static_cast<uint16_t>(_slot) * STORE_SLOT_SIZE, _slot_buffer, _slot_length);
+    return true;
+#else
+    return false;
+#endif
+}
+
+// a stored value outside the range of the registry keeps the default
+void PersistentStore::restoreSetting(uint8_t id, uint32_t value)
+{
+    if (checkSetting(id, value))
+        *getSetting(id) = value;
+}
+
+void PersistentStore::restoreSettings(settings_values &values)
+{
+    _settings = getSettingValues(values);
+
+#if defined(HEV_STORE_NVS)
+    if (_begun) {
+        char key[8];
+        if (_prefs.getUInt("settings_ver", 0) != SETTINGS_VERSION) {
+            for (uint8_t id = 0; id < SETTINGS_COUNT; id++) {
+                snprintf(key, sizeof(key), "s%u", id);
+                _prefs.remove(key);
+            }
+            _prefs.putUInt("settings_ver", SETTINGS_VERSION);
+        } else {
+            // settings never written keep their defaults
+            for (uint8_t id = 0; id < SETTINGS_COUNT; id++) {
+                snprintf(key, sizeof(key), "s%u", id);
+                restoreSetting(id, _prefs.getUInt(key, *getSetting(id)));
+            }
+        }
+    }
+#elif defined(HEV_STORE_EEPROM)
+    if (_begun)
+        restoreLog();
+#endif
+
+    for (uint8_t id = 0; id < SETTINGS_COUNT; id++)
+        _settings_stored[id] = *getSetting(id);
+    _settings_next = 0;
+    _settings_time = static_cast<uint32_t>(millis());
+}
+
+// first setting, from the round robin start, that differs from the stored value
+uint8_t PersistentStore::findChangedSetting()
+{
+    for (uint8_t i = 0; i < SETTINGS_COUNT; i++) {
+        uint8_t id = (_settings_next + i) % SETTINGS_COUNT;
+        if (*getSetting(id) != _settings_stored[id]) {
+            _settings_next = (id + 1) % SETTINGS_COUNT;
+            return id;
+        }
+    }
+    return SETTINGS_NONE;
+}
+
+void PersistentStore::update(bool idle)
+{
+    if (!_begun)
+        return;
+
+#if defined(HEV_STORE_EEPROM)
+    // an EEPROM byte write takes ~3.3 ms but runs on its own, only start one when the previous has finished
+    (void)idle;
+    if (_write_pos < _write_length) {
+        if (eeprom_is_ready()) {
+            // update only rewrites the cells that differ
+            EEPROM.update(_write_address + _write_pos, _write_data[_write_pos]);
+            _write_pos++;
+        }
+        return;
+    }
+#elif defined(HEV_STORE_NVS)
+    // a flash write suspends the cache, stalling every task that runs from flash, the FSM
+    // timer included, for up to tens of ms when a page is erased. they wait for the FSM to stop
+    if (!idle)
+        return;
+#else
+    (void)idle;
+#endif
+
+    if (_slot_pending) {
+        writeSlot();
+        return;
+    }
+    if (_settings == nullptr)
+        return;
+
+    uint32_t tnow = static_cast<uint32_t>(millis());
+    if (tnow - _settings_time < SETTINGS_WRITE_INTERVAL)
+        return;
+
+    uint8_t id = findChangedSetting();
+    if (id != SETTINGS_NONE) {
+        _settings_time = tnow;
+        writeSetting(id);
+    }
+}
+
+bool PersistentStore::writeSetting(uint8_t id)
+{
+#if defined(HEV_STORE_NVS)
+    // NVS spreads the writes over its pages itself
+    char key[8];
+    snprintf(key, sizeof(key), "s%u", id);
+    uint32_t value = *getSetting(id);
+    if (_prefs.putUInt(key, value) == 0)
+        return false;
+    _settings_stored[id] = value;
+    return true;
+#elif defined(HEV_STORE_EEPROM)
+    _settings_stored[id] = *getSetting(id);
+    appendEntry(id);
+    return true;
+#else
+    (void)id;
+    return false;
+#endif
+}
+
+#ifdef HEV_STORE_EEPROM
+uint16_t PersistentStore::getEntryAddress(uint8_t idx)
+{
+    return static_cast<uint16_t>(STORE_SLOTS * STORE_SLOT_SIZE + static_cast<uint16_t>(idx) * sizeof(settings_entry));
+}
+
+bool PersistentStore::readEntry(uint8_t idx, settings_entry &entry)
+{
+    EEPROM.get(getEntryAddress(idx), entry);
+    if (entry.version != SETTINGS_VERSION || entry.id >= SETTINGS_COUNT)
+        return false;
+    return entry.crc == calcCRC(&entry, offsetof(settings_entry, crc));
+}
+
+void PersistentStore::restoreLog()
+{
+    _log_size = static_cast<uint8_t>(STORE_LOG_ENTRIES > 0xFF ? 0xFF : STORE_LOG_ENTRIES);
+    _log_head = 0;
+    _log_seq  = 0;
+    memset(_log_live, SETTINGS_NONE, sizeof(_log_live));
+
+    // the newest entry of each id holds its value, the newest entry overall precedes the head
+    uint32_t seqs[SETTINGS_COUNT];
+    bool found = false;
+    settings_entry entry;
+    for (uint8_t idx = 0; idx < _log_size; idx++) {
+        if (!readEntry(idx, entry))
+            continue;
+        if (_log_live[entry.id] == SETTINGS_NONE || entry.seq > seqs[entry.id]) {
+            _log_live[entry.id] = idx;
+            seqs[entry.id] = entry.seq;
+            restoreSetting(entry.id, entry.value);
+        }
+        if (!found || entry.seq >= _log_seq) {
+            _log_seq  = entry.seq + 1;
+            _log_head = (idx + 1) % _log_size;
+            found = true;
+        }
+    }
+}
+
+bool PersistentStore::isLiveEntry(uint8_t idx)
+{
+    for (uint8_t id = 0; id < SETTINGS_COUNT; id++) {
+        if (_log_live[id] == idx)
+            return true;
+    }
+    return false;
+}
+
+void PersistentStore::appendEntry(uint8_t id)
+{
+    // the only copy of a setting is never overwritten, the head skips over it.
+    // the ring holds more entries than there are settings, so a free entry exists
+    while (isLiveEntry(_log_head))
+        _log_head = (_log_head + 1) % _log_size;
+
+    _entry.seq     = _log_seq++;
+    _entry.id      = id;
+    _entry.version = SETTINGS_VERSION;
+    _entry.value   = _settings_stored[id];
+    _entry.crc     = calcCRC(&_entry, offsetof(settings_entry, crc));
+    startWrite(getEntryAddress(_log_head), &_entry, sizeof(_entry));
+
+    _log_live[id] = _log_head;
+    _log_head = (_log_head + 1) % _log_size;
+}
+
+void PersistentStore::startWrite(uint16_t address, const void *data, uint8_t length)
+{
+    _write_data    = reinterpret_cast<const uint8_t *>(data);
+    _write_address = address;
+    _write_length  = length;
+    _write_pos     = 0;
+}
+#endif
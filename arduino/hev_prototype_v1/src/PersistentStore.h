@@ -0,0 +1,117 @@
+#ifndef PERSISTENT_STORE_H
+#define PERSISTENT_STORE_H
+
+// Non-volatile storage of small records that must survive a power cycle.
+// NVS (Preferences) on ESP32, EEPROM on AVR; SAM/SAMD have no EEPROM and the
+// store reports every record as missing.
+
+#include <Arduino.h>
+#include "common.h"
+#if defined(CHIP_ESP32)
+#include <Preferences.h>
+#define HEV_STORE_NVS
+#elif defined(ARDUINO_ARCH_AVR)
+#include <EEPROM.h>
+#define HEV_STORE_EEPROM
+#endif
+
+#define STORE_MAGIC     0x4845  // "HE"
+#define STORE_SLOT_SIZE 48      // bytes reserved per slot in EEPROM, header included
+#define STORE_SLOTS     2       // slots reserved in EEPROM, the settings log follows them
+
+// bump when the meaning of a setting id changes, stored settings are then ignored
+#define SETTINGS_VERSION        1
+// at most one changed setting is written per interval
+#define SETTINGS_WRITE_INTERVAL 100     // ms
+
+enum STORE_SLOT : uint8_t {
+    CALIBRATION_SLOT = 0
+};
+
+// written in front of every record, a record is only used if all fields match
+struct store_header {
+    uint16_t magic;
+    uint8_t  version;  // layout version of the record
+    uint8_t  size;
+    uint16_t crc;      // of the record data
+};
+
+// one setting in the EEPROM log, the entry with the newest seq of an id holds its value
+struct settings_entry {
+    uint32_t seq;      // never wraps within the endurance of the EEPROM
+    uint32_t value;
+    uint8_t  id;
+    uint8_t  version;
+    uint16_t crc;      // of the fields above
+};
+
+#ifdef HEV_STORE_EEPROM
+// the EEPROM after the slots is the settings ring. a setting that was ever changed keeps its
+// live entry, so only the entries beyond SETTINGS_COUNT rotate: on the 1 KB EEPROM of the
+// Uno and Yun that is (1024 - 96) / 12 = 77 entries for 61 settings, 16 taking the wear
+#define STORE_LOG_ENTRIES ((E2END + 1 - STORE_SLOTS * STORE_SLOT_SIZE) / sizeof(settings_entry))
+static_assert(STORE_LOG_ENTRIES > SETTINGS_COUNT, "EEPROM too small for the settings ring");
+#endif
+
+class PersistentStore
+{
+
+public:
+    PersistentStore();
+    ~PersistentStore();
+    void begin();
+    bool load(STORE_SLOT slot, uint8_t version, void *data, uint8_t size);
+    // the record is copied and written later by update()
+    bool save(STORE_SLOT slot, uint8_t version, const void *data, uint8_t size);
+
+    // settings are restored at boot and written back by update() when changed
+    void restoreSettings(settings_values &values);
+    // writes a saved record or a changed setting, a bounded step per call from loop().
+    // idle: the FSM is in IDLE or STOP, flash writes that stall the CPU are only done then
+    void update(bool idle);
+
+private:
+    uint16_t calcCRC(const void *data, uint8_t size);
+    uint32_t *getSetting(uint8_t id) { return _settings + id; }
+    void     restoreSetting(uint8_t id, uint32_t value);
+    uint8_t  findChangedSetting();
+    bool     writeSlot();
+    bool     writeSetting(uint8_t id);
+#ifdef HEV_STORE_EEPROM
+    // settings are appended to a ring of entries to spread the wear over the EEPROM
+    bool     readEntry(uint8_t idx, settings_entry &entry);
+    uint16_t getEntryAddress(uint8_t idx);
+    void     restoreLog();
+    bool     isLiveEntry(uint8_t idx);
+    void     appendEntry(uint8_t id);
+    void     startWrite(uint16_t address, const void *data, uint8_t length);
+
+    uint8_t  _log_size;                     // entries in the ring
+    uint8_t  _log_head;                     // next entry to write
+    uint32_t _log_seq;
+    uint8_t  _log_live[SETTINGS_COUNT];     // entry holding the value of each setting, or SETTINGS_NONE
+    settings_entry _entry;                  // settings entry being appended
+    // the record in flight is written one byte per call, so update never waits on the EEPROM
+    const uint8_t *_write_data;
+    uint16_t _write_address;
+    uint8_t  _write_length;
+    uint8_t  _write_pos;
+#endif
+    // the record passed to save(), until update writes it
+    uint8_t  _slot_buffer[STORE_SLOT_SIZE];
+    uint8_t  _slot_length;
+    uint8_t  _slot;
+    bool     _slot_pending;
+
+#ifdef HEV_STORE_NVS
+    Preferences _prefs;
+#endif
+    bool _begun;
+
+    uint32_t *_settings;                          // settings_values as a flat array, indexed by setting id
+    uint32_t  _settings_stored[SETTINGS_COUNT];   // value last sent to the store
+    uint8_t   _settings_next;                     // round robin start of the search for changes
+    uint32_t  _settings_time;
+};
+
+#endif
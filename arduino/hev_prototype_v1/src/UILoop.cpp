@@ -1,9 +1,30 @@
 #include "UILoop.h"
 // #include "BreathingLoop.h"
+#include "LoopTiming.h"
+#include "MemoryFree.h"
+#include <uCRC16Lib.h>
 
-UILoop::UILoop(BreathingLoop *bl)
+UILoop::UILoop(BreathingLoop *bl, AlarmLoop *al, CommsControl *comms)
 {
     _breathing_loop = bl;
+    _alarm_loop = al;
+    _comms = comms;
+    memset(_reports_pending, 0, sizeof(_reports_pending));
+    _memory_report_time = static_cast<uint32_t>(millis());
+    memset(&_settings_shadow, 0, sizeof(_settings_shadow));
+    _settings_txn = 0;
+    _settings_chunk = 0;
+    _settings_open = false;
+    _settings_committed = false;
+    _settings_applied = false;
+    _settings_crc = 0;
+    _settings_epoch = 0;
+    _waveform_txn = 0;
+    _waveform_chunk = 0;
+    _waveform_open = false;
+    _waveform_committed = false;
+    _waveform_applied = false;
+    _waveform_crc = 0;
 }
 
 UILoop::~UILoop()
@@ -27,37 +48,364 @@ int UILoop::doCommand(cmd_format *cf)
         case CMD_TYPE::SET_THRESHOLD_MAX :
             cmdSetThresholdMax(cf);
             break;
+        case CMD_TYPE::SET_VALVE_RAMP :
+            cmdSetValveRamp(cf);
+            break;
+        case CMD_TYPE::SET_VALVE_RAMP_PT :
+            cmdSetValveRampPoint(cf);
+            break;
+        case CMD_TYPE::SET_VALVE_LATENCY :
+            cmdSetValveLatency(cf);
+            break;
+        case CMD_TYPE::ACK_ALARM :
+            cmdAckAlarm(cf);
+            break;
+        case CMD_TYPE::REQUEST_REPORT :
+            cmdRequestReport(cf);
+            break;
         default:
             break;
     }
     return 0;
 }
 
+// chunks of a transaction are staged in order, the last one commits the whole transaction.
+// chunk 0 starts afresh, unless it repeats the chunk 0 of the transaction applied last
+void UILoop::doSettings(settings_format *sf) {
+    // a later chunk resent because its link ACK was lost is already staged
+    if (sf->chunk > 0 && sf->txn == _settings_txn && static_cast<uint8_t>(sf->chunk + 1) == _settings_chunk)
+        return;
+
+    if (sf->chunk == 0) {
+        uint16_t crc = uCRC16Lib::calculate(reinterpret_cast<char *>(sf), sizeof(settings_format));
+        if (_settings_committed) {
+            // the same txn is a resend of its only chunk, answered once it is applied
+            if (sf->txn != _settings_txn)
+                replySettings(sf->txn, SETTINGS_STATUS::SETTINGS_BUSY, _breathing_loop->getSettingsEpoch());
+            return;
+        }
+        if (_settings_applied && sf->txn == _settings_txn && crc == _settings_crc) {
+            // resent after its link ACK was lost, applying it again would bump the epoch twice
+            replySettings(_settings_txn, SETTINGS_STATUS::SETTINGS_APPLIED, _settings_epoch);
+            return;
+        }
+        memset(_settings_shadow.staged, 0, sizeof(_settings_shadow.staged));
+        _settings_txn = sf->txn;
+        _settings_crc = crc;
+        _settings_chunk = 0;
+        _settings_open = true;
+        _settings_applied = false;
+    } else if (!_settings_open || sf->txn != _settings_txn || sf->chunk != _settings_chunk) {
+        _settings_open = false;
+        replySettings(sf->txn, SETTINGS_STATUS::SETTINGS_SEQUENCE, _breathing_loop->getSettingsEpoch());
+        return;
+    }
+
+    bool valid = (sf->chunk < sf->chunks) && (sf->count <= SETTINGS_FRAME_VALUES);
+    for (uint8_t i = 0; valid && i < sf->count; i++)
+        valid = stageSetting(sf->values[i]);
+    if (!valid) {
+        _settings_open = false;
+        replySettings(sf->txn, SETTINGS_STATUS::SETTINGS_INVALID, _breathing_loop->getSettingsEpoch());
+        return;
+    }
+
+    _settings_chunk++;
+    if (_settings_chunk == sf->chunks) {
+        _settings_open = false;
+        _settings_committed = true;
+        _breathing_loop->commitSettings(&_settings_shadow);
+    }
+}
+
+// false for an unknown setting or a value out of its range
+bool UILoop::stageSetting(const setting_value &value) {
+    uint8_t id = getSettingId(value.cmd_type, value.cmd_code);
+    if (!checkSetting(id, value.param))
+        return false;
+    getSettingValues(_settings_shadow.values)[id] = value.param;
+    _settings_shadow.staged[id / 32] |= (1UL << (id % 32));
+    return true;
+}
+
+void UILoop::replySettings(uint8_t txn, SETTINGS_STATUS status, uint32_t epoch) {
+    settings_format reply;
+    reply.txn    = txn;
+    reply.status = status;
+    reply.epoch  = epoch;
+    _payload.setSettings(&reply);
+    _comms->writePayload(_payload);
+}
+
+// one reply per transaction, once the breathing loop has applied it
+void UILoop::sendSettingsReply() {
+    if (_settings_committed && !_breathing_loop->getSettingsPending()) {
+        _settings_committed = false;
+        _settings_applied = true;
+        _settings_epoch = _breathing_loop->getSettingsEpoch();
+        replySettings(_settings_txn, SETTINGS_STATUS::SETTINGS_APPLIED, _settings_epoch);
+    }
+}
+
+// waveform uploads follow the chunking and replies of the settings transactions
+void UILoop::doWaveform(waveform_format *wf) {
+    if (wf->chunk > 0 && wf->txn == _waveform_txn && static_cast<uint8_t>(wf->chunk + 1) == _waveform_chunk)
+        return;
+
+    waveform_table *staging = _breathing_loop->getWaveformStaging();
+    if (wf->chunk == 0) {
+        uint16_t crc = uCRC16Lib::calculate(reinterpret_cast<char *>(wf), sizeof(waveform_format));
+        if (_waveform_committed) {
+            if (wf->txn != _waveform_txn)
+                replyWaveform(wf->txn, SETTINGS_STATUS::SETTINGS_BUSY);
+            return;
+        }
+        if (_waveform_applied && wf->txn == _waveform_txn && crc == _waveform_crc) {
+            replyWaveform(_waveform_txn, SETTINGS_STATUS::SETTINGS_APPLIED);
+            return;
+        }
+        staging->count = 0;
+        _waveform_txn = wf->txn;
+        _waveform_crc = crc;
+        _waveform_chunk = 0;
+        _waveform_open = true;
+        _waveform_applied = false;
+    } else if (!_waveform_open || wf->txn != _waveform_txn || wf->chunk != _waveform_chunk) {
+        _waveform_open = false;
+        replyWaveform(wf->txn, SETTINGS_STATUS::SETTINGS_SEQUENCE);
+        return;
+    }
+
+    // points must fit the table, stay within the valve range and increase in time
+    bool valid = (wf->chunk < wf->chunks) && (wf->count <= WAVEFORM_FRAME_POINTS)
+              && (staging->count + wf->count <= WAVEFORM_POINTS);
+    for (uint8_t i = 0; valid && i < wf->count; i++) {
+        const waveform_point &point = wf->points[i];
+        valid = (point.value <= WAVEFORM_VALUE_MAX)
+             && (staging->count == 0 || point.time > staging->points[staging->count - 1].time);
+        if (valid)
+            staging->points[staging->count++] = point;
+    }
+    if (!valid) {
+        _waveform_open = false;
+        replyWaveform(wf->txn, SETTINGS_STATUS::SETTINGS_INVALID);
+        return;
+    }
+
+    _waveform_chunk++;
+    if (_waveform_chunk == wf->chunks) {
+        _waveform_open = false;
+        _waveform_committed = true;
+        _breathing_loop->commitWaveform();
+    }
+}
+
+void UILoop::replyWaveform(uint8_t txn, SETTINGS_STATUS status) {
+    waveform_format reply;
+    reply.txn    = txn;
+    reply.status = status;
+    _payload.setWaveform(&reply);
+    _comms->writePayload(_payload);
+}
+
+// one reply per upload, once the table has been swapped in
+void UILoop::sendWaveformReply() {
+    if (_waveform_committed && !_breathing_loop->getWaveformPending()) {
+        _waveform_committed = false;
+        _waveform_applied = true;
+        replyWaveform(_waveform_txn, SETTINGS_STATUS::SETTINGS_APPLIED);
+    }
+}
+
 void UILoop::cmdGeneral(cmd_format *cf) {
     switch (cf->cmd_code) {
         case 0x1 : _breathing_loop->doStart();
             break;
         case 0x2 : _breathing_loop->doStop();
             break;
+        case 0x5 : _breathing_loop->doCalibrate();
+            break;
         default:
             break;
     }
 }
 
+// values outside the range in the settings registry are ignored
 void UILoop::cmdSetTimeout(cmd_format *cf) {
-    setTimeout(static_cast<CMD_SET_TIMEOUT>(cf->cmd_code), _breathing_loop->getTimeouts(), cf->param);
+    setSetting(cf->cmd_type, cf->cmd_code, cf->param);
 }
 
 void UILoop::cmdSetMode(cmd_format *cf) {
-    ;
+    (void)cf;
 }
 
 void UILoop::cmdSetThresholdMin(cmd_format *cf) {
-    setThreshold(static_cast<ALARM_CODES>(cf->cmd_code), alarm_threshold_min, cf->param);
+    setSetting(cf->cmd_type, cf->cmd_code, cf->param);
 }
 
 void UILoop::cmdSetThresholdMax(cmd_format *cf) {
-    setThreshold(static_cast<ALARM_CODES>(cf->cmd_code), alarm_threshold_max, cf->param);
+    setSetting(cf->cmd_type, cf->cmd_code, cf->param);
+}
+
+void UILoop::cmdSetValveRamp(cmd_format *cf) {
+    // param: profile << 16 | duration in ms
+    _breathing_loop->getValvesController()->setRamp(static_cast<CMD_SET_VALVE_RAMP>(cf->cmd_code),
+                                                    static_cast<VALVE_RAMP_PROFILE>((cf->param >> 16) & 0xFF),
+                                                    static_cast<uint16_t>(cf->param & 0xFFFF));
+}
+
+void UILoop::cmdSetValveRampPoint(cmd_format *cf) {
+    // param: point index << 8 | value
+    _breathing_loop->getValvesController()->setRampPoint(static_cast<CMD_SET_VALVE_RAMP>(cf->cmd_code),
+                                                         static_cast<uint8_t>((cf->param >> 8) & 0xFF),
+                                                         static_cast<uint8_t>(cf->param & 0xFF));
+}
+
+void UILoop::cmdSetValveLatency(cmd_format *cf) {
+    _breathing_loop->getValvesController()->setLatency(static_cast<CMD_SET_VALVE_LATENCY>(cf->cmd_code),
+                                                       static_cast<uint16_t>(cf->param));
+}
+
+void UILoop::cmdAckAlarm(cmd_format *cf) {
+    _alarm_loop->ackAlarm(static_cast<ALARM_CODES>(cf->cmd_code));
+}
+
+void UILoop::cmdRequestReport(cmd_format *cf) {
+    // param: mask of the report codes, 0 for all of them
+    uint8_t type = cf->cmd_code;
+    if (type == REPORT_TYPE::CONFIGURATION) {
+        // everything the host caches, so that it can sync in one request
+        for (uint8_t t = REPORT_TYPE::TIMEOUTS; t <= REPORT_TYPE::SETTINGS_REGISTRY; t++)
+            _reports_pending[t - 1] |= getReportCodes(t);
+        return;
+    }
+    if (type > REPORT_TYPES)
+        return;
+    uint32_t codes = cf->param;
+    if (codes == 0)
+        codes = getReportCodes(type);
+    _reports_pending[type - 1] |= codes;
 }
 
+// mask of all report codes of a type
+uint32_t UILoop::getReportCodes(uint8_t type) {
+    switch (type) {
+        case REPORT_TYPE::LOOP_TIMING:
+            return (1UL << LOOP_STAGE_COUNT) - 1;
+        case REPORT_TYPE::THRESHOLDS_MIN:
+        case REPORT_TYPE::THRESHOLDS_MAX:
+            return (1UL << ((SETTINGS_THRESHOLDS + REPORT_ARRAY_VALUES - 1) / REPORT_ARRAY_VALUES)) - 1;
+        case REPORT_TYPE::SETTINGS_REGISTRY:
+            return (1UL << ((SETTINGS_COUNT + REPORT_REGISTRY_ENTRIES - 1) / REPORT_REGISTRY_ENTRIES)) - 1;
+        default:
+            return 1;
+    }
+}
+
+// uint32 settings are read back REPORT_ARRAY_VALUES at a time, report_code selects the chunk
+static bool fillArrayReport(const void *values, uint8_t size, uint8_t code, report_format &report) {
+    uint8_t count = size / sizeof(uint32_t);
+    uint8_t first = code * REPORT_ARRAY_VALUES;
+    if (first >= count)
+        return false;
+    uint8_t n = (count - first < REPORT_ARRAY_VALUES) ? count - first : REPORT_ARRAY_VALUES;
+    memcpy(report.data, reinterpret_cast<const uint32_t *>(values) + first, n * sizeof(uint32_t));
+    report.size = n * sizeof(uint32_t);
+    return true;
+}
 
+bool UILoop::fillReport(REPORT_TYPE type, uint8_t code, report_format &report) {
+    switch (type) {
+        case REPORT_TYPE::LOOP_TIMING:
+#ifdef HEV_PROFILING
+            if (code >= LOOP_STAGE_COUNT)
+                return false;
+            report.size = loop_timing.fillReport(static_cast<LOOP_STAGE>(code), report.data);
+            return true;
+#else
+            return false;
+#endif
+        case REPORT_TYPE::MEMORY: {
+            memory_stats stats;
+            getMemoryStats(&stats);
+            memcpy(report.data, &stats, sizeof(stats));
+            report.size = sizeof(stats);
+            return true;
+        }
+        case REPORT_TYPE::TIMEOUTS:
+            return fillArrayReport(&settings.timeouts, sizeof(states_timeouts), code, report);
+        case REPORT_TYPE::THRESHOLDS_MIN:
+            return fillArrayReport(&settings.threshold_min, sizeof(alarm_thresholds), code, report);
+        case REPORT_TYPE::THRESHOLDS_MAX:
+            return fillArrayReport(&settings.threshold_max, sizeof(alarm_thresholds), code, report);
+        case REPORT_TYPE::CONTROLLER_STATE: {
+            controller_state state;
+            state.fsm_state        = _breathing_loop->getFsmState();
+            state.ventilation_mode = _breathing_loop->getVentilationMode();
+            state.running          = _breathing_loop->getRunning();
+            state.calibrated       = _breathing_loop->getCalibrated();
+            state.settings_epoch   = _breathing_loop->getSettingsEpoch();
+            state.uptime           = static_cast<uint32_t>(millis());
+            memcpy(report.data, &state, sizeof(state));
+            report.size = sizeof(state);
+            return true;
+        }
+        case REPORT_TYPE::CALIBRATION_OFFSETS:
+            memcpy(report.data, &_breathing_loop->getCalibration(), sizeof(pressure_calibration));
+            report.size = sizeof(pressure_calibration);
+            return true;
+        case REPORT_TYPE::FIRMWARE_VERSION: {
+            firmware_version version;
+            memset(&version, 0, sizeof(version));
+            version.major               = HEV_FIRMWARE_MAJOR;
+            version.minor               = HEV_FIRMWARE_MINOR;
+            version.patch               = HEV_FIRMWARE_PATCH;
+            version.format_version      = HEV_FORMAT_VERSION;
+            version.settings_version    = SETTINGS_VERSION;
+            version.calibration_version = CALIBRATION_VERSION;
+            strncpy(version.build, __DATE__ " " __TIME__, sizeof(version.build) - 1);
+            memcpy(report.data, &version, sizeof(version));
+            report.size = sizeof(version);
+            return true;
+        }
+        case REPORT_TYPE::SETTINGS_REGISTRY: {
+            uint8_t id = code * REPORT_REGISTRY_ENTRIES;
+            setting_descriptor *descriptors = reinterpret_cast<setting_descriptor *>(report.data);
+            report.size = 0;
+            for (uint8_t i = 0; i < REPORT_REGISTRY_ENTRIES && getSettingDescriptor(id + i, descriptors[i]); i++)
+                report.size += sizeof(setting_descriptor);
+            return report.size > 0;
+        }
+        default:
+            return false;
+    }
+}
+
+// send the next pending report, without pushing anything out of the report queue
+void UILoop::sendReports() {
+    uint32_t tnow = static_cast<uint32_t>(millis());
+    if (tnow - _memory_report_time > MEMORY_REPORT_INTERVAL) {
+        _memory_report_time = tnow;
+        _reports_pending[REPORT_TYPE::MEMORY - 1] |= 1;
+    }
+
+    for (uint8_t t = 0; t < REPORT_TYPES; t++) {
+        if (_reports_pending[t] == 0)
+            continue;
+        if (_comms->isQueueFull(PAYLOAD_TYPE::REPORT))
+            return;
+
+        uint8_t code = static_cast<uint8_t>(__builtin_ctzl(_reports_pending[t]));
+        _reports_pending[t] &= ~(1UL << code);
+
+        report_format report;
+        report.report_type = t + 1;
+        report.report_code = code;
+        report.timestamp   = static_cast<uint32_t>(millis());
+        if (fillReport(static_cast<REPORT_TYPE>(t + 1), code, report)) {
+            _payload.setReport(&report);
+            _comms->writePayload(_payload);
+        }
+        return;
+    }
+}
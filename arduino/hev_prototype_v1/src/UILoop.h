@@ -2,25 +2,94 @@
 #define UI_LOOP_H
 
 #include <Arduino.h>
-#include "CommsFormat.h"
+#include "CommsControl.h"
 #include "BreathingLoop.h"
+#include "AlarmLoop.h"
 #include "common.h"
 
+// report types are 1..REPORT_TYPES, each with up to 32 report codes
+#define REPORT_TYPES 9
+// uint32 settings sent per report, REPORT_DATA_SIZE / 4
+#define REPORT_ARRAY_VALUES 12
+// setting_descriptor entries sent per report, REPORT_DATA_SIZE / 16
+#define REPORT_REGISTRY_ENTRIES 3
+// period of the unrequested MEMORY report
+#define MEMORY_REPORT_INTERVAL 10000 // ms
+
+// CONTROLLER_STATE read back
+struct controller_state {
+    uint8_t  fsm_state;
+    uint8_t  ventilation_mode;
+    uint8_t  running;
+    uint8_t  calibrated;
+    uint32_t settings_epoch;  // bulk settings transactions applied since boot
+    uint32_t uptime;          // ms
+};
+
+// FIRMWARE_VERSION read back
+struct firmware_version {
+    uint8_t  major;
+    uint8_t  minor;
+    uint8_t  patch;
+    uint8_t  format_version;       // HEV_FORMAT_VERSION of the comms formats
+    uint8_t  settings_version;     // SETTINGS_VERSION of the stored settings
+    uint8_t  calibration_version;  // CALIBRATION_VERSION of the stored calibration
+    uint16_t reserved;
+    char     build[24];            // build date and time
+};
+
 class UILoop
 {
 
 public:
-    UILoop(BreathingLoop *bl);
+    UILoop(BreathingLoop *bl, AlarmLoop *al, CommsControl *comms);
     ~UILoop();
     int doCommand(cmd_format *cf);
+    void doSettings(settings_format *sf);
+    void doWaveform(waveform_format *wf);
+    void sendReports();
+    void sendSettingsReply();
+    void sendWaveformReply();
 private:
     void cmdGeneral(cmd_format *cf);
     void cmdSetTimeout(cmd_format *cf);
     void cmdSetMode(cmd_format *cf);
     void cmdSetThresholdMin(cmd_format *cf);
     void cmdSetThresholdMax(cmd_format *cf);
+    void cmdSetValveRamp(cmd_format *cf);
+    void cmdSetValveRampPoint(cmd_format *cf);
+    void cmdSetValveLatency(cmd_format *cf);
+    void cmdAckAlarm(cmd_format *cf);
+    void cmdRequestReport(cmd_format *cf);
+    uint32_t getReportCodes(uint8_t type);
+    bool fillReport(REPORT_TYPE type, uint8_t code, report_format &report);
+    bool stageSetting(const setting_value &value);
+    void replySettings(uint8_t txn, SETTINGS_STATUS status, uint32_t epoch);
+    void replyWaveform(uint8_t txn, SETTINGS_STATUS status);
 
     BreathingLoop *_breathing_loop;
+    AlarmLoop     *_alarm_loop;
+    CommsControl  *_comms;
+    Payload        _payload;
+    // requested report codes of each type, sent one per call of sendReports as the queue allows
+    uint32_t       _reports_pending[REPORT_TYPES];
+    uint32_t       _memory_report_time;
+    // bulk settings transaction, staged here until the breathing loop applies it
+    settings_shadow _settings_shadow;
+    uint8_t        _settings_txn;
+    uint8_t        _settings_chunk;      // next chunk expected
+    bool           _settings_open;       // chunks are being received
+    bool           _settings_committed;  // handed to the breathing loop, replied to once applied
+    bool           _settings_applied;    // _settings_txn was applied, a resend of it gets the same reply
+    uint16_t       _settings_crc;        // of chunk 0, tells a resend from a new transaction reusing the txn
+    uint32_t       _settings_epoch;      // sent in the reply of _settings_txn
+    // waveform upload, staged in the inactive table of the breathing loop
+    uint8_t        _waveform_txn;
+    uint8_t        _waveform_chunk;
+    bool           _waveform_open;
+    bool           _waveform_committed;
+    bool           _waveform_applied;
+    uint16_t       _waveform_crc;
 };
 
 #endif
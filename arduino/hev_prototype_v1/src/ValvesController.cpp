@@ -1,76 +1,389 @@
 #include "ValvesController.h"
 #include "common.h"
+#ifdef CHIP_ESP32
+#include <soc/gpio_struct.h>
+#endif
+
+uint16_t ValvesController::_duty_table[VALVE_DUTY_TABLE_SIZE];
+#if defined(VALVE_RAMP_TIMER) && !defined(CHIP_ESP32)
+ValvesController *ValvesController::_ramp_instance = nullptr;
+#endif
 
 ValvesController::ValvesController()
 {
-    _air_in.pin = pin_valve_air_in;
-    _air_in.proportional = false;
-    _air_in.state = VALVE_STATE::CLOSED;
-
-    _o2_in.pin = pin_valve_o2_in;
-    _o2_in.proportional = false;
-    _o2_in.state = VALVE_STATE::CLOSED;
+    initDigitalValve(_air_in, pin_valve_air_in);
+    initDigitalValve(_o2_in, pin_valve_o2_in);
+    initPWMValve(_inhale, pin_valve_inhale);
+    initPWMValve(_exhale, pin_valve_exhale);
+    initDigitalValve(_purge, pin_valve_purge);
 
-    _inhale.pin = pin_valve_inhale;
-    _inhale.proportional = true;
-    _inhale.state = VALVE_STATE::CLOSED;
+#ifdef CHIP_ESP32
+    _inhale.pwm_chan = pwm_chan_inhale;
+    _exhale.pwm_chan = pwm_chan_exhale;
+#endif
 
-    _exhale.pin = pin_valve_exhale;
-    _exhale.proportional = false;
-    _exhale.state = VALVE_STATE::CLOSED;
+    // precompute the duty cycles once, so that setting a valve is a table lookup
+    for (int i = 0; i < VALVE_DUTY_TABLE_SIZE; i++) {
+        _duty_table[i] = static_cast<uint16_t>(calcValveDutyCycle(pwm_resolution, static_cast<float>(i) / (VALVE_DUTY_TABLE_SIZE - 1)));
+    }
 
-    _purge.pin = pin_valve_purge;
-    _purge.proportional = false;
-    _purge.state = VALVE_STATE::CLOSED;
+#ifdef CHIP_ESP32
+    _ramp_timer = nullptr;
+    _ramp_lock  = nullptr;
+#endif
 
+    // default to the step function, i.e. no ramp
+    setRamp(CMD_SET_VALVE_RAMP::INHALE_RISE, VALVE_RAMP_PROFILE::RAMP_STEP, 0);
+    setRamp(CMD_SET_VALVE_RAMP::INHALE_FALL, VALVE_RAMP_PROFILE::RAMP_STEP, 0);
+    setRamp(CMD_SET_VALVE_RAMP::EXHALE_RISE, VALVE_RAMP_PROFILE::RAMP_STEP, 0);
+    setRamp(CMD_SET_VALVE_RAMP::EXHALE_FALL, VALVE_RAMP_PROFILE::RAMP_STEP, 0);
 }
 
 ValvesController::~ValvesController()
 { ; }
 
+void ValvesController::initDigitalValve(valve &v, int pin)
+{
+    v.pin = pin;
+    v.proportional = false;
+    v.state = VALVE_STATE::CLOSED;
+    v.written = false;
+
+    // cache the output register and bit, so that writes skip the digitalWrite lookups
+#if defined(CHIP_ESP32)
+    v.out_mask = (pin < 32) ? (1UL << pin) : (1UL << (pin - 32));
+#elif defined(ARDUINO_ARCH_AVR)
+    v.out_reg  = portOutputRegister(digitalPinToPort(pin));
+    v.out_mask = digitalPinToBitMask(pin);
+#elif defined(ARDUINO_ARCH_SAMD)
+    v.out_group = g_APinDescription[pin].ulPort;
+    v.out_mask  = 1UL << g_APinDescription[pin].ulPin;
+#endif
+}
+
+void ValvesController::initPWMValve(valve &v, int pin)
+{
+    initDigitalValve(v, pin);
+    v.proportional = true;
+}
+
 int ValvesController::calcValveDutyCycle(int pwm_resolution, float frac_open)
 {
     // Here the duty cycle is an integer in the range of the PWM resolution
     // - for 8 bit, we have range 0-255
     // => duty_cycle = frac_open * 255
     // there's a hard limit set by MAX_VALVE_FRAC_OPEN
-    int range_upper_val = pow(2, pwm_resolution) - 1;
-    if (frac_open > MAX_VALVE_FRAC_OPEN) 
+    int range_upper_val = (1 << pwm_resolution) - 1;
+    if (frac_open > MAX_VALVE_FRAC_OPEN)
         return (int)(range_upper_val * MAX_VALVE_FRAC_OPEN);
+    if (frac_open < 0)
+        return 0;
     return (int)(range_upper_val  * frac_open);
 }
 
-void ValvesController::setPWMValve(int pin, float frac_open)
+// returns true if the requested level differs from the one on the pin
+bool ValvesController::setDigitalValve(valve &v, bool state)
+{
+    v.state = state;
+    if (v.written && v.duty == static_cast<uint16_t>(state))
+        return false;
+    v.duty = static_cast<uint16_t>(state);
+    v.written = true;
+    return true;
+}
+
+void ValvesController::setPWMValve(valve &v, valve_ramp_state &rs, const valve_ramp &rise, const valve_ramp &fall, float frac_open)
+{
+    // same request as last time, nothing to do
+    if (v.written && v.state == frac_open)
+        return;
+    v.state = frac_open;
+
+    int idx = static_cast<int>(frac_open * (VALVE_DUTY_TABLE_SIZE - 1) + 0.5f);
+    if (idx < 0)
+        idx = 0;
+    else if (idx > VALVE_DUTY_TABLE_SIZE - 1)
+        idx = VALVE_DUTY_TABLE_SIZE - 1;
+
+    uint16_t duty_cycle = _duty_table[idx];
+    if (v.written && v.duty == duty_cycle)
+        return;
+    bool first = !v.written;
+    v.duty = duty_cycle;
+    v.written = true;
+
+    lockRamps();
+    const valve_ramp &ramp = (duty_cycle > rs.output) ? rise : fall;
+    if (first || ramp.profile == VALVE_RAMP_PROFILE::RAMP_STEP || ramp.duration == 0) {
+        rs.active = false;
+        writePWMValve(v, rs, duty_cycle);
+    } else {
+        // the ramp timer moves the output from here on
+        rs.ramp   = &ramp;
+        rs.from   = rs.output;
+        rs.to     = duty_cycle;
+        rs.start  = static_cast<uint32_t>(millis());
+        rs.active = true;
+    }
+    unlockRamps();
+}
+
+// keeps the ramp timer out while a ramp or its shape changes.
+// the interrupt state is put back as it was, so this is safe with interrupts already off
+void ValvesController::lockRamps()
+{
+#if defined(CHIP_ESP32)
+    if (_ramp_lock) xSemaphoreTake(_ramp_lock, portMAX_DELAY);
+#elif defined(ARDUINO_ARCH_AVR)
+    _ramp_sreg = SREG;
+    cli();
+#elif defined(VALVE_RAMP_TIMER)
+    _ramp_primask = __get_PRIMASK();
+    __disable_irq();
+#endif
+}
+
+void ValvesController::unlockRamps()
+{
+#if defined(CHIP_ESP32)
+    if (_ramp_lock) xSemaphoreGive(_ramp_lock);
+#elif defined(ARDUINO_ARCH_AVR)
+    SREG = _ramp_sreg;
+#elif defined(VALVE_RAMP_TIMER)
+    __set_PRIMASK(_ramp_primask);
+#endif
+}
+
+void ValvesController::writePWMValve(valve &v, valve_ramp_state &rs, uint16_t duty_cycle)
+{
+    rs.output = duty_cycle;
+#ifdef CHIP_ESP32
+    ledcWrite(v.pwm_chan, duty_cycle);
+#else
+    analogWrite(v.pin, duty_cycle);
+#endif
+}
+
+void ValvesController::stepRamp(valve &v, valve_ramp_state &rs, uint32_t tnow)
+{
+    if (!rs.active)
+        return;
+
+    uint32_t elapsed = tnow - rs.start;
+    uint16_t duration = rs.ramp->duration;
+    uint16_t duty_cycle;
+    if (elapsed >= duration) {
+        duty_cycle = rs.to;
+        rs.active = false;
+    } else {
+        // position along the shape table, with 8 bit fraction between two points
+        uint32_t pos = (elapsed * (VALVE_RAMP_TABLE_SIZE - 1) * 256) / duration;
+        uint8_t  i   = pos >> 8;
+        int32_t  lo  = rs.ramp->table[i];
+        int32_t  hi  = rs.ramp->table[i + 1];
+        int32_t  shape = lo + (((hi - lo) * static_cast<int32_t>(pos & 0xFF)) >> 8);
+        duty_cycle = static_cast<uint16_t>(rs.from + ((static_cast<int32_t>(rs.to) - rs.from) * shape) / 255);
+    }
+
+    if (duty_cycle != rs.output)
+        writePWMValve(v, rs, duty_cycle);
+}
+
+void ValvesController::stepRamps()
 {
+    uint32_t tnow = static_cast<uint32_t>(millis());
+    stepRamp(_inhale, _inhale_ramp, tnow);
+    stepRamp(_exhale, _exhale_ramp, tnow);
+}
 
+#if defined(CHIP_ESP32)
+void ValvesController::onRampTimer(void *arg)
+{
+    ValvesController *vc = static_cast<ValvesController *>(arg);
+    if (!vc->_inhale_ramp.active && !vc->_exhale_ramp.active)
+        return;
+    xSemaphoreTake(vc->_ramp_lock, portMAX_DELAY);
+    vc->stepRamps();
+    xSemaphoreGive(vc->_ramp_lock);
+}
+#elif defined(ARDUINO_ARCH_AVR)
+// overflow of timer 2, left in the core's phase correct PWM mode so that analogWrite on its
+// pins still works: 16 MHz / 64 / 510 gives a tick every 2.04 ms. timer 0 is kept for millis()
+// and the valve PWM on pins 5/6. the ramps follow millis(), so the coarser tick only means
+// fewer, larger steps. tone() takes timer 2 over, so the buzzer must not use it
+ISR(TIMER2_OVF_vect)
+{
+    ValvesController *vc = ValvesController::_ramp_instance;
+    if (vc)
+        vc->stepRamps();
+}
+#elif defined(ARDUINO_ARCH_SAMD) || defined(ARDUINO_ARCH_SAM)
+// called by the core from the 1 ms SysTick interrupt, 0 lets it carry on with its own tick
+extern "C" int sysTickHook(void)
+{
+    ValvesController *vc = ValvesController::_ramp_instance;
+    if (vc)
+        vc->stepRamps();
+    return 0;
+}
+#endif
+
+void ValvesController::beginRampTimer()
+{
 #ifdef CHIP_ESP32
-    int duty_cycle = calcValveDutyCycle(pwm_resolution, frac_open);
-    int chan = pin_to_chan[pin];
-    ledcWrite(chan, duty_cycle);
+    // esp_timer runs off the hardware timer in its own high priority task,
+    // so ramps advance at a fixed rate whatever loop() is doing
+    _ramp_lock = xSemaphoreCreateMutex();
+    esp_timer_create_args_t args;
+    args.callback = &ValvesController::onRampTimer;
+    args.arg = this;
+    args.dispatch_method = ESP_TIMER_TASK;
+    args.name = "valve_ramp";
+    esp_timer_create(&args, &_ramp_timer);
+    esp_timer_start_periodic(_ramp_timer, VALVE_RAMP_TICK_US);
+#elif defined(VALVE_RAMP_TIMER)
+    // the interrupt handlers above, from timers the core already runs
+    _ramp_instance = this;
+#if defined(ARDUINO_ARCH_AVR)
+    TIMSK2 |= _BV(TOIE2);
+#endif
+#endif
+}
+
+valve_ramp *ValvesController::getRamp(CMD_SET_VALVE_RAMP ramp_id)
+{
+    switch (ramp_id) {
+        case CMD_SET_VALVE_RAMP::INHALE_RISE:
+            return &_inhale_rise;
+        case CMD_SET_VALVE_RAMP::INHALE_FALL:
+            return &_inhale_fall;
+        case CMD_SET_VALVE_RAMP::EXHALE_RISE:
+            return &_exhale_rise;
+        case CMD_SET_VALVE_RAMP::EXHALE_FALL:
+            return &_exhale_fall;
+        default:
+            return nullptr;
+    }
+}
+
+void ValvesController::setRamp(CMD_SET_VALVE_RAMP ramp_id, VALVE_RAMP_PROFILE profile, uint16_t duration)
+{
+    valve_ramp *ramp = getRamp(ramp_id);
+    if (ramp == nullptr)
+        return;
+
+    // the shape is tabulated here, so that stepping only interpolates integers,
+    // and only copied in under the lock, the timer may be stepping along the old one
+    const uint8_t last = VALVE_RAMP_TABLE_SIZE - 1;
+    uint8_t table[VALVE_RAMP_TABLE_SIZE];
+    switch (profile) {
+        case VALVE_RAMP_PROFILE::RAMP_LINEAR:
+            for (uint8_t i = 0; i <= last; i++)
+                table[i] = static_cast<uint8_t>((255 * i) / last);
+            break;
+        case VALVE_RAMP_PROFILE::RAMP_EXPONENTIAL: {
+            // first order response, reaching ~98% after 4 time constants
+            const float k = 4.0;
+            for (uint8_t i = 0; i <= last; i++)
+                table[i] = static_cast<uint8_t>(255 * (1 - expf(-k * i / last)) / (1 - expf(-k)) + 0.5f);
+            break;
+        }
+        case VALVE_RAMP_PROFILE::RAMP_CUSTOM:
+            // keep the points set through setRampPoint
+            memcpy(table, ramp->table, sizeof(table));
+            break;
+        default:
+            profile = VALVE_RAMP_PROFILE::RAMP_STEP;
+            for (uint8_t i = 0; i <= last; i++)
+                table[i] = 255;
+            break;
+    }
+    lockRamps();
+    memcpy(ramp->table, table, sizeof(table));
+    ramp->profile  = profile;
+    ramp->duration = duration;
+    unlockRamps();
+}
+
+void ValvesController::setRampPoint(CMD_SET_VALVE_RAMP ramp_id, uint8_t idx, uint8_t value)
+{
+    valve_ramp *ramp = getRamp(ramp_id);
+    if (ramp == nullptr || idx >= VALVE_RAMP_TABLE_SIZE)
+        return;
+    lockRamps();
+    ramp->table[idx] = value;
+    unlockRamps();
+}
+
+// write all changed digital valves in one go, bit 0 = air in, bit 1 = o2 in, bit 2 = purge
+void ValvesController::writeDigitalValves(uint8_t changed)
+{
+    valve *digital[3] = {&_air_in, &_o2_in, &_purge};
+
+#if defined(CHIP_ESP32)
+    // set and clear registers of both banks, one store each
+    uint32_t set_lo = 0, clr_lo = 0, set_hi = 0, clr_hi = 0;
+    for (uint8_t i = 0; i < 3; i++) {
+        if (!(changed & (1 << i)))
+            continue;
+        valve *v = digital[i];
+        if (v->pin < 32) {
+            if (v->duty) set_lo |= v->out_mask; else clr_lo |= v->out_mask;
+        } else {
+            if (v->duty) set_hi |= v->out_mask; else clr_hi |= v->out_mask;
+        }
+    }
+    if (set_lo) GPIO.out_w1ts = set_lo;
+    if (clr_lo) GPIO.out_w1tc = clr_lo;
+    if (set_hi) GPIO.out1_w1ts.val = set_hi;
+    if (clr_hi) GPIO.out1_w1tc.val = clr_hi;
+#elif defined(ARDUINO_ARCH_AVR)
+    // read-modify-write of the port registers, protected against ISRs touching the same port
+    uint8_t old_sreg = SREG;
+    cli();
+    for (uint8_t i = 0; i < 3; i++) {
+        if (!(changed & (1 << i)))
+            continue;
+        valve *v = digital[i];
+        if (v->duty) *v->out_reg |= v->out_mask; else *v->out_reg &= ~v->out_mask;
+    }
+    SREG = old_sreg;
+#elif defined(ARDUINO_ARCH_SAMD)
+    for (uint8_t i = 0; i < 3; i++) {
+        if (!(changed & (1 << i)))
+            continue;
+        valve *v = digital[i];
+        if (v->duty) PORT->Group[v->out_group].OUTSET.reg = v->out_mask;
+        else         PORT->Group[v->out_group].OUTCLR.reg = v->out_mask;
+    }
 #else
-    int duty_cycle = pow(2, pwm_resolution) * frac_open;
-    analogWrite(pin, duty_cycle);
+    for (uint8_t i = 0; i < 3; i++) {
+        if (changed & (1 << i))
+            digitalWrite(digital[i]->pin, digital[i]->duty);
+    }
 #endif
 }
 
-void ValvesController::setValves(bool vin_air, bool vin_o2, float vinhale, 
+void ValvesController::setValves(bool vin_air, bool vin_o2, float vinhale,
                float vexhale, bool vpurge)
 {
-    digitalWrite(_air_in.pin, vin_air);
-    digitalWrite(_o2_in.pin, vin_o2);
-    setPWMValve(_inhale.pin, vinhale);
-    setPWMValve(_exhale.pin, vexhale);
-    digitalWrite(_purge.pin, vpurge);
+    // only outputs that changed since the last call are written
+    uint8_t changed = 0;
+    if (setDigitalValve(_air_in, vin_air)) changed |= 0x1;
+    if (setDigitalValve(_o2_in,  vin_o2 )) changed |= 0x2;
+    if (setDigitalValve(_purge,  vpurge )) changed |= 0x4;
+    if (changed)
+        writeDigitalValves(changed);
 
-    // save the state 
-    _air_in.state = vin_air;
-    _o2_in.state  = vin_o2;
-    _inhale.state = vinhale;
-    _exhale.state = vexhale;
-    _purge.state  = vpurge;
+    setPWMValve(_inhale, _inhale_ramp, _inhale_rise, _inhale_fall, vinhale);
+    setPWMValve(_exhale, _exhale_ramp, _exhale_rise, _exhale_fall, vexhale);
+#ifndef VALVE_RAMP_TIMER
+    // no ramp timer on this board, ramps advance once per loop
+    stepRamps();
+#endif
 }
 
-void ValvesController::getValves(bool &vin_air, bool &vin_o2, float &vinhale, 
+void ValvesController::getValves(bool &vin_air, bool &vin_o2, float &vinhale,
                float &vexhale, bool &vpurge)
 {
     // read the state
@@ -79,4 +392,47 @@ void ValvesController::getValves(bool &vin_air, bool &vin_o2, float &vinhale,
     vinhale = _inhale.state;
     vexhale = _exhale.state;
     vpurge  = _purge.state ;
-}
\ No newline at end of file
+}
+
+valve *ValvesController::getLatencyValve(CMD_SET_VALVE_LATENCY latency_id)
+{
+    switch (latency_id) {
+        case CMD_SET_VALVE_LATENCY::AIR_IN_OPEN:
+        case CMD_SET_VALVE_LATENCY::AIR_IN_CLOSE:
+            return &_air_in;
+        case CMD_SET_VALVE_LATENCY::O2_IN_OPEN:
+        case CMD_SET_VALVE_LATENCY::O2_IN_CLOSE:
+            return &_o2_in;
+        case CMD_SET_VALVE_LATENCY::INHALE_OPEN:
+        case CMD_SET_VALVE_LATENCY::INHALE_CLOSE:
+            return &_inhale;
+        case CMD_SET_VALVE_LATENCY::EXHALE_OPEN:
+        case CMD_SET_VALVE_LATENCY::EXHALE_CLOSE:
+            return &_exhale;
+        case CMD_SET_VALVE_LATENCY::PURGE_OPEN:
+        case CMD_SET_VALVE_LATENCY::PURGE_CLOSE:
+            return &_purge;
+        default:
+            return nullptr;
+    }
+}
+
+void ValvesController::setLatency(CMD_SET_VALVE_LATENCY latency_id, uint16_t latency)
+{
+    valve *v = getLatencyValve(latency_id);
+    if (v == nullptr)
+        return;
+    // open codes are odd, close codes even
+    if (latency_id & 0x1)
+        v->latency_open  = latency;
+    else
+        v->latency_close = latency;
+}
+
+uint16_t ValvesController::getLatency(CMD_SET_VALVE_LATENCY latency_id)
+{
+    valve *v = getLatencyValve(latency_id);
+    if (v == nullptr)
+        return 0;
+    return (latency_id & 0x1) ? v->latency_open : v->latency_close;
+}
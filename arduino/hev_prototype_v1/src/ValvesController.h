@@ -2,11 +2,60 @@
 #define VALVES_CONTROLLER_H
 
 #include <Arduino.h>
+#include "common.h"
+#ifdef CHIP_ESP32
+#include <esp_timer.h>
+#include <freertos/semphr.h>
+#endif
+
+// number of entries in the duty cycle lookup table, i.e. 1% steps of the valve opening
+#define VALVE_DUTY_TABLE_SIZE 101
+// number of points describing a ramp shape, evenly spaced in time from start to end
+#define VALVE_RAMP_TABLE_SIZE 17
+// period of the ramp stepping timer
+#define VALVE_RAMP_TICK_US 1000
+// boards where a timer steps the ramps, elsewhere they advance once per loop
+#if defined(CHIP_ESP32) || defined(ARDUINO_ARCH_AVR) || defined(ARDUINO_ARCH_SAMD) || defined(ARDUINO_ARCH_SAM)
+#define VALVE_RAMP_TIMER
+#endif
+
+// shape of a proportional valve ramp, each point is 0-255 of the full step
+struct valve_ramp {
+    uint8_t  profile  = VALVE_RAMP_PROFILE::RAMP_STEP;
+    uint16_t duration = 0; // ms
+    uint8_t  table[VALVE_RAMP_TABLE_SIZE];
+};
+
+// ramp in progress on a proportional valve
+struct valve_ramp_state {
+    volatile bool active = false;
+    const valve_ramp *ramp = nullptr;
+    uint16_t from   = 0;  // duty cycle at the start of the ramp
+    uint16_t to     = 0;  // duty cycle at the end of the ramp
+    uint16_t output = 0;  // duty cycle currently on the pin
+    uint32_t start  = 0;  // ms
+};
 
 struct valve {
     int pin = -1;
     bool proportional = false;
-    float state; 
+    float state;
+    // output layer: last value written to the hardware
+    bool     written = false;   // false until the first write, forces the initial output
+    uint16_t duty    = 0;       // last duty cycle (proportional) or level (digital)
+    // mechanical actuation delay, ms
+    uint16_t latency_open  = 0;
+    uint16_t latency_close = 0;
+#if defined(CHIP_ESP32)
+    int      pwm_chan = -1;     // ledc channel of proportional valves
+    uint32_t out_mask = 0;      // bit in GPIO.out (pins 0-31) or GPIO.out1 (pins 32-39)
+#elif defined(ARDUINO_ARCH_AVR)
+    volatile uint8_t *out_reg = nullptr;
+    uint8_t  out_mask = 0;
+#elif defined(ARDUINO_ARCH_SAMD)
+    uint8_t  out_group = 0;
+    uint32_t out_mask = 0;
+#endif
 };
 
 enum VALVE_STATE : bool
@@ -15,9 +64,6 @@ enum VALVE_STATE : bool
     OPEN = HIGH
 };
 
-static int pin_to_chan[50];  // too lazy to create a proper hashmap for 2 variables; 50 pins is probably fine
-static int chan_to_pin[50];  
-
 class ValvesController
 {
 
@@ -25,20 +71,64 @@ class ValvesController
 public:
     ValvesController();
     ~ValvesController();
-    void setPWMValve(int pin, float frac_open);
     void setValves(bool vin_air, bool vin_o2, float vinhale,
                    float vexhale, bool vpurge);
     void getValves(bool &vin_air, bool &vin_o2, float &vinhale,
                    float &vexhale, bool &vpurge);
     int calcValveDutyCycle(int pwm_resolution, float frac_open);
 
+    // ramps of the proportional valves
+    void beginRampTimer();
+    void setRamp(CMD_SET_VALVE_RAMP ramp_id, VALVE_RAMP_PROFILE profile, uint16_t duration);
+    void setRampPoint(CMD_SET_VALVE_RAMP ramp_id, uint8_t idx, uint8_t value);
+    void stepRamps();
+#if defined(VALVE_RAMP_TIMER) && !defined(CHIP_ESP32)
+    // the instance stepped by the timer interrupt
+    static ValvesController *_ramp_instance;
+#endif
+
+    // actuation delays, used to issue commands ahead of the intended edge
+    void setLatency(CMD_SET_VALVE_LATENCY latency_id, uint16_t latency);
+    uint16_t getLatency(CMD_SET_VALVE_LATENCY latency_id);
+
 private:
+    void initDigitalValve(valve &v, int pin);
+    void initPWMValve(valve &v, int pin);
+    bool setDigitalValve(valve &v, bool state);
+    void setPWMValve(valve &v, valve_ramp_state &rs, const valve_ramp &rise, const valve_ramp &fall, float frac_open);
+    void writeDigitalValves(uint8_t changed);
+    void writePWMValve(valve &v, valve_ramp_state &rs, uint16_t duty_cycle);
+    void stepRamp(valve &v, valve_ramp_state &rs, uint32_t tnow);
+    valve_ramp *getRamp(CMD_SET_VALVE_RAMP ramp_id);
+    valve *getLatencyValve(CMD_SET_VALVE_LATENCY latency_id);
+    void lockRamps();
+    void unlockRamps();
+
     valve _air_in;
     valve _o2_in;
     valve _inhale;
     valve _exhale;
     valve _purge;
 
+    // duty cycles for 0..100% opening, clamped at MAX_VALVE_FRAC_OPEN
+    static uint16_t _duty_table[VALVE_DUTY_TABLE_SIZE];
+
+    valve_ramp _inhale_rise;
+    valve_ramp _inhale_fall;
+    valve_ramp _exhale_rise;
+    valve_ramp _exhale_fall;
+    valve_ramp_state _inhale_ramp;
+    valve_ramp_state _exhale_ramp;
+#ifdef CHIP_ESP32
+    static void onRampTimer(void *arg);
+    esp_timer_handle_t _ramp_timer;
+    SemaphoreHandle_t  _ramp_lock;
+#elif defined(ARDUINO_ARCH_AVR)
+    uint8_t  _ramp_sreg;    // interrupt state to restore on unlockRamps()
+#elif defined(VALVE_RAMP_TIMER)
+    uint32_t _ramp_primask;
+#endif
+
 };
 
-#endif
\ No newline at end of file
+#endif
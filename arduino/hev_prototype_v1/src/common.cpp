@@ -1,124 +1,102 @@
 #include "common.h"
 
+settings_values settings;
 
-void setThreshold(ALARM_CODES alarm, alarm_thresholds &thresholds, uint32_t value) {
-    switch (alarm) {
-        case ALARM_CODES::APNEA                         :
-            thresholds.apnea = value;
-            break;
-        case ALARM_CODES::CHECK_VALVE_EXHALE            :
-            thresholds.check_valve_exhale = value;
-            break;
-        case ALARM_CODES::CHECK_P_PATIENT               :
-            thresholds.check_p_patient = value;
-            break;
-        case ALARM_CODES::EXPIRATION_SENSE_FAULT_OR_LEAK:
-            thresholds.expiration_sense_fault_or_leak = value;
-            break;
-        case ALARM_CODES::EXPIRATION_VALVE_Leak         :
-            thresholds.expiration_valve_leak = value;
-            break;
-        case ALARM_CODES::HIGH_FIO2                     :
-            thresholds.high_fio2 = value;
-            break;
-        case ALARM_CODES::HIGH_PRESSURE                 :
-            thresholds.high_pressure = value;
-            break;
-        case ALARM_CODES::HIGH_RR                       :
-            thresholds.high_rr = value;
-            break;
-        case ALARM_CODES::HIGH_VTE                      :
-            thresholds.high_vte = value;
-            break;
-        case ALARM_CODES::LOW_VTE                       :
-            thresholds.low_vte = value;
-            break;
-        case ALARM_CODES::HIGH_VTI                      :
-            thresholds.high_vti = value;
-            break;
-        case ALARM_CODES::LOW_VTI                       :
-            thresholds.low_vti = value;
-            break;
-        case ALARM_CODES::INTENTIONAL_STOP              :
-            thresholds.intentional_stop = value;
-            break;
-        case ALARM_CODES::LOW_BATTERY                   :
-            thresholds.low_battery = value;
-            break;
-        case ALARM_CODES::LOW_FIO2                      :
-            thresholds.low_fio2 = value;
-            break;
-        case ALARM_CODES::OCCLUSION                     :
-            thresholds.occlusion = value;
-            break;
-        case ALARM_CODES::HIGH_PEEP                     :
-            thresholds.high_peep = value;
-            break;
-        case ALARM_CODES::LOW_PEEP                      :
-            thresholds.low_peep = value;
-            break;
-        case ALARM_CODES::AC_POWER_DISCONNECTION        :
-            thresholds.ac_power_disconnection = value;
-            break;
-        case ALARM_CODES::BATTERY_FAULT_SRVC            :
-            thresholds.battery_fault_srvc = value;
-            break;
-        case ALARM_CODES::BATTERY_CHARGE                :
-            thresholds.battery_charge = value;
-            break;
-        case ALARM_CODES::AIR_FAIL                      :
-            thresholds.air_fail = value;
-            break;
-        case ALARM_CODES::O2_FAIL                       :
-            thresholds.o2_fail = value;
-            break;
-        case ALARM_CODES::PRESSURE_SENSOR_FAULT         :
-            thresholds.pressure_sensor_fault = value;
-            break;
-        case ALARM_CODES::ARDUINO_FAIL                  :
-            thresholds.arduino_fail = value;
-            break;
-        default:
-            break;
-    }
+// thresholds of each alarm: X(code, unit, max). both sides default to 0, which disables them
+#define ALARM_THRESHOLD_SETTINGS(X) \
+    X(APNEA                         , UNIT_NONE, 0xFFFFFFFF) \
+    X(CHECK_VALVE_EXHALE            , UNIT_NONE, 0xFFFFFFFF) \
+    X(CHECK_P_PATIENT               , UNIT_ADC , 0xFFFF    ) \
+    X(EXPIRATION_SENSE_FAULT_OR_LEAK, UNIT_NONE, 0xFFFFFFFF) \
+    X(EXPIRATION_VALVE_Leak         , UNIT_NONE, 0xFFFFFFFF) \
+    X(HIGH_FIO2                     , UNIT_NONE, 0xFFFFFFFF) \
+    X(HIGH_PRESSURE                 , UNIT_ADC , 0xFFFF    ) \
+    X(HIGH_RR                       , UNIT_NONE, 0xFFFFFFFF) \
+    X(HIGH_VTE                      , UNIT_NONE, 0xFFFFFFFF) \
+    X(LOW_VTE                       , UNIT_NONE, 0xFFFFFFFF) \
+    X(HIGH_VTI                      , UNIT_NONE, 0xFFFFFFFF) \
+    X(LOW_VTI                       , UNIT_NONE, 0xFFFFFFFF) \
+    X(INTENTIONAL_STOP              , UNIT_NONE, 0xFFFFFFFF) \
+    X(LOW_BATTERY                   , UNIT_NONE, 0xFFFFFFFF) \
+    X(LOW_FIO2                      , UNIT_NONE, 0xFFFFFFFF) \
+    X(OCCLUSION                     , UNIT_ADC , 0xFFFF    ) \
+    X(HIGH_PEEP                     , UNIT_ADC , 0xFFFF    ) \
+    X(LOW_PEEP                      , UNIT_ADC , 0xFFFF    ) \
+    X(AC_POWER_DISCONNECTION        , UNIT_NONE, 0xFFFFFFFF) \
+    X(BATTERY_FAULT_SRVC            , UNIT_NONE, 0xFFFFFFFF) \
+    X(BATTERY_CHARGE                , UNIT_NONE, 0xFFFFFFFF) \
+    X(AIR_FAIL                      , UNIT_ADC , 0xFFFF    ) \
+    X(O2_FAIL                       , UNIT_ADC , 0xFFFF    ) \
+    X(PRESSURE_SENSOR_FAULT         , UNIT_NONE, 0xFFFFFFFF) \
+    X(ARDUINO_FAIL                  , UNIT_US  , 0xFFFF    )   // breath timing error
+
+#define TIMEOUT_SETTING(code, min, max, def) \
+    {CMD_TYPE::SET_TIMEOUT, CMD_SET_TIMEOUT::code, SETTING_UNIT::UNIT_MS, 0, min, max, def},
+#define THRESHOLD_MIN_SETTING(code, unit, max) \
+    {CMD_TYPE::SET_THRESHOLD_MIN, ALARM_CODES::code, SETTING_UNIT::unit, 0, 0, max, 0},
+#define THRESHOLD_MAX_SETTING(code, unit, max) \
+    {CMD_TYPE::SET_THRESHOLD_MAX, ALARM_CODES::code, SETTING_UNIT::unit, 0, 0, max, 0},
+
+// every setting in id order, kept in flash. read out with a SETTINGS_REGISTRY report
+static constexpr setting_descriptor settings_registry[SETTINGS_COUNT] PROGMEM = {
+    //              code              min    max    default
+    TIMEOUT_SETTING(CALIBRATION    ,  1000, 60000, 10000)
+    TIMEOUT_SETTING(BUFF_PURGE     ,     0, 60000,   600)
+    TIMEOUT_SETTING(BUFF_FLUSH     ,     0, 60000,   600)
+    TIMEOUT_SETTING(BUFF_PREFILL   ,     0, 10000,   100)
+    TIMEOUT_SETTING(BUFF_FILL      ,     0, 10000,   600)
+    TIMEOUT_SETTING(BUFF_LOADED    ,     0, 10000,   100)
+    TIMEOUT_SETTING(BUFF_PRE_INHALE,     0, 10000,   100)
+    TIMEOUT_SETTING(INHALE         ,   100, 10000,  1000)
+    TIMEOUT_SETTING(PAUSE          ,     0, 10000,   500)
+    TIMEOUT_SETTING(EXHALE_FILL    ,     0, 10000,   600)
+    TIMEOUT_SETTING(EXHALE         ,     0, 60000,   400)
+    ALARM_THRESHOLD_SETTINGS(THRESHOLD_MIN_SETTING)
+    ALARM_THRESHOLD_SETTINGS(THRESHOLD_MAX_SETTING)
+};
+
+// every entry sits at the id of its command and has its default in range
+static constexpr bool checkRegistry(uint8_t id)
+{
+    return (id >= SETTINGS_COUNT)
+        || ((getSettingId(settings_registry[id].cmd_type, settings_registry[id].cmd_code) == id)
+            && (settings_registry[id].min <= settings_registry[id].def)
+            && (settings_registry[id].def <= settings_registry[id].max)
+            && checkRegistry(id + 1));
+}
+static_assert(checkRegistry(0), "settings_registry does not match settings_values");
+
+bool getSettingDescriptor(uint8_t id, setting_descriptor &descriptor)
+{
+    if (id >= SETTINGS_COUNT)
+        return false;
+    memcpy_P(&descriptor, &settings_registry[id], sizeof(setting_descriptor));
+    return true;
+}
+
+bool checkSetting(uint8_t id, uint32_t value)
+{
+    setting_descriptor descriptor;
+    if (!getSettingDescriptor(id, descriptor))
+        return false;
+    return (value >= descriptor.min) && (value <= descriptor.max);
+}
+
+// false, and nothing written, for an unknown setting or a value out of its range
+bool setSetting(uint8_t cmd_type, uint8_t cmd_code, uint32_t value)
+{
+    uint8_t id = getSettingId(cmd_type, cmd_code);
+    if (!checkSetting(id, value))
+        return false;
+    getSettingValues(settings)[id] = value;
+    return true;
 }
 
-void setTimeout(CMD_SET_TIMEOUT cmd, states_timeouts &timeouts, uint32_t value) {
-    switch (cmd) {
-        case CMD_SET_TIMEOUT::CALIBRATION:
-            timeouts.calibration     = value;
-            break;
-        case CMD_SET_TIMEOUT::BUFF_PURGE:
-            timeouts.buff_purge      = value;
-            break;
-        case CMD_SET_TIMEOUT::BUFF_FLUSH:
-            timeouts.buff_flush      = value;
-            break;
-        case CMD_SET_TIMEOUT::BUFF_PREFILL:
-            timeouts.buff_prefill    = value;
-            break;
-        case CMD_SET_TIMEOUT::BUFF_FILL:
-            timeouts.buff_fill       = value;
-            break;
-        case CMD_SET_TIMEOUT::BUFF_LOADED:
-            timeouts.buff_loaded     = value;
-            break;
-        case CMD_SET_TIMEOUT::BUFF_PRE_INHALE:
-            timeouts.buff_pre_inhale = value;
-            break;
-        case CMD_SET_TIMEOUT::INHALE:
-            timeouts.inhale          = value;
-            break;
-        case CMD_SET_TIMEOUT::PAUSE:
-            timeouts.pause           = value;
-            break;
-        case CMD_SET_TIMEOUT::EXHALE_FILL:
-            timeouts.exhale_fill     = value;
-            break;
-        case CMD_SET_TIMEOUT::EXHALE:
-            timeouts.exhale          = value;
-            break;
-        default:
-            break;
+void resetSettings()
+{
+    setting_descriptor descriptor;
+    for (uint8_t id = 0; id < SETTINGS_COUNT; id++) {
+        getSettingDescriptor(id, descriptor);
+        getSettingValues(settings)[id] = descriptor.def;
     }
 }
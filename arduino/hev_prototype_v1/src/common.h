@@ -24,8 +24,15 @@
 #include <Arduino_Due_pinout.h>
 #elif defined(ARDUINO_AVR_YUN)
 #include <Arduino_Yun_pinout.h>
+#elif defined(ARDUINO_ARCH_HOST)
+#include <host_pinout.h>
 #endif
 
+// firmware release, read back with a FIRMWARE_VERSION report
+#define HEV_FIRMWARE_MAJOR 0
+#define HEV_FIRMWARE_MINOR 1
+#define HEV_FIRMWARE_PATCH 0
+
 // 
 const float MAX_VALVE_FRAC_OPEN = 0.68;
 // input params
@@ -34,14 +41,20 @@ enum CMD_TYPE  : uint8_t {
     SET_TIMEOUT       =  2,
     SET_MODE          =  3,
     SET_THRESHOLD_MIN =  4,
-    SET_THRESHOLD_MAX =  5
+    SET_THRESHOLD_MAX =  5,
+    SET_VALVE_RAMP    =  6,
+    SET_VALVE_RAMP_PT =  7,
+    SET_VALVE_LATENCY =  8,
+    ACK_ALARM         =  9,  // cmd_code: ALARM_CODES
+    REQUEST_REPORT    = 10   // cmd_code: REPORT_TYPE
 };
 
 enum CMD_GENERAL : uint8_t {
     START =  1,
     STOP  =  2,
     PURGE =  3,
-    FLUSH =  4
+    FLUSH =  4,
+    CALIBRATE = 5   // discard the stored calibration, the next start recalibrates
 };
 
 // Taken from the FSM doc. Correct as of 1400 on 20200417
@@ -59,6 +72,71 @@ enum CMD_SET_TIMEOUT : uint8_t {
     EXHALE          = 11
 };
 
+// SET_VALVE_RAMP    param: profile << 16 | duration in ms
+// SET_VALVE_RAMP_PT param: point index << 8 | value (0-255), used by RAMP_CUSTOM
+enum CMD_SET_VALVE_RAMP : uint8_t {
+    INHALE_RISE =  1,
+    INHALE_FALL =  2,
+    EXHALE_RISE =  3,
+    EXHALE_FALL =  4
+};
+
+enum VALVE_RAMP_PROFILE : uint8_t {
+    RAMP_STEP        =  0,
+    RAMP_LINEAR      =  1,
+    RAMP_EXPONENTIAL =  2,
+    RAMP_CUSTOM      =  3
+};
+
+// mechanical delay between command and the valve reaching its state
+// SET_VALVE_LATENCY param: delay in ms
+enum CMD_SET_VALVE_LATENCY : uint8_t {
+    AIR_IN_OPEN   =  1,
+    AIR_IN_CLOSE  =  2,
+    O2_IN_OPEN    =  3,
+    O2_IN_CLOSE   =  4,
+    INHALE_OPEN   =  5,
+    INHALE_CLOSE  =  6,
+    EXHALE_OPEN   =  7,
+    EXHALE_CLOSE  =  8,
+    PURGE_OPEN    =  9,
+    PURGE_CLOSE   = 10
+};
+
+// read outs sent as REPORT payloads, report_code selects the part.
+// settings are read back as uint32 arrays in the order of their enum, 12 values per report_code
+enum REPORT_TYPE : uint8_t {
+    CONFIGURATION       =  0,  // REQUEST_REPORT only: all of TIMEOUTS to SETTINGS_REGISTRY
+    LOOP_TIMING         =  1,  // report_code: LOOP_STAGE, needs HEV_PROFILING
+    MEMORY              =  2,  // memory_stats, also sent periodically
+    TIMEOUTS            =  3,  // states_timeouts
+    THRESHOLDS_MIN      =  4,  // alarm_threshold_min, report_code 0-2
+    THRESHOLDS_MAX      =  5,  // alarm_threshold_max, report_code 0-2
+    CONTROLLER_STATE    =  6,  // controller_state
+    CALIBRATION_OFFSETS =  7,  // pressure_calibration
+    FIRMWARE_VERSION    =  8,  // firmware_version
+    SETTINGS_REGISTRY   =  9   // setting_descriptor of 3 setting ids per report_code
+};
+
+// status in the reply to a bulk settings transaction or a waveform upload
+enum SETTINGS_STATUS : uint8_t {
+    SETTINGS_APPLIED  =  1,  // epoch: settings epoch of the breath it took effect in
+    SETTINGS_BUSY     =  2,  // the previous transaction is still waiting for a breath boundary
+    SETTINGS_SEQUENCE =  3,  // chunk out of order or of another transaction, nothing applied
+    SETTINGS_INVALID  =  4   // unknown setting or bad waveform point, nothing applied
+};
+
+// stages of loop() timed with HEV_PROFILING
+enum LOOP_STAGE : uint8_t {
+    FSM_ASSIGNMENT    =  0,
+    FSM_BREATH_CYCLE  =  1,
+    UPDATE_READINGS   =  2,
+    COMMS_SENDER      =  3,
+    COMMS_RECEIVER    =  4,
+    COMMAND_HANDLING  =  5
+};
+#define LOOP_STAGE_COUNT 6
+
 enum CMD_SET_MODE : uint8_t {
     HEV_MODE_PS,
     HEV_MODE_CPAP,
@@ -147,17 +225,63 @@ struct alarm_thresholds {
     uint32_t arduino_fail;
 };
 
-// default values definitions
-static alarm_thresholds alarm_threshold_min;
-static alarm_thresholds alarm_threshold_max;
+// all settings, one instance shared by all units (defined in common.cpp).
+// every field is a uint32_t in the order of its enum, the setting id is the uint32 offset of a field
+struct settings_values {
+    states_timeouts  timeouts;
+    alarm_thresholds threshold_min;
+    alarm_thresholds threshold_max;
+};
+extern settings_values settings;
+
+#define SETTINGS_COUNT          (sizeof(settings_values) / sizeof(uint32_t))
+#define SETTINGS_NONE           0xFF
+#define SETTINGS_TIMEOUTS       (sizeof(states_timeouts)  / sizeof(uint32_t))
+#define SETTINGS_THRESHOLDS     (sizeof(alarm_thresholds) / sizeof(uint32_t))
+
+enum SETTING_UNIT : uint8_t {
+    UNIT_NONE = 0,
+    UNIT_MS   = 1,
+    UNIT_US   = 2,
+    UNIT_ADC  = 3   // adc counts
+};
+
+// entry of the settings registry (common.cpp), indexed by setting id
+struct setting_descriptor {
+    uint8_t  cmd_type;   // CMD_TYPE that sets it
+    uint8_t  cmd_code;
+    uint8_t  unit;       // SETTING_UNIT
+    uint8_t  reserved;
+    uint32_t min;
+    uint32_t max;
+    uint32_t def;
+};
 
-// static uint32_t valve_port_states = 0x0; 
-// static int pin_to_chan[50];  // too lazy to create a proper hashmap for 2 variables; 50 pins is probably fine
-// static int chan_to_pin[50];  
+// id of the setting written by a SET_* command, SETTINGS_NONE if there is none
+constexpr uint8_t getSettingId(uint8_t cmd_type, uint8_t cmd_code)
+{
+    return (cmd_code < 1) ? SETTINGS_NONE
+         : (cmd_type == CMD_TYPE::SET_TIMEOUT       && cmd_code <= SETTINGS_TIMEOUTS)
+            ? offsetof(settings_values, timeouts)      / sizeof(uint32_t) + cmd_code - 1
+         : (cmd_type == CMD_TYPE::SET_THRESHOLD_MIN && cmd_code <= SETTINGS_THRESHOLDS)
+            ? offsetof(settings_values, threshold_min) / sizeof(uint32_t) + cmd_code - 1
+         : (cmd_type == CMD_TYPE::SET_THRESHOLD_MAX && cmd_code <= SETTINGS_THRESHOLDS)
+            ? offsetof(settings_values, threshold_max) / sizeof(uint32_t) + cmd_code - 1
+         : SETTINGS_NONE;
+}
 
+inline uint32_t *getSettingValues(settings_values &values) { return reinterpret_cast<uint32_t *>(&values); }
 
-void setThreshold(ALARM_CODES alarm, alarm_thresholds &thresholds, uint32_t value);
-void setTimeout(CMD_SET_TIMEOUT cmd, states_timeouts &timeouts, uint32_t value);
+bool getSettingDescriptor(uint8_t id, setting_descriptor &descriptor);
+bool checkSetting(uint8_t id, uint32_t value);
+bool setSetting(uint8_t cmd_type, uint8_t cmd_code, uint32_t value);
+void resetSettings();
+
+// settings staged by a bulk transaction, applied all at once between two breaths
+struct settings_shadow {
+    settings_values values;
+    uint32_t        staged[(SETTINGS_COUNT + 31) / 32];  // bit per setting id
+};
 
 // used for calculating averages, template due to different size for sums and averages
 template <typename T> struct readings{
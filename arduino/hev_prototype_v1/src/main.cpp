@@ -3,15 +3,20 @@
 #ifdef CHIP_ESP32
 #include <WiFi.h>
 #endif
-// #include <MemoryFree.h>
+#include "MemoryFree.h"
+// no I2C on the host, where the firmware runs against a simulated plant
+#ifndef ARDUINO_ARCH_HOST
 #include <Wire.h>
 #include <Adafruit_MCP9808.h>
 #include <INA.h>
+#endif
 #include "CommsControl.h"
 #include "BreathingLoop.h"
 #include "ValvesController.h"
 #include "UILoop.h"
 #include "AlarmLoop.h"
+#include "PersistentStore.h"
+#include "LoopTiming.h"
 
 int ventilation_mode = HEV_MODE_PS;
 
@@ -36,10 +41,12 @@ CommsControl comms;
 Payload plReceive;
 Payload plSend;
 
+PersistentStore store;
+
 // loops
 BreathingLoop breathing_loop;
-UILoop        ui_loop(&breathing_loop);
-AlarmLoop     alarm_loop;
+AlarmLoop     alarm_loop(&breathing_loop, &comms);
+UILoop        ui_loop(&breathing_loop, &alarm_loop, &comms);
 
 // bool start_fsm = false;
 
@@ -64,6 +71,7 @@ AlarmLoop     alarm_loop;
 
 void setup()
 {
+    beginMemoryStats();
 #ifdef CHIP_ESP32
     WiFi.mode(WIFI_OFF);
     btStop();
@@ -71,10 +79,6 @@ void setup()
     ledcSetup(pwm_chan_exhale, pwm_frequency, pwm_resolution);
     ledcAttachPin(pin_valve_inhale , pwm_chan_inhale);  
     ledcAttachPin(pin_valve_exhale , pwm_chan_exhale);  
-    pin_to_chan[pin_valve_inhale] = pwm_chan_inhale;
-    pin_to_chan[pin_valve_exhale] = pwm_chan_exhale;
-
-// map<int,int> pin_to_chan; // = { pin_valve_inhale : pwm_chan_inhale , pin_valve_exhale : pwm_chan_exhale};
 #else
 // NOTE defaults to whatever the frequency of the pin is for non-ESP32 boards.  Changing frequency is possible but complicated
     pinMode(pin_valve_inhale, OUTPUT);
@@ -105,6 +109,17 @@ void setup()
     pinMode(pin_buzzer, OUTPUT);
     pinMode(pin_button_0, INPUT);
 
+    // restore the calibration and settings of the last run, if any
+    store.begin();
+    breathing_loop.loadCalibration(&store);
+    resetSettings();
+    store.restoreSettings(settings);
+    // continue a breath cycle cut short by a watchdog or brownout reset
+    breathing_loop.resumeWarmState();
+
+    breathing_loop.getValvesController()->beginRampTimer();
+    breathing_loop.beginFsmTimer();
+
     while (!Serial) ;
     comms.beginSerial();
 
@@ -116,7 +131,6 @@ void loop()
     // tone(pin, freq (Hz), duration);
 
     // data2.fsm_state              = 2;
-    // data2.dummy                  = 0x0e0e;
     // data2.timestamp              = 0x01010101;
     // data2.pressure_air_supply    = 0x0303;
     // data2.pressure_air_regulated = 0x0404;
@@ -157,10 +171,15 @@ void loop()
     data.pressure_diff_patient  = readings_avgs.pressure_diff_patient;
 
     data.fsm_state              = breathing_loop.getFsmState();
+    data.breath_timing_error    = breathing_loop.getBreathTimingError();
     data.readback_mode          = breathing_loop.getVentilationMode();
 
+    LOOP_TIMING_START(fsm_assignment);
     breathing_loop.FSM_assignment();
+    LOOP_TIMING_STOP(fsm_assignment, LOOP_STAGE::FSM_ASSIGNMENT);
+    LOOP_TIMING_START(fsm_breath_cycle);
     breathing_loop.FSM_breathCycle();
+    LOOP_TIMING_STOP(fsm_breath_cycle, LOOP_STAGE::FSM_BREATH_CYCLE);
 
     uint32_t tnow = static_cast<uint32_t>(millis());
     if(tnow - report_time > report_timeout) {
@@ -170,20 +189,57 @@ void loop()
         comms.writePayload(plSend);
         report_time = tnow;
     }
+    // requested read outs, taken from settings the FSM may be applying
+    breathing_loop.lock();
+    ui_loop.sendReports();
+    ui_loop.sendSettingsReply();
+    ui_loop.sendWaveformReply();
+    breathing_loop.unlock();
     // per cycle sender
+    LOOP_TIMING_START(comms_sender);
     comms.sender();
+    LOOP_TIMING_STOP(comms_sender, LOOP_STAGE::COMMS_SENDER);
     // per cycle receiver
+    LOOP_TIMING_START(comms_receiver);
     comms.receiver();
+    LOOP_TIMING_STOP(comms_receiver, LOOP_STAGE::COMMS_RECEIVER);
 
     // check any received payload
+    LOOP_TIMING_START(command_handling);
     if(comms.readPayload(plReceive)) {
+      breathing_loop.lock();
       if (plReceive.getType() == PAYLOAD_TYPE::CMD) {
           // apply received cmd to ui loop
           ui_loop.doCommand(plReceive.getCmd());
           plReceive.setType(PAYLOAD_TYPE::UNSET);
+      } else if (plReceive.getType() == PAYLOAD_TYPE::SETTINGS) {
+          // stage the settings transaction, applied at the next breath boundary
+          ui_loop.doSettings(plReceive.getSettings());
+          plReceive.setType(PAYLOAD_TYPE::UNSET);
+      } else if (plReceive.getType() == PAYLOAD_TYPE::WAVEFORM) {
+          // stage the inhale waveform, swapped in at the next breath boundary
+          ui_loop.doWaveform(plReceive.getWaveform());
+          plReceive.setType(PAYLOAD_TYPE::UNSET);
       }
+      breathing_loop.unlock();
     }
-
-    // run value readings
-    breathing_loop.updateReadings(); 
+    LOOP_TIMING_STOP(command_handling, LOOP_STAGE::COMMAND_HANDLING);
+
+    // run value readings, every new average is checked against the alarm thresholds.
+    // the FSM resets the sums on a state change and writes the calibration they are offset by
+    breathing_loop.lock();
+    LOOP_TIMING_START(update_readings);
+    bool readings_updated = breathing_loop.updateReadings();
+    LOOP_TIMING_STOP(update_readings, LOOP_STAGE::UPDATE_READINGS);
+    if (readings_updated)
+        alarm_loop.checkAlarms();
+    breathing_loop.unlock();
+
+    // write back a new calibration and changed settings. the FSM holds off while the
+    // settings are compared, and is not ventilating when a write may stall it
+    breathing_loop.saveCalibration();
+    breathing_loop.lock();
+    uint8_t fsm_state = breathing_loop.getFsmState();
+    store.update((fsm_state == BreathingLoop::BL_STATES::IDLE) || (fsm_state == BreathingLoop::BL_STATES::STOP));
+    breathing_loop.unlock();
 }
@@ -0,0 +1,96 @@
+// CommsControl of the firmware and of a data server at the two ends of a socketpair, on the
+// virtual clock of the host build:
+//   pio test -e native_sim
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include <unity.h>
+
+#include "CommsControl.h"
+
+// DATA a little slower than the timeout of the CMD queue, as the firmware sends it
+#define TEST_DATA_PERIOD 51
+#define TEST_DURATION    1000
+
+static VirtualClock *_clock;
+
+// one ms of both links: the firmware sends, the data server receives and ACKs
+static void stepLinks(CommsControl &fw, HardwareSerial &fw_serial, CommsControl &ui, HardwareSerial &ui_serial)
+{
+    fw.sender();
+    fw_serial.flushBacklog();
+    while (ui_serial.available() > 0)
+        ui.receiver();
+    ui.sender();
+    ui_serial.flushBacklog();
+    while (fw_serial.available() > 0)
+        fw.receiver();
+    _clock->advance(1000);
+}
+
+// a SETTINGS reply is queued while DATA keeps the link busy, it must not wait for a gap in DATA
+void test_cmd_not_starved_by_data()
+{
+    int pair[2];
+    TEST_ASSERT_EQUAL_INT(0, socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+    HardwareSerial fw_serial, ui_serial;
+    fw_serial.attach(pair[0]);
+    ui_serial.attach(pair[1]);
+    CommsControl fw(115200, fw_serial);
+    CommsControl ui(115200, ui_serial);
+
+    data_format data;
+    settings_format settings;
+    settings.txn = 42;
+    Payload pl;
+    uint32_t data_written = 0, data_read = 0, settings_read = 0;
+    uint32_t reply_ms = 0, received_ms = 0;
+    for (uint32_t t = 0; t < TEST_DURATION; t++) {
+        if (t % TEST_DATA_PERIOD == 0) {
+            data.timestamp = t;
+            pl.setData(&data);
+            fw.writePayload(pl);
+            data_written++;
+        }
+        // just after the first DATA went out
+        if (t == TEST_DATA_PERIOD + 5) {
+            pl.setSettings(&settings);
+            fw.writePayload(pl);
+            reply_ms = t;
+        }
+        stepLinks(fw, fw_serial, ui, ui_serial);
+        while (ui.readPayload(pl)) {
+            if (pl.getType() == PAYLOAD_TYPE::DATA) {
+                data_read++;
+            } else if (pl.getType() == PAYLOAD_TYPE::SETTINGS) {
+                TEST_ASSERT_EQUAL_UINT8(42, pl.getSettings()->txn);
+                if (settings_read++ == 0)
+                    received_ms = t;
+            }
+        }
+    }
+
+    // sent within one timeout of the CMD queue and ACKed, while no DATA was held back for it
+    TEST_ASSERT_EQUAL_UINT32(1, settings_read);
+    TEST_ASSERT_UINT32_WITHIN(CONST_TIMEOUT_CMD + 5, reply_ms + CONST_TIMEOUT_CMD, received_ms);
+    TEST_ASSERT_TRUE(fw.isQueueEmpty(PAYLOAD_TYPE::SETTINGS));
+    TEST_ASSERT_EQUAL_UINT32(1, fw.getAckedCount(PAYLOAD_TYPE::SETTINGS));
+    TEST_ASSERT_EQUAL_UINT32(data_written, data_read);
+    TEST_ASSERT_EQUAL_UINT32(data_written, fw.getAckedCount(PAYLOAD_TYPE::DATA));
+
+    fw_serial.close();
+    ui_serial.close();
+}
+
+void setUp() {}
+void tearDown() {}
+
+int main(int argc, char **argv)
+{
+    _clock = dynamic_cast<VirtualClock *>(&getClock());
+    if (_clock == nullptr)
+        return 1;
+    UNITY_BEGIN();
+    RUN_TEST(test_cmd_not_starved_by_data);
+    return UNITY_END();
+}
@@ -0,0 +1 @@
+../raspberry-dataserver/hevboard.py
\ No newline at end of file
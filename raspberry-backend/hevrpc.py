@@ -0,0 +1 @@
+../raspberry-dataserver/hevrpc.py
\ No newline at end of file
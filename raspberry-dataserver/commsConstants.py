@@ -12,7 +12,7 @@ logging.basicConfig(level=logging.INFO,
 
 class BaseFormat():
     def __init__(self):
-        self._RPI_VERSION = 0xA1
+        self._RPI_VERSION = 0xA3
         self._byteArray = None
         self._type = PAYLOAD_TYPE.UNSET
         self._version = 0
@@ -63,7 +63,7 @@ class DataFormat(BaseFormat):
         # make all zero to start with
         self._version = 0
         self._fsm_state = 0
-        self._dummy = 0
+        self._breath_timing_error = 0
         self._timestamp = 0
         self._pressure_air_supply = 0
         self._pressure_air_regulated = 0
@@ -85,6 +85,7 @@ class DataFormat(BaseFormat):
         return f"""{{
     "version"                : {self._version},
     "fsm_state"              : {self._fsm_state},
+    "breath_timing_error"    : {self._breath_timing_error},
     "timestamp"              : {self._timestamp},
     "pressure_air_supply"    : {self._pressure_air_supply},
     "pressure_air_regulated" : {self._pressure_air_regulated},
@@ -111,7 +112,7 @@ class DataFormat(BaseFormat):
         #logging.info(binascii.hexlify(byteArray))
         (self._version,
         self._fsm_state,
-        self._dummy,
+        self._breath_timing_error,
         self._timestamp,
         self._pressure_air_supply,
         self._pressure_air_regulated,
@@ -140,7 +141,7 @@ class DataFormat(BaseFormat):
         self._byteArray = self._dataStruct.pack(
             self._RPI_VERSION,
             self._fsm_state,
-            self._dummy,
+            self._breath_timing_error,
             self._timestamp,
             self._pressure_air_supply,
             self._pressure_air_regulated,
@@ -163,6 +164,7 @@ class DataFormat(BaseFormat):
         data = {
             "version"                : self._version,
             "fsm_state"              : self._fsm_state,
+            "breath_timing_error"    : self._breath_timing_error,
             "timestamp"              : self._timestamp,
             "pressure_air_supply"    : self._pressure_air_supply,
             "pressure_air_regulated" : self._pressure_air_regulated,
@@ -285,7 +287,9 @@ class AlarmFormat(BaseFormat):
         self._version = 0
         self._dummy = 0
         self._timestamp = 0
-        self._alarmCode   = 0
+        self._alarmType = 0
+        self._alarmCode = 0
+        self._latency = 0
         self._param = 0
 
     def __repr__(self):
@@ -294,6 +298,7 @@ class AlarmFormat(BaseFormat):
     "timestamp" : {self._timestamp},
     "alarmType" : {self._alarmType},
     "alarmCode" : {self._alarmCode},
+    "latency"   : {self._latency},
     "param"     : {self._param}
 }}"""
         
@@ -305,7 +310,7 @@ class AlarmFormat(BaseFormat):
         self._timestamp,
         self._alarmType,
         self._alarmCode,
-        self._dummy,
+        self._latency,
         self._param) = self._dataStruct.unpack(self._byteArray)
 
     def toByteArray(self):
@@ -316,7 +321,7 @@ class AlarmFormat(BaseFormat):
             self._timestamp,
             self._alarmType,
             self._alarmCode,
-            self._dummy,
+            self._latency,
             self._param
         ) 
     
@@ -325,12 +330,392 @@ class AlarmFormat(BaseFormat):
             "version"   : self._version,
             "alarmType" : self._alarmType,
             "alarmCode" : self._alarmCode,
+            "latency"   : self._latency,
             "timestamp" : self._timestamp,
             "param"     : self._param
         }
         return data
 
 
+# =======================================
+# report type payload
+# =======================================
+class ReportFormat(BaseFormat):
+    # layouts of the data field, per report type
+    _reportStructs = {}
+    # report types holding an array of uint32 settings, with the enum naming them
+    _reportArrays = {}
+    _arrayValues = 12
+    # setting_descriptor entries per SETTINGS_REGISTRY report
+    _registryStruct = Struct("<BBBBIII")
+    _registryEntries = 3
+
+    def __init__(self):
+        super().__init__()
+        # header only, followed by a variable number of data bytes
+        self._dataStruct = Struct("<BBBBI")
+        self._byteArray = None
+        self._type = PAYLOAD_TYPE.REPORT
+
+        self._version = 0
+        self._reportType = 0
+        self._reportCode = 0
+        self._size = 0
+        self._timestamp = 0
+        self._data = b""
+
+    def __repr__(self):
+        return f"""{{
+    "version"    : {self._version},
+    "timestamp"  : {self._timestamp},
+    "reportType" : {self._reportType},
+    "reportCode" : {self._reportCode},
+    "data"       : {self.getFields()}
+}}"""
+
+    def fromByteArray(self, byteArray):
+        self._byteArray = byteArray
+        headerSize = self._dataStruct.size
+        (self._version,
+        self._reportType,
+        self._reportCode,
+        self._size,
+        self._timestamp) = self._dataStruct.unpack(self._byteArray[:headerSize])
+        self._data = bytes(self._byteArray[headerSize:headerSize + self._size])
+
+    def toByteArray(self):
+        self._byteArray = self._dataStruct.pack(
+            self._RPI_VERSION,
+            self._reportType,
+            self._reportCode,
+            len(self._data),
+            self._timestamp
+        ) + self._data
+
+    # decode the data field if its layout is known, raw bytes otherwise
+    def getFields(self):
+        try:
+            reportType = REPORT_TYPE(self._reportType)
+        except ValueError:
+            return self._data.hex()
+        if reportType in self._reportArrays:
+            return self.getArrayFields(self._reportArrays[reportType])
+        if reportType == REPORT_TYPE.SETTINGS_REGISTRY:
+            return self.getRegistryFields()
+        try:
+            fmt, names = self._reportStructs[reportType]
+        except KeyError:
+            return self._data.hex()
+        values = Struct(fmt).unpack(self._data[:Struct(fmt).size])
+        fields = {}
+        idx = 0
+        for name, count in names:
+            fields[name] = values[idx] if count == 1 else list(values[idx:idx + count])
+            if isinstance(fields[name], bytes):
+                fields[name] = fields[name].split(b"\0")[0].decode(errors="replace")
+            idx += count
+        return fields
+
+    # settings arrays, named by the enum whose values start at 1
+    def getArrayFields(self, names):
+        fields = {}
+        first = self._reportCode * self._arrayValues + 1
+        for idx, (value,) in enumerate(Struct("<I").iter_unpack(self._data[:len(self._data) // 4 * 4])):
+            try:
+                fields[names(first + idx).name] = value
+            except ValueError:
+                fields[first + idx] = value
+        return fields
+
+    # settings registry, one entry per setting id, named "<cmdtype>.<cmd>"
+    def getRegistryFields(self):
+        fields = {}
+        first = self._reportCode * self._registryEntries
+        size = self._registryStruct.size
+        for idx, entry in enumerate(self._registryStruct.iter_unpack(self._data[:len(self._data) // size * size])):
+            cmdType, cmdCode, unit, _, minimum, maximum, default = entry
+            try:
+                name = f"{CMD_TYPE(cmdType).name}.{CMD_MAP[CMD_TYPE(cmdType).name].value(cmdCode).name}"
+            except (ValueError, KeyError):
+                name = f"{cmdType}.{cmdCode}"
+            try:
+                unit = SETTING_UNIT(unit).name
+            except ValueError:
+                pass
+            fields[name] = {"id": first + idx, "unit": unit, "min": minimum, "max": maximum, "default": default}
+        return fields
+
+    def getDict(self):
+        try:
+            reportType = REPORT_TYPE(self._reportType).name
+        except ValueError:
+            reportType = self._reportType
+        data = {
+            "version"    : self._version,
+            "reportType" : reportType,
+            "reportCode" : self._reportCode,
+            "timestamp"  : self._timestamp,
+            "data"       : self.getFields()
+        }
+        return data
+
+
+# =======================================
+# settings transaction payload
+# =======================================
+class SettingsFormat(BaseFormat):
+    # values carried by one frame
+    _frameValues = 5
+
+    def __init__(self, txn=0, chunk=0, chunks=1, values=None):
+        super().__init__()
+        # header, then (cmd_type, cmd_code, reserved, param) per value
+        self._dataStruct = Struct("<BBBBBBHI" + "BBHI" * self._frameValues)
+        self._byteArray = None
+        self._type = PAYLOAD_TYPE.SETTINGS
+
+        self._version = 0
+        self._dummy = 0
+        self._txn = txn
+        self._chunk = chunk
+        self._chunks = chunks
+        self._status = 0
+        self._epoch = 0
+        self._values = list(values) if values is not None else [] # (cmdType, cmdCode, param)
+        self.toByteArray()
+
+    # split a list of (cmdType, cmdCode, param) into the frames of one transaction
+    @classmethod
+    def transaction(cls, txn, values):
+        values = list(values)
+        chunks = max(1, -(-len(values) // cls._frameValues))
+        return [cls(txn, chunk, chunks, values[chunk * cls._frameValues:(chunk + 1) * cls._frameValues]) for chunk in range(chunks)]
+
+    @property
+    def txn(self):
+        return self._txn
+
+    @property
+    def status(self):
+        return self._status
+
+    @property
+    def epoch(self):
+        return self._epoch
+
+    def __repr__(self):
+        return f"""{{
+    "version" : {self._version},
+    "txn"     : {self._txn},
+    "chunk"   : {self._chunk},
+    "chunks"  : {self._chunks},
+    "status"  : {self._status},
+    "epoch"   : {self._epoch},
+    "values"  : {self._values}
+}}"""
+
+    def fromByteArray(self, byteArray):
+        self._byteArray = byteArray
+        fields = self._dataStruct.unpack(self._byteArray)
+        (self._version,
+        self._txn,
+        self._chunk,
+        self._chunks,
+        count,
+        self._status,
+        self._dummy,
+        self._epoch) = fields[:8]
+        self._values = [(fields[8 + 4 * i], fields[9 + 4 * i], fields[11 + 4 * i]) for i in range(min(count, self._frameValues))]
+
+    def toByteArray(self):
+        values = []
+        for idx in range(self._frameValues):
+            if idx < len(self._values):
+                cmdType, cmdCode, param = self._values[idx]
+                values += [cmdType, cmdCode, self._dummy, param]
+            else:
+                values += [0, 0, 0, 0]
+        self._byteArray = self._dataStruct.pack(
+            self._RPI_VERSION,
+            self._txn,
+            self._chunk,
+            self._chunks,
+            len(self._values),
+            self._status,
+            self._dummy,
+            self._epoch,
+            *values
+        )
+
+    def getDict(self):
+        try:
+            status = SETTINGS_STATUS(self._status).name
+        except ValueError:
+            status = self._status
+        data = {
+            "version" : self._version,
+            "txn"     : self._txn,
+            "status"  : status,
+            "epoch"   : self._epoch
+        }
+        return data
+
+
+# =======================================
+# inhale waveform upload payload
+# =======================================
+class WaveformFormat(BaseFormat):
+    # points carried by one frame
+    _framePoints = 12
+
+    def __init__(self, txn=0, chunk=0, chunks=1, points=None):
+        super().__init__()
+        # header, then (time in ms, inhale valve opening in 1/1000) per point
+        self._dataStruct = Struct("<BBBBBBH" + "HH" * self._framePoints)
+        self._byteArray = None
+        self._type = PAYLOAD_TYPE.WAVEFORM
+
+        self._version = 0
+        self._dummy = 0
+        self._txn = txn
+        self._chunk = chunk
+        self._chunks = chunks
+        self._status = 0
+        self._points = list(points) if points is not None else [] # (time, value)
+        self.toByteArray()
+
+    # split a list of (time, value) into the frames of one upload
+    @classmethod
+    def upload(cls, txn, points):
+        points = list(points)
+        chunks = max(1, -(-len(points) // cls._framePoints))
+        return [cls(txn, chunk, chunks, points[chunk * cls._framePoints:(chunk + 1) * cls._framePoints]) for chunk in range(chunks)]
+
+    @property
+    def txn(self):
+        return self._txn
+
+    @property
+    def status(self):
+        return self._status
+
+    def __repr__(self):
+        return f"""{{
+    "version" : {self._version},
+    "txn"     : {self._txn},
+    "chunk"   : {self._chunk},
+    "chunks"  : {self._chunks},
+    "status"  : {self._status},
+    "points"  : {self._points}
+}}"""
+
+    def fromByteArray(self, byteArray):
+        self._byteArray = byteArray
+        fields = self._dataStruct.unpack(self._byteArray)
+        (self._version,
+        self._txn,
+        self._chunk,
+        self._chunks,
+        count,
+        self._status,
+        self._dummy) = fields[:7]
+        self._points = [(fields[7 + 2 * i], fields[8 + 2 * i]) for i in range(min(count, self._framePoints))]
+
+    def toByteArray(self):
+        points = []
+        for idx in range(self._framePoints):
+            points += self._points[idx] if idx < len(self._points) else (0, 0)
+        self._byteArray = self._dataStruct.pack(
+            self._RPI_VERSION,
+            self._txn,
+            self._chunk,
+            self._chunks,
+            len(self._points),
+            self._status,
+            self._dummy,
+            *points
+        )
+
+    def getDict(self):
+        try:
+            status = SETTINGS_STATUS(self._status).name
+        except ValueError:
+            status = self._status
+        data = {
+            "version" : self._version,
+            "txn"     : self._txn,
+            "status"  : status
+        }
+        return data
+
+
+# =======================================
+# compact broadcast of hevdaemon (port 54323)
+# =======================================
+class BroadcastFormat():
+    # "HV", version, flags, size of the whole frame, then the payloads as received from the controller
+    _headerStruct = Struct("<2sBBH")
+    _flagSensors = 0x01
+    _flagDevice = 0x02  # name of the controller, when hevdaemon serves several
+
+    # size of the frame at the start of byteArray, None until the header is complete
+    @classmethod
+    def getFrameSize(cls, byteArray):
+        if len(byteArray) < cls._headerStruct.size:
+            return None
+        magic, _, _, size = cls._headerStruct.unpack(byteArray[:cls._headerStruct.size])
+        if magic != b"HV":
+            raise ValueError("Not a broadcast frame")
+        return size
+
+    # the same dict as the JSON broadcast
+    @classmethod
+    def getDict(cls, byteArray):
+        _, _, flags, size = cls._headerStruct.unpack(byteArray[:cls._headerStruct.size])
+        pos = cls._headerStruct.size
+        device = None
+        if flags & cls._flagDevice:
+            end = pos + 1 + byteArray[pos]
+            device = bytes(byteArray[pos + 1:end]).decode()
+            pos = end
+        sensors = None
+        if flags & cls._flagSensors:
+            data = DataFormat()
+            end = pos + data._dataStruct.size
+            data.fromByteArray(bytes(byteArray[pos:end]))
+            sensors = data.getDict()
+            pos = end
+
+        count = byteArray[pos]
+        alarms = []
+        for code in byteArray[pos + 1:pos + 1 + count]:
+            try:
+                alarms.append(ALARM_CODES(code).name)
+            except ValueError:
+                alarms.append("ARDUINO_FAIL")
+        pos += 1 + count
+
+        count = byteArray[pos]
+        pos += 1
+        reports = {}
+        for _ in range(count):
+            report = ReportFormat()
+            end = pos + report._dataStruct.size + byteArray[pos + 3]
+            report.fromByteArray(bytes(byteArray[pos:end]))
+            report = report.getDict()
+            reports[f"{report['reportType']}.{report['reportCode']}"] = report
+            pos = end
+
+        result = {
+            "sensors" : sensors,
+            "alarms"  : alarms if len(alarms) > 0 else None,
+            "reports" : reports if len(reports) > 0 else None
+        }
+        if device is not None:
+            result = {"device": device, **result}
+        return result
+
+
 # =======================================
 # Enum definitions
 # =======================================
@@ -338,6 +723,9 @@ class PAYLOAD_TYPE(Enum):
     DATA  = auto()
     CMD   = auto()
     ALARM = auto()
+    REPORT = auto()
+    SETTINGS = auto()
+    WAVEFORM = auto()
     UNSET = auto()
 
 @unique
@@ -347,6 +735,11 @@ class CMD_TYPE(Enum):
     SET_MODE          =  3
     SET_THRESHOLD_MIN =  4
     SET_THRESHOLD_MAX =  5
+    SET_VALVE_RAMP    =  6
+    SET_VALVE_RAMP_PT =  7
+    SET_VALVE_LATENCY =  8
+    ACK_ALARM         =  9
+    REQUEST_REPORT    = 10
 
 @unique
 class CMD_GENERAL(Enum):
@@ -354,6 +747,7 @@ class CMD_GENERAL(Enum):
     STOP  =  2
     PURGE =  3
     FLUSH =  4
+    CALIBRATE = 5
 
 # Taken from the FSM doc. Correct as of 1400 on 20200417
 @unique
@@ -370,6 +764,37 @@ class CMD_SET_TIMEOUT(Enum):
     EXHALE_FILL     = 10
     EXHALE          = 11
 
+# SET_VALVE_RAMP    param: profile << 16 | duration in ms
+# SET_VALVE_RAMP_PT param: point index << 8 | value (0-255), used by RAMP_CUSTOM
+@unique
+class CMD_SET_VALVE_RAMP(Enum):
+    INHALE_RISE =  1
+    INHALE_FALL =  2
+    EXHALE_RISE =  3
+    EXHALE_FALL =  4
+
+@unique
+class VALVE_RAMP_PROFILE(Enum):
+    RAMP_STEP        =  0
+    RAMP_LINEAR      =  1
+    RAMP_EXPONENTIAL =  2
+    RAMP_CUSTOM      =  3
+
+# mechanical delay between command and the valve reaching its state
+# SET_VALVE_LATENCY param: delay in ms
+@unique
+class CMD_SET_VALVE_LATENCY(Enum):
+    AIR_IN_OPEN   =  1
+    AIR_IN_CLOSE  =  2
+    O2_IN_OPEN    =  3
+    O2_IN_CLOSE   =  4
+    INHALE_OPEN   =  5
+    INHALE_CLOSE  =  6
+    EXHALE_OPEN   =  7
+    EXHALE_CLOSE  =  8
+    PURGE_OPEN    =  9
+    PURGE_CLOSE   = 10
+
 class CMD_SET_MODE(Enum):
     HEV_MODE_PS   = auto()
     HEV_MODE_CPAP = auto()
@@ -410,9 +835,63 @@ class ALARM_CODES(Enum):
     PRESSURE_SENSOR_FAULT          = 24  # HP
     ARDUINO_FAIL                   = 25  # HP
 
+@unique
+class SETTINGS_STATUS(Enum):
+    SETTINGS_APPLIED  =  1   # epoch: settings epoch of the breath it took effect in
+    SETTINGS_BUSY     =  2   # the previous transaction is still waiting for a breath boundary
+    SETTINGS_SEQUENCE =  3   # chunk out of order or of another transaction, nothing applied
+    SETTINGS_INVALID  =  4   # unknown setting or bad waveform point, nothing applied
+
+@unique
+class REPORT_TYPE(Enum):
+    CONFIGURATION       =  0   # REQUEST_REPORT only: all of TIMEOUTS to SETTINGS_REGISTRY
+    LOOP_TIMING         =  1   # report_code: LOOP_STAGE, needs HEV_PROFILING
+    MEMORY              =  2   # memory_stats, also sent periodically
+    TIMEOUTS            =  3   # states_timeouts
+    THRESHOLDS_MIN      =  4   # alarm_threshold_min, report_code 0-2
+    THRESHOLDS_MAX      =  5   # alarm_threshold_max, report_code 0-2
+    CONTROLLER_STATE    =  6   # controller_state
+    CALIBRATION_OFFSETS =  7   # pressure_calibration
+    FIRMWARE_VERSION    =  8   # firmware_version
+    SETTINGS_REGISTRY   =  9   # setting_descriptor of 3 setting ids per report_code
+
+@unique
+class LOOP_STAGE(Enum):
+    FSM_ASSIGNMENT    =  0
+    FSM_BREATH_CYCLE  =  1
+    UPDATE_READINGS   =  2
+    COMMS_SENDER      =  3
+    COMMS_RECEIVER    =  4
+    COMMAND_HANDLING  =  5
+
+@unique
+class SETTING_UNIT(Enum):
+    UNIT_NONE = 0
+    UNIT_MS   = 1
+    UNIT_US   = 2
+    UNIT_ADC  = 3   # adc counts
+
+# loop_timing_report: durations in ticks, bucket b counts (ticks >> shift) in [2^(b-1), 2^b)
+ReportFormat._reportStructs[REPORT_TYPE.LOOP_TIMING] = ("<BBHII16H", [("stage", 1), ("shift", 1), ("ticks_per_us", 1), ("count", 1), ("worst", 1), ("buckets", 16)])
+# memory_stats: bytes
+ReportFormat._reportStructs[REPORT_TYPE.MEMORY] = ("<IIII", [("free_heap", 1), ("largest_block", 1), ("min_free_heap", 1), ("stack_free", 1)])
+ReportFormat._reportStructs[REPORT_TYPE.CONTROLLER_STATE] = ("<BBBBII", [("fsm_state", 1), ("ventilation_mode", 1), ("running", 1), ("calibrated", 1), ("settings_epoch", 1), ("uptime", 1)])
+# pressure_calibration: adc counts, latency in ms
+ReportFormat._reportStructs[REPORT_TYPE.CALIBRATION_OFFSETS] = ("<7H", [("pressure_buffer", 1), ("pressure_inhale", 1), ("pressure_patient", 1), ("pressure_diff_patient", 1), ("pressure_air_regulated", 1), ("pressure_o2_regulated", 1), ("latency_inhale_open", 1)])
+ReportFormat._reportStructs[REPORT_TYPE.FIRMWARE_VERSION] = ("<BBBBBBH24s", [("major", 1), ("minor", 1), ("patch", 1), ("format_version", 1), ("settings_version", 1), ("calibration_version", 1), ("reserved", 1), ("build", 1)])
+# settings read backs: uint32 values named by their enum, starting at field reportCode * 12
+ReportFormat._reportArrays[REPORT_TYPE.TIMEOUTS] = CMD_SET_TIMEOUT
+ReportFormat._reportArrays[REPORT_TYPE.THRESHOLDS_MIN] = ALARM_CODES
+ReportFormat._reportArrays[REPORT_TYPE.THRESHOLDS_MAX] = ALARM_CODES
+
 class CMD_MAP(Enum):
     GENERAL           =  CMD_GENERAL
     SET_TIMEOUT       =  CMD_SET_TIMEOUT
     SET_MODE          =  CMD_SET_MODE
     SET_THRESHOLD_MIN =  ALARM_CODES
     SET_THRESHOLD_MAX =  ALARM_CODES
+    SET_VALVE_RAMP    =  CMD_SET_VALVE_RAMP
+    SET_VALVE_RAMP_PT =  CMD_SET_VALVE_RAMP
+    SET_VALVE_LATENCY =  CMD_SET_VALVE_LATENCY
+    ACK_ALARM         =  ALARM_CODES
+    REQUEST_REPORT    =  REPORT_TYPE
@@ -108,7 +108,8 @@ class commsControl():
     def getQueue(self, payloadType):
         if   payloadType == commsConstants.PAYLOAD_TYPE.ALARM:
             return self._alarms
-        elif payloadType == commsConstants.PAYLOAD_TYPE.CMD:
+        elif payloadType in (commsConstants.PAYLOAD_TYPE.CMD, commsConstants.PAYLOAD_TYPE.SETTINGS, commsConstants.PAYLOAD_TYPE.WAVEFORM):
+            # settings transactions and waveform uploads keep their order with the commands
             return self._commands
         elif payloadType == commsConstants.PAYLOAD_TYPE.DATA:
             return self._data
@@ -116,6 +117,12 @@ class commsControl():
             return None
     
     def getInfoType(self, address):
+        if address & 0xE0 == 0x60:
+            return commsConstants.PAYLOAD_TYPE.REPORT
+        if address & 0xE0 == 0xA0:
+            return commsConstants.PAYLOAD_TYPE.SETTINGS
+        if address & 0xE0 == 0xE0:
+            return commsConstants.PAYLOAD_TYPE.WAVEFORM
         address &= 0xC0
         if address == 0xC0:
             return commsConstants.PAYLOAD_TYPE.ALARM
@@ -186,6 +193,10 @@ class commsControl():
             tmpComms = commsFormat.generateCmd(payload)
         elif payloadType == commsConstants.PAYLOAD_TYPE.DATA:
             tmpComms = commsFormat.generateData(payload)
+        elif payloadType == commsConstants.PAYLOAD_TYPE.SETTINGS:
+            tmpComms = commsFormat.generateSettings(payload)
+        elif payloadType == commsConstants.PAYLOAD_TYPE.WAVEFORM:
+            tmpComms = commsFormat.generateWaveform(payload)
         else:
             return False        
         tmpComms.setInformation(payload)
@@ -220,6 +231,12 @@ class commsControl():
             payload = commsConstants.CommandFormat()
         elif payloadType == commsConstants.PAYLOAD_TYPE.DATA:
             payload = commsConstants.DataFormat()
+        elif payloadType == commsConstants.PAYLOAD_TYPE.REPORT:
+            payload = commsConstants.ReportFormat()
+        elif payloadType == commsConstants.PAYLOAD_TYPE.SETTINGS:
+            payload = commsConstants.SettingsFormat()
+        elif payloadType == commsConstants.PAYLOAD_TYPE.WAVEFORM:
+            payload = commsConstants.WaveformFormat()
         else:
             return False
         
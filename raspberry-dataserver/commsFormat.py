@@ -26,6 +26,16 @@ def generateData(payload):
     comms.setInformation(payload)
     return comms
 
+def generateSettings(payload):
+    comms = commsFormat(infoSize = payload.getSize(), address = 0xA0)
+    comms.setInformation(payload)
+    return comms
+
+def generateWaveform(payload):
+    comms = commsFormat(infoSize = payload.getSize(), address = 0xE0)
+    comms.setInformation(payload)
+    return comms
+
 
 # basic format based on HDLC
 class commsFormat:
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+# reader of the latest values board of hevdaemon, a shared memory segment
+# for the UIs on the same host (layout in hevdaemon/include/HevBoard.h)
+
+import mmap
+import os
+import time
+from struct import Struct
+from typing import Dict, List, Tuple
+import logging
+from commsConstants import DataFormat, ALARM_CODES
+logging.basicConfig(level=logging.INFO,
+                    format='%(asctime)s - %(levelname)s - %(message)s')
+
+BOARD_PATH = "/dev/shm/hevboard"
+BOARD_VERSION = 1
+BOARD_ALARMS = 32
+READ_RETRIES = 1000
+
+
+class HEVBoard(object):
+    _headerStruct = Struct("<4sBBHIII")
+    _latestStruct = Struct("<IBBHQ")        # seq, sensors valid, alarm count, update time (us)
+    _latestSeqStruct = Struct("<I")
+    _headOffset = 192
+    _ringOffset = 256
+    _seqStruct = Struct("<Q")
+
+    def __init__(self, path: str=BOARD_PATH):
+        # raises OSError while hevdaemon has not created the board
+        with open(path, "rb") as board:
+            self._mmap = mmap.mmap(board.fileno(), 0, access=mmap.ACCESS_READ)
+        magic, version, formatVersion, _, self._ringSamples, self._sampleSize, self._writerPid = \
+            self._headerStruct.unpack_from(self._mmap, 0)
+        self._sample = DataFormat()
+        # the samples are only decoded right with the data_format they were written in
+        if (magic != b"HEVB" or version != BOARD_VERSION or formatVersion != self._sample._RPI_VERSION
+                or self._sampleSize != self._sample._dataStruct.size):
+            self._mmap.close()
+            raise ValueError(f"{path} is not a board of this version")
+        self._latestOffset = 64
+        self._sensorsOffset = self._latestOffset + self._latestStruct.size
+        self._alarmsOffset = self._sensorsOffset + self._sampleSize
+        self._slotSize = self._seqStruct.size + self._sampleSize
+
+    def close(self) -> None:
+        self._mmap.close()
+
+    def writer_alive(self) -> bool:
+        # the board of a daemon that died is left as it was
+        try:
+            os.kill(self._writerPid, 0)
+        except ProcessLookupError:
+            return False
+        except PermissionError:
+            pass
+        return True
+
+    def read_latest(self) -> Dict:
+        # the same sensors and alarms as the broadcast, retried until the copy is consistent
+        for _ in range(READ_RETRIES):
+            seq, valid, count, _, update_us = self._latestStruct.unpack_from(self._mmap, self._latestOffset)
+            if seq & 1:
+                continue
+            sensors = self._mmap[self._sensorsOffset:self._sensorsOffset + self._sampleSize]
+            alarms = self._mmap[self._alarmsOffset:self._alarmsOffset + min(count, BOARD_ALARMS)]
+            if self._latestSeqStruct.unpack_from(self._mmap, self._latestOffset)[0] != seq:
+                continue
+            values = None
+            if valid:
+                self._sample.fromByteArray(sensors)
+                values = self._sample.getDict()
+            names = []
+            for code in alarms:
+                try:
+                    names.append(ALARM_CODES(code).name)
+                except ValueError:
+                    names.append("ARDUINO_FAIL")
+            return {
+                "sensors"   : values,
+                "alarms"    : names if len(names) > 0 else None,
+                "update_us" : update_us
+            }
+        raise TimeoutError("board kept changing while read, is the writer stuck?")
+
+    def get_head(self) -> int:
+        # number of samples written so far, the index the next sample will get
+        return self._seqStruct.unpack_from(self._mmap, self._headOffset)[0]
+
+    def read_samples(self, next: int) -> Tuple[List[Dict], int]:
+        # samples from index next on, and the index to continue from.
+        # Samples overwritten before they could be read are skipped
+        head = self.get_head()
+        next = max(next, head - self._ringSamples)
+        samples = []
+        while next < head:
+            offset = self._ringOffset + (next % self._ringSamples) * self._slotSize
+            seq = 2 * next + 2
+            if self._seqStruct.unpack_from(self._mmap, offset)[0] != seq:
+                # overwritten by a newer lap of the ring
+                next += 1
+                continue
+            data = self._mmap[offset + self._seqStruct.size:offset + self._slotSize]
+            if self._seqStruct.unpack_from(self._mmap, offset)[0] == seq:
+                sample = DataFormat()
+                sample.fromByteArray(data)
+                samples.append(sample.getDict())
+            next += 1
+        return samples, next
+
+
+if __name__ == "__main__":
+    # example implementation, follow the samples as they are published
+    board = HEVBoard()
+    next = board.get_head()
+    for i in range(10):
+        time.sleep(1)
+        samples, next = board.read_samples(next)
+        latest = board.read_latest()
+        print(f"{len(samples)} samples, latest: {latest['sensors']}, alarms: {latest['alarms']}")
+    board.close()
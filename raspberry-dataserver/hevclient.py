@@ -9,6 +9,7 @@ import json
 import threading
 from typing import List, Dict
 import logging
+from commsConstants import BroadcastFormat
 logging.basicConfig(level=logging.INFO,
                     format='%(asctime)s - %(levelname)s - %(message)s')
 
@@ -20,7 +21,8 @@ setflag = False
 
 
 class HEVClient(object):
-    def __init__(self):
+    def __init__(self, binary: bool=False):
+        self._binary = binary  # compact broadcast of hevdaemon rather than JSON
         self._alarms = []  # db for alarms
         self._values = None  # db for sensor values
         self._thresholds = []  # db for threshold settings
@@ -32,6 +34,10 @@ class HEVClient(object):
         worker.start()
 
     async def polling(self) -> None:
+        if self._binary:
+            await self.polling_binary()
+            return
+
         # open persistent connection with server
         reader, writer = await asyncio.open_connection("127.0.0.1", 54320)
 
@@ -50,10 +56,35 @@ class HEVClient(object):
         writer.close()
         await writer.wait_closed()
 
+    async def polling_binary(self) -> None:
+        # frames carry their size, so they are split exactly however the reads fall
+        reader, writer = await asyncio.open_connection("127.0.0.1", 54323)
+
+        buffer = bytearray()
+        while self._polling:
+            data = await reader.read(4096)
+            if not data:
+                logging.warning("Connection lost with hevdaemon")
+                break
+            buffer += data
+            while True:
+                size = BroadcastFormat.getFrameSize(buffer)
+                if size is None or len(buffer) < size:
+                    break
+                payload = BroadcastFormat.getDict(buffer[:size])
+                del buffer[:size]
+                with self._lock:
+                    self._values = payload["sensors"]
+                    self._alarms = payload["alarms"]
+
+        # close connection
+        writer.close()
+        await writer.wait_closed()
+
     def start_client(self) -> None:
         asyncio.run(self.polling())
 
-    async def send_request(self, reqtype, cmdtype:str=None, cmd: str=None, param: str=None, alarm: str=None) -> bool:
+    async def send_request(self, reqtype, cmdtype:str=None, cmd: str=None, param: str=None, alarm: str=None, settings: List[Dict]=None, waveform: List[Dict]=None, device: str=None) -> bool:
         # open connection and send packet
         reader, writer = await asyncio.open_connection("127.0.0.1", 54321)
 
@@ -69,6 +100,20 @@ class HEVClient(object):
                 "type": "alarm",
                 "ack": alarm
             }
+        elif reqtype == "settings":
+            payload = {
+                "type": "settings",
+                "settings": settings
+            }
+        elif reqtype == "waveform":
+            payload = {
+                "type": "waveform",
+                "waveform": waveform
+            }
+
+        # the controller, when hevdaemon serves several; the first one otherwise
+        if device is not None:
+            payload["device"] = device
 
         logging.info(payload)
         packet = json.dumps(payload).encode()
@@ -95,13 +140,58 @@ class HEVClient(object):
             logging.warning(f"Request type {reqtype} failed")
             return False
 
-    def send_cmd(self, cmdtype:str, cmd: str, param: str=None) -> bool:
+    async def send_query(self, payload: Dict) -> Dict:
+        # a request answered with data, which can be far longer than one read; the daemon closes once it is all sent
+        reader, writer = await asyncio.open_connection("127.0.0.1", 54321)
+        writer.write(json.dumps(payload).encode())
+        await writer.drain()
+        data = await reader.read()
+        writer.close()
+        await writer.wait_closed()
+        try:
+            data = json.loads(data.decode("utf-8"))
+        except json.decoder.JSONDecodeError:
+            logging.warning(f"Could not decode reply of {len(data)} bytes")
+            return None
+        if data["type"] != "ack":
+            logging.warning(f"Request {payload} failed")
+            return None
+        return data
+
+    def send_cmd(self, cmdtype:str, cmd: str, param: str=None, device: str=None) -> bool:
         # send a cmd and wait to see if it's valid
-        return asyncio.run(self.send_request("cmd", cmdtype=cmdtype, cmd=cmd, param=param))
+        return asyncio.run(self.send_request("cmd", cmdtype=cmdtype, cmd=cmd, param=param, device=device))
+
+    def send_settings(self, settings: List[Dict], device: str=None) -> bool:
+        # send {"cmdtype", "cmd", "param"} dicts as one transaction, true once the controller applied all of them
+        return asyncio.run(self.send_request("settings", settings=settings, device=device))
+
+    def send_waveform(self, waveform: List[Dict], device: str=None) -> bool:
+        # send {"time", "value"} dicts as the inhale waveform, true once the controller swapped it in
+        return asyncio.run(self.send_request("waveform", waveform=waveform, device=device))
 
-    def ack_alarm(self, alarm: str) -> bool:
+    def ack_alarm(self, alarm: str, device: str=None) -> bool:
         # acknowledge alarm to remove it from the hevserver list
-        return asyncio.run(self.send_request("alarm", alarm=alarm))
+        return asyncio.run(self.send_request("alarm", alarm=alarm, device=device))
+
+    def get_history(self, start: float=None, end: float=None, points: int=None, channels: List[str]=None) -> Dict:
+        # min/max/mean of the sensors over [start, end) in time.time() seconds, the last minute by default,
+        # as {"step", "time", "count", "channels": {name: {"min", "max", "mean"}}} with about points entries
+        payload = {"type": "history"}
+        if start is not None:
+            payload["from"] = start
+        if end is not None:
+            payload["to"] = end
+        if points is not None:
+            payload["points"] = points
+        if channels is not None:
+            payload["channels"] = channels
+        return asyncio.run(self.send_query(payload))
+
+    def get_devices(self) -> List[Dict]:
+        # controllers served by hevdaemon, with the payloads received from each and the commands sent to it
+        data = asyncio.run(self.send_query({"type": "devices"}))
+        return None if data is None else data["devices"]
 
     def get_values(self) -> Dict:
         # get sensor values from db
@@ -0,0 +1,115 @@
+// Latest values board benchmark: latency of HevBoardReader::readLatest and readSamples
+// while a writer thread publishes, at the rate of the controller or flat out.
+//
+//   pio run -e board_bench && .pio/build/board_bench/program [updates per second, 0 flat out] [seconds]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EventLoop.h"
+#include "HevBoard.h"
+#include "Log.h"
+#include "SharedBoard.h"
+
+static uint64_t getTimeNs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void printLatency(const char *name, std::vector<uint32_t> &ns)
+{
+    if (ns.empty())
+        return;
+    std::sort(ns.begin(), ns.end());
+    printf("%-12s %10zu reads   median %6u ns   99%% %6u ns   99.99%% %7u ns   max %8u ns\n", name, ns.size(),
+           ns[ns.size() / 2], ns[ns.size() * 99 / 100], ns[ns.size() * 9999 / 10000], ns.back());
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t rate = (argc > 1) ? static_cast<uint32_t>(atoi(argv[1])) : 100;
+    double seconds = (argc > 2) ? atof(argv[2]) : 3.0;
+    setLogLevel(LOG_WARNING);
+
+    std::string name = "/hevboard-bench-" + std::to_string(getpid());
+    SharedBoard board;
+    if (!board.open(name.c_str()))
+        return 1;
+    HevBoardReader reader;
+    if (!reader.open(name.c_str()))
+        return 1;
+
+    std::atomic<bool> running(true);
+    std::thread writer([&]() {
+        data_format data;
+        std::vector<uint8_t> alarms;
+        uint64_t period_ns = rate ? 1000000000ull / rate : 0;
+        uint64_t next = getTimeNs();
+        while (running) {
+            data.timestamp++;
+            data.pressure_inhale = static_cast<uint16_t>(data.timestamp);
+            board.publishSensors(data);
+            if (data.timestamp % 100 == 0) {
+                alarms.assign(1, static_cast<uint8_t>(data.timestamp / 100 % 20));
+                board.publishAlarms(alarms);
+            }
+            if (period_ns) {
+                next += period_ns;
+                uint64_t tnow = getTimeNs();
+                if (next > tnow)
+                    usleep(static_cast<useconds_t>((next - tnow) / 1000));
+            }
+        }
+    });
+
+    // readers poll as a UI drawing at a high frame rate would, only faster
+    std::vector<uint32_t> latest_ns, samples_ns;
+    latest_ns.reserve(10000000);
+    samples_ns.reserve(1000000);
+    uint64_t next_sample = reader.getHead();
+    uint64_t samples = 0, torn = 0, failed = 0, lost = 0;
+    data_format buffer[64];
+    uint64_t end = getTimeNs() + static_cast<uint64_t>(seconds * 1e9);
+    HevBoardSnapshot snapshot;
+    for (uint64_t i = 0; getTimeNs() < end; i++) {
+        uint64_t t0 = getTimeNs();
+        bool read = reader.readLatest(snapshot);
+        uint64_t t1 = getTimeNs();
+        if (latest_ns.size() < latest_ns.capacity())
+            latest_ns.push_back(static_cast<uint32_t>(t1 - t0));
+        // the pressure follows the timestamp, a torn copy would show
+        if (!read)
+            failed++;
+        else if (snapshot.sensors_valid && snapshot.sensors.pressure_inhale != static_cast<uint16_t>(snapshot.sensors.timestamp))
+            torn++;
+
+        if (i % 16 == 0) {
+            uint64_t from = next_sample;
+            uint64_t t2 = getTimeNs();
+            size_t count = reader.readSamples(next_sample, buffer, 64);
+            uint64_t t3 = getTimeNs();
+            if (count > 0 && samples_ns.size() < samples_ns.capacity())
+                samples_ns.push_back(static_cast<uint32_t>(t3 - t2));
+            lost += next_sample - from - count;
+            samples += count;
+        }
+    }
+    running = false;
+    writer.join();
+
+    printf("%u updates/s for %.1f s, %llu published\n", rate, seconds, static_cast<unsigned long long>(reader.getHead()));
+    printLatency("readLatest", latest_ns);
+    printLatency("readSamples", samples_ns);
+    printf("samples read %llu, lost %llu, torn copies %llu, reads given up %llu\n", static_cast<unsigned long long>(samples),
+           static_cast<unsigned long long>(lost), static_cast<unsigned long long>(torn), static_cast<unsigned long long>(failed));
+    return torn ? 1 : 0;
+}
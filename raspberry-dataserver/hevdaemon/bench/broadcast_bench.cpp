@@ -0,0 +1,183 @@
+// Broadcast fan out benchmark: CPU time of the event loop thread per update,
+// for 1 to 50 TCP clients on the loopback, with the frame serialised once for all
+// clients (as hevdaemon does) or once per client (as hevserver.py does).
+//
+//   pio run -e bench && .pio/build/bench/program [updates per second] [seconds]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "Broadcaster.h"
+#include "EventLoop.h"
+#include "HevFormat.h"
+#include "Log.h"
+#include "common.h"
+
+static const int client_counts[] = {1, 2, 5, 10, 20, 50};
+
+static uint64_t getThreadCpuUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// a broadcast as after start up: sensors, an alarm and the CONFIGURATION read outs
+static std::string serialise(uint32_t timestamp)
+{
+    JsonWriter json;
+    data_format data;
+    data.timestamp = timestamp;
+    data.pressure_buffer = 36864;
+    data.pressure_inhale = 12000 + timestamp % 1000;
+    json.beginObject();
+    json.key("sensors");
+    writeData(json, data);
+    json.key("alarms").beginArray().value("APNEA").endArray();
+    json.key("reports").beginObject();
+    for (uint8_t type = REPORT_TYPE::TIMEOUTS; type <= REPORT_TYPE::SETTINGS_REGISTRY; type++) {
+        for (uint8_t code = 0; code < 3; code++) {
+            report_format report;
+            report.report_type = type;
+            report.report_code = code;
+            report.size = REPORT_DATA_SIZE;
+            for (uint8_t i = 0; i < REPORT_DATA_SIZE; i++)
+                report.data[i] = static_cast<uint8_t>(i + code);
+            json.key(getReportKey(report));
+            writeReport(json, report);
+        }
+    }
+    json.endObject();
+    json.endObject();
+    return json.str();
+}
+
+struct Result {
+    double   cpu_us_per_update;
+    double   cpu_percent;
+    uint64_t frames_dropped;
+    uint64_t bytes_per_client;
+};
+
+static Result run(int clients, bool per_client, uint32_t rate, double seconds)
+{
+    EventLoop loop;
+    Broadcaster broadcaster(loop);
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t size = sizeof(addr);
+    bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    listen(listener, 64);
+    getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &size);
+
+    // the UIs, each reading as fast as it can on one thread
+    int reader_epoll = epoll_create1(0);
+    std::vector<int> readers;
+    for (int i = 0; i < clients; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+        int server_fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK);
+        int nodelay = 1;
+        setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        broadcaster.addClient(server_fd, BROADCAST_JSON, "bench");
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(reader_epoll, EPOLL_CTL_ADD, fd, &ev);
+        readers.push_back(fd);
+    }
+    close(listener);
+
+    std::atomic<bool> reading(true);
+    std::atomic<uint64_t> bytes(0);
+    std::thread reader([&]() {
+        char buffer[65536];
+        epoll_event events[64];
+        while (reading) {
+            int n = epoll_wait(reader_epoll, events, 64, 10);
+            for (int i = 0; i < n; i++) {
+                ssize_t got = read(events[i].data.fd, buffer, sizeof(buffer));
+                if (got > 0)
+                    bytes += static_cast<uint64_t>(got);
+            }
+        }
+    });
+
+    uint32_t updates = static_cast<uint32_t>(rate * seconds);
+    uint32_t sent = 0;
+    uint32_t period_ms = (rate >= 1000) ? 1 : 1000 / rate;
+    uint32_t per_tick = (rate >= 1000) ? rate / 1000 : 1;
+    std::function<void()> tick = [&]() {
+        for (uint32_t i = 0; i < per_tick && sent < updates; i++, sent++) {
+            if (per_client) {
+                // every client builds and encodes its own copy
+                Broadcaster::Frame frame;
+                for (int c = 0; c < clients; c++)
+                    frame = std::make_shared<const std::string>(serialise(sent));
+                broadcaster.publish(BROADCAST_JSON, frame);
+            } else {
+                broadcaster.publish(BROADCAST_JSON, std::make_shared<const std::string>(serialise(sent)));
+            }
+        }
+        if (sent < updates)
+            loop.addTimer(period_ms, tick);
+        else
+            loop.stop();
+    };
+    loop.addTimer(period_ms, tick);
+
+    uint64_t wall_start = EventLoop::getTimeUs();
+    uint64_t cpu_start = getThreadCpuUs();
+    loop.run();
+    uint64_t cpu = getThreadCpuUs() - cpu_start;
+    uint64_t wall = EventLoop::getTimeUs() - wall_start;
+
+    usleep(100000);
+    reading = false;
+    reader.join();
+    for (int fd : readers)
+        close(fd);
+    close(reader_epoll);
+
+    Result result;
+    result.cpu_us_per_update = static_cast<double>(cpu) / updates;
+    result.cpu_percent = 100.0 * cpu / wall;
+    result.frames_dropped = broadcaster.getFramesDropped();
+    result.bytes_per_client = bytes / clients;
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t rate = (argc > 1) ? static_cast<uint32_t>(atoi(argv[1])) : 100;
+    double seconds = (argc > 2) ? atof(argv[2]) : 3.0;
+    if (rate == 0)
+        rate = 100;
+    setLogLevel(LOG_WARNING);
+
+    printf("%u updates/s for %.1f s, frame of %zu bytes\n", rate, seconds, serialise(0).size());
+    printf("%8s | %24s | %24s | %8s\n", "", "serialised once", "serialised per client", "");
+    printf("%8s | %11s %12s | %11s %12s | %8s\n", "clients", "cpu %", "us/update", "cpu %", "us/update", "dropped");
+    for (int clients : client_counts) {
+        Result once = run(clients, false, rate, seconds);
+        Result each = run(clients, true, rate, seconds);
+        printf("%8d | %11.2f %12.1f | %11.2f %12.1f | %8llu\n", clients,
+               once.cpu_percent, once.cpu_us_per_update, each.cpu_percent, each.cpu_us_per_update,
+               static_cast<unsigned long long>(once.frames_dropped + each.frames_dropped));
+    }
+    return 0;
+}
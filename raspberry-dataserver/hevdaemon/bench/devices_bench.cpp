@@ -0,0 +1,269 @@
+// Multi controller benchmark: the daemon serving 1 to 32 simulated controllers, each on a pty
+// sending DATA at the given rate through CommsControl as the firmware does. Reports the CPU
+// use of the daemon (a child process) and the latency from a DATA payload being written to
+// the pty to its frame arriving on the merged binary broadcast.
+//
+//   pio run -e devices_bench && .pio/build/devices_bench/program [devices] [DATA per second] [seconds]
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "CommsControl.h"
+#include "EventLoop.h"
+#include "HevFormat.h"
+#include "HevServer.h"
+#include "Log.h"
+
+// out of the way of a daemon on 127.0.0.1
+#define BENCH_IP "127.0.0.2"
+
+static const int device_counts[] = {1, 2, 4, 8, 16, 32};
+
+// CPU time of another process
+static uint64_t getCpuUs(clockid_t clock)
+{
+    timespec ts;
+    if (clock_gettime(clock, &ts) != 0)
+        return 0;
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// the daemon with one controller per pty, until every link is lost
+static int serve(const std::vector<std::string> &ptys)
+{
+    EventLoop loop;
+    HevServer server(loop);
+    std::deque<HardwareSerial> serials;
+    std::deque<CommsControl> links;
+    if (!server.listen(BENCH_IP))
+        return 1;
+    for (size_t i = 0; i < ptys.size(); i++) {
+        serials.emplace_back();
+        links.emplace_back(115200, serials.back());
+        if (!serials.back().open(ptys[i].c_str()))
+            return 1;
+        serials.back().begin(115200);
+        if (!server.attachSerial("hev" + std::to_string(i), serials.back(), links.back()))
+            return 1;
+    }
+    // every link is lost on purpose at the end
+    if (!freopen("/dev/null", "w", stderr))
+        return 1;
+    loop.run();
+    return 0;
+}
+
+struct Result {
+    uint64_t sent;
+    uint64_t dropped;    // the DATA queue of a controller was full
+    uint64_t received;   // frames with sensors on the broadcast
+    double   cpu_percent;
+    double   cpu_us_per_sample;
+    std::vector<uint32_t> latencies_us;
+};
+
+static Result run(int devices, uint32_t rate, double seconds)
+{
+    Result result = Result();
+    std::vector<int> masters;
+    std::vector<std::string> ptys;
+    for (int i = 0; i < devices; i++) {
+        int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        grantpt(master);
+        unlockpt(master);
+        // raw before anything is written, the daemon only begins it once it has opened it
+        int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+        termios tio;
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        close(slave);
+        masters.push_back(master);
+        ptys.push_back(ptsname(master));
+    }
+
+    pid_t child = fork();
+    if (child == 0) {
+        // a link is only lost once every copy of its master is closed
+        for (int master : masters)
+            close(master);
+        _exit(serve(ptys));
+    }
+
+    // the controllers and a UI on the binary broadcast, on one loop
+    EventLoop loop;
+    std::deque<HardwareSerial> serials;
+    std::deque<CommsControl> controllers;
+    for (int i = 0; i < devices; i++) {
+        serials.emplace_back();
+        serials.back().attach(masters[i]);
+        controllers.emplace_back(115200, serials.back());
+        CommsControl *comms = &controllers.back();
+        HardwareSerial *serial = &serials.back();
+        loop.add(masters[i], EPOLLIN, [comms, serial](uint32_t) {
+            // ACKs, and the commands of the daemon at start up which are only ACKed
+            Payload pl;
+            while (serial->available() > 0) {
+                comms->receiver();
+                while (comms->readPayload(pl))
+                    ;
+            }
+            comms->sender();
+            serial->flushBacklog();
+        });
+    }
+
+    int ui = -1;
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(HEV_PORT_BROADCAST_BINARY);
+    inet_pton(AF_INET, BENCH_IP, &addr.sin_addr);
+    for (int attempt = 0; attempt < 200 && ui < 0; attempt++) {
+        ui = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connect(ui, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0) {
+            close(ui);
+            ui = -1;
+            usleep(10000);
+        }
+    }
+    if (ui < 0) {
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+        return result;
+    }
+    std::string input;
+    bool measuring = false;
+    loop.add(ui, EPOLLIN, [&](uint32_t) {
+        char buffer[65536];
+        ssize_t n = read(ui, buffer, sizeof(buffer));
+        if (n <= 0)
+            return;
+        input.append(buffer, static_cast<size_t>(n));
+        uint32_t now = static_cast<uint32_t>(micros());
+        size_t pos = 0;
+        while (input.size() - pos >= BROADCAST_BINARY_HEADER) {
+            size_t size = static_cast<uint8_t>(input[pos + 4]) | static_cast<uint8_t>(input[pos + 5]) << 8;
+            if (input.size() - pos < size)
+                break;
+            uint8_t flags = static_cast<uint8_t>(input[pos + 3]);
+            size_t data = pos + BROADCAST_BINARY_HEADER;
+            if (flags & BROADCAST_BINARY_DEVICE)
+                data += 1 + static_cast<uint8_t>(input[data]);
+            if ((flags & BROADCAST_BINARY_SENSORS) && measuring) {
+                data_format sensors;
+                memcpy(&sensors, input.data() + data, sizeof(sensors));
+                // the controllers put the time they wrote the payload in place of their millis()
+                result.received++;
+                result.latencies_us.push_back(now - sensors.timestamp);
+            }
+            pos += size;
+        }
+        input.erase(0, pos);
+    });
+
+    // a second to settle, then the measurement
+    uint64_t period_us = 1000000 / rate;
+    uint64_t next_us = EventLoop::getTimeUs();
+    uint64_t start_us = next_us + 1000000;
+    uint64_t end_us = start_us + static_cast<uint64_t>(seconds * 1e6);
+    clockid_t daemon_clock;
+    clock_getcpuclockid(child, &daemon_clock);
+    uint64_t cpu_start = 0, cpu_end = 0;
+    std::function<void()> tick = [&]() {
+        uint64_t now_us = EventLoop::getTimeUs();
+        if (!measuring && now_us >= start_us) {
+            measuring = true;
+            cpu_start = getCpuUs(daemon_clock);
+        }
+        if (now_us >= end_us) {
+            cpu_end = getCpuUs(daemon_clock);
+            loop.stop();
+            return;
+        }
+        for (size_t i = 0; i < controllers.size(); i++) {
+            data_format data;
+            data.timestamp = static_cast<uint32_t>(micros());
+            data.pressure_buffer = static_cast<uint16_t>(30000 + rand() % 16);
+            data.pressure_inhale = static_cast<uint16_t>(2000 + rand() % 16);
+            Payload pl;
+            pl.setData(&data);
+            if (controllers[i].writePayload(pl)) {
+                if (measuring)
+                    result.sent++;
+            } else if (measuring) {
+                result.dropped++;
+            }
+            controllers[i].sender();
+            serials[i].flushBacklog();
+        }
+        next_us += period_us;
+        loop.addTimer(next_us > now_us ? static_cast<uint32_t>((next_us - now_us + 999) / 1000) : 0, tick);
+    };
+    loop.addTimer(0, tick);
+    loop.run();
+
+    // the daemon stops once every link is lost
+    loop.remove(ui);
+    close(ui);
+    for (int i = 0; i < devices; i++) {
+        loop.remove(masters[i]);
+        serials[i].close();
+    }
+    waitpid(child, nullptr, 0);
+    uint64_t cpu_us = cpu_end - cpu_start;
+    result.cpu_percent = 100.0 * cpu_us / (seconds * 1e6);
+    result.cpu_us_per_sample = result.received ? static_cast<double>(cpu_us) / result.received : 0.0;
+    return result;
+}
+
+static uint32_t getPercentile(std::vector<uint32_t> &values, double percentile)
+{
+    if (values.empty())
+        return 0;
+    size_t rank = static_cast<size_t>(percentile / 100 * (values.size() - 1));
+    std::nth_element(values.begin(), values.begin() + rank, values.end());
+    return values[rank];
+}
+
+int main(int argc, char **argv)
+{
+    int max_devices = (argc > 1) ? atoi(argv[1]) : 32;
+    uint32_t rate = (argc > 2) ? static_cast<uint32_t>(atoi(argv[2])) : 100;
+    double seconds = (argc > 3) ? atof(argv[3]) : 5.0;
+    if (rate == 0)
+        rate = 100;
+    setLogLevel(LOG_WARNING);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%u DATA/s per controller for %.1f s\n", rate, seconds);
+    printf("%8s %10s %10s %8s %10s %8s %8s %8s\n", "devices", "samples/s", "dropped", "cpu %", "us/sample",
+           "p50 us", "p99 us", "max us");
+    for (int devices : device_counts) {
+        if (devices > max_devices)
+            break;
+        Result result = run(devices, rate, seconds);
+        uint32_t p50 = getPercentile(result.latencies_us, 50);
+        uint32_t p99 = getPercentile(result.latencies_us, 99);
+        uint32_t worst = getPercentile(result.latencies_us, 100);
+        printf("%8d %10.0f %10llu %8.1f %10.1f %8u %8u %8u\n", devices, result.received / seconds,
+               static_cast<unsigned long long>(result.dropped), result.cpu_percent, result.cpu_us_per_sample, p50, p99, worst);
+        fflush(stdout);
+    }
+    return 0;
+}
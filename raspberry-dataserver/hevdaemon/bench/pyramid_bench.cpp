@@ -0,0 +1,66 @@
+// Downsampling pyramid benchmark: cost of adding a sample, then the time to get ~N points
+// of every channel over ranges from a second to a day, which should not grow with the range.
+//
+//   pio run -e pyramid_bench && .pio/build/pyramid_bench/program [hours] [samples per second] [points]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "EventLoop.h"
+#include "Pyramid.h"
+
+static uint64_t getCpuUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    double hours = (argc > 1) ? atof(argv[1]) : 24.0;
+    uint32_t rate = (argc > 2) ? static_cast<uint32_t>(atoi(argv[2])) : 100;
+    size_t points = (argc > 3) ? static_cast<size_t>(atoi(argv[3])) : 500;
+
+    Pyramid pyramid;
+    uint64_t samples = static_cast<uint64_t>(hours * 3600 * rate);
+    uint64_t period_us = 1000000 / rate;
+    uint64_t start_us = EventLoop::getWallTimeUs();
+    data_format data;
+    uint64_t cpu_start = getCpuUs();
+    for (uint64_t i = 0; i < samples; i++) {
+        double phase = fmod(i * period_us / 3e6, 1.0);
+        bool inhale = phase < 0.35;
+        data.fsm_state = inhale ? 5 : 6;
+        data.pressure_inhale = static_cast<uint16_t>(2000 + (inhale ? 12000 * sin(phase / 0.35 * M_PI) : 0) + rand() % 16);
+        data.pressure_patient = static_cast<uint16_t>(1500 + (inhale ? 10000 * sin(phase / 0.35 * M_PI) : 500) + rand() % 32);
+        data.readback_valve_inhale = inhale;
+        pyramid.add(start_us + i * period_us, data);
+    }
+    uint64_t cpu_add = getCpuUs() - cpu_start;
+    uint64_t end_us = start_us + samples * period_us;
+    printf("%llu samples (%.1f h at %u/s)\n", static_cast<unsigned long long>(samples), hours, rate);
+    printf("add              %6.0f ns per sample (cpu)\n", samples ? cpu_add * 1e3 / samples : 0.0);
+
+    std::vector<int> channels;
+    for (int c = 0; c < HEV_PYRAMID_CHANNELS; c++)
+        channels.push_back(c);
+    const double ranges_s[] = {1, 10, 60, 600, 3600, 6 * 3600, 24 * 3600};
+    PyramidPoints out;
+    for (double range_s : ranges_s) {
+        uint64_t range_us = static_cast<uint64_t>(range_s * 1e6);
+        if (range_us > end_us - start_us)
+            break;
+        const int repeats = 100;
+        size_t n = 0;
+        uint64_t query_start = EventLoop::getTimeUs();
+        for (int r = 0; r < repeats; r++)
+            n = pyramid.query(end_us - range_us, end_us, points, channels, out);
+        uint64_t query_us = EventLoop::getTimeUs() - query_start;
+        printf("query %7.0f s   %6.1f us for %zu points of %llu ms\n", range_s, query_us / (double)repeats, n,
+               static_cast<unsigned long long>(out.step_us / 1000));
+    }
+    return 0;
+}
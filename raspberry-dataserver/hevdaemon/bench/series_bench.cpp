@@ -0,0 +1,111 @@
+// Time series store benchmark: encoding cost and size per sample of a synthetic breathing
+// signal, then the time to open the store and read back all of it and one minute of it.
+//
+//   pio run -e series_bench && .pio/build/series_bench/program [hours] [samples per second]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+
+#include "EventLoop.h"
+#include "HevSeries.h"
+#include "Log.h"
+#include "SeriesStore.h"
+#include "common.h"
+
+static uint64_t getCpuUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    double hours = (argc > 1) ? atof(argv[1]) : 1.0;
+    uint32_t rate = (argc > 2) ? static_cast<uint32_t>(atoi(argv[2])) : 100;
+    setLogLevel(LOG_WARNING);
+
+    char dir[] = "/tmp/hevseries-bench-XXXXXX";
+    if (mkdtemp(dir) == nullptr)
+        return 1;
+    EventLoop loop;
+    SeriesStore store(loop);
+    if (!store.open(dir, UINT64_MAX))
+        return 1;
+
+    // 20 breaths a minute, sensor noise of a few counts, an alarm now and then
+    uint64_t samples = static_cast<uint64_t>(hours * 3600 * rate);
+    uint64_t period_us = 1000000 / rate;
+    uint64_t start_us = EventLoop::getWallTimeUs();
+    uint64_t commit_us = start_us;
+    data_format data;
+    std::vector<uint8_t> alarms;
+    uint64_t cpu_start = getCpuUs();
+    for (uint64_t i = 0; i < samples; i++) {
+        uint64_t t = start_us + i * period_us + static_cast<uint64_t>(rand() % 500);
+        double phase = fmod(i * period_us / 3e6, 1.0);
+        bool inhale = phase < 0.35;
+        data.timestamp = static_cast<uint32_t>(i * period_us / 1000);
+        data.fsm_state = inhale ? 5 : 6;
+        data.pressure_buffer = static_cast<uint16_t>(30000 - (inhale ? 4000 * phase : 0) + rand() % 16);
+        data.pressure_inhale = static_cast<uint16_t>(2000 + (inhale ? 12000 * sin(phase / 0.35 * M_PI) : 0) + rand() % 16);
+        data.pressure_patient = static_cast<uint16_t>(1500 + (inhale ? 10000 * sin(phase / 0.35 * M_PI) : 500) + rand() % 32);
+        data.pressure_diff_patient = static_cast<uint16_t>(32768 + (inhale ? 3000 : -1500) * sin(phase * M_PI) + rand() % 64);
+        data.pressure_air_regulated = static_cast<uint16_t>(20000 + rand() % 8);
+        data.pressure_o2_regulated = static_cast<uint16_t>(20000 + rand() % 8);
+        data.temperature_buffer = static_cast<uint16_t>(2500 + i / (rate * 60) % 10);
+        data.readback_valve_inhale = inhale;
+        data.readback_valve_exhale = !inhale;
+        if (i % (rate * 600) == 0)
+            alarms.assign(1, ALARM_CODES::HIGH_PRESSURE);
+        else if (i % (rate * 600) == rate * 30)
+            alarms.clear();
+        store.append(t, data, alarms);
+        // the group commit of the daemon, on the samples' clock rather than on a timer
+        if (t - commit_us >= HEV_SERIES_COMMIT_MS * 1000ull) {
+            store.commit();
+            commit_us = t;
+        }
+    }
+    uint64_t cpu_append = getCpuUs() - cpu_start;
+    store.close();
+
+    uint64_t open_start = EventLoop::getTimeUs();
+    HevSeriesReader reader;
+    if (!reader.open(dir))
+        return 1;
+    uint64_t open_us = EventLoop::getTimeUs() - open_start;
+    HevSeriesColumns columns;
+    uint64_t all_start = EventLoop::getTimeUs();
+    size_t all = reader.query(0, UINT64_MAX, columns);
+    uint64_t all_us = EventLoop::getTimeUs() - all_start;
+    columns.clear();
+    uint64_t middle = start_us + samples * period_us / 2;
+    uint64_t minute_start = EventLoop::getTimeUs();
+    size_t minute = reader.query(middle, middle + 60000000, columns);
+    uint64_t minute_us = EventLoop::getTimeUs() - minute_start;
+
+    uint64_t bytes = 0;
+    std::string command = std::string("du -sb ") + dir;
+    if (FILE *du = popen(command.c_str(), "r")) {
+        unsigned long long size = 0;
+        if (fscanf(du, "%llu", &size) == 1)
+            bytes = size;
+        pclose(du);
+    }
+    printf("%llu samples (%.1f h at %u/s), %zu chunks\n", static_cast<unsigned long long>(samples), hours, rate,
+           reader.getChunkCount());
+    printf("append + encode  %6.0f ns per sample (cpu)\n", samples ? cpu_append * 1e3 / samples : 0.0);
+    printf("size             %6.2f bytes per sample, %.1f MB, raw data_format + time %zu bytes\n",
+           samples ? static_cast<double>(bytes) / samples : 0.0, bytes / 1e6, sizeof(data_format) + 8);
+    printf("open             %6.2f ms\n", open_us / 1e3);
+    printf("query all        %6.1f ms for %zu samples, %.1f M samples/s\n", all_us / 1e3, all, all_us ? all / (double)all_us : 0.0);
+    printf("query 1 minute   %6.3f ms for %zu samples\n", minute_us / 1e3, minute);
+
+    std::string cleanup = std::string("rm -rf ") + dir;
+    return system(cleanup.c_str()) == 0 && all == samples ? 0 : 1;
+}
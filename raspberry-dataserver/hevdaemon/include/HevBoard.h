@@ -0,0 +1,185 @@
+#ifndef HEV_BOARD_H
+#define HEV_BOARD_H
+
+// Latest values board of hevdaemon, a POSIX shared memory segment (/dev/shm/hevboard)
+// for the UIs on the same host: the latest data_format and latched alarms, and a ring
+// of the recent samples. The daemon is the only writer, readers never block it:
+// every block is guarded by a sequence number that is odd while it is written,
+// a reader copies the block and retries if the sequence moved meanwhile.
+//
+// Header only, needs CommsCommon.h of CommsControl for data_format:
+//   HevBoardReader board;
+//   if (board.open()) { HevBoardSnapshot now; board.readLatest(now); }
+//
+// The layout is fixed, little endian, read by hevboard.py as well:
+//   0    header   "HEVB", layout version, format version, ring size, sample size, writer pid
+//   64   latest   sequence, sensors valid, alarm count, update time (us, CLOCK_MONOTONIC),
+//                 data_format, alarm codes
+//   192  head     number of samples written since the daemon started
+//   256  ring     HEV_BOARD_RING_SAMPLES slots of sequence and data_format,
+//                 sample i is in slot i % HEV_BOARD_RING_SAMPLES with sequence 2 * i + 2 once written
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "CommsCommon.h"
+
+#define HEV_BOARD_NAME          "/hevboard"
+#define HEV_BOARD_VERSION       1
+#define HEV_BOARD_ALARMS        32
+#define HEV_BOARD_RING_SAMPLES  1024 // 10 s of data every 10 ms
+// a read is given up after this many torn copies, the writer only holds a block for a memcpy
+#define HEV_BOARD_READ_RETRIES  1000
+
+struct hev_board_header {
+    char     magic[4];          // "HEVB" once the board is initialised
+    uint8_t  layout_version;    // HEV_BOARD_VERSION
+    uint8_t  format_version;    // HEV_FORMAT_VERSION of the samples
+    uint16_t reserved;
+    uint32_t ring_samples;
+    uint32_t sample_size;       // sizeof(data_format)
+    uint32_t writer_pid;
+    uint8_t  padding[44];
+};
+
+struct hev_board_latest {
+    uint32_t    seq;
+    uint8_t     sensors_valid;
+    uint8_t     alarm_count;
+    uint16_t    reserved;
+    uint64_t    update_us;
+    data_format sensors;
+    uint8_t     alarms[HEV_BOARD_ALARMS];   // ALARM_CODES latched until acknowledged
+    uint8_t     padding[48];
+};
+
+struct hev_board_sample {
+    uint64_t    seq;
+    data_format data;
+};
+
+struct hev_board {
+    hev_board_header header;
+    hev_board_latest latest;
+    uint64_t         head;
+    uint8_t          padding[56];
+    hev_board_sample ring[HEV_BOARD_RING_SAMPLES];
+};
+
+static_assert(sizeof(data_format) == 32, "data_format layout changed, update HEV_BOARD_VERSION");
+static_assert(offsetof(hev_board, latest) == 64, "hev_board layout");
+static_assert(offsetof(hev_board_latest, sensors) == 16, "hev_board layout");
+static_assert(offsetof(hev_board, head) == 192, "hev_board layout");
+static_assert(offsetof(hev_board, ring) == 256, "hev_board layout");
+static_assert(sizeof(hev_board_sample) == 40, "hev_board layout");
+
+// a consistent copy of the latest block
+struct HevBoardSnapshot {
+    uint64_t    update_us;
+    bool        sensors_valid;
+    data_format sensors;
+    uint8_t     alarm_count;
+    uint8_t     alarms[HEV_BOARD_ALARMS];
+};
+
+class HevBoardReader
+{
+public:
+    HevBoardReader() : _board(nullptr) {}
+    ~HevBoardReader() { close(); }
+
+    // false while the daemon has not created the board, or when its layout or
+    // data_format is of another version than this reader was built with
+    bool open(const char *name = HEV_BOARD_NAME)
+    {
+        close();
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(hev_board))
+            addr = mmap(nullptr, sizeof(hev_board), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            return false;
+        _board = static_cast<const hev_board *>(addr);
+        const hev_board_header &header = _board->header;
+        if (memcmp(header.magic, "HEVB", 4) != 0 || header.layout_version != HEV_BOARD_VERSION
+                || header.format_version != HEV_FORMAT_VERSION || header.ring_samples != HEV_BOARD_RING_SAMPLES
+                || header.sample_size != sizeof(data_format)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close()
+    {
+        if (_board != nullptr)
+            munmap(const_cast<hev_board *>(_board), sizeof(hev_board));
+        _board = nullptr;
+    }
+
+    bool isOpen() const { return _board != nullptr; }
+    // pid of the daemon that created the board, to tell whether it is still running
+    uint32_t getWriterPid() const { return _board->header.writer_pid; }
+
+    // false if no consistent copy could be made, which only happens if the writer died mid update
+    bool readLatest(HevBoardSnapshot &snapshot) const
+    {
+        const hev_board_latest &latest = _board->latest;
+        for (int retry = 0; retry < HEV_BOARD_READ_RETRIES; retry++) {
+            uint32_t seq = __atomic_load_n(&latest.seq, __ATOMIC_ACQUIRE);
+            if (seq & 1)
+                continue;
+            snapshot.update_us = latest.update_us;
+            snapshot.sensors_valid = latest.sensors_valid;
+            memcpy(&snapshot.sensors, &latest.sensors, sizeof(data_format));
+            snapshot.alarm_count = latest.alarm_count < HEV_BOARD_ALARMS ? latest.alarm_count : HEV_BOARD_ALARMS;
+            memcpy(snapshot.alarms, latest.alarms, HEV_BOARD_ALARMS);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&latest.seq, __ATOMIC_RELAXED) == seq)
+                return true;
+        }
+        return false;
+    }
+
+    // number of samples written so far, the index the next sample will get
+    uint64_t getHead() const { return __atomic_load_n(&_board->head, __ATOMIC_ACQUIRE); }
+
+    // copies up to max samples from index next on and advances next past them,
+    // samples overwritten before they could be read are skipped
+    size_t readSamples(uint64_t &next, data_format *samples, size_t max) const
+    {
+        uint64_t head = getHead();
+        if (head > HEV_BOARD_RING_SAMPLES && next < head - HEV_BOARD_RING_SAMPLES)
+            next = head - HEV_BOARD_RING_SAMPLES;
+        size_t count = 0;
+        while (count < max && next < head) {
+            const hev_board_sample &slot = _board->ring[next % HEV_BOARD_RING_SAMPLES];
+            uint64_t seq = 2 * next + 2;
+            if (__atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE) != seq) {
+                // overwritten by a newer lap of the ring
+                next++;
+                continue;
+            }
+            memcpy(&samples[count], &slot.data, sizeof(data_format));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot.seq, __ATOMIC_RELAXED) == seq)
+                count++;
+            next++;
+        }
+        return count;
+    }
+
+private:
+    const hev_board *_board;
+};
+
+#endif
@@ -0,0 +1,342 @@
+#ifndef HEV_SERIES_H
+#define HEV_SERIES_H
+
+// Time series store of hevdaemon (--store DIR): every data_format received, with the host
+// time and the latched alarms, kept column by column rather than row by row.
+// Samples are buffered into chunks of up to HEV_SERIES_CHUNK_SAMPLES; within a chunk each
+// column is stored as its first value and the deltas from one sample to the next, less
+// the smallest of them, bit packed at the width of the largest. Constant channels take
+// no bits at all, slowly moving ones a few.
+//
+// Header only, needs CommsCommon.h of CommsControl for data_format:
+//   HevSeriesReader store;
+//   HevSeriesColumns columns;
+//   if (store.open("/var/lib/hev/series")) store.query(from_us, to_us, columns);
+//
+// The store is a directory of segment files, <start time in us>.hevs, oldest deleted first.
+// A segment is only ever appended to, little endian:
+//   hev_series_segment   "HEVS", layout version, format version, number of columns, start time
+//   chunks               hev_series_chunk, hev_series_column for each column, then for each
+//                        column (count - 1) * bits packed into uint64 words, least significant first
+// A chunk cut short or not matching its checksum (a power cut during a write) is skipped.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "CommsCommon.h"
+
+#define HEV_SERIES_VERSION        1
+#define HEV_SERIES_CHUNK_SAMPLES  1024
+#define HEV_SERIES_SUFFIX         ".hevs"
+
+// column of the store: time, alarms, then the fields of data_format
+struct HevSeriesField {
+    const char *name;
+    uint8_t     offset;     // in data_format
+    uint8_t     size;       // 0 for the columns not in data_format
+};
+
+#define HEV_SERIES_FIELD(name) { #name, offsetof(data_format, name), sizeof(data_format::name) }
+
+static const HevSeriesField hev_series_fields[] = {
+    {"time_us", 0, 0},      // host wall clock, us since the epoch
+    {"alarms",  0, 0},      // bit n set while ALARM_CODES n is latched
+    HEV_SERIES_FIELD(version),
+    HEV_SERIES_FIELD(fsm_state),
+    HEV_SERIES_FIELD(breath_timing_error),
+    HEV_SERIES_FIELD(timestamp),
+    HEV_SERIES_FIELD(pressure_air_supply),
+    HEV_SERIES_FIELD(pressure_air_regulated),
+    HEV_SERIES_FIELD(pressure_o2_supply),
+    HEV_SERIES_FIELD(pressure_o2_regulated),
+    HEV_SERIES_FIELD(pressure_buffer),
+    HEV_SERIES_FIELD(pressure_inhale),
+    HEV_SERIES_FIELD(pressure_patient),
+    HEV_SERIES_FIELD(temperature_buffer),
+    HEV_SERIES_FIELD(pressure_diff_patient),
+    HEV_SERIES_FIELD(readback_valve_air_in),
+    HEV_SERIES_FIELD(readback_valve_o2_in),
+    HEV_SERIES_FIELD(readback_valve_inhale),
+    HEV_SERIES_FIELD(readback_valve_exhale),
+    HEV_SERIES_FIELD(readback_valve_purge),
+    HEV_SERIES_FIELD(readback_mode)
+};
+
+#define HEV_SERIES_COLUMNS  (sizeof(hev_series_fields) / sizeof(hev_series_fields[0]))
+#define HEV_SERIES_TIME     0
+#define HEV_SERIES_ALARMS   1
+
+struct hev_series_segment {
+    char     magic[4];          // "HEVS"
+    uint8_t  layout_version;    // HEV_SERIES_VERSION
+    uint8_t  format_version;    // HEV_FORMAT_VERSION of the samples
+    uint16_t columns;           // HEV_SERIES_COLUMNS
+    uint64_t start_us;
+    uint8_t  reserved[48];
+};
+
+struct hev_series_chunk {
+    char     magic[4];          // "HEVC"
+    uint32_t size;              // of the whole chunk, this header included
+    uint32_t count;             // samples
+    uint32_t checksum;          // FNV-1a of the rest of the chunk
+    uint64_t min_us;            // time range of the samples
+    uint64_t max_us;
+};
+
+struct hev_series_column {
+    int64_t  first;             // value of the first sample
+    int64_t  min_delta;         // subtracted from every delta before packing
+    uint8_t  bits;              // 0 to 64, 0 when every delta is min_delta
+    uint8_t  reserved[7];
+};
+
+static_assert(sizeof(data_format) == 32, "data_format layout changed, update HEV_SERIES_VERSION");
+static_assert(sizeof(hev_series_segment) == 64, "hev_series_segment layout");
+static_assert(sizeof(hev_series_chunk) == 32, "hev_series_chunk layout");
+static_assert(sizeof(hev_series_column) == 24, "hev_series_column layout");
+
+inline uint32_t hevSeriesChecksum(const uint8_t *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+inline size_t hevSeriesPackedWords(uint32_t count, uint8_t bits)
+{
+    return count > 1 ? ((static_cast<size_t>(count) - 1) * bits + 63) / 64 : 0;
+}
+
+// samples of a query, values[column][row]
+struct HevSeriesColumns {
+    std::vector<int64_t> values[HEV_SERIES_COLUMNS];
+
+    size_t size() const { return values[HEV_SERIES_TIME].size(); }
+    void clear()
+    {
+        for (auto &column : values)
+            column.clear();
+    }
+    // the data_format of a row
+    void getSample(size_t row, data_format &data) const
+    {
+        for (size_t c = 0; c < HEV_SERIES_COLUMNS; c++) {
+            const HevSeriesField &field = hev_series_fields[c];
+            if (field.size == 0)
+                continue;
+            uint64_t value = static_cast<uint64_t>(values[c][row]);
+            for (uint8_t i = 0; i < field.size; i++)
+                reinterpret_cast<uint8_t *>(&data)[field.offset + i] = static_cast<uint8_t>(value >> (8 * i));
+        }
+    }
+};
+
+inline int hevSeriesColumn(const char *name)
+{
+    for (size_t c = 0; c < HEV_SERIES_COLUMNS; c++)
+        if (strcmp(hev_series_fields[c].name, name) == 0)
+            return static_cast<int>(c);
+    return -1;
+}
+
+class HevSeriesReader
+{
+public:
+    HevSeriesReader() {}
+    ~HevSeriesReader() { close(); }
+    HevSeriesReader(const HevSeriesReader &) = delete;
+    HevSeriesReader &operator=(const HevSeriesReader &) = delete;
+
+    // maps the segments there are now and indexes their chunks, false if there are none
+    bool open(const char *dir)
+    {
+        close();
+        DIR *d = opendir(dir);
+        if (d == nullptr)
+            return false;
+        std::vector<std::string> names;
+        size_t suffix = strlen(HEV_SERIES_SUFFIX);
+        while (dirent *entry = readdir(d)) {
+            size_t length = strlen(entry->d_name);
+            if (length > suffix && strcmp(entry->d_name + length - suffix, HEV_SERIES_SUFFIX) == 0)
+                names.push_back(entry->d_name);
+        }
+        closedir(d);
+        // zero padded start times, by name is by age
+        std::sort(names.begin(), names.end());
+        for (const std::string &name : names)
+            mapSegment(std::string(dir) + "/" + name);
+        return !_segments.empty();
+    }
+
+    void close()
+    {
+        for (Segment &segment : _segments)
+            munmap(const_cast<uint8_t *>(segment.data), segment.size);
+        _segments.clear();
+        _chunks.clear();
+    }
+
+    size_t   getChunkCount() const { return _chunks.size(); }
+    uint64_t getSampleCount() const
+    {
+        uint64_t count = 0;
+        for (const hev_series_chunk *chunk : _chunks)
+            count += chunk->count;
+        return count;
+    }
+    uint64_t getFirstUs() const { return _chunks.empty() ? 0 : _chunks.front()->min_us; }
+    uint64_t getLastUs() const { return _chunks.empty() ? 0 : _chunks.back()->max_us; }
+
+    // appends the samples with from_us <= time_us < to_us in the order stored,
+    // only the chunks overlapping the range are decoded
+    size_t query(uint64_t from_us, uint64_t to_us, HevSeriesColumns &out) const
+    {
+        size_t before = out.size();
+        size_t most = 0;
+        for (const hev_series_chunk *chunk : _chunks)
+            if (chunk->max_us >= from_us && chunk->min_us < to_us)
+                most += chunk->count;
+        for (auto &column : out.values)
+            column.reserve(before + most);
+
+        std::vector<int64_t> decoded(HEV_SERIES_CHUNK_SAMPLES);
+        std::vector<uint32_t> rows;
+        for (const hev_series_chunk *chunk : _chunks) {
+            if (chunk->max_us < from_us || chunk->min_us >= to_us)
+                continue;
+            uint32_t count = chunk->count;
+            const hev_series_column *columns = reinterpret_cast<const hev_series_column *>(chunk + 1);
+            const uint64_t *words = reinterpret_cast<const uint64_t *>(columns + HEV_SERIES_COLUMNS);
+
+            // a chunk inside the range is decoded straight into the columns,
+            // one across an end row by row from the time column
+            if (chunk->min_us >= from_us && chunk->max_us < to_us) {
+                for (size_t c = 0; c < HEV_SERIES_COLUMNS; c++) {
+                    std::vector<int64_t> &column = out.values[c];
+                    column.resize(column.size() + count);
+                    decode(columns[c], words, count, column.data() + column.size() - count);
+                    words += hevSeriesPackedWords(count, columns[c].bits);
+                }
+                continue;
+            }
+            rows.clear();
+            decode(columns[HEV_SERIES_TIME], words, count, decoded.data());
+            for (uint32_t i = 0; i < count; i++) {
+                uint64_t t = static_cast<uint64_t>(decoded[i]);
+                if (t >= from_us && t < to_us)
+                    rows.push_back(i);
+            }
+            for (size_t c = 0; c < HEV_SERIES_COLUMNS && !rows.empty(); c++) {
+                if (c != HEV_SERIES_TIME)
+                    decode(columns[c], words, count, decoded.data());
+                for (uint32_t row : rows)
+                    out.values[c].push_back(decoded[row]);
+                words += hevSeriesPackedWords(count, columns[c].bits);
+            }
+        }
+        return out.size() - before;
+    }
+
+private:
+    struct Segment {
+        const uint8_t *data;
+        size_t         size;
+    };
+
+    void mapSegment(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return;
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= static_cast<off_t>(sizeof(hev_series_segment)))
+            addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED)
+            return;
+        const uint8_t *data = static_cast<const uint8_t *>(addr);
+        size_t size = static_cast<size_t>(st.st_size);
+        const hev_series_segment *segment = reinterpret_cast<const hev_series_segment *>(data);
+        if (memcmp(segment->magic, "HEVS", 4) != 0 || segment->layout_version != HEV_SERIES_VERSION
+                || segment->columns != HEV_SERIES_COLUMNS) {
+            munmap(addr, size);
+            return;
+        }
+        _segments.push_back(Segment{data, size});
+
+        size_t offset = sizeof(hev_series_segment);
+        while (offset + sizeof(hev_series_chunk) <= size) {
+            const hev_series_chunk *chunk = reinterpret_cast<const hev_series_chunk *>(data + offset);
+            if (memcmp(chunk->magic, "HEVC", 4) != 0 || chunk->size < sizeof(hev_series_chunk)
+                    || chunk->size > size - offset)
+                break;
+            if (valid(*chunk))
+                _chunks.push_back(chunk);
+            offset += chunk->size;
+        }
+    }
+
+    static bool valid(const hev_series_chunk &chunk)
+    {
+        const uint8_t *body = reinterpret_cast<const uint8_t *>(&chunk + 1);
+        size_t body_size = chunk.size - sizeof(chunk);
+        if (chunk.count == 0 || chunk.count > HEV_SERIES_CHUNK_SAMPLES
+                || body_size < HEV_SERIES_COLUMNS * sizeof(hev_series_column))
+            return false;
+        // the packed columns must be exactly what the column headers say
+        const hev_series_column *columns = reinterpret_cast<const hev_series_column *>(body);
+        size_t words = 0;
+        for (size_t c = 0; c < HEV_SERIES_COLUMNS; c++) {
+            if (columns[c].bits > 64)
+                return false;
+            words += hevSeriesPackedWords(chunk.count, columns[c].bits);
+        }
+        if (body_size != HEV_SERIES_COLUMNS * sizeof(hev_series_column) + words * sizeof(uint64_t))
+            return false;
+        return hevSeriesChecksum(body, body_size) == chunk.checksum;
+    }
+
+    static void decode(const hev_series_column &column, const uint64_t *words, uint32_t count, int64_t *out)
+    {
+        // in uint64 arithmetic, wrapping as the encoder did
+        uint64_t value = static_cast<uint64_t>(column.first);
+        uint64_t min_delta = static_cast<uint64_t>(column.min_delta);
+        out[0] = column.first;
+        if (column.bits == 0) {
+            for (uint32_t i = 1; i < count; i++) {
+                value += min_delta;
+                out[i] = static_cast<int64_t>(value);
+            }
+            return;
+        }
+        uint8_t bits = column.bits;
+        uint64_t mask = bits == 64 ? ~0ull : (1ull << bits) - 1;
+        size_t bit = 0;
+        for (uint32_t i = 1; i < count; i++, bit += bits) {
+            size_t word = bit / 64, shift = bit % 64;
+            uint64_t delta = words[word] >> shift;
+            if (shift + bits > 64)
+                delta |= words[word + 1] << (64 - shift);
+            value += (delta & mask) + min_delta;
+            out[i] = static_cast<int64_t>(value);
+        }
+    }
+
+    std::vector<Segment> _segments;
+    std::vector<const hev_series_chunk *> _chunks;
+};
+
+#endif
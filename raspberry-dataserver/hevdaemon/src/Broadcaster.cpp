@@ -0,0 +1,175 @@
+#include "Broadcaster.h"
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Log.h"
+
+// frames handed to the kernel in one sendmsg
+#define BROADCAST_IOV_MAX 16
+
+Broadcaster::Broadcaster(EventLoop &loop)
+    : _loop(loop)
+{
+    for (size_t &count : _clients_per_encoding)
+        count = 0;
+    _frames_dropped = 0;
+    _clients_dropped = 0;
+}
+
+Broadcaster::~Broadcaster()
+{
+    for (auto &client : _clients)
+        close(client.first);
+}
+
+void Broadcaster::addClient(int fd, BROADCAST_ENCODING encoding, const std::string &name)
+{
+    Client &client = _clients[fd];
+    client.fd = fd;
+    client.encoding = encoding;
+    client.name = name;
+    client.queue.clear();
+    client.queued.clear();
+    client.offset = 0;
+    client.writable = true;
+    client.progress_ms = EventLoop::getTimeUs() / 1000;
+    client.stats = ClientStats{0, 0, 0};
+    _clients_per_encoding[encoding]++;
+    _loop.add(fd, EPOLLIN, [this, fd](uint32_t events) { onClient(fd, events); });
+    logMessage(LOG_INFO, "Broadcasting to %s", name.c_str());
+}
+
+void Broadcaster::publish(BROADCAST_ENCODING encoding, const Frame &frame, const void *source)
+{
+    uint64_t tnow = EventLoop::getTimeUs() / 1000;
+    std::vector<int> lost;
+    for (auto &entry : _clients) {
+        Client &client = entry.second;
+        if (client.encoding != encoding)
+            continue;
+
+        size_t &queued = client.queued[source];
+        if (queued >= HEV_BROADCAST_QUEUE_FRAMES) {
+            if (tnow - client.progress_ms > HEV_BROADCAST_STALL_MS) {
+                lost.push_back(client.fd);
+                continue;
+            }
+            // every frame holds the full state of its source, only the latest of each matter.
+            // the front frame may be half sent, the oldest of the source after it is the one to go
+            auto it = client.queue.begin() + (client.offset > 0 ? 1 : 0);
+            while (it->source != source)
+                ++it;
+            client.queue.erase(it);
+            queued--;
+            client.stats.frames_dropped++;
+            _frames_dropped++;
+        }
+        client.queue.push_back(Queued{frame, source});
+        queued++;
+
+        // a client waiting for EPOLLOUT is written once its socket drains
+        if (client.writable && !flush(client))
+            lost.push_back(client.fd);
+    }
+    for (int fd : lost) {
+        _clients_dropped++;
+        closeClient(fd, "Dropping slow client");
+    }
+}
+
+bool Broadcaster::flush(Client &client)
+{
+    while (!client.queue.empty()) {
+        iovec iov[BROADCAST_IOV_MAX];
+        size_t count = 0;
+        for (auto &queued : client.queue) {
+            if (count == BROADCAST_IOV_MAX)
+                break;
+            size_t skip = (count == 0) ? client.offset : 0;
+            iov[count].iov_base = const_cast<char *>(queued.frame->data() + skip);
+            iov[count].iov_len  = queued.frame->size() - skip;
+            count++;
+        }
+
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t sent = sendmsg(client.fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            if (client.writable) {
+                client.writable = false;
+                _loop.modify(client.fd, EPOLLIN | EPOLLOUT);
+            }
+            return true;
+        }
+
+        client.progress_ms = EventLoop::getTimeUs() / 1000;
+        client.stats.bytes_sent += static_cast<uint64_t>(sent);
+        size_t remaining = static_cast<size_t>(sent);
+        while (remaining > 0) {
+            size_t left = client.queue.front().frame->size() - client.offset;
+            if (remaining < left) {
+                client.offset += remaining;
+                break;
+            }
+            remaining -= left;
+            client.queued[client.queue.front().source]--;
+            client.queue.pop_front();
+            client.offset = 0;
+            client.stats.frames_sent++;
+        }
+    }
+
+    if (!client.writable) {
+        client.writable = true;
+        _loop.modify(client.fd, EPOLLIN);
+    }
+    return true;
+}
+
+void Broadcaster::onClient(int fd, uint32_t events)
+{
+    auto it = _clients.find(fd);
+    if (it == _clients.end())
+        return;
+    Client &client = it->second;
+
+    if (events & EPOLLIN) {
+        // nothing is expected from broadcast clients, only their going away
+        char discard[256];
+        ssize_t n = recv(fd, discard, sizeof(discard), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            closeClient(fd, "Connection lost with");
+            return;
+        }
+    }
+    if ((events & EPOLLOUT) && !flush(client)) {
+        closeClient(fd, "Connection lost with");
+        return;
+    }
+    if (events & (EPOLLHUP | EPOLLERR))
+        closeClient(fd, "Connection lost with");
+}
+
+void Broadcaster::closeClient(int fd, const char *reason)
+{
+    auto it = _clients.find(fd);
+    if (it == _clients.end())
+        return;
+    Client &client = it->second;
+    logMessage(LOG_WARNING, "%s %s after %llu frames, %llu dropped", reason, client.name.c_str(),
+               static_cast<unsigned long long>(client.stats.frames_sent),
+               static_cast<unsigned long long>(client.stats.frames_dropped));
+    _clients_per_encoding[client.encoding]--;
+    _loop.remove(fd);
+    close(fd);
+    _clients.erase(it);
+}
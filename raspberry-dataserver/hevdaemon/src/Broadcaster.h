@@ -0,0 +1,84 @@
+#ifndef BROADCASTER_H
+#define BROADCASTER_H
+
+// Fan out of broadcast frames to the UI clients.
+// A frame is serialised once and shared by reference between the queues of all clients,
+// each client's queue is written out with writev as its socket drains
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "EventLoop.h"
+
+// frames of one source queued per client, the oldest unsent frames of that source are dropped
+// beyond this, so a slow client never loses the only frame of a quieter controller
+#define HEV_BROADCAST_QUEUE_FRAMES 32
+// a client whose queue is full and that has not read anything for this long is disconnected
+#define HEV_BROADCAST_STALL_MS 10000
+
+enum BROADCAST_ENCODING : uint8_t {
+    BROADCAST_JSON,
+    BROADCAST_BINARY,
+    BROADCAST_ENCODINGS
+};
+
+class Broadcaster
+{
+public:
+    typedef std::shared_ptr<const std::string> Frame;
+
+    struct ClientStats {
+        uint64_t frames_sent;
+        uint64_t frames_dropped;
+        uint64_t bytes_sent;
+    };
+
+    Broadcaster(EventLoop &loop);
+    ~Broadcaster();
+
+    // takes ownership of a connected, non-blocking socket
+    void addClient(int fd, BROADCAST_ENCODING encoding, const std::string &name);
+    // only frames of an encoding with clients need to be serialised
+    bool hasClients(BROADCAST_ENCODING encoding) const { return _clients_per_encoding[encoding] > 0; }
+    size_t getClientCount() const { return _clients.size(); }
+    // queue the frame for every client of its encoding and write as much as the sockets take,
+    // source tells the controllers apart, it is only compared
+    void publish(BROADCAST_ENCODING encoding, const Frame &frame, const void *source = nullptr);
+
+    uint64_t getFramesDropped() const { return _frames_dropped; }
+    uint64_t getClientsDropped() const { return _clients_dropped; }
+
+private:
+    struct Queued {
+        Frame       frame;
+        const void *source;
+    };
+
+    struct Client {
+        int                 fd;
+        BROADCAST_ENCODING  encoding;
+        std::string         name;       // peer address, for the log
+        std::deque<Queued>  queue;
+        std::map<const void *, size_t> queued;  // frames in the queue per source
+        size_t              offset;     // bytes of the front frame already sent
+        bool                writable;   // last write did not hit EAGAIN
+        uint64_t            progress_ms;
+        ClientStats         stats;
+    };
+
+    void onClient(int fd, uint32_t events);
+    // false if the client has gone away
+    bool flush(Client &client);
+    void closeClient(int fd, const char *reason);
+
+    EventLoop &_loop;
+    std::map<int, Client> _clients;
+    size_t   _clients_per_encoding[BROADCAST_ENCODINGS];
+    uint64_t _frames_dropped;
+    uint64_t _clients_dropped;
+};
+
+#endif
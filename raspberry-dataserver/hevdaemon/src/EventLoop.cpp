@@ -0,0 +1,128 @@
+#include "EventLoop.h"
+#include <errno.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EVENT_LOOP_MAX_EVENTS 64
+
+EventLoop::EventLoop()
+{
+    _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    _running = false;
+    _timer_next = 1;
+}
+
+EventLoop::~EventLoop()
+{
+    if (_epoll_fd >= 0)
+        close(_epoll_fd);
+}
+
+uint64_t EventLoop::getTimeUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t EventLoop::getWallTimeUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool EventLoop::add(int fd, uint32_t events, IoHandler handler)
+{
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+        return false;
+    _handlers[fd] = std::make_shared<IoHandler>(handler);
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events)
+{
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(_epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void EventLoop::remove(int fd)
+{
+    epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    _handlers.erase(fd);
+}
+
+uint64_t EventLoop::addTimer(uint32_t delay_ms, TimerHandler handler)
+{
+    uint64_t id = _timer_next++;
+    uint64_t deadline = getTimeUs() + static_cast<uint64_t>(delay_ms) * 1000;
+    _timers.insert(std::make_pair(deadline, std::make_pair(id, handler)));
+    _timer_deadlines[id] = deadline;
+    return id;
+}
+
+void EventLoop::cancelTimer(uint64_t id)
+{
+    auto it = _timer_deadlines.find(id);
+    if (it == _timer_deadlines.end())
+        return;
+    auto range = _timers.equal_range(it->second);
+    for (auto t = range.first; t != range.second; ++t) {
+        if (t->second.first == id) {
+            _timers.erase(t);
+            break;
+        }
+    }
+    _timer_deadlines.erase(it);
+}
+
+// ms until the first timer, rounded up so that it has expired on wake up, -1 without timers
+int EventLoop::getTimeout()
+{
+    if (_timers.empty())
+        return -1;
+    uint64_t tnow = getTimeUs();
+    uint64_t deadline = _timers.begin()->first;
+    if (deadline <= tnow)
+        return 0;
+    return static_cast<int>((deadline - tnow + 999) / 1000);
+}
+
+void EventLoop::runTimers()
+{
+    uint64_t tnow = getTimeUs();
+    while (!_timers.empty() && _timers.begin()->first <= tnow) {
+        TimerHandler handler = _timers.begin()->second.second;
+        _timer_deadlines.erase(_timers.begin()->second.first);
+        _timers.erase(_timers.begin());
+        handler();
+    }
+}
+
+void EventLoop::run()
+{
+    epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    _running = true;
+    while (_running) {
+        int n = epoll_wait(_epoll_fd, events, EVENT_LOOP_MAX_EVENTS, getTimeout());
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; i++) {
+            auto it = _handlers.find(events[i].data.fd);
+            if (it == _handlers.end())
+                continue;
+            // the handler may remove its own fd, keep it alive until it returns
+            std::shared_ptr<IoHandler> handler = it->second;
+            (*handler)(events[i].events);
+        }
+        runTimers();
+        if (_idle)
+            _idle();
+    }
+}
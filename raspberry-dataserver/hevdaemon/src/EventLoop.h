@@ -0,0 +1,55 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+// Single threaded epoll loop with one shot timers
+// All handlers run on the thread calling run()
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+
+class EventLoop
+{
+public:
+    typedef std::function<void(uint32_t events)> IoHandler;
+    typedef std::function<void()> TimerHandler;
+
+    EventLoop();
+    ~EventLoop();
+
+    // events: EPOLLIN, EPOLLOUT, ... handlers may add and remove fds, including their own
+    bool add(int fd, uint32_t events, IoHandler handler);
+    bool modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    // timers fire once, from the loop, at or after the delay
+    uint64_t addTimer(uint32_t delay_ms, TimerHandler handler);
+    void cancelTimer(uint64_t id);
+
+    // called once per wake up, after the fd and timer handlers
+    void setIdleHandler(TimerHandler handler) { _idle = handler; }
+
+    void run();
+    void stop() { _running = false; }
+
+    static uint64_t getTimeUs();
+    // wall clock, us since the epoch, for what is kept beyond the process
+    static uint64_t getWallTimeUs();
+
+private:
+    int  getTimeout();
+    void runTimers();
+
+    int  _epoll_fd;
+    bool _running;
+    std::unordered_map<int, std::shared_ptr<IoHandler>> _handlers;
+    // deadline in us -> (id, handler)
+    std::multimap<uint64_t, std::pair<uint64_t, TimerHandler>> _timers;
+    std::unordered_map<uint64_t, uint64_t> _timer_deadlines;
+    uint64_t _timer_next;
+    TimerHandler _idle;
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include "HevFormat.h"
+#include "HevNames.h"
+#include "common.h"
+
+// field of a report layout, types as in python struct: B, H, I and s (string of count bytes)
+struct ReportField {
+    const char *name;
+    char        type;
+    uint8_t     count;
+};
+
+struct ReportLayout {
+    uint8_t            report_type;
+    const ReportField *fields;
+    size_t             count;
+};
+
+// loop_timing_report: durations in ticks, bucket b counts (ticks >> shift) in [2^(b-1), 2^b)
+static const ReportField loop_timing_fields[] = {
+    {"stage", 'B', 1}, {"shift", 'B', 1}, {"ticks_per_us", 'H', 1}, {"count", 'I', 1}, {"worst", 'I', 1}, {"buckets", 'H', 16}
+};
+// memory_stats: bytes
+static const ReportField memory_fields[] = {
+    {"free_heap", 'I', 1}, {"largest_block", 'I', 1}, {"min_free_heap", 'I', 1}, {"stack_free", 'I', 1}
+};
+static const ReportField controller_state_fields[] = {
+    {"fsm_state", 'B', 1}, {"ventilation_mode", 'B', 1}, {"running", 'B', 1}, {"calibrated", 'B', 1},
+    {"settings_epoch", 'I', 1}, {"uptime", 'I', 1}
+};
+// pressure_calibration: adc counts, latency in ms
+static const ReportField calibration_fields[] = {
+    {"pressure_buffer", 'H', 1}, {"pressure_inhale", 'H', 1}, {"pressure_patient", 'H', 1}, {"pressure_diff_patient", 'H', 1},
+    {"pressure_air_regulated", 'H', 1}, {"pressure_o2_regulated", 'H', 1}, {"latency_inhale_open", 'H', 1}
+};
+static const ReportField firmware_version_fields[] = {
+    {"major", 'B', 1}, {"minor", 'B', 1}, {"patch", 'B', 1}, {"format_version", 'B', 1},
+    {"settings_version", 'B', 1}, {"calibration_version", 'B', 1}, {"reserved", 'H', 1}, {"build", 's', 24}
+};
+
+#define REPORT_LAYOUT(type, fields) { type, fields, sizeof(fields) / sizeof(fields[0]) }
+
+static const ReportLayout report_layouts[] = {
+    REPORT_LAYOUT(REPORT_TYPE::LOOP_TIMING,         loop_timing_fields),
+    REPORT_LAYOUT(REPORT_TYPE::MEMORY,              memory_fields),
+    REPORT_LAYOUT(REPORT_TYPE::CONTROLLER_STATE,    controller_state_fields),
+    REPORT_LAYOUT(REPORT_TYPE::CALIBRATION_OFFSETS, calibration_fields),
+    REPORT_LAYOUT(REPORT_TYPE::FIRMWARE_VERSION,    firmware_version_fields)
+};
+
+static uint32_t readLE(const uint8_t *data, uint8_t size)
+{
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < size; i++)
+        value |= static_cast<uint32_t>(data[i]) << (8 * i);
+    return value;
+}
+
+static uint8_t getFieldSize(char type)
+{
+    switch (type) {
+        case 'H': return 2;
+        case 'I': return 4;
+        default:  return 1;
+    }
+}
+
+static void writeHex(JsonWriter &json, const uint8_t *data, size_t size)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < size; i++) {
+        hex += digits[data[i] >> 4];
+        hex += digits[data[i] & 0x0F];
+    }
+    json.value(hex);
+}
+
+// up to the first NUL, anything but printable ascii becomes U+FFFD
+static void writeText(JsonWriter &json, const uint8_t *data, size_t size)
+{
+    std::string text;
+    for (size_t i = 0; i < size && data[i] != 0; i++) {
+        if (data[i] >= 0x20 && data[i] < 0x7F)
+            text += static_cast<char>(data[i]);
+        else
+            text += "\xEF\xBF\xBD";
+    }
+    json.value(text);
+}
+
+static bool writeLayout(JsonWriter &json, const ReportLayout &layout, const uint8_t *data, size_t size)
+{
+    size_t needed = 0;
+    for (size_t f = 0; f < layout.count; f++)
+        needed += getFieldSize(layout.fields[f].type) * layout.fields[f].count;
+    if (size < needed)
+        return false;
+
+    json.beginObject();
+    for (size_t f = 0; f < layout.count; f++) {
+        const ReportField &field = layout.fields[f];
+        uint8_t field_size = getFieldSize(field.type);
+        json.key(field.name);
+        if (field.type == 's') {
+            writeText(json, data, field.count);
+            data += field.count;
+            continue;
+        }
+        if (field.count > 1)
+            json.beginArray();
+        for (uint8_t i = 0; i < field.count; i++, data += field_size)
+            json.value(readLE(data, field_size));
+        if (field.count > 1)
+            json.endArray();
+    }
+    json.endObject();
+    return true;
+}
+
+// settings arrays, named by the enum whose values start at 1
+static void writeArray(JsonWriter &json, const EnumNames &names, const report_format &report, uint8_t size)
+{
+    json.beginObject();
+    uint32_t first = report.report_code * REPORT_ARRAY_VALUES + 1;
+    for (uint8_t i = 0; i + 4 <= size; i += 4) {
+        uint32_t value = first + i / 4;
+        const char *name = (value <= 0xFF) ? names.getName(static_cast<uint8_t>(value)) : nullptr;
+        json.key(name ? std::string(name) : std::to_string(value));
+        json.value(readLE(report.data + i, 4));
+    }
+    json.endObject();
+}
+
+// settings registry, one entry per setting id, named "<cmdtype>.<cmd>"
+static void writeRegistry(JsonWriter &json, const report_format &report, uint8_t size)
+{
+    json.beginObject();
+    uint32_t first = report.report_code * REPORT_REGISTRY_ENTRIES;
+    for (uint8_t i = 0; i + sizeof(setting_descriptor) <= size; i += sizeof(setting_descriptor)) {
+        const uint8_t *entry = report.data + i;
+        const char *type_name = cmd_type_names.getName(entry[0]);
+        const EnumNames *codes = getCmdCodeNames(entry[0]);
+        const char *code_name = codes ? codes->getName(entry[1]) : nullptr;
+        if (type_name && code_name)
+            json.key(std::string(type_name) + "." + code_name);
+        else
+            json.key(std::to_string(entry[0]) + "." + std::to_string(entry[1]));
+        json.beginObject();
+        json.key("id").value(first + i / static_cast<uint32_t>(sizeof(setting_descriptor)));
+        json.key("unit");
+        const char *unit = setting_unit_names.getName(entry[2]);
+        if (unit)
+            json.value(unit);
+        else
+            json.value(static_cast<int>(entry[2]));
+        json.key("min").value(readLE(entry + 4, 4));
+        json.key("max").value(readLE(entry + 8, 4));
+        json.key("default").value(readLE(entry + 12, 4));
+        json.endObject();
+    }
+    json.endObject();
+}
+
+// decode the data field if its layout is known, raw bytes otherwise
+static void writeReportFields(JsonWriter &json, const report_format &report)
+{
+    uint8_t size = (report.size < REPORT_DATA_SIZE) ? report.size : REPORT_DATA_SIZE;
+    switch (report.report_type) {
+        case REPORT_TYPE::TIMEOUTS:
+            writeArray(json, timeout_names, report, size);
+            return;
+        case REPORT_TYPE::THRESHOLDS_MIN:
+        case REPORT_TYPE::THRESHOLDS_MAX:
+            writeArray(json, alarm_code_names, report, size);
+            return;
+        case REPORT_TYPE::SETTINGS_REGISTRY:
+            writeRegistry(json, report, size);
+            return;
+        default:
+            break;
+    }
+    for (auto &layout : report_layouts) {
+        if (layout.report_type == report.report_type && writeLayout(json, layout, report.data, size))
+            return;
+    }
+    writeHex(json, report.data, size);
+}
+
+void writeBinaryHeader(char *header, uint8_t flags, size_t size)
+{
+    header[0] = 'H';
+    header[1] = 'V';
+    header[2] = static_cast<char>(HEV_FORMAT_VERSION);
+    header[3] = static_cast<char>(flags);
+    header[4] = static_cast<char>(size & 0xFF);
+    header[5] = static_cast<char>((size >> 8) & 0xFF);
+}
+
+void writeData(JsonWriter &json, const data_format &data)
+{
+    json.beginObject();
+    json.key("version").value(static_cast<int>(data.version));
+    json.key("fsm_state").value(static_cast<int>(data.fsm_state));
+    json.key("breath_timing_error").value(static_cast<int>(data.breath_timing_error));
+    json.key("timestamp").value(data.timestamp);
+    json.key("pressure_air_supply").value(static_cast<int>(data.pressure_air_supply));
+    json.key("pressure_air_regulated").value(static_cast<int>(data.pressure_air_regulated));
+    json.key("pressure_o2_supply").value(static_cast<int>(data.pressure_o2_supply));
+    json.key("pressure_o2_regulated").value(static_cast<int>(data.pressure_o2_regulated));
+    json.key("pressure_buffer").value(static_cast<int>(data.pressure_buffer));
+    json.key("pressure_inhale").value(static_cast<int>(data.pressure_inhale));
+    json.key("pressure_patient").value(static_cast<int>(data.pressure_patient));
+    json.key("temperature_buffer").value(static_cast<int>(data.temperature_buffer));
+    json.key("pressure_diff_patient").value(static_cast<int>(data.pressure_diff_patient));
+    json.key("readback_valve_air_in").value(static_cast<int>(data.readback_valve_air_in));
+    json.key("readback_valve_o2_in").value(static_cast<int>(data.readback_valve_o2_in));
+    json.key("readback_valve_inhale").value(static_cast<int>(data.readback_valve_inhale));
+    json.key("readback_valve_exhale").value(static_cast<int>(data.readback_valve_exhale));
+    json.key("readback_valve_purge").value(static_cast<int>(data.readback_valve_purge));
+    json.key("readback_mode").value(static_cast<int>(data.readback_mode));
+    json.endObject();
+}
+
+void writeReport(JsonWriter &json, const report_format &report)
+{
+    json.beginObject();
+    json.key("version").value(static_cast<int>(report.version));
+    json.key("reportType");
+    const char *type = report_type_names.getName(report.report_type);
+    if (type)
+        json.value(type);
+    else
+        json.value(static_cast<int>(report.report_type));
+    json.key("reportCode").value(static_cast<int>(report.report_code));
+    json.key("timestamp").value(report.timestamp);
+    json.key("data");
+    writeReportFields(json, report);
+    json.endObject();
+}
+
+std::string getReportKey(const report_format &report)
+{
+    const char *type = report_type_names.getName(report.report_type);
+    return (type ? std::string(type) : std::to_string(report.report_type)) + "." + std::to_string(report.report_code);
+}
+
+const char *getAlarmName(uint8_t alarm_code)
+{
+    const char *name = alarm_code_names.getName(alarm_code);
+    return name ? name : "ARDUINO_FAIL";
+}
@@ -0,0 +1,33 @@
+#ifndef HEV_FORMAT_H
+#define HEV_FORMAT_H
+
+// JSON encoding of the payloads received from the controller,
+// the same dicts as getDict() in commsConstants.py
+
+#include <string>
+#include "CommsCommon.h"
+#include "Json.h"
+
+#define REPORT_ARRAY_VALUES     12
+#define REPORT_REGISTRY_ENTRIES 3
+
+// compact broadcast frame, little endian, the payloads as received from the controller:
+//   "HV", uint8 HEV_FORMAT_VERSION, uint8 flags, uint16 size of the whole frame
+//   uint8 size, name             of the controller if flags & BROADCAST_BINARY_DEVICE (several served)
+//   data_format                  if flags & BROADCAST_BINARY_SENSORS
+//   uint8 count, ALARM_CODES     latched alarms
+//   uint8 count, reports         each the report_format header followed by its size bytes of data
+#define BROADCAST_BINARY_HEADER  6
+#define BROADCAST_BINARY_SENSORS 0x01
+#define BROADCAST_BINARY_DEVICE  0x02
+
+void writeBinaryHeader(char *header, uint8_t flags, size_t size);
+void writeData  (JsonWriter &json, const data_format &data);
+void writeReport(JsonWriter &json, const report_format &report);
+
+// "<reportType>.<reportCode>", the key of the latest read out in the broadcast
+std::string getReportKey(const report_format &report);
+// ALARM_CODES name, ARDUINO_FAIL for an unknown code as the controller is then not to be trusted
+const char *getAlarmName(uint8_t alarm_code);
+
+#endif
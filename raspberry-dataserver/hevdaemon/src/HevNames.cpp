@@ -0,0 +1,180 @@
+#include "HevNames.h"
+#include <string.h>
+#include "common.h"
+
+#define ENUM_NAME(value) { value, #value }
+#define ENUM_NAMES(table) { table, sizeof(table) / sizeof(table[0]) }
+
+const char *EnumNames::getName(uint8_t value) const
+{
+    for (size_t i = 0; i < count; i++) {
+        if (entries[i].value == value)
+            return entries[i].name;
+    }
+    return nullptr;
+}
+
+bool EnumNames::getValue(const char *name, uint8_t &value) const
+{
+    for (size_t i = 0; i < count; i++) {
+        if (strcmp(entries[i].name, name) == 0) {
+            value = entries[i].value;
+            return true;
+        }
+    }
+    return false;
+}
+
+static const EnumName cmd_types[] = {
+    ENUM_NAME(GENERAL),
+    ENUM_NAME(SET_TIMEOUT),
+    ENUM_NAME(SET_MODE),
+    ENUM_NAME(SET_THRESHOLD_MIN),
+    ENUM_NAME(SET_THRESHOLD_MAX),
+    ENUM_NAME(SET_VALVE_RAMP),
+    ENUM_NAME(SET_VALVE_RAMP_PT),
+    ENUM_NAME(SET_VALVE_LATENCY),
+    ENUM_NAME(ACK_ALARM),
+    ENUM_NAME(REQUEST_REPORT)
+};
+
+static const EnumName cmd_generals[] = {
+    ENUM_NAME(START),
+    ENUM_NAME(STOP),
+    ENUM_NAME(PURGE),
+    ENUM_NAME(FLUSH),
+    ENUM_NAME(CALIBRATE)
+};
+
+static const EnumName timeouts[] = {
+    ENUM_NAME(CALIBRATION),
+    ENUM_NAME(BUFF_PURGE),
+    ENUM_NAME(BUFF_FLUSH),
+    ENUM_NAME(BUFF_PREFILL),
+    ENUM_NAME(BUFF_FILL),
+    ENUM_NAME(BUFF_LOADED),
+    ENUM_NAME(BUFF_PRE_INHALE),
+    ENUM_NAME(INHALE),
+    ENUM_NAME(PAUSE),
+    ENUM_NAME(EXHALE_FILL),
+    ENUM_NAME(EXHALE)
+};
+
+static const EnumName modes[] = {
+    ENUM_NAME(HEV_MODE_PS),
+    ENUM_NAME(HEV_MODE_CPAP),
+    ENUM_NAME(HEV_MODE_PRVC),
+    ENUM_NAME(HEV_MODE_TEST)
+};
+
+static const EnumName valve_ramps[] = {
+    ENUM_NAME(INHALE_RISE),
+    ENUM_NAME(INHALE_FALL),
+    ENUM_NAME(EXHALE_RISE),
+    ENUM_NAME(EXHALE_FALL)
+};
+
+static const EnumName valve_latencies[] = {
+    ENUM_NAME(AIR_IN_OPEN),
+    ENUM_NAME(AIR_IN_CLOSE),
+    ENUM_NAME(O2_IN_OPEN),
+    ENUM_NAME(O2_IN_CLOSE),
+    ENUM_NAME(INHALE_OPEN),
+    ENUM_NAME(INHALE_CLOSE),
+    ENUM_NAME(EXHALE_OPEN),
+    ENUM_NAME(EXHALE_CLOSE),
+    ENUM_NAME(PURGE_OPEN),
+    ENUM_NAME(PURGE_CLOSE)
+};
+
+static const EnumName alarm_codes[] = {
+    ENUM_NAME(APNEA),
+    ENUM_NAME(CHECK_VALVE_EXHALE),
+    ENUM_NAME(CHECK_P_PATIENT),
+    ENUM_NAME(EXPIRATION_SENSE_FAULT_OR_LEAK),
+    ENUM_NAME(EXPIRATION_VALVE_Leak),
+    ENUM_NAME(HIGH_FIO2),
+    ENUM_NAME(HIGH_PRESSURE),
+    ENUM_NAME(HIGH_RR),
+    ENUM_NAME(HIGH_VTE),
+    ENUM_NAME(LOW_VTE),
+    ENUM_NAME(HIGH_VTI),
+    ENUM_NAME(LOW_VTI),
+    ENUM_NAME(INTENTIONAL_STOP),
+    ENUM_NAME(LOW_BATTERY),
+    ENUM_NAME(LOW_FIO2),
+    ENUM_NAME(OCCLUSION),
+    ENUM_NAME(HIGH_PEEP),
+    ENUM_NAME(LOW_PEEP),
+    ENUM_NAME(AC_POWER_DISCONNECTION),
+    ENUM_NAME(BATTERY_FAULT_SRVC),
+    ENUM_NAME(BATTERY_CHARGE),
+    ENUM_NAME(AIR_FAIL),
+    ENUM_NAME(O2_FAIL),
+    ENUM_NAME(PRESSURE_SENSOR_FAULT),
+    ENUM_NAME(ARDUINO_FAIL)
+};
+
+static const EnumName report_types[] = {
+    ENUM_NAME(CONFIGURATION),
+    ENUM_NAME(LOOP_TIMING),
+    ENUM_NAME(MEMORY),
+    ENUM_NAME(TIMEOUTS),
+    ENUM_NAME(THRESHOLDS_MIN),
+    ENUM_NAME(THRESHOLDS_MAX),
+    ENUM_NAME(CONTROLLER_STATE),
+    ENUM_NAME(CALIBRATION_OFFSETS),
+    ENUM_NAME(FIRMWARE_VERSION),
+    ENUM_NAME(SETTINGS_REGISTRY)
+};
+
+static const EnumName settings_statuses[] = {
+    ENUM_NAME(SETTINGS_APPLIED),
+    ENUM_NAME(SETTINGS_BUSY),
+    ENUM_NAME(SETTINGS_SEQUENCE),
+    ENUM_NAME(SETTINGS_INVALID)
+};
+
+static const EnumName setting_units[] = {
+    ENUM_NAME(UNIT_NONE),
+    ENUM_NAME(UNIT_MS),
+    ENUM_NAME(UNIT_US),
+    ENUM_NAME(UNIT_ADC)
+};
+
+const EnumNames cmd_type_names        = ENUM_NAMES(cmd_types);
+const EnumNames alarm_code_names      = ENUM_NAMES(alarm_codes);
+const EnumNames report_type_names     = ENUM_NAMES(report_types);
+const EnumNames settings_status_names = ENUM_NAMES(settings_statuses);
+const EnumNames setting_unit_names    = ENUM_NAMES(setting_units);
+const EnumNames timeout_names         = ENUM_NAMES(timeouts);
+
+static const EnumNames cmd_general_names     = ENUM_NAMES(cmd_generals);
+static const EnumNames mode_names            = ENUM_NAMES(modes);
+static const EnumNames valve_ramp_names      = ENUM_NAMES(valve_ramps);
+static const EnumNames valve_latency_names   = ENUM_NAMES(valve_latencies);
+
+const EnumNames *getCmdCodeNames(uint8_t cmd_type)
+{
+    switch (cmd_type) {
+        case CMD_TYPE::GENERAL:
+            return &cmd_general_names;
+        case CMD_TYPE::SET_TIMEOUT:
+            return &timeout_names;
+        case CMD_TYPE::SET_MODE:
+            return &mode_names;
+        case CMD_TYPE::SET_THRESHOLD_MIN:
+        case CMD_TYPE::SET_THRESHOLD_MAX:
+        case CMD_TYPE::ACK_ALARM:
+            return &alarm_code_names;
+        case CMD_TYPE::SET_VALVE_RAMP:
+        case CMD_TYPE::SET_VALVE_RAMP_PT:
+            return &valve_ramp_names;
+        case CMD_TYPE::SET_VALVE_LATENCY:
+            return &valve_latency_names;
+        case CMD_TYPE::REQUEST_REPORT:
+            return &report_type_names;
+        default:
+            return nullptr;
+    }
+}
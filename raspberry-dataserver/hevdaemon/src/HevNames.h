@@ -0,0 +1,34 @@
+#ifndef HEV_NAMES_H
+#define HEV_NAMES_H
+
+// Names of the enums in common.h, as used in the JSON of the sockets
+// (the enums of commsConstants.py)
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct EnumName {
+    uint8_t     value;
+    const char *name;
+};
+
+struct EnumNames {
+    const EnumName *entries;
+    size_t          count;
+
+    // nullptr if the value has no name
+    const char *getName(uint8_t value) const;
+    bool getValue(const char *name, uint8_t &value) const;
+};
+
+extern const EnumNames cmd_type_names;
+extern const EnumNames alarm_code_names;
+extern const EnumNames report_type_names;
+extern const EnumNames settings_status_names;
+extern const EnumNames setting_unit_names;
+extern const EnumNames timeout_names;
+
+// names of the cmd_code of a CMD_TYPE, as CMD_MAP; nullptr for an unknown type
+const EnumNames *getCmdCodeNames(uint8_t cmd_type);
+
+#endif
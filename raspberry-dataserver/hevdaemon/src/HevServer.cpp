@@ -0,0 +1,967 @@
+#include "HevServer.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "HevFormat.h"
+#include "HevNames.h"
+#include "Log.h"
+#include "common.h"
+
+static const char *REPLY_ACK  = "{\"type\": \"ack\"}";
+static const char *REPLY_NACK = "{\"type\": \"nack\"}";
+
+static std::string getPeerName(int fd)
+{
+    sockaddr_in addr;
+    socklen_t size = sizeof(addr);
+    char ip[INET_ADDRSTRLEN] = "?";
+    if (getpeername(fd, reinterpret_cast<sockaddr *>(&addr), &size) == 0)
+        inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    return std::string(ip) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+// integer parameter of a command, null is 0 as in hevserver.py
+static bool getParam(const JsonValue *param, uint32_t &value)
+{
+    if (param == nullptr)
+        return false;
+    if (param->isNull()) {
+        value = 0;
+        return true;
+    }
+    if (!param->isNumber())
+        return false;
+    double number = param->getNumber();
+    if (number < 0 || number > UINT32_MAX || floor(number) != number)
+        return false;
+    value = static_cast<uint32_t>(number);
+    return true;
+}
+
+// CMD_TYPE and cmd_code from their names, as CMD_MAP
+static bool getCmd(const std::string &type_name, const std::string &code_name, uint8_t &cmd_type, uint8_t &cmd_code)
+{
+    if (!cmd_type_names.getValue(type_name.c_str(), cmd_type))
+        return false;
+    const EnumNames *codes = getCmdCodeNames(cmd_type);
+    return codes && codes->getValue(code_name.c_str(), cmd_code);
+}
+
+HevServer::HevServer(EventLoop &loop)
+    : _loop(loop), _broadcaster(loop),
+      _rpc(loop, [this](const rpc_request &request, uint64_t &index) { return submitRpc(request, index); })
+{
+    _request_next = 1;
+
+    // payloads received in one wake up go out in one broadcast per device
+    _loop.setIdleHandler([this]() {
+        for (Device &device : _devices) {
+            if (device.broadcast_pending) {
+                device.broadcast_pending = false;
+                broadcast(device);
+            }
+        }
+    });
+}
+
+HevServer::~HevServer()
+{
+    for (int fd : _listen_fds)
+        close(fd);
+    for (auto &client : _request_clients)
+        close(client.second.fd);
+}
+
+int HevServer::listenSocket(const char *ip, uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1
+            || bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0
+            || ::listen(fd, 16) != 0) {
+        logMessage(LOG_ERROR, "Could not listen on %s:%u: %s", ip, port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    _listen_fds.push_back(fd);
+    return fd;
+}
+
+bool HevServer::listen(const char *ip)
+{
+    int web    = listenSocket(ip, HEV_PORT_BROADCAST_WEB);
+    int request = listenSocket(ip, HEV_PORT_REQUEST);
+    int native = listenSocket(ip, HEV_PORT_BROADCAST_NATIVE);
+    int binary = listenSocket(ip, HEV_PORT_BROADCAST_BINARY);
+    int rpc    = listenSocket(ip, HEV_PORT_RPC);
+    if (web < 0 || request < 0 || native < 0 || binary < 0 || rpc < 0)
+        return false;
+
+    _loop.add(web,     EPOLLIN, [this, web](uint32_t)     { acceptBroadcast(web, BROADCAST_JSON); });
+    _loop.add(request, EPOLLIN, [this, request](uint32_t) { acceptRequest(request); });
+    _loop.add(native,  EPOLLIN, [this, native](uint32_t)  { acceptBroadcast(native, BROADCAST_JSON); });
+    _loop.add(binary,  EPOLLIN, [this, binary](uint32_t)  { acceptBroadcast(binary, BROADCAST_BINARY); });
+    _loop.add(rpc,     EPOLLIN, [this, rpc](uint32_t)     { acceptRpc(rpc); });
+    logMessage(LOG_INFO, "Serving on %s:%d and %s:%d (binary on %d), listening for requests on %s:%d (binary on %d)",
+               ip, HEV_PORT_BROADCAST_WEB, ip, HEV_PORT_BROADCAST_NATIVE, HEV_PORT_BROADCAST_BINARY, ip, HEV_PORT_REQUEST,
+               HEV_PORT_RPC);
+    return true;
+}
+
+bool HevServer::openBoard(const char *name)
+{
+    bool opened = true;
+    for (Device &device : _devices) {
+        device.board.reset(new SharedBoard());
+        if (device.board->open(getDevicePath(name, device, '.').c_str()))
+            device.board->publishAlarms(device.alarms);
+        else
+            opened = false;
+    }
+    return opened;
+}
+
+bool HevServer::openStore(const char *dir)
+{
+    if (_devices.size() > 1 && mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        logMessage(LOG_ERROR, "Could not create store %s: %s", dir, strerror(errno));
+        return false;
+    }
+    for (Device &device : _devices) {
+        device.store.reset(new SeriesStore(_loop));
+        if (!device.store->open(getDevicePath(dir, device, '/').c_str()))
+            return false;
+    }
+    return true;
+}
+
+bool HevServer::attachSerial(const std::string &name, HardwareSerial &serial, CommsControl &comms)
+{
+    if (!serial.isOpen())
+        return false;
+    for (const Device &other : _devices) {
+        if (other.name == name) {
+            logMessage(LOG_ERROR, "Two controllers named %s", name.c_str());
+            return false;
+        }
+    }
+    // port 54324 tells them apart by a byte
+    if (_devices.size() > UINT8_MAX) {
+        logMessage(LOG_ERROR, "At most %d controllers can be served", UINT8_MAX + 1);
+        return false;
+    }
+    _devices.push_back(Device());
+    Device &device = _devices.back();
+    device.name = name;
+    device.index = static_cast<uint8_t>(_devices.size() - 1);
+    device.serial = &serial;
+    device.comms = &comms;
+    device.serial_events = EPOLLIN;
+    device.connected = true;
+    device.sender_timer = 0;
+    device.cmd_sent = 0;
+    device.cmd_acked = 0;
+    device.cmd_acked_count = comms.getAckedCount(PAYLOAD_TYPE::CMD);
+    device.sensors_valid = false;
+    device.broadcast_pending = false;
+    device.settings_txn = 0;
+    device.waveform_txn = 0;
+    memset(device.received, 0, sizeof(device.received));
+    device.mismatched = 0;
+    device.data_us = 0;
+    device.pyramid.reset(new Pyramid());
+
+    comms.beginSerial();
+    Device *attached = &device;
+    return _loop.add(serial.getFd(), device.serial_events, [this, attached](uint32_t events) { onSerial(*attached, events); });
+}
+
+void HevServer::requestConfiguration()
+{
+    for (Device &device : _devices)
+        sendCommand(device, CMD_TYPE::REQUEST_REPORT, REPORT_TYPE::CONFIGURATION, 0);
+}
+
+void HevServer::onSerial(Device &device, uint32_t events)
+{
+    if (events & EPOLLOUT)
+        device.serial->flushBacklog();
+
+    // receiver() stops after each frame, keep going until the read ahead is empty
+    Payload pl;
+    while (device.serial->available() > 0) {
+        device.comms->receiver();
+        while (device.comms->readPayload(pl))
+            handlePayload(device, pl);
+    }
+
+    if (!device.serial->isConnected()) {
+        logMessage(LOG_ERROR, "Serial link to the controller %s lost after %llu DATA payloads", device.name.c_str(),
+                   static_cast<unsigned long long>(device.received[PAYLOAD_TYPE::DATA]));
+        _loop.remove(device.serial->getFd());
+        if (device.sender_timer)
+            _loop.cancelTimer(device.sender_timer);
+        device.sender_timer = 0;
+        device.connected = false;
+        // the other controllers are still served
+        bool connected = false;
+        for (const Device &other : _devices)
+            connected |= other.connected;
+        if (!connected)
+            _loop.stop();
+        return;
+    }
+
+    // an ACK completes the request it was for and frees the queue for the next payload
+    updateAcked(device);
+    pumpSender(device);
+}
+
+void HevServer::handlePayload(Device &device, Payload &pl)
+{
+    logMessage(LOG_DEBUG, "Payload received from %s: type %d", device.name.c_str(), pl.getType());
+    // every format starts with its version, a controller of another one would be misparsed
+    const uint8_t *information = static_cast<const uint8_t *>(pl.getInformation());
+    if (information == nullptr || information[0] != HEV_FORMAT_VERSION) {
+        if (device.mismatched++ == 0)
+            logMessage(LOG_ERROR, "Controller %s sends payload format 0x%02X, this server reads 0x%02X, dropping its payloads",
+                       device.name.c_str(), information ? information[0] : 0, HEV_FORMAT_VERSION);
+        return;
+    }
+    if (pl.getType() < PAYLOAD_TYPE::UNSET)
+        device.received[pl.getType()]++;
+    switch (pl.getType()) {
+        case PAYLOAD_TYPE::ALARM: {
+            // alarm is latched until acknowledged in GUI
+            uint8_t code = pl.getAlarm()->alarm_code;
+            if (alarm_code_names.getName(code) == nullptr) {
+                logMessage(LOG_ERROR, "Unknown alarm code %u, assuming the controller is broken", code);
+                code = ALARM_CODES::ARDUINO_FAIL;
+            }
+            bool latched = false;
+            for (uint8_t alarm : device.alarms)
+                latched |= (alarm == code);
+            if (!latched) {
+                device.alarms.push_back(code);
+                if (device.board)
+                    device.board->publishAlarms(device.alarms);
+            }
+            device.broadcast_pending = true;
+            break;
+        }
+        case PAYLOAD_TYPE::DATA: {
+            device.sensors = *pl.getData();
+            device.sensors_valid = true;
+            device.data_us = EventLoop::getTimeUs();
+            if (device.board)
+                device.board->publishSensors(device.sensors);
+            uint64_t time_us = EventLoop::getWallTimeUs();
+            if (device.store)
+                device.store->append(time_us, device.sensors, device.alarms);
+            device.pyramid->add(time_us, device.sensors);
+            _json.clear();
+            writeData(_json, device.sensors);
+            device.sensors_json = _json.str();
+            device.broadcast_pending = true;
+            break;
+        }
+        case PAYLOAD_TYPE::REPORT: {
+            // keep the latest read out of each report type and code
+            std::string key = getReportKey(*pl.getReport());
+            LatestReport *latest = nullptr;
+            for (auto &report : device.reports) {
+                if (report.key == key)
+                    latest = &report;
+            }
+            if (latest == nullptr) {
+                device.reports.push_back(LatestReport());
+                latest = &device.reports.back();
+                latest->key = key;
+            }
+            latest->report = *pl.getReport();
+            _json.clear();
+            writeReport(_json, latest->report);
+            latest->json = _json.str();
+            device.broadcast_pending = true;
+            break;
+        }
+        case PAYLOAD_TYPE::SETTINGS:
+            replySettings(device, pl);
+            break;
+        case PAYLOAD_TYPE::WAVEFORM:
+            replyWaveform(device, pl);
+            break;
+        default:
+            // commands from the controller are ignored for the minute
+            break;
+    }
+}
+
+uint64_t HevServer::sendPayload(Device &device, Payload &pl)
+{
+    device.outgoing.push_back(pl);
+    pumpSender(device);
+    return device.cmd_sent++;
+}
+
+uint64_t HevServer::sendCommand(Device &device, uint8_t cmd_type, uint8_t cmd_code, uint32_t param)
+{
+    cmd_format cf;
+    cf.cmd_type = cmd_type;
+    cf.cmd_code = cmd_code;
+    cf.param    = param;
+    Payload pl;
+    pl.setCmd(&cf);
+    return sendPayload(device, pl);
+}
+
+// commands, settings and waveforms share the command queue, each is resent until ACKed
+void HevServer::pumpSender(Device &device)
+{
+    if (!device.connected)
+        return;
+    while (!device.outgoing.empty() && !device.comms->isQueueFull(PAYLOAD_TYPE::CMD)) {
+        device.comms->writePayload(device.outgoing.front());
+        device.outgoing.pop_front();
+    }
+    device.comms->sender();
+    updateSerialEvents(device);
+
+    if (device.sender_timer == 0 && (!device.outgoing.empty() || !device.comms->isQueueEmpty(PAYLOAD_TYPE::CMD))) {
+        Device *pumped = &device;
+        device.sender_timer = _loop.addTimer(CONST_TIMEOUT_ALARM, [this, pumped]() {
+            pumped->sender_timer = 0;
+            pumpSender(*pumped);
+        });
+    }
+}
+
+// payloads go out in order and none is dropped, so the n-th sent is ACKed once the count passes n
+void HevServer::updateAcked(Device &device)
+{
+    uint32_t count = device.comms->getAckedCount(PAYLOAD_TYPE::CMD);
+    device.cmd_acked += static_cast<uint32_t>(count - device.cmd_acked_count);
+    device.cmd_acked_count = count;
+    _rpc.setAcked(device.index, device.cmd_acked);
+}
+
+void HevServer::updateSerialEvents(Device &device)
+{
+    uint32_t events = device.serial->getBacklog() ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    if (events != device.serial_events && device.serial->isOpen()) {
+        _loop.modify(device.serial->getFd(), events);
+        device.serial_events = events;
+    }
+}
+
+HevServer::Device *HevServer::getDevice(const JsonValue &request)
+{
+    const JsonValue *name = request.isObject() ? request.get("device") : nullptr;
+    Device *device = nullptr;
+    if (name == nullptr || name->isNull()) {
+        if (!_devices.empty())
+            device = &_devices.front();
+    } else if (name->isString()) {
+        for (Device &named : _devices) {
+            if (named.name == name->getString())
+                device = &named;
+        }
+    }
+    // nothing can be sent to a controller whose link is lost
+    return (device && device->connected) ? device : nullptr;
+}
+
+std::string HevServer::getDevicePath(const std::string &base, const Device &device, char separator) const
+{
+    if (_devices.size() == 1)
+        return base;
+    return base + separator + device.name;
+}
+
+void HevServer::acceptBroadcast(int listen_fd, BROADCAST_ENCODING encoding)
+{
+    int fd;
+    while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        // frames of several controllers go out back to back, none may wait on the ACK of the one before
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        _broadcaster.addClient(fd, encoding, getPeerName(fd));
+    }
+}
+
+// each encoding is serialised once, and only if someone listens to it.
+// a client falling behind drops older frames of the same device only
+void HevServer::broadcast(const Device &device)
+{
+    if (_broadcaster.hasClients(BROADCAST_JSON))
+        _broadcaster.publish(BROADCAST_JSON, getJsonFrame(device), &device);
+    if (_broadcaster.hasClients(BROADCAST_BINARY))
+        _broadcaster.publish(BROADCAST_BINARY, getBinaryFrame(device), &device);
+}
+
+// frames of a single controller are as those of hevserver.py, with several they are tagged with its name
+Broadcaster::Frame HevServer::getJsonFrame(const Device &device)
+{
+    _json.clear();
+    _json.beginObject();
+    if (_devices.size() > 1)
+        _json.key("device").value(device.name);
+    _json.key("sensors");
+    if (device.sensors_valid)
+        _json.raw(device.sensors_json);
+    else
+        _json.null();
+    _json.key("alarms");
+    if (device.alarms.empty()) {
+        _json.null();
+    } else {
+        _json.beginArray();
+        for (uint8_t alarm : device.alarms)
+            _json.value(getAlarmName(alarm));
+        _json.endArray();
+    }
+    // latest read outs requested with REQUEST_REPORT
+    _json.key("reports");
+    if (device.reports.empty()) {
+        _json.null();
+    } else {
+        _json.beginObject();
+        for (auto &report : device.reports)
+            _json.key(report.key).raw(report.json);
+        _json.endObject();
+    }
+    _json.endObject();
+    return std::make_shared<const std::string>(_json.str());
+}
+
+Broadcaster::Frame HevServer::getBinaryFrame(const Device &device)
+{
+    std::string frame;
+    frame.reserve(BROADCAST_BINARY_HEADER + 1 + device.name.size() + sizeof(data_format) + device.alarms.size() + 2
+                  + device.reports.size() * sizeof(report_format));
+    frame.resize(BROADCAST_BINARY_HEADER);
+    uint8_t flags = 0;
+    if (_devices.size() > 1) {
+        flags |= BROADCAST_BINARY_DEVICE;
+        uint8_t size = static_cast<uint8_t>(device.name.size() < UINT8_MAX ? device.name.size() : UINT8_MAX);
+        frame += static_cast<char>(size);
+        frame.append(device.name, 0, size);
+    }
+    if (device.sensors_valid) {
+        flags |= BROADCAST_BINARY_SENSORS;
+        frame.append(reinterpret_cast<const char *>(&device.sensors), sizeof(device.sensors));
+    }
+    uint8_t alarms = static_cast<uint8_t>(device.alarms.size() < UINT8_MAX ? device.alarms.size() : UINT8_MAX);
+    frame += static_cast<char>(alarms);
+    frame.append(reinterpret_cast<const char *>(device.alarms.data()), alarms);
+    uint8_t reports = static_cast<uint8_t>(device.reports.size() < UINT8_MAX ? device.reports.size() : UINT8_MAX);
+    frame += static_cast<char>(reports);
+    for (uint8_t i = 0; i < reports; i++) {
+        const report_format &report = device.reports[i].report;
+        uint8_t size = (report.size < REPORT_DATA_SIZE) ? report.size : REPORT_DATA_SIZE;
+        frame.append(reinterpret_cast<const char *>(&report), offsetof(report_format, data));
+        frame[frame.size() - offsetof(report_format, data) + offsetof(report_format, size)] = static_cast<char>(size);
+        frame.append(reinterpret_cast<const char *>(report.data), size);
+    }
+    writeBinaryHeader(&frame[0], flags, frame.size());
+    return std::make_shared<const std::string>(std::move(frame));
+}
+
+void HevServer::acceptRequest(int listen_fd)
+{
+    int fd;
+    while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        uint64_t id = _request_next++;
+        _request_clients[id] = RequestClient{fd, std::string(), std::string(), false};
+        _loop.add(fd, EPOLLIN, [this, id](uint32_t events) { onRequestClient(id, events); });
+        logMessage(LOG_INFO, "Answering request from %s", getPeerName(fd).c_str());
+    }
+}
+
+// one request per connection, answered once complete
+void HevServer::onRequestClient(uint64_t id, uint32_t events)
+{
+    auto it = _request_clients.find(id);
+    if (it == _request_clients.end())
+        return;
+    RequestClient &client = it->second;
+
+    if (!client.output.empty()) {
+        if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            reply(id, std::string());
+        return;
+    }
+
+    char buffer[4096];
+    ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) || (events & EPOLLERR)) {
+        closeRequestClient(id);
+        return;
+    }
+    if (n < 0 || client.waiting)
+        return;
+
+    client.input.append(buffer, static_cast<size_t>(n));
+    JsonValue request;
+    JSON_PARSE result = JsonValue::parse(client.input.data(), client.input.data() + client.input.size(), request);
+    if (result == JSON_INCOMPLETE && client.input.size() < HEV_REQUEST_SIZE_MAX)
+        return;
+    if (result != JSON_OK) {
+        logMessage(LOG_WARNING, "Invalid packet: not a JSON request");
+        reply(id, REPLY_NACK);
+        return;
+    }
+    handleRequest(id, request);
+}
+
+void HevServer::closeRequestClient(uint64_t id)
+{
+    auto it = _request_clients.find(id);
+    if (it == _request_clients.end())
+        return;
+    _loop.remove(it->second.fd);
+    close(it->second.fd);
+    _request_clients.erase(it);
+}
+
+void HevServer::handleRequest(uint64_t id, const JsonValue &request)
+{
+    const JsonValue *type = request.isObject() ? request.get("type") : nullptr;
+    std::string reqtype = (type && type->isString()) ? type->getString() : std::string();
+    bool valid = false;
+    Device *device = getDevice(request);
+
+    if (reqtype == "devices") {
+        handleDevices(id);
+        return;
+    } else if (device == nullptr) {
+        logMessage(LOG_WARNING, "Invalid packet: %s request for an unknown or lost controller", reqtype.c_str());
+        reply(id, REPLY_NACK);
+        return;
+    }
+
+    if (reqtype == "cmd") {
+        valid = handleCmd(*device, request);
+    } else if (reqtype == "settings") {
+        const JsonValue *settings = request.get("settings");
+        // answered once the controller has replied
+        if (settings && sendSettings(*device, id, *settings))
+            return;
+    } else if (reqtype == "waveform") {
+        const JsonValue *waveform = request.get("waveform");
+        if (waveform && sendWaveform(*device, id, *waveform))
+            return;
+    } else if (reqtype == "alarm") {
+        valid = handleAlarm(*device, request);
+    } else if (reqtype == "history") {
+        if (handleHistory(*device, id, request))
+            return;
+    }
+    // "broadcast" requests are ignored for the minute, and answered with a nack
+
+    if (!valid)
+        logMessage(LOG_WARNING, "Invalid packet: %s request", reqtype.empty() ? "unknown" : reqtype.c_str());
+    reply(id, valid ? REPLY_ACK : REPLY_NACK);
+}
+
+bool HevServer::handleCmd(Device &device, const JsonValue &request)
+{
+    const JsonValue *cmd = request.get("cmd");
+    if (!cmd || !cmd->isString())
+        return false;
+
+    std::string code_name = cmd->getString();
+    std::string type_name;
+    if (code_name == "CMD_START" || code_name == "CMD_STOP") {
+        // temporary, since CMD_START and CMD_STOP are now deprecated
+        logMessage(LOG_WARNING, "CMD_START AND CMD_STOP are deprecated and will be removed in a future release.");
+        type_name = "GENERAL";
+        code_name = code_name.substr(4);
+    } else {
+        const JsonValue *cmdtype = request.get("cmdtype");
+        if (!cmdtype || !cmdtype->isString())
+            return false;
+        type_name = cmdtype->getString();
+    }
+
+    uint8_t cmd_type, cmd_code;
+    uint32_t param;
+    if (!getCmd(type_name, code_name, cmd_type, cmd_code) || !getParam(request.get("param"), param))
+        return false;
+    sendCommand(device, cmd_type, cmd_code, param);
+    return true;
+}
+
+// acknowledgement of alarm from gui
+bool HevServer::handleAlarm(Device &device, const JsonValue &request)
+{
+    const JsonValue *ack = request.get("ack");
+    if (!ack || !ack->isString())
+        return false;
+    uint8_t code;
+    uint64_t index;
+    if (!alarm_code_names.getValue(ack->getString().c_str(), code) || !unlatchAlarm(device, code, index)) {
+        logMessage(LOG_WARNING, "Alarm %s could not be removed. May have been removed already.", ack->getString().c_str());
+        return false;
+    }
+    return true;
+}
+
+// ~points min/max/mean points per channel over a time range, for plots of the history
+bool HevServer::handleHistory(Device &device, uint64_t id, const JsonValue &request)
+{
+    // seconds since the epoch as time.time(), the last minute by default
+    const JsonValue *from = request.get("from");
+    const JsonValue *to = request.get("to");
+    const JsonValue *points = request.get("points");
+    const JsonValue *names = request.get("channels");
+    uint64_t to_us = EventLoop::getWallTimeUs();
+    if (to && !to->isNull()) {
+        if (!to->isNumber() || to->getNumber() <= 0)
+            return false;
+        to_us = static_cast<uint64_t>(to->getNumber() * 1e6);
+    }
+    uint64_t from_us = to_us > 60000000 ? to_us - 60000000 : 0;
+    if (from && !from->isNull()) {
+        if (!from->isNumber() || from->getNumber() < 0)
+            return false;
+        from_us = static_cast<uint64_t>(from->getNumber() * 1e6);
+    }
+    size_t count = HEV_HISTORY_POINTS;
+    if (points && !points->isNull()) {
+        if (!points->isNumber() || points->getNumber() < 1 || points->getNumber() > HEV_HISTORY_POINTS_MAX)
+            return false;
+        count = static_cast<size_t>(points->getNumber());
+    }
+    std::vector<int> channels;
+    if (names && !names->isNull()) {
+        if (!names->isArray())
+            return false;
+        for (const JsonValue &name : names->getArray()) {
+            int channel = name.isString() ? Pyramid::getChannel(name.getString().c_str()) : -1;
+            if (channel < 0)
+                return false;
+            channels.push_back(channel);
+        }
+    } else {
+        for (int channel = 0; channel < HEV_PYRAMID_CHANNELS; channel++)
+            channels.push_back(channel);
+    }
+
+    PyramidPoints result;
+    device.pyramid->query(from_us, to_us, count, channels, result);
+    JsonWriter json;
+    json.beginObject().key("type").value("ack");
+    json.key("step").value(result.step_us / 1e6, 13);
+    json.key("time").beginArray();
+    for (uint64_t time_us : result.time_us)
+        json.value(time_us / 1e6, 13);
+    json.endArray();
+    json.key("count").beginArray();
+    for (uint32_t n : result.count)
+        json.value(n);
+    json.endArray();
+    json.key("channels").beginObject();
+    for (size_t k = 0; k < channels.size(); k++) {
+        json.key(Pyramid::getChannelName(channels[k])).beginObject();
+        json.key("min").beginArray();
+        for (uint16_t value : result.min[k])
+            json.value(static_cast<int>(value));
+        json.endArray().key("max").beginArray();
+        for (uint16_t value : result.max[k])
+            json.value(static_cast<int>(value));
+        json.endArray().key("mean").beginArray();
+        for (double value : result.mean[k])
+            json.value(value, 7);
+        json.endArray().endObject();
+    }
+    json.endObject().endObject();
+    reply(id, json.str());
+    return true;
+}
+
+// the controllers served and their counters
+void HevServer::handleDevices(uint64_t id)
+{
+    static const char *payload_names[PAYLOAD_TYPE::UNSET] = {"DATA", "CMD", "ALARM", "REPORT", "SETTINGS", "WAVEFORM"};
+    uint64_t now_us = EventLoop::getTimeUs();
+    JsonWriter json;
+    json.beginObject().key("type").value("ack").key("devices").beginArray();
+    for (const Device &device : _devices) {
+        json.beginObject();
+        json.key("device").value(device.name);
+        json.key("connected").value(device.connected);
+        json.key("received").beginObject();
+        for (int type = 0; type < PAYLOAD_TYPE::UNSET; type++)
+            json.key(payload_names[type]).value(device.received[type]);
+        json.endObject();
+        // seconds since the last DATA payload
+        json.key("data_age");
+        if (device.data_us)
+            json.value((now_us - device.data_us) / 1e6, 6);
+        else
+            json.null();
+        json.key("cmd_sent").value(device.cmd_sent);
+        json.key("cmd_acked").value(device.cmd_acked);
+        json.key("cmd_queued").value(static_cast<uint64_t>(device.outgoing.size()));
+        json.key("alarms").value(static_cast<uint64_t>(device.alarms.size()));
+        json.endObject();
+    }
+    json.endArray().endObject();
+    reply(id, json.str());
+}
+
+bool HevServer::unlatchAlarm(Device &device, uint8_t code, uint64_t &index)
+{
+    for (auto it = device.alarms.begin(); it != device.alarms.end(); ++it) {
+        if (*it != code)
+            continue;
+        device.alarms.erase(it);
+        if (device.board)
+            device.board->publishAlarms(device.alarms);
+        // unlatch the alarm on the controller too
+        index = sendCommand(device, CMD_TYPE::ACK_ALARM, code, 0);
+        return true;
+    }
+    return false;
+}
+
+void HevServer::acceptRpc(int listen_fd)
+{
+    int fd;
+    while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        _rpc.addClient(fd, getPeerName(fd));
+    }
+}
+
+// the commands of the request socket, by value rather than by name, for the controller of the index
+bool HevServer::submitRpc(const rpc_request &request, uint64_t &index)
+{
+    if (request.device >= _devices.size() || !_devices[request.device].connected)
+        return false;
+    Device &device = _devices[request.device];
+    switch (request.kind) {
+        case RPC_CMD: {
+            const EnumNames *codes = getCmdCodeNames(request.cmd_type);
+            if (cmd_type_names.getName(request.cmd_type) == nullptr || codes == nullptr
+                    || codes->getName(request.cmd_code) == nullptr)
+                return false;
+            index = sendCommand(device, request.cmd_type, request.cmd_code, request.param);
+            return true;
+        }
+        case RPC_ACK_ALARM:
+            if (!unlatchAlarm(device, request.cmd_type, index)) {
+                logMessage(LOG_WARNING, "Alarm %u could not be removed. May have been removed already.", request.cmd_type);
+                return false;
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+// all settings are sent as one transaction, the controller applies them together between two breaths
+bool HevServer::sendSettings(Device &device, uint64_t id, const JsonValue &settings)
+{
+    if (!settings.isArray())
+        return false;
+
+    std::vector<setting_value> values;
+    for (auto &setting : settings.getArray()) {
+        const JsonValue *cmdtype = setting.isObject() ? setting.get("cmdtype") : nullptr;
+        const JsonValue *cmd = setting.isObject() ? setting.get("cmd") : nullptr;
+        if (!cmdtype || !cmd || !cmdtype->isString() || !cmd->isString())
+            return false;
+        if (cmdtype->getString() != "SET_TIMEOUT" && cmdtype->getString() != "SET_THRESHOLD_MIN"
+                && cmdtype->getString() != "SET_THRESHOLD_MAX") {
+            logMessage(LOG_WARNING, "%s can not be set in a settings transaction", cmdtype->getString().c_str());
+            return false;
+        }
+        setting_value value;
+        if (!getCmd(cmdtype->getString(), cmd->getString(), value.cmd_type, value.cmd_code)
+                || !getParam(setting.get("param"), value.param))
+            return false;
+        values.push_back(value);
+    }
+    if (values.size() > UINT8_MAX * SETTINGS_FRAME_VALUES)
+        return false;
+
+    uint8_t txn = ++device.settings_txn;
+    uint8_t chunks = static_cast<uint8_t>((values.size() + SETTINGS_FRAME_VALUES - 1) / SETTINGS_FRAME_VALUES);
+    if (chunks == 0)
+        chunks = 1;
+    for (uint8_t chunk = 0; chunk < chunks; chunk++) {
+        settings_format sf;
+        sf.txn    = txn;
+        sf.chunk  = chunk;
+        sf.chunks = chunks;
+        for (size_t i = chunk * SETTINGS_FRAME_VALUES; i < values.size() && sf.count < SETTINGS_FRAME_VALUES; i++)
+            sf.values[sf.count++] = values[i];
+        Payload pl;
+        pl.setSettings(&sf);
+        sendPayload(device, pl);
+    }
+    waitReply(device.settings_pending, txn, id, "Settings transaction");
+    return true;
+}
+
+// the inhale valve opening over time, swapped in by the controller between two breaths
+bool HevServer::sendWaveform(Device &device, uint64_t id, const JsonValue &waveform)
+{
+    if (!waveform.isArray())
+        return false;
+    if (waveform.getArray().size() > HEV_WAVEFORM_POINTS) {
+        logMessage(LOG_WARNING, "Waveform of %zu points, at most %d fit", waveform.getArray().size(), HEV_WAVEFORM_POINTS);
+        return false;
+    }
+
+    std::vector<waveform_point> points;
+    for (auto &entry : waveform.getArray()) {
+        uint32_t time, value;
+        if (!entry.isObject() || !getParam(entry.get("time"), time) || !getParam(entry.get("value"), value)
+                || time > UINT16_MAX || value > UINT16_MAX)
+            return false;
+        waveform_point point;
+        point.time  = static_cast<uint16_t>(time);
+        point.value = static_cast<uint16_t>(value);
+        points.push_back(point);
+    }
+
+    uint8_t txn = ++device.waveform_txn;
+    uint8_t chunks = static_cast<uint8_t>((points.size() + WAVEFORM_FRAME_POINTS - 1) / WAVEFORM_FRAME_POINTS);
+    if (chunks == 0)
+        chunks = 1;
+    for (uint8_t chunk = 0; chunk < chunks; chunk++) {
+        waveform_format wf;
+        wf.txn    = txn;
+        wf.chunk  = chunk;
+        wf.chunks = chunks;
+        for (size_t i = chunk * WAVEFORM_FRAME_POINTS; i < points.size() && wf.count < WAVEFORM_FRAME_POINTS; i++)
+            wf.points[wf.count++] = points[i];
+        Payload pl;
+        pl.setWaveform(&wf);
+        sendPayload(device, pl);
+    }
+    waitReply(device.waveform_pending, txn, id, "Waveform upload");
+    return true;
+}
+
+// single reply from the controller once applied, or on rejection
+void HevServer::waitReply(std::map<uint8_t, PendingReply> &pending, uint8_t txn, uint64_t id, const char *name)
+{
+    // the txn has wrapped around onto a request still waiting
+    auto old = pending.find(txn);
+    if (old != pending.end()) {
+        _loop.cancelTimer(old->second.timer);
+        reply(old->second.client, REPLY_NACK);
+        pending.erase(old);
+    }
+
+    // the client is only read again once it has its reply
+    auto client = _request_clients.find(id);
+    if (client != _request_clients.end())
+        client->second.waiting = true;
+    uint64_t timer = _loop.addTimer(HEV_REPLY_TIMEOUT, [this, &pending, txn, id, name]() {
+        auto it = pending.find(txn);
+        if (it == pending.end() || it->second.client != id)
+            return;
+        pending.erase(it);
+        logMessage(LOG_WARNING, "%s %u not applied within %d s", name, txn, HEV_REPLY_TIMEOUT / 1000);
+        reply(id, REPLY_NACK);
+    });
+    pending[txn] = PendingReply{id, timer};
+}
+
+void HevServer::replySettings(Device &device, Payload &pl)
+{
+    settings_format *sf = pl.getSettings();
+    auto it = device.settings_pending.find(sf->txn);
+    if (it == device.settings_pending.end()) {
+        logMessage(LOG_DEBUG, "Reply to settings transaction %u nobody is waiting for", sf->txn);
+        return;
+    }
+    PendingReply pending = it->second;
+    device.settings_pending.erase(it);
+    _loop.cancelTimer(pending.timer);
+
+    if (sf->status != SETTINGS_STATUS::SETTINGS_APPLIED) {
+        const char *status = settings_status_names.getName(sf->status);
+        logMessage(LOG_WARNING, "Settings transaction %u rejected: %s", sf->txn, status ? status : "unknown status");
+        reply(pending.client, REPLY_NACK);
+        return;
+    }
+
+    // refresh the read backs of what changed
+    sendCommand(device, CMD_TYPE::REQUEST_REPORT, REPORT_TYPE::TIMEOUTS, 0);
+    sendCommand(device, CMD_TYPE::REQUEST_REPORT, REPORT_TYPE::THRESHOLDS_MIN, 0);
+    sendCommand(device, CMD_TYPE::REQUEST_REPORT, REPORT_TYPE::THRESHOLDS_MAX, 0);
+    sendCommand(device, CMD_TYPE::REQUEST_REPORT, REPORT_TYPE::CONTROLLER_STATE, 0);
+
+    JsonWriter json;
+    json.beginObject().key("type").value("ack").key("epoch").value(sf->epoch).endObject();
+    reply(pending.client, json.str());
+}
+
+void HevServer::replyWaveform(Device &device, Payload &pl)
+{
+    waveform_format *wf = pl.getWaveform();
+    auto it = device.waveform_pending.find(wf->txn);
+    if (it == device.waveform_pending.end()) {
+        logMessage(LOG_DEBUG, "Reply to waveform upload %u nobody is waiting for", wf->txn);
+        return;
+    }
+    PendingReply pending = it->second;
+    device.waveform_pending.erase(it);
+    _loop.cancelTimer(pending.timer);
+
+    if (wf->status != SETTINGS_STATUS::SETTINGS_APPLIED) {
+        const char *status = settings_status_names.getName(wf->status);
+        logMessage(LOG_WARNING, "Waveform upload %u rejected: %s", wf->txn, status ? status : "unknown status");
+        reply(pending.client, REPLY_NACK);
+        return;
+    }
+    reply(pending.client, REPLY_ACK);
+}
+
+// send the reply and close the connection, the client may already have gone;
+// a reply larger than the socket takes is finished as it drains
+void HevServer::reply(uint64_t id, const std::string &json)
+{
+    auto it = _request_clients.find(id);
+    if (it == _request_clients.end())
+        return;
+    RequestClient &client = it->second;
+    bool started = !client.output.empty();
+    client.output += json;
+    while (!client.output.empty()) {
+        ssize_t sent = send(client.fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!started)
+                _loop.modify(client.fd, EPOLLOUT);
+            return;
+        }
+        if (sent <= 0)
+            break;
+        client.output.erase(0, static_cast<size_t>(sent));
+    }
+    closeRequestClient(id);
+}
@@ -0,0 +1,176 @@
+#ifndef HEV_SERVER_H
+#define HEV_SERVER_H
+
+// Data server between the UIs and the controller, the sockets of hevserver.py:
+// broadcasts on 54320 (WebUI) and 54322 (NativeUI), requests on 54321,
+// plus the same broadcasts in a compact binary encoding on 54323, pipelined binary
+// requests answered on the controller's ACK on 54324
+// and the latest values on a shared memory board for the UIs on the same host,
+// every sample kept in a time series store and in a downsampling pyramid for plots of the history.
+// Everything runs on one event loop, the serial link is read as soon as bytes arrive.
+// Several controllers can be served side by side, each under its own name: their broadcasts are
+// merged into one stream tagged with the name, requests name the one they are for, and each
+// has a board, a store and a history of its own
+
+#include <stdint.h>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Broadcaster.h"
+#include "CommsControl.h"
+#include "EventLoop.h"
+#include "Json.h"
+#include "Pyramid.h"
+#include "RpcServer.h"
+#include "SeriesStore.h"
+#include "SharedBoard.h"
+
+#define HEV_PORT_BROADCAST_WEB    54320
+#define HEV_PORT_REQUEST          54321
+#define HEV_PORT_BROADCAST_NATIVE 54322
+#define HEV_PORT_BROADCAST_BINARY 54323
+#define HEV_PORT_RPC              54324
+
+// a transaction is applied at the next breath boundary, allow for a slow breath
+#define HEV_REPLY_TIMEOUT 15000 // ms
+// size of the inhale waveform table on the controller
+#define HEV_WAVEFORM_POINTS 32
+// largest request accepted on the request socket
+#define HEV_REQUEST_SIZE_MAX 65536
+// points of a history request, by default and at most
+#define HEV_HISTORY_POINTS     500
+#define HEV_HISTORY_POINTS_MAX 10000
+
+class HevServer
+{
+public:
+    explicit HevServer(EventLoop &loop);
+    ~HevServer();
+
+    bool listen(const char *ip);
+    // shared memory board of the latest values of each controller attached, see HevBoard.h;
+    // with several, that of a controller is named NAME.DEVICE
+    bool openBoard(const char *name);
+    // time series store of every sample received from each controller attached, see HevSeries.h;
+    // with several, that of a controller is the subdirectory DIR/DEVICE
+    bool openStore(const char *dir);
+    // a controller on an open (and begun, but for Serial) serial link, comms on top of it;
+    // its index in the order attached selects it on port 54324
+    bool attachSerial(const std::string &name, HardwareSerial &serial, CommsControl &comms);
+    // read back the settings in use on the controllers rather than assuming them
+    void requestConfiguration();
+
+private:
+    struct RequestClient {
+        int         fd;
+        std::string input;
+        std::string output;    // rest of a reply larger than the socket took at once
+        bool        waiting;   // for the controller's reply to a settings transaction or waveform upload
+    };
+
+    struct PendingReply {
+        uint64_t client;
+        uint64_t timer;
+    };
+
+    // latest read out of a report type and code
+    struct LatestReport {
+        std::string   key;
+        report_format report;
+        std::string   json;
+    };
+
+    // a controller, its link and what was received from it
+    struct Device {
+        std::string     name;
+        uint8_t         index;      // in the order attached
+        HardwareSerial *serial;
+        CommsControl   *comms;
+        uint32_t        serial_events;
+        bool            connected;
+
+        // payloads waiting for room in the comms queue, it drops the oldest when full
+        std::deque<Payload> outgoing;
+        uint64_t            sender_timer;
+        uint64_t            cmd_sent;          // payloads given to sendPayload
+        uint64_t            cmd_acked;         // of those, ACKed by the controller
+        uint32_t            cmd_acked_count;   // last getAckedCount, which wraps around
+
+        // latest values, sensors and reports also pre-serialised to JSON
+        data_format sensors;
+        bool        sensors_valid;
+        std::string sensors_json;
+        std::vector<uint8_t>      alarms;   // ALARM_CODES latched until acknowledged
+        std::vector<LatestReport> reports;  // in the order first received
+        bool        broadcast_pending;
+
+        uint8_t settings_txn;  // id of the last settings transaction sent
+        uint8_t waveform_txn;  // id of the last waveform upload sent
+        std::map<uint8_t, PendingReply> settings_pending;
+        std::map<uint8_t, PendingReply> waveform_pending;
+
+        uint64_t received[PAYLOAD_TYPE::UNSET];   // payloads by type
+        uint64_t mismatched;                      // payloads of another HEV_FORMAT_VERSION, dropped
+        uint64_t data_us;                         // when the last DATA came, 0 before
+
+        // the board and the store once opened, the history from the start
+        std::unique_ptr<SharedBoard> board;
+        std::unique_ptr<SeriesStore> store;
+        std::unique_ptr<Pyramid>     pyramid;
+    };
+
+    int  listenSocket(const char *ip, uint16_t port);
+    void onSerial(Device &device, uint32_t events);
+    void handlePayload(Device &device, Payload &pl);
+    // the number of command queue payloads sent to the device before this one
+    uint64_t sendPayload(Device &device, Payload &pl);
+    uint64_t sendCommand(Device &device, uint8_t cmd_type, uint8_t cmd_code, uint32_t param);
+    void pumpSender(Device &device);
+    void updateAcked(Device &device);
+    void updateSerialEvents(Device &device);
+    // the device a request names, the first one if it names none
+    Device *getDevice(const JsonValue &request);
+    // base itself with a single device, else base, separator and the device name
+    std::string getDevicePath(const std::string &base, const Device &device, char separator) const;
+
+    void acceptBroadcast(int listen_fd, BROADCAST_ENCODING encoding);
+    void broadcast(const Device &device);
+    Broadcaster::Frame getJsonFrame(const Device &device);
+    Broadcaster::Frame getBinaryFrame(const Device &device);
+
+    void acceptRequest(int listen_fd);
+    void onRequestClient(uint64_t id, uint32_t events);
+    void closeRequestClient(uint64_t id);
+    void handleRequest(uint64_t id, const JsonValue &request);
+    bool handleCmd(Device &device, const JsonValue &request);
+    bool handleAlarm(Device &device, const JsonValue &request);
+    bool handleHistory(Device &device, uint64_t id, const JsonValue &request);
+    void handleDevices(uint64_t id);
+    bool unlatchAlarm(Device &device, uint8_t code, uint64_t &index);
+    void acceptRpc(int listen_fd);
+    bool submitRpc(const rpc_request &request, uint64_t &index);
+    bool sendSettings(Device &device, uint64_t id, const JsonValue &settings);
+    bool sendWaveform(Device &device, uint64_t id, const JsonValue &waveform);
+    void replySettings(Device &device, Payload &pl);
+    void replyWaveform(Device &device, Payload &pl);
+    void reply(uint64_t id, const std::string &json);
+    void waitReply(std::map<uint8_t, PendingReply> &pending, uint8_t txn, uint64_t id, const char *name);
+
+    EventLoop &_loop;
+
+    std::vector<int>   _listen_fds;
+    // a deque so that a device stays in place as others are attached
+    std::deque<Device> _devices;
+    JsonWriter         _json;
+
+    Broadcaster _broadcaster;
+    RpcServer   _rpc;
+    std::map<uint64_t, RequestClient>  _request_clients;
+    uint64_t                           _request_next;
+};
+
+#endif
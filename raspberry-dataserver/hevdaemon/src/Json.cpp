@@ -0,0 +1,371 @@
+#include "Json.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+void JsonWriter::separate()
+{
+    if (_after_key) {
+        _after_key = false;
+        return;
+    }
+    if (!_first.empty()) {
+        if (!_first.back())
+            _out += ", ";
+        _first.back() = false;
+    }
+}
+
+void JsonWriter::quote(const char *text)
+{
+    _out += '"';
+    for (const char *c = text; *c; c++) {
+        switch (*c) {
+            case '"':  _out += "\\\""; break;
+            case '\\': _out += "\\\\"; break;
+            case '\n': _out += "\\n";  break;
+            case '\r': _out += "\\r";  break;
+            case '\t': _out += "\\t";  break;
+            default:
+                if (static_cast<uint8_t>(*c) < 0x20) {
+                    char escaped[8];
+                    snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<uint8_t>(*c));
+                    _out += escaped;
+                } else {
+                    _out += *c;
+                }
+        }
+    }
+    _out += '"';
+}
+
+JsonWriter &JsonWriter::beginObject()
+{
+    separate();
+    _out += '{';
+    _first.push_back(true);
+    return *this;
+}
+
+JsonWriter &JsonWriter::endObject()
+{
+    _out += '}';
+    _first.pop_back();
+    return *this;
+}
+
+JsonWriter &JsonWriter::beginArray()
+{
+    separate();
+    _out += '[';
+    _first.push_back(true);
+    return *this;
+}
+
+JsonWriter &JsonWriter::endArray()
+{
+    _out += ']';
+    _first.pop_back();
+    return *this;
+}
+
+JsonWriter &JsonWriter::key(const char *name)
+{
+    separate();
+    quote(name);
+    _out += ": ";
+    _after_key = true;
+    return *this;
+}
+
+// integers are most of a broadcast, formatted without going through printf
+void JsonWriter::appendUnsigned(uint64_t number)
+{
+    char text[24];
+    char *end = text + sizeof(text);
+    char *begin = end;
+    do {
+        *--begin = static_cast<char>('0' + number % 10);
+        number /= 10;
+    } while (number > 0);
+    _out.append(begin, end);
+}
+
+JsonWriter &JsonWriter::value(int64_t number)
+{
+    separate();
+    if (number < 0) {
+        _out += '-';
+        appendUnsigned(static_cast<uint64_t>(0) - static_cast<uint64_t>(number));
+    } else {
+        appendUnsigned(static_cast<uint64_t>(number));
+    }
+    return *this;
+}
+
+JsonWriter &JsonWriter::value(uint64_t number)
+{
+    separate();
+    appendUnsigned(number);
+    return *this;
+}
+
+JsonWriter &JsonWriter::value(double number)
+{
+    return value(number, 17);
+}
+
+JsonWriter &JsonWriter::value(double number, int digits)
+{
+    separate();
+    if (!isfinite(number)) {
+        _out += "null";
+        return *this;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), "%.*g", digits, number);
+    _out += text;
+    return *this;
+}
+
+JsonWriter &JsonWriter::value(bool flag)
+{
+    separate();
+    _out += flag ? "true" : "false";
+    return *this;
+}
+
+JsonWriter &JsonWriter::value(const char *text)
+{
+    separate();
+    quote(text);
+    return *this;
+}
+
+JsonWriter &JsonWriter::null()
+{
+    separate();
+    _out += "null";
+    return *this;
+}
+
+JsonWriter &JsonWriter::raw(const std::string &json)
+{
+    separate();
+    _out += json;
+    return *this;
+}
+
+const JsonValue *JsonValue::get(const char *name) const
+{
+    for (auto &member : _object) {
+        if (member.first == name)
+            return &member.second;
+    }
+    return nullptr;
+}
+
+// recursive descent over [_pos, _end), running out of input is JSON_INCOMPLETE
+class JsonParser
+{
+public:
+    JsonParser(const char *begin, const char *end) : _pos(begin), _end(end) {}
+
+    JSON_PARSE parseValue(JsonValue &value, uint8_t depth)
+    {
+        if (depth > 32)
+            return JSON_ERROR;
+        skipSpace();
+        if (_pos == _end)
+            return JSON_INCOMPLETE;
+        switch (*_pos) {
+            case '{': return parseObject(value, depth);
+            case '[': return parseArray(value, depth);
+            case '"':
+                value._type = JsonValue::STRING;
+                return parseString(value._string);
+            case 't':
+                value._type = JsonValue::BOOLEAN;
+                value._boolean = true;
+                return parseLiteral("true");
+            case 'f':
+                value._type = JsonValue::BOOLEAN;
+                value._boolean = false;
+                return parseLiteral("false");
+            case 'n':
+                value._type = JsonValue::NUL;
+                return parseLiteral("null");
+            default:
+                return parseNumber(value);
+        }
+    }
+
+    const char *getPos() { return _pos; }
+
+private:
+    void skipSpace()
+    {
+        while (_pos < _end && (*_pos == ' ' || *_pos == '\t' || *_pos == '\n' || *_pos == '\r'))
+            _pos++;
+    }
+
+    JSON_PARSE parseLiteral(const char *literal)
+    {
+        for (const char *c = literal; *c; c++, _pos++) {
+            if (_pos == _end)
+                return JSON_INCOMPLETE;
+            if (*_pos != *c)
+                return JSON_ERROR;
+        }
+        return JSON_OK;
+    }
+
+    JSON_PARSE parseNumber(JsonValue &value)
+    {
+        const char *start = _pos;
+        while (_pos < _end && (isdigit(static_cast<uint8_t>(*_pos)) || *_pos == '-' || *_pos == '+'
+                               || *_pos == '.' || *_pos == 'e' || *_pos == 'E'))
+            _pos++;
+        // a number at the end of the input may continue in the next read
+        if (_pos == _end)
+            return JSON_INCOMPLETE;
+        std::string text(start, _pos);
+        char *stop = nullptr;
+        value._number = strtod(text.c_str(), &stop);
+        value._type = JsonValue::NUMBER;
+        return (!text.empty() && stop == text.c_str() + text.size()) ? JSON_OK : JSON_ERROR;
+    }
+
+    static void appendUtf8(std::string &out, uint32_t code)
+    {
+        if (code < 0x80) {
+            out += static_cast<char>(code);
+        } else if (code < 0x800) {
+            out += static_cast<char>(0xC0 | (code >> 6));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        } else {
+            out += static_cast<char>(0xE0 | (code >> 12));
+            out += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (code & 0x3F));
+        }
+    }
+
+    JSON_PARSE parseString(std::string &out)
+    {
+        _pos++;
+        while (_pos < _end) {
+            char c = *_pos++;
+            if (c == '"')
+                return JSON_OK;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (_pos == _end)
+                return JSON_INCOMPLETE;
+            c = *_pos++;
+            switch (c) {
+                case 'n': out += '\n'; break;
+                case 'r': out += '\r'; break;
+                case 't': out += '\t'; break;
+                case 'b': out += '\b'; break;
+                case 'f': out += '\f'; break;
+                case 'u': {
+                    if (_end - _pos < 4)
+                        return JSON_INCOMPLETE;
+                    char hex[5] = {_pos[0], _pos[1], _pos[2], _pos[3], 0};
+                    char *stop = nullptr;
+                    uint32_t code = static_cast<uint32_t>(strtoul(hex, &stop, 16));
+                    if (stop != hex + 4)
+                        return JSON_ERROR;
+                    appendUtf8(out, code);
+                    _pos += 4;
+                    break;
+                }
+                default:
+                    out += c;
+            }
+        }
+        return JSON_INCOMPLETE;
+    }
+
+    JSON_PARSE parseArray(JsonValue &value, uint8_t depth)
+    {
+        value._type = JsonValue::ARRAY;
+        _pos++;
+        skipSpace();
+        if (_pos == _end)
+            return JSON_INCOMPLETE;
+        if (*_pos == ']') {
+            _pos++;
+            return JSON_OK;
+        }
+        while (true) {
+            value._array.emplace_back();
+            JSON_PARSE result = parseValue(value._array.back(), depth + 1);
+            if (result != JSON_OK)
+                return result;
+            skipSpace();
+            if (_pos == _end)
+                return JSON_INCOMPLETE;
+            char c = *_pos++;
+            if (c == ']')
+                return JSON_OK;
+            if (c != ',')
+                return JSON_ERROR;
+        }
+    }
+
+    JSON_PARSE parseObject(JsonValue &value, uint8_t depth)
+    {
+        value._type = JsonValue::OBJECT;
+        _pos++;
+        skipSpace();
+        if (_pos == _end)
+            return JSON_INCOMPLETE;
+        if (*_pos == '}') {
+            _pos++;
+            return JSON_OK;
+        }
+        while (true) {
+            skipSpace();
+            if (_pos == _end)
+                return JSON_INCOMPLETE;
+            if (*_pos != '"')
+                return JSON_ERROR;
+            value._object.emplace_back();
+            JSON_PARSE result = parseString(value._object.back().first);
+            if (result != JSON_OK)
+                return result;
+            skipSpace();
+            if (_pos == _end)
+                return JSON_INCOMPLETE;
+            if (*_pos++ != ':')
+                return JSON_ERROR;
+            result = parseValue(value._object.back().second, depth + 1);
+            if (result != JSON_OK)
+                return result;
+            skipSpace();
+            if (_pos == _end)
+                return JSON_INCOMPLETE;
+            char c = *_pos++;
+            if (c == '}')
+                return JSON_OK;
+            if (c != ',')
+                return JSON_ERROR;
+        }
+    }
+
+    const char *_pos;
+    const char *_end;
+};
+
+JSON_PARSE JsonValue::parse(const char *begin, const char *end, JsonValue &value, size_t *used)
+{
+    value = JsonValue();
+    JsonParser parser(begin, end);
+    JSON_PARSE result = parser.parseValue(value, 0);
+    if (used)
+        *used = static_cast<size_t>(parser.getPos() - begin);
+    return result;
+}
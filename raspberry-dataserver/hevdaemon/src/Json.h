@@ -0,0 +1,97 @@
+#ifndef JSON_H
+#define JSON_H
+
+// The JSON used on the sockets: a writer formatting like python's json.dumps,
+// and a parser for the small requests sent by the UIs
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+class JsonWriter
+{
+public:
+    JsonWriter() { _out.reserve(1024); }
+
+    JsonWriter &beginObject();
+    JsonWriter &endObject();
+    JsonWriter &beginArray();
+    JsonWriter &endArray();
+    JsonWriter &key(const char *name);
+    JsonWriter &key(const std::string &name) { return key(name.c_str()); }
+    JsonWriter &value(int64_t number);
+    JsonWriter &value(uint64_t number);
+    JsonWriter &value(int number) { return value(static_cast<int64_t>(number)); }
+    JsonWriter &value(uint32_t number) { return value(static_cast<uint64_t>(number)); }
+    JsonWriter &value(double number);
+    // to the significant digits given rather than all of them
+    JsonWriter &value(double number, int digits);
+    JsonWriter &value(bool flag);
+    JsonWriter &value(const char *text);
+    JsonWriter &value(const std::string &text) { return value(text.c_str()); }
+    JsonWriter &null();
+    // an already serialised value
+    JsonWriter &raw(const std::string &json);
+
+    const std::string &str() const { return _out; }
+    void clear() { _out.clear(); _first.clear(); _after_key = false; }
+
+private:
+    void separate();
+    void quote(const char *text);
+    void appendUnsigned(uint64_t number);
+
+    std::string _out;
+    std::vector<bool> _first;   // per open container, nothing written into it yet
+    bool _after_key = false;
+};
+
+enum JSON_PARSE : uint8_t {
+    JSON_OK,
+    JSON_INCOMPLETE,   // valid so far, more input needed
+    JSON_ERROR
+};
+
+class JsonValue
+{
+public:
+    enum TYPE : uint8_t {
+        NUL,
+        BOOLEAN,
+        NUMBER,
+        STRING,
+        ARRAY,
+        OBJECT
+    };
+
+    // parses one value from the start of the input, used is set to the bytes consumed
+    static JSON_PARSE parse(const char *begin, const char *end, JsonValue &value, size_t *used = nullptr);
+
+    TYPE getType() const { return _type; }
+    bool isNull() const { return _type == NUL; }
+    bool isNumber() const { return _type == NUMBER; }
+    bool isString() const { return _type == STRING; }
+    bool isArray() const { return _type == ARRAY; }
+    bool isObject() const { return _type == OBJECT; }
+
+    bool getBool() const { return _boolean; }
+    double getNumber() const { return _number; }
+    int64_t getInt() const { return static_cast<int64_t>(_number); }
+    const std::string &getString() const { return _string; }
+    const std::vector<JsonValue> &getArray() const { return _array; }
+    // member of an object, nullptr if missing
+    const JsonValue *get(const char *name) const;
+
+private:
+    friend class JsonParser;
+
+    TYPE _type = NUL;
+    bool _boolean = false;
+    double _number = 0;
+    std::string _string;
+    std::vector<JsonValue> _array;
+    std::vector<std::pair<std::string, JsonValue>> _object;
+};
+
+#endif
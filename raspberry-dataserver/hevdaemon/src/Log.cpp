@@ -0,0 +1,35 @@
+#include "Log.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <time.h>
+
+static LOG_LEVEL log_level = LOG_INFO;
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+
+void setLogLevel(LOG_LEVEL level)
+{
+    log_level = level;
+}
+
+void logMessage(LOG_LEVEL level, const char *format, ...)
+{
+    if (level < log_level)
+        return;
+
+    timeval tv;
+    gettimeofday(&tv, nullptr);
+    tm local;
+    localtime_r(&tv.tv_sec, &local);
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+
+    char message[512];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+
+    fprintf(stderr, "%s,%03ld - %s - %s\n", stamp, static_cast<long>(tv.tv_usec / 1000), level_names[level], message);
+}
@@ -0,0 +1,17 @@
+#ifndef LOG_H
+#define LOG_H
+
+// stderr logging in the format of the python server:
+// 2020-04-20 12:00:00,000 - INFO - message
+
+enum LOG_LEVEL {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR
+};
+
+void setLogLevel(LOG_LEVEL level);
+void logMessage(LOG_LEVEL level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif
@@ -0,0 +1,171 @@
+#include "Pyramid.h"
+#include <string.h>
+#include <algorithm>
+
+static const uint64_t level_widths_us[HEV_PYRAMID_LEVELS] = {1000, 10000, 100000, 1000000, 10000000};
+
+// min and max are kept in 16 bits, every field here is at most that
+static const HevSeriesField channel_fields[] = {
+    HEV_SERIES_FIELD(fsm_state),
+    HEV_SERIES_FIELD(breath_timing_error),
+    HEV_SERIES_FIELD(pressure_air_supply),
+    HEV_SERIES_FIELD(pressure_air_regulated),
+    HEV_SERIES_FIELD(pressure_o2_supply),
+    HEV_SERIES_FIELD(pressure_o2_regulated),
+    HEV_SERIES_FIELD(pressure_buffer),
+    HEV_SERIES_FIELD(pressure_inhale),
+    HEV_SERIES_FIELD(pressure_patient),
+    HEV_SERIES_FIELD(temperature_buffer),
+    HEV_SERIES_FIELD(pressure_diff_patient),
+    HEV_SERIES_FIELD(readback_valve_air_in),
+    HEV_SERIES_FIELD(readback_valve_o2_in),
+    HEV_SERIES_FIELD(readback_valve_inhale),
+    HEV_SERIES_FIELD(readback_valve_exhale),
+    HEV_SERIES_FIELD(readback_valve_purge),
+    HEV_SERIES_FIELD(readback_mode)
+};
+
+static_assert(sizeof(channel_fields) / sizeof(channel_fields[0]) == HEV_PYRAMID_CHANNELS, "HEV_PYRAMID_CHANNELS");
+
+Pyramid::Pyramid()
+{
+    for (Level &level : _levels) {
+        level.buckets.resize(HEV_PYRAMID_BUCKETS);
+        level.first = 0;
+        level.size = 0;
+        level.wrapped = false;
+    }
+}
+
+int Pyramid::getChannel(const char *name)
+{
+    for (int c = 0; c < HEV_PYRAMID_CHANNELS; c++)
+        if (strcmp(channel_fields[c].name, name) == 0)
+            return c;
+    return -1;
+}
+
+const char *Pyramid::getChannelName(int channel)
+{
+    return (channel >= 0 && channel < HEV_PYRAMID_CHANNELS) ? channel_fields[channel].name : nullptr;
+}
+
+uint64_t Pyramid::getWidthUs(int level)
+{
+    return level_widths_us[level];
+}
+
+void Pyramid::add(uint64_t time_us, const data_format &data)
+{
+    uint16_t values[HEV_PYRAMID_CHANNELS];
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&data);
+    for (int c = 0; c < HEV_PYRAMID_CHANNELS; c++) {
+        const HevSeriesField &field = channel_fields[c];
+        values[c] = (field.size == 1) ? bytes[field.offset] : static_cast<uint16_t>(bytes[field.offset] | bytes[field.offset + 1] << 8);
+    }
+
+    for (int l = 0; l < HEV_PYRAMID_LEVELS; l++) {
+        Level &level = _levels[l];
+        uint64_t start_us = time_us - time_us % level_widths_us[l];
+        if (level.size > 0 && start_us <= level.at(level.size - 1).start_us) {
+            Bucket &bucket = level.at(level.size - 1);
+            bucket.count++;
+            for (int c = 0; c < HEV_PYRAMID_CHANNELS; c++) {
+                bucket.min[c] = std::min(bucket.min[c], values[c]);
+                bucket.max[c] = std::max(bucket.max[c], values[c]);
+                bucket.sum[c] += values[c];
+            }
+            continue;
+        }
+        if (level.size == HEV_PYRAMID_BUCKETS) {
+            level.first = (level.first + 1) % HEV_PYRAMID_BUCKETS;
+            level.size--;
+            level.wrapped = true;
+        }
+        Bucket &bucket = level.at(level.size++);
+        bucket.start_us = start_us;
+        bucket.count = 1;
+        for (int c = 0; c < HEV_PYRAMID_CHANNELS; c++) {
+            bucket.min[c] = bucket.max[c] = values[c];
+            bucket.sum[c] = values[c];
+        }
+    }
+}
+
+bool Pyramid::covers(int level, uint64_t time_us) const
+{
+    const Level &l = _levels[level];
+    return l.size > 0 && (!l.wrapped || l.at(0).start_us <= time_us);
+}
+
+size_t Pyramid::query(uint64_t from_us, uint64_t to_us, size_t points, const std::vector<int> &channels, PyramidPoints &out) const
+{
+    out.time_us.clear();
+    out.count.clear();
+    out.min.assign(channels.size(), std::vector<uint16_t>());
+    out.max.assign(channels.size(), std::vector<uint16_t>());
+    out.mean.assign(channels.size(), std::vector<double>());
+    out.step_us = 0;
+    if (points == 0 || to_us <= from_us)
+        return 0;
+
+    // the coarsest level still at least as fine as a point and going back far enough,
+    // else the finest going back far enough, else the one going back furthest
+    uint64_t target_us = (to_us - from_us + points - 1) / points;
+    int level = -1;
+    for (int l = 0; l < HEV_PYRAMID_LEVELS; l++) {
+        if (!covers(l, from_us))
+            continue;
+        if (level < 0 || level_widths_us[l] <= target_us)
+            level = l;
+        if (level_widths_us[l] >= target_us)
+            break;
+    }
+    if (level < 0)
+        level = HEV_PYRAMID_LEVELS - 1;
+    const Level &buckets = _levels[level];
+    uint64_t width_us = level_widths_us[level];
+    // whole buckets per point, points aligned on multiples of the step so they do not move while scrolling
+    uint64_t step_us = std::max(width_us, (target_us + width_us - 1) / width_us * width_us);
+    out.step_us = step_us;
+    uint64_t first_us = from_us - from_us % step_us;
+
+    // first bucket of the range
+    size_t lo = 0, hi = buckets.size;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (buckets.at(mid).start_us < first_us)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (size_t i = lo; i < buckets.size && buckets.at(i).start_us < to_us; i++) {
+        const Bucket &bucket = buckets.at(i);
+        uint64_t point_us = bucket.start_us - bucket.start_us % step_us;
+        size_t n = out.time_us.size();
+        if (n == 0 || out.time_us[n - 1] != point_us) {
+            out.time_us.push_back(point_us);
+            out.count.push_back(bucket.count);
+            for (size_t k = 0; k < channels.size(); k++) {
+                int c = channels[k];
+                out.min[k].push_back(bucket.min[c]);
+                out.max[k].push_back(bucket.max[c]);
+                out.mean[k].push_back(static_cast<double>(bucket.sum[c]));
+            }
+            continue;
+        }
+        out.count[n - 1] += bucket.count;
+        for (size_t k = 0; k < channels.size(); k++) {
+            int c = channels[k];
+            out.min[k][n - 1] = std::min(out.min[k][n - 1], bucket.min[c]);
+            out.max[k][n - 1] = std::max(out.max[k][n - 1], bucket.max[c]);
+            out.mean[k][n - 1] += static_cast<double>(bucket.sum[c]);
+        }
+    }
+    // the sums become means once every bucket of a point is in
+    for (size_t k = 0; k < channels.size(); k++)
+        for (size_t n = 0; n < out.time_us.size(); n++)
+            out.mean[k][n] /= out.count[n];
+    return out.time_us.size();
+}
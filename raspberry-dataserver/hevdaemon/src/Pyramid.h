@@ -0,0 +1,73 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+// Min/max/mean downsampling of the sensors for plotting history at any zoom.
+// Every sample is added to one bucket at each of HEV_PYRAMID_LEVELS resolutions, from 1 ms
+// to 10 s, holding the min, max, sum and count of each channel. A level keeps its last
+// HEV_PYRAMID_BUCKETS occupied buckets, so the fine levels hold the last minute and the
+// coarsest most of a day. A query for ~N points over a time range reads the coarsest level
+// still fine enough and merges at most 10 of its buckets per point: O(N) whatever the range,
+// up to the ranges only the coarsest level goes back to, where it reads at most all its buckets.
+
+#include <stdint.h>
+#include <vector>
+
+#include "HevSeries.h"
+
+#define HEV_PYRAMID_LEVELS   5
+#define HEV_PYRAMID_BUCKETS  8192
+// the sensors of data_format, its version and timestamp aside
+#define HEV_PYRAMID_CHANNELS 17
+
+// samples of a query, one entry per point and per channel asked for
+struct PyramidPoints {
+    uint64_t step_us;                       // time covered by a point
+    std::vector<uint64_t> time_us;          // start of the point, a multiple of step_us
+    std::vector<uint32_t> count;            // samples merged into it
+    std::vector<std::vector<uint16_t>> min;
+    std::vector<std::vector<uint16_t>> max;
+    std::vector<std::vector<double>>   mean;
+};
+
+class Pyramid
+{
+public:
+    Pyramid();
+
+    // samples older than the latest one are merged into the latest bucket
+    void add(uint64_t time_us, const data_format &data);
+    // at most points points, each merging whole buckets of one level, over from_us <= t < to_us
+    size_t query(uint64_t from_us, uint64_t to_us, size_t points, const std::vector<int> &channels, PyramidPoints &out) const;
+
+    // channel of a data_format field by name, -1 if there is none
+    static int getChannel(const char *name);
+    static const char *getChannelName(int channel);
+    static uint64_t getWidthUs(int level);
+
+private:
+    struct Bucket {
+        uint64_t start_us;
+        uint32_t count;
+        uint16_t min[HEV_PYRAMID_CHANNELS];
+        uint16_t max[HEV_PYRAMID_CHANNELS];
+        uint64_t sum[HEV_PYRAMID_CHANNELS];
+    };
+
+    // ring of the occupied buckets, oldest first
+    struct Level {
+        std::vector<Bucket> buckets;
+        size_t first;
+        size_t size;
+        bool   wrapped;     // buckets were dropped, the level no longer goes back to the first sample
+
+        Bucket &at(size_t i) { return buckets[(first + i) % HEV_PYRAMID_BUCKETS]; }
+        const Bucket &at(size_t i) const { return buckets[(first + i) % HEV_PYRAMID_BUCKETS]; }
+    };
+
+    // whether the level still has the buckets from the time on
+    bool covers(int level, uint64_t time_us) const;
+
+    Level _levels[HEV_PYRAMID_LEVELS];
+};
+
+#endif
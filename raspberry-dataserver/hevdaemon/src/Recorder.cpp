@@ -0,0 +1,150 @@
+#include "Recorder.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "CommsCommon.h"
+#include "EventLoop.h"
+#include "Log.h"
+
+static bool writeAll(int fd, const std::string &data)
+{
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+Recorder::Recorder(EventLoop &loop)
+    : _loop(loop)
+{
+    _fd = -1;
+    _index_fd = -1;
+    _offset = 0;
+    _start_us = 0;
+    _next_index_us = 0;
+    _flush_timer = 0;
+    _records = 0;
+}
+
+Recorder::~Recorder()
+{
+    close();
+}
+
+bool Recorder::open(const char *path)
+{
+    close();
+    _fd = ::open(path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (_fd < 0) {
+        logMessage(LOG_ERROR, "Could not create recording %s: %s", path, strerror(errno));
+        return false;
+    }
+    std::string index_path = std::string(path) + ".idx";
+    _index_fd = ::open(index_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (_index_fd < 0)
+        logMessage(LOG_WARNING, "Could not create index %s, replay will scan the recording", index_path.c_str());
+
+    timeval tv;
+    gettimeofday(&tv, nullptr);
+    hev_recording_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "HEVR", 4);
+    header.version = HEV_RECORD_VERSION;
+    header.format_version = HEV_FORMAT_VERSION;
+    header.header_size = sizeof(header);
+    header.start_us = static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+    _buffer.assign(reinterpret_cast<const char *>(&header), sizeof(header));
+    _offset = sizeof(header);
+
+    _path = path;
+    _start_us = EventLoop::getTimeUs();
+    _next_index_us = 0;
+    _records = 0;
+    flush();
+    logMessage(LOG_INFO, "Recording the serial link to %s", path);
+    return true;
+}
+
+void Recorder::close()
+{
+    if (_fd < 0)
+        return;
+    flush();
+    if (_flush_timer != 0)
+        _loop.cancelTimer(_flush_timer);
+    _flush_timer = 0;
+    ::close(_fd);
+    if (_index_fd >= 0)
+        ::close(_index_fd);
+    _fd = _index_fd = -1;
+    logMessage(LOG_INFO, "Recorded %llu chunks, %llu bytes to %s", static_cast<unsigned long long>(_records),
+               static_cast<unsigned long long>(_offset), _path.c_str());
+}
+
+void Recorder::record(RECORD_KIND kind, const uint8_t *data, size_t size)
+{
+    if (_fd < 0)
+        return;
+    uint64_t time_us = EventLoop::getTimeUs() - _start_us;
+
+    // chunks are at most a read ahead, split anything larger still
+    while (size > 0) {
+        uint16_t chunk = static_cast<uint16_t>(size < UINT16_MAX ? size : UINT16_MAX);
+        if (time_us >= _next_index_us) {
+            hev_recording_index entry = {time_us, _offset};
+            _index_buffer.append(reinterpret_cast<const char *>(&entry), sizeof(entry));
+            _next_index_us = (time_us / HEV_RECORD_INDEX_US + 1) * HEV_RECORD_INDEX_US;
+        }
+        hev_record header;
+        memset(&header, 0, sizeof(header));
+        header.time_us = time_us;
+        header.size = chunk;
+        header.kind = kind;
+        _buffer.append(reinterpret_cast<const char *>(&header), sizeof(header));
+        _buffer.append(reinterpret_cast<const char *>(data), chunk);
+        _offset += sizeof(header) + chunk;
+        _records++;
+        data += chunk;
+        size -= chunk;
+    }
+
+    if (_buffer.size() >= HEV_RECORD_BUFFER_MAX) {
+        flush();
+    } else if (_flush_timer == 0) {
+        _flush_timer = _loop.addTimer(HEV_RECORD_FLUSH_MS, [this]() {
+            _flush_timer = 0;
+            flush();
+        });
+    }
+}
+
+void Recorder::flush()
+{
+    if (_fd < 0 || _buffer.empty())
+        return;
+    if (!writeAll(_fd, _buffer)) {
+        logMessage(LOG_ERROR, "Could not write recording %s: %s, recording stopped", _path.c_str(), strerror(errno));
+        ::close(_fd);
+        if (_index_fd >= 0)
+            ::close(_index_fd);
+        _fd = _index_fd = -1;
+        return;
+    }
+    _buffer.clear();
+    // the index only points at records already in the file
+    if (_index_fd >= 0 && !_index_buffer.empty() && !writeAll(_index_fd, _index_buffer)) {
+        logMessage(LOG_WARNING, "Could not write index of %s, replay will scan the recording", _path.c_str());
+        ::close(_index_fd);
+        _index_fd = -1;
+    }
+    _index_buffer.clear();
+}
@@ -0,0 +1,84 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+// Append only recording of the serial link, the bytes exactly as read from and written
+// to the controller with the time they were seen, for replay (Replay.h) and offline analysis.
+// Little endian:
+//   hev_recording_header
+//   records  hev_record: uint64 time (us since the recording started), uint16 size,
+//            uint8 RECORD_KIND, then size bytes
+// A crash can leave a partial record at the end, it is ignored on replay.
+// Alongside, <path>.idx holds a sparse time index: an hev_recording_index entry for the
+// first record of every HEV_RECORD_INDEX_US, to seek without reading the whole file.
+
+#include <stdint.h>
+#include <string>
+
+#define HEV_RECORD_VERSION     1
+#define HEV_RECORD_INDEX_US    1000000
+// buffered records are written out at least this often
+#define HEV_RECORD_FLUSH_MS    200
+#define HEV_RECORD_BUFFER_MAX  65536
+
+enum RECORD_KIND : uint8_t {
+    RECORD_RX = 0,  // read from the controller
+    RECORD_TX = 1   // written to the controller
+};
+
+struct hev_recording_header {
+    char     magic[4];          // "HEVR"
+    uint8_t  version;           // HEV_RECORD_VERSION
+    uint8_t  format_version;    // HEV_FORMAT_VERSION of the payloads
+    uint16_t header_size;
+    uint64_t start_us;          // wall clock (us since the epoch) at the start, for humans
+    uint8_t  reserved[48];
+};
+
+struct hev_record {
+    uint64_t time_us;
+    uint16_t size;
+    uint8_t  kind;
+    uint8_t  reserved[5];
+};
+
+struct hev_recording_index {
+    uint64_t time_us;
+    uint64_t offset;            // of the record in the recording
+};
+
+static_assert(sizeof(hev_recording_header) == 64, "hev_recording_header layout");
+static_assert(sizeof(hev_record) == 16, "hev_record layout");
+static_assert(sizeof(hev_recording_index) == 16, "hev_recording_index layout");
+
+class EventLoop;
+
+class Recorder
+{
+public:
+    Recorder(EventLoop &loop);
+    ~Recorder();
+
+    // a new file, an existing one is never overwritten
+    bool open(const char *path);
+    void close();
+    bool isOpen() const { return _fd >= 0; }
+
+    void record(RECORD_KIND kind, const uint8_t *data, size_t size);
+    // hands the buffered records to the kernel
+    void flush();
+
+private:
+    EventLoop  &_loop;
+    int         _fd;
+    int         _index_fd;
+    std::string _path;
+    std::string _buffer;
+    std::string _index_buffer;
+    uint64_t    _offset;        // of the end of _buffer in the file
+    uint64_t    _start_us;
+    uint64_t    _next_index_us;
+    uint64_t    _flush_timer;
+    uint64_t    _records;
+};
+
+#endif
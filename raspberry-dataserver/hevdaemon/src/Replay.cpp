@@ -0,0 +1,296 @@
+#include "Replay.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <linux/sockios.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+
+#include "CommsCommon.h"
+#include "EventLoop.h"
+#include "Log.h"
+
+Replay::Replay(EventLoop &loop)
+    : _loop(loop)
+{
+    _data = nullptr;
+    _size = 0;
+    _duration_us = 0;
+    _fd = -1;
+    _speed = 1;
+    _repeat = false;
+    _waiting_writable = false;
+    _pos = 0;
+    _sent = 0;
+    _base_time_us = 0;
+    _base_wall_us = 0;
+    _timer = 0;
+    _start_wall_us = 0;
+    _bytes = 0;
+    _records = 0;
+}
+
+Replay::~Replay()
+{
+    close();
+}
+
+bool Replay::open(const char *path)
+{
+    close();
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        logMessage(LOG_ERROR, "Could not open recording %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    void *addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(hev_recording_header))
+        addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        logMessage(LOG_ERROR, "Could not map recording %s", path);
+        return false;
+    }
+    _data = static_cast<const uint8_t *>(addr);
+    _size = static_cast<size_t>(st.st_size);
+    // replayed front to back
+    madvise(addr, _size, MADV_SEQUENTIAL);
+
+    hev_recording_header header;
+    memcpy(&header, _data, sizeof(header));
+    if (memcmp(header.magic, "HEVR", 4) != 0 || header.version != HEV_RECORD_VERSION
+            || header.header_size < sizeof(header) || header.header_size > _size) {
+        logMessage(LOG_ERROR, "%s is not a recording of this version", path);
+        close();
+        return false;
+    }
+    if (header.format_version != HEV_FORMAT_VERSION)
+        logMessage(LOG_WARNING, "%s was recorded with payload format 0x%02X", path, header.format_version);
+    _pos = header.header_size;
+
+    if (!readIndex(std::string(path) + ".idx"))
+        buildIndex();
+    // the index may stop short of a recording cut by a crash, the last records give the duration
+    size_t offset = _index.empty() ? _pos : _index.back().offset;
+    hev_record record;
+    while (getRecord(offset, record)) {
+        _duration_us = record.time_us;
+        offset += sizeof(record) + record.size;
+    }
+    logMessage(LOG_INFO, "Replaying %s, %.1f s recorded", path, _duration_us / 1e6);
+    return true;
+}
+
+void Replay::close()
+{
+    if (_timer != 0)
+        _loop.cancelTimer(_timer);
+    _timer = 0;
+    if (_fd >= 0) {
+        _loop.remove(_fd);
+        ::close(_fd);
+    }
+    _fd = -1;
+    if (_data != nullptr)
+        munmap(const_cast<uint8_t *>(_data), _size);
+    _data = nullptr;
+    _size = 0;
+    _index.clear();
+}
+
+// the index is only trusted as far as its entries point at records in the recording
+bool Replay::readIndex(const std::string &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    hev_recording_index entry;
+    hev_record record;
+    while (::read(fd, &entry, sizeof(entry)) == sizeof(entry)) {
+        if (!getRecord(entry.offset, record) || record.time_us != entry.time_us
+                || (!_index.empty() && entry.offset <= _index.back().offset))
+            break;
+        _index.push_back(entry);
+    }
+    ::close(fd);
+    return !_index.empty();
+}
+
+void Replay::buildIndex()
+{
+    logMessage(LOG_WARNING, "No index of the recording, scanning it");
+    uint64_t next_us = 0;
+    size_t offset = _pos;
+    hev_record record;
+    while (getRecord(offset, record)) {
+        if (record.time_us >= next_us) {
+            _index.push_back(hev_recording_index{record.time_us, offset});
+            next_us = (record.time_us / HEV_RECORD_INDEX_US + 1) * HEV_RECORD_INDEX_US;
+        }
+        offset += sizeof(record) + record.size;
+    }
+}
+
+bool Replay::getRecord(size_t offset, hev_record &record) const
+{
+    if (offset < sizeof(hev_recording_header) || offset + sizeof(record) > _size)
+        return false;
+    memcpy(&record, _data + offset, sizeof(record));
+    return offset + sizeof(record) + record.size <= _size;
+}
+
+bool Replay::start(int fd, double speed, bool repeat, FinishedHandler finished)
+{
+    if (_data == nullptr)
+        return false;
+    _fd = fd;
+    _speed = speed;
+    _repeat = repeat;
+    _finished = finished;
+    _waiting_writable = false;
+    fcntl(_fd, F_SETFL, fcntl(_fd, F_GETFL) | O_NONBLOCK);
+    if (!_loop.add(_fd, EPOLLIN, [this](uint32_t events) { onSocket(events); }))
+        return false;
+    _start_wall_us = EventLoop::getTimeUs();
+    _bytes = 0;
+    _records = 0;
+    seek(_base_time_us);
+    return true;
+}
+
+void Replay::seek(uint64_t time_us)
+{
+    if (_data == nullptr)
+        return;
+    // last index entry at or before the time, then record by record
+    auto it = std::upper_bound(_index.begin(), _index.end(), time_us,
+                               [](uint64_t t, const hev_recording_index &entry) { return t < entry.time_us; });
+    size_t offset = (it == _index.begin()) ? reinterpret_cast<const hev_recording_header *>(_data)->header_size
+                                           : (it - 1)->offset;
+    hev_record record;
+    while (getRecord(offset, record) && record.time_us < time_us)
+        offset += sizeof(record) + record.size;
+    _pos = offset;
+    _sent = 0;
+    _base_time_us = time_us;
+    _base_wall_us = EventLoop::getTimeUs();
+    if (_fd < 0)
+        return;
+    if (_timer != 0)
+        _loop.cancelTimer(_timer);
+    _timer = 0;
+    pump();
+}
+
+void Replay::pump()
+{
+    hev_record record;
+    while (getRecord(_pos, record)) {
+        if (record.kind != RECORD_RX) {
+            _pos += sizeof(record) + record.size;
+            continue;
+        }
+        if (_speed > 0 && record.time_us > _base_time_us) {
+            uint64_t due_us = _base_wall_us + static_cast<uint64_t>((record.time_us - _base_time_us) / _speed);
+            uint64_t tnow = EventLoop::getTimeUs();
+            if (due_us > tnow) {
+                _timer = _loop.addTimer(static_cast<uint32_t>((due_us - tnow + 999) / 1000), [this]() {
+                    _timer = 0;
+                    pump();
+                });
+                return;
+            }
+        }
+
+        const uint8_t *bytes = _data + _pos + sizeof(record);
+        while (_sent < record.size) {
+            ssize_t n = send(_fd, bytes + _sent, record.size - _sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // the server is behind, carry on once it has read
+                if (!_waiting_writable) {
+                    _waiting_writable = true;
+                    _loop.modify(_fd, EPOLLIN | EPOLLOUT);
+                }
+                return;
+            }
+            if (n <= 0) {
+                finish();
+                return;
+            }
+            _sent += static_cast<size_t>(n);
+            _bytes += static_cast<uint64_t>(n);
+        }
+        _pos += sizeof(record) + record.size;
+        _sent = 0;
+        _records++;
+    }
+
+    if (_repeat) {
+        logMessage(LOG_INFO, "Replay reached the end of the recording, starting over");
+        // a timer rather than recursion, an empty recording would otherwise never yield
+        _timer = _loop.addTimer(0, [this]() {
+            _timer = 0;
+            seek(0);
+        });
+        return;
+    }
+    drain();
+}
+
+// the end of the recording is only reached once the other side has read all of it
+void Replay::drain()
+{
+    int unread = 0;
+    if (ioctl(_fd, SIOCOUTQ, &unread) == 0 && unread > 0) {
+        _timer = _loop.addTimer(1, [this]() {
+            _timer = 0;
+            drain();
+        });
+        return;
+    }
+    finish();
+}
+
+void Replay::onSocket(uint32_t events)
+{
+    if (events & EPOLLIN) {
+        // ACKs and commands of the server, nobody to answer them
+        char discard[4096];
+        ssize_t n = recv(_fd, discard, sizeof(discard), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            finish();
+            return;
+        }
+    }
+    if ((events & EPOLLOUT) && _waiting_writable) {
+        _waiting_writable = false;
+        _loop.modify(_fd, EPOLLIN);
+        pump();
+    }
+}
+
+void Replay::finish()
+{
+    if (_fd < 0)
+        return;
+    double elapsed = (EventLoop::getTimeUs() - _start_wall_us) / 1e6;
+    logMessage(LOG_INFO, "Replayed %llu chunks, %llu bytes in %.2f s",
+               static_cast<unsigned long long>(_records), static_cast<unsigned long long>(_bytes), elapsed);
+    if (_timer != 0)
+        _loop.cancelTimer(_timer);
+    _timer = 0;
+    _loop.remove(_fd);
+    // told before the socket closes, so the server stops rather than sees its controller go away
+    if (_finished)
+        _finished();
+    ::close(_fd);
+    _fd = -1;
+}
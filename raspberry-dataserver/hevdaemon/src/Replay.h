@@ -0,0 +1,68 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+// Replay of a recording of the serial link (Recorder.h) into a socket, in place of the controller:
+// the bytes read from the controller are written out at their recorded pace, scaled by the speed,
+// or as fast as the other side takes them. What the other side writes back is read and dropped.
+// The recording is mapped, not read, so seeking and replaying long recordings costs no copies.
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "Recorder.h"
+
+class EventLoop;
+
+class Replay
+{
+public:
+    typedef std::function<void()> FinishedHandler;
+
+    Replay(EventLoop &loop);
+    ~Replay();
+
+    bool open(const char *path);
+    void close();
+    // time of the last record
+    uint64_t getDurationUs() const { return _duration_us; }
+
+    // speed 1 for real time, 0 for as fast as possible; at the end either start over or finish
+    bool start(int fd, double speed, bool repeat, FinishedHandler finished);
+    // continue from the first record at or after the time, at the same speed
+    void seek(uint64_t time_us);
+
+private:
+    bool readIndex(const std::string &path);
+    void buildIndex();
+    // the record at an offset, false if it is past the end or cut short
+    bool getRecord(size_t offset, hev_record &record) const;
+    void pump();
+    void drain();
+    void onSocket(uint32_t events);
+    void finish();
+
+    EventLoop   &_loop;
+    const uint8_t *_data;
+    size_t       _size;
+    uint64_t     _duration_us;
+    std::vector<hev_recording_index> _index;
+
+    int          _fd;
+    double       _speed;
+    bool         _repeat;
+    bool         _waiting_writable;
+    FinishedHandler _finished;
+    size_t       _pos;              // offset of the next record
+    size_t       _sent;             // bytes of it already written
+    uint64_t     _base_time_us;     // recording time replayed at _base_wall_us
+    uint64_t     _base_wall_us;
+    uint64_t     _timer;
+
+    uint64_t     _start_wall_us;
+    uint64_t     _bytes;
+    uint64_t     _records;
+};
+
+#endif
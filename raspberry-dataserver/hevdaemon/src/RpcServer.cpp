@@ -0,0 +1,233 @@
+#include "RpcServer.h"
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <set>
+
+#include "Log.h"
+
+// larger frames are taken as a client speaking another protocol
+#define RPC_FRAME_SIZE_MAX 256
+// bytes queued for a client that reads none of its replies before it is dropped
+#define RPC_OUTPUT_MAX (HEV_RPC_IN_FLIGHT_MAX * sizeof(rpc_reply) * 4)
+
+RpcServer::RpcServer(EventLoop &loop, SubmitHandler submit)
+    : _loop(loop), _submit(submit)
+{
+    _client_next = 0;
+}
+
+RpcServer::~RpcServer()
+{
+    for (auto &pending : _pending)
+        _loop.cancelTimer(pending.second.timer);
+    for (auto &client : _clients)
+        close(client.second.fd);
+}
+
+void RpcServer::addClient(int fd, const std::string &name)
+{
+    uint64_t client_id = _client_next++;
+    Client &client = _clients[client_id];
+    client.fd = fd;
+    client.name = name;
+    client.events = EPOLLIN;
+    client.in_flight = 0;
+    client.acked = 0;
+    _loop.add(fd, client.events, [this, client_id](uint32_t events) { onClient(client_id, events); });
+    logMessage(LOG_INFO, "Answering requests from %s", name.c_str());
+}
+
+void RpcServer::setAcked(uint8_t device, uint64_t acked)
+{
+    uint64_t &device_acked = _acked[device];
+    if (acked == device_acked)
+        return;
+    device_acked = acked;
+
+    // replies to everything the ACKs completed, written once per client
+    uint64_t tnow = EventLoop::getTimeUs();
+    std::set<uint64_t> replied;
+    auto it = _pending.lower_bound(std::make_pair(device, static_cast<uint64_t>(0)));
+    while (it != _pending.end() && it->first.first == device && it->first.second < acked) {
+        Pending pending = it->second;
+        it = _pending.erase(it);
+        _loop.cancelTimer(pending.timer);
+        complete(pending.client, pending.kind, pending.id, RPC_ACKED,
+                 static_cast<uint32_t>(std::min<uint64_t>(tnow - pending.received_us, UINT32_MAX)));
+        replied.insert(pending.client);
+    }
+    for (uint64_t client_id : replied) {
+        auto client = _clients.find(client_id);
+        if (client == _clients.end())
+            continue;
+        if (!flush(client->second)) {
+            closeClient(client_id);
+            continue;
+        }
+        // a client stalled on its in flight limit has room again
+        readRequests(client_id);
+    }
+}
+
+void RpcServer::onClient(uint64_t client_id, uint32_t events)
+{
+    auto it = _clients.find(client_id);
+    if (it == _clients.end())
+        return;
+    Client &client = it->second;
+
+    if ((events & EPOLLOUT) && !flush(client)) {
+        closeClient(client_id);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        char buffer[4096];
+        ssize_t n = recv(client.fd, buffer, sizeof(buffer), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            closeClient(client_id);
+            return;
+        }
+        if (n > 0)
+            client.input.append(buffer, static_cast<size_t>(n));
+        readRequests(client_id);
+    }
+}
+
+// handles every complete request read so far, a batch written at once is submitted at once
+void RpcServer::readRequests(uint64_t client_id)
+{
+    auto it = _clients.find(client_id);
+    if (it == _clients.end())
+        return;
+    Client &client = it->second;
+
+    size_t pos = 0;
+    uint64_t tnow = EventLoop::getTimeUs();
+    while (client.input.size() - pos >= sizeof(uint16_t) && client.in_flight < HEV_RPC_IN_FLIGHT_MAX) {
+        uint16_t size;
+        memcpy(&size, client.input.data() + pos, sizeof(size));
+        if (size < offsetof(rpc_request, cmd_type) || size > RPC_FRAME_SIZE_MAX) {
+            logMessage(LOG_WARNING, "Invalid request frame of %u bytes from %s", size, client.name.c_str());
+            closeClient(client_id);
+            return;
+        }
+        if (client.input.size() - pos < size)
+            break;
+
+        rpc_request request;
+        memset(&request, 0, sizeof(request));
+        memcpy(&request, client.input.data() + pos, std::min<size_t>(size, sizeof(request)));
+        pos += size;
+
+        uint64_t index;
+        if (size != sizeof(rpc_request) || !_submit(request, index)) {
+            logMessage(LOG_WARNING, "Invalid packet: request %u of kind %u", request.id, request.kind);
+            complete(client_id, request.kind, request.id, RPC_REJECTED, 0);
+            continue;
+        }
+        client.in_flight++;
+        std::pair<uint8_t, uint64_t> key(request.device, index);
+        uint64_t timer = _loop.addTimer(HEV_RPC_TIMEOUT, [this, key]() {
+            auto pending = _pending.find(key);
+            if (pending == _pending.end())
+                return;
+            Pending timed_out = pending->second;
+            _pending.erase(pending);
+            logMessage(LOG_WARNING, "Request %u not ACKed by the controller within %d ms", timed_out.id, HEV_RPC_TIMEOUT);
+            complete(timed_out.client, timed_out.kind, timed_out.id, RPC_TIMEOUT, HEV_RPC_TIMEOUT * 1000);
+            auto owner = _clients.find(timed_out.client);
+            if (owner != _clients.end() && !flush(owner->second))
+                closeClient(timed_out.client);
+        });
+        _pending[key] = Pending{client_id, request.kind, request.id, tnow, timer};
+    }
+    client.input.erase(0, pos);
+
+    if (!flush(client))
+        closeClient(client_id);
+}
+
+void RpcServer::complete(uint64_t client_id, uint8_t kind, uint32_t id, RPC_STATUS status, uint32_t latency_us)
+{
+    auto it = _clients.find(client_id);
+    if (it == _clients.end())
+        return;
+    Client &client = it->second;
+
+    rpc_reply reply;
+    reply.size = sizeof(reply);
+    reply.kind = kind;
+    reply.status = status;
+    reply.id = id;
+    reply.latency_us = latency_us;
+    client.output.append(reinterpret_cast<const char *>(&reply), sizeof(reply));
+    if (status != RPC_REJECTED)
+        client.in_flight--;
+    if (status == RPC_ACKED) {
+        if (client.latencies_us.size() < HEV_RPC_LATENCY_SAMPLES)
+            client.latencies_us.push_back(latency_us);
+        else
+            client.latencies_us[client.acked % HEV_RPC_LATENCY_SAMPLES] = latency_us;
+        client.acked++;
+    }
+}
+
+bool RpcServer::flush(Client &client)
+{
+    while (!client.output.empty()) {
+        ssize_t sent = send(client.fd, client.output.data(), client.output.size(), MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                return false;
+            break;
+        }
+        client.output.erase(0, static_cast<size_t>(sent));
+    }
+    if (client.output.size() > RPC_OUTPUT_MAX)
+        return false;
+    updateEvents(client);
+    return true;
+}
+
+void RpcServer::updateEvents(Client &client)
+{
+    // stop reading while the in flight limit is reached, the client then blocks in its writes
+    uint32_t events = 0;
+    if (client.in_flight < HEV_RPC_IN_FLIGHT_MAX)
+        events |= EPOLLIN;
+    if (!client.output.empty())
+        events |= EPOLLOUT;
+    if (events != client.events) {
+        client.events = events;
+        _loop.modify(client.fd, events);
+    }
+}
+
+void RpcServer::closeClient(uint64_t client_id)
+{
+    auto it = _clients.find(client_id);
+    if (it == _clients.end())
+        return;
+    Client &client = it->second;
+
+    std::vector<uint32_t> &latencies = client.latencies_us;
+    if (latencies.empty()) {
+        logMessage(LOG_INFO, "Connection lost with %s", client.name.c_str());
+    } else {
+        std::sort(latencies.begin(), latencies.end());
+        logMessage(LOG_INFO, "Connection lost with %s after %llu requests ACKed, latency of the last %zu: median %u us, 99%% %u us, max %u us",
+                   client.name.c_str(), static_cast<unsigned long long>(client.acked), latencies.size(),
+                   latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100], latencies.back());
+    }
+    // requests still in flight are sent to the controller regardless, their replies go nowhere
+    _loop.remove(client.fd);
+    close(client.fd);
+    _clients.erase(it);
+}
@@ -0,0 +1,116 @@
+#ifndef RPC_SERVER_H
+#define RPC_SERVER_H
+
+// Persistent binary request channel (port 54324): a client keeps its connection open
+// and may write any number of requests without waiting, each tagged with an id of its
+// choosing. A request is answered once the controller has ACKed the payload it turned
+// into, with the time taken since the daemon read it, or once it timed out.
+// Frames are little endian and start with their size:
+//   request  uint16 size, uint8 RPC_KIND, uint8 device, uint32 id, uint8 cmd_type (ALARM_CODES for
+//            RPC_ACK_ALARM), uint8 cmd_code, uint16 0, uint32 param
+// where device is the index of the controller in the order the daemon attached them, 0 for the first
+//   reply    uint16 size, uint8 RPC_KIND, uint8 RPC_STATUS, uint32 id, uint32 latency (us)
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "EventLoop.h"
+
+// a command is resent until ACKed, give up on it after this long
+#define HEV_RPC_TIMEOUT 2000 // ms
+// requests of one client in flight, it is not read further beyond this
+#define HEV_RPC_IN_FLIGHT_MAX 256
+// latencies of the last requests of a client, summarised in the log when it goes away
+#define HEV_RPC_LATENCY_SAMPLES 4096
+
+enum RPC_KIND : uint8_t {
+    RPC_CMD       = 1,
+    RPC_ACK_ALARM = 2
+};
+
+enum RPC_STATUS : uint8_t {
+    RPC_ACKED    = 0,   // the controller ACKed the payload
+    RPC_REJECTED = 1,   // malformed, unknown command or alarm not latched, nothing was sent
+    RPC_TIMEOUT  = 2    // not ACKed within HEV_RPC_TIMEOUT, may still be delivered later
+};
+
+struct rpc_request {
+    uint16_t size;
+    uint8_t  kind;
+    uint8_t  device;
+    uint32_t id;
+    uint8_t  cmd_type;
+    uint8_t  cmd_code;
+    uint16_t reserved2;
+    uint32_t param;
+};
+
+struct rpc_reply {
+    uint16_t size;
+    uint8_t  kind;
+    uint8_t  status;
+    uint32_t id;
+    uint32_t latency_us;
+};
+
+static_assert(sizeof(rpc_request) == 16, "rpc_request layout");
+static_assert(sizeof(rpc_reply) == 12, "rpc_reply layout");
+
+class RpcServer
+{
+public:
+    // sends the payload of a request and gives the number of payloads written to the command
+    // queue of its device before it, false to reject the request
+    typedef std::function<bool(const rpc_request &request, uint64_t &index)> SubmitHandler;
+
+    RpcServer(EventLoop &loop, SubmitHandler submit);
+    ~RpcServer();
+
+    // takes ownership of a connected, non-blocking socket
+    void addClient(int fd, const std::string &name);
+    // the command queue payloads ACKed by the controller of the device so far
+    void setAcked(uint8_t device, uint64_t acked);
+
+private:
+    struct Client {
+        int                   fd;
+        std::string           name;
+        std::string           input;
+        std::string           output;
+        uint32_t              events;
+        size_t                in_flight;
+        uint64_t              acked;
+        std::vector<uint32_t> latencies_us;   // ring of the last HEV_RPC_LATENCY_SAMPLES
+    };
+
+    struct Pending {
+        uint64_t client;
+        uint8_t  kind;
+        uint32_t id;
+        uint64_t received_us;
+        uint64_t timer;
+    };
+
+    void onClient(uint64_t client_id, uint32_t events);
+    void readRequests(uint64_t client_id);
+    void complete(uint64_t client_id, uint8_t kind, uint32_t id, RPC_STATUS status, uint32_t latency_us);
+    // writes whatever is queued for the client, false if it has gone away
+    bool flush(Client &client);
+    void updateEvents(Client &client);
+    void closeClient(uint64_t client_id);
+
+    EventLoop    &_loop;
+    SubmitHandler _submit;
+
+    std::map<uint64_t, Client>  _clients;
+    uint64_t                    _client_next;
+    // by device and index in its command queue
+    std::map<std::pair<uint8_t, uint64_t>, Pending> _pending;
+    std::map<uint8_t, uint64_t>                     _acked;
+};
+
+#endif
@@ -0,0 +1,311 @@
+#include "SeriesStore.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <utility>
+
+#include "EventLoop.h"
+#include "Log.h"
+
+static bool writeAll(int fd, const char *data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+SeriesStore::SeriesStore(EventLoop &loop)
+    : _loop(loop)
+{
+    _max_bytes = HEV_SERIES_MAX_BYTES;
+    _commit_timer = 0;
+    _min_us = UINT64_MAX;
+    _max_us = 0;
+    _samples = 0;
+    _dropped = 0;
+    _stopping = false;
+    _fd = -1;
+    _segment_bytes = 0;
+    _written = 0;
+    _syncs = 0;
+    for (auto &column : _columns)
+        column.reserve(HEV_SERIES_CHUNK_SAMPLES);
+}
+
+SeriesStore::~SeriesStore()
+{
+    close();
+}
+
+bool SeriesStore::open(const char *dir, uint64_t max_bytes)
+{
+    close();
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        logMessage(LOG_ERROR, "Could not create store %s: %s", dir, strerror(errno));
+        return false;
+    }
+    _dir = dir;
+    _max_bytes = max_bytes;
+    _samples = _dropped = 0;
+    _written = _syncs = 0;
+    // the first segment before the thread starts, so a store that can not be written is reported here
+    if (!startSegment(EventLoop::getWallTimeUs()))
+        return false;
+
+    _stopping = false;
+    _thread = std::thread(&SeriesStore::writer, this);
+    scheduleCommit();
+    logMessage(LOG_INFO, "Storing samples in %s", dir);
+    return true;
+}
+
+void SeriesStore::close()
+{
+    if (!isOpen())
+        return;
+    if (_commit_timer != 0)
+        _loop.cancelTimer(_commit_timer);
+    _commit_timer = 0;
+    commit();
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+
+    logMessage(LOG_INFO, "Stored %llu samples in %s, %llu bytes (%.1f per sample) in %llu commits%s",
+               static_cast<unsigned long long>(_samples), _dir.c_str(), static_cast<unsigned long long>(_written),
+               _samples ? static_cast<double>(_written) / _samples : 0.0, static_cast<unsigned long long>(_syncs),
+               _dropped ? ", some dropped as the disk did not keep up" : "");
+}
+
+void SeriesStore::append(uint64_t time_us, const data_format &data, const std::vector<uint8_t> &alarms)
+{
+    if (!isOpen())
+        return;
+    uint32_t mask = 0;
+    for (uint8_t code : alarms)
+        if (code < 32)
+            mask |= 1u << code;
+    _columns[HEV_SERIES_TIME].push_back(static_cast<int64_t>(time_us));
+    _columns[HEV_SERIES_ALARMS].push_back(mask);
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(&data);
+    for (size_t c = 0; c < HEV_SERIES_COLUMNS; c++) {
+        const HevSeriesField &field = hev_series_fields[c];
+        if (field.size == 0)
+            continue;
+        uint64_t value = 0;
+        for (uint8_t i = 0; i < field.size; i++)
+            value |= static_cast<uint64_t>(bytes[field.offset + i]) << (8 * i);
+        _columns[c].push_back(static_cast<int64_t>(value));
+    }
+    _min_us = std::min(_min_us, time_us);
+    _max_us = std::max(_max_us, time_us);
+    _samples++;
+    if (_columns[HEV_SERIES_TIME].size() >= HEV_SERIES_CHUNK_SAMPLES)
+        seal();
+}
+
+void SeriesStore::commit()
+{
+    seal();
+    if (_sealed.empty())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_pending.size() + _sealed.size() > HEV_SERIES_BACKLOG_MAX) {
+            if (_dropped++ == 0)
+                logMessage(LOG_WARNING, "Store %s can not keep up, dropping samples", _dir.c_str());
+        } else {
+            _pending += _sealed;
+        }
+    }
+    _sealed.clear();
+    _wake.notify_one();
+}
+
+void SeriesStore::scheduleCommit()
+{
+    _commit_timer = _loop.addTimer(HEV_SERIES_COMMIT_MS, [this]() {
+        commit();
+        scheduleCommit();
+    });
+}
+
+// encodes the open chunk, see HevSeries.h
+void SeriesStore::seal()
+{
+    uint32_t count = static_cast<uint32_t>(_columns[HEV_SERIES_TIME].size());
+    if (count == 0)
+        return;
+
+    hev_series_column headers[HEV_SERIES_COLUMNS];
+    memset(headers, 0, sizeof(headers));
+    std::vector<uint64_t> words;
+    for (size_t c = 0; c < HEV_SERIES_COLUMNS; c++) {
+        const std::vector<int64_t> &values = _columns[c];
+        hev_series_column &header = headers[c];
+        header.first = values[0];
+        if (count == 1)
+            continue;
+
+        // frame of reference on the deltas, in uint64 arithmetic so that any jump wraps back
+        int64_t min_delta = INT64_MAX;
+        for (uint32_t i = 1; i < count; i++)
+            min_delta = std::min(min_delta, static_cast<int64_t>(static_cast<uint64_t>(values[i]) - static_cast<uint64_t>(values[i - 1])));
+        uint64_t range = 0;
+        for (uint32_t i = 1; i < count; i++)
+            range |= static_cast<uint64_t>(values[i]) - static_cast<uint64_t>(values[i - 1]) - static_cast<uint64_t>(min_delta);
+        header.min_delta = min_delta;
+        header.bits = range ? static_cast<uint8_t>(64 - __builtin_clzll(range)) : 0;
+        if (header.bits == 0)
+            continue;
+
+        size_t base = words.size();
+        words.resize(base + hevSeriesPackedWords(count, header.bits), 0);
+        size_t bit = 0;
+        for (uint32_t i = 1; i < count; i++) {
+            uint64_t packed = static_cast<uint64_t>(values[i]) - static_cast<uint64_t>(values[i - 1]) - static_cast<uint64_t>(min_delta);
+            size_t word = base + bit / 64, shift = bit % 64;
+            words[word] |= packed << shift;
+            if (shift + header.bits > 64)
+                words[word + 1] |= packed >> (64 - shift);
+            bit += header.bits;
+        }
+    }
+
+    hev_series_chunk chunk;
+    memcpy(chunk.magic, "HEVC", 4);
+    chunk.size = static_cast<uint32_t>(sizeof(chunk) + sizeof(headers) + words.size() * sizeof(uint64_t));
+    chunk.count = count;
+    chunk.checksum = 0;
+    chunk.min_us = _min_us;
+    chunk.max_us = _max_us;
+    size_t start = _sealed.size();
+    _sealed.append(reinterpret_cast<const char *>(&chunk), sizeof(chunk));
+    _sealed.append(reinterpret_cast<const char *>(headers), sizeof(headers));
+    _sealed.append(reinterpret_cast<const char *>(words.data()), words.size() * sizeof(uint64_t));
+    const uint8_t *body = reinterpret_cast<const uint8_t *>(_sealed.data() + start + sizeof(chunk));
+    chunk.checksum = hevSeriesChecksum(body, chunk.size - sizeof(chunk));
+    memcpy(&_sealed[start + offsetof(hev_series_chunk, checksum)], &chunk.checksum, sizeof(chunk.checksum));
+
+    for (auto &column : _columns)
+        column.clear();
+    _min_us = UINT64_MAX;
+    _max_us = 0;
+}
+
+// commit thread: one write and one fdatasync for everything handed over since the last time
+void SeriesStore::writer()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        _wake.wait(lock, [this]() { return _stopping || !_pending.empty(); });
+        if (_pending.empty())
+            break;
+        std::string batch;
+        batch.swap(_pending);
+        lock.unlock();
+
+        if (_fd < 0 || _segment_bytes >= HEV_SERIES_SEGMENT_BYTES)
+            startSegment(EventLoop::getWallTimeUs());
+        if (_fd >= 0) {
+            if (writeAll(_fd, batch.data(), batch.size())) {
+                _segment_bytes += batch.size();
+                _written += batch.size();
+            } else {
+                logMessage(LOG_ERROR, "Could not write store %s: %s", _dir.c_str(), strerror(errno));
+            }
+            fdatasync(_fd);
+            _syncs++;
+        }
+        lock.lock();
+    }
+}
+
+bool SeriesStore::startSegment(uint64_t start_us)
+{
+    if (_fd >= 0)
+        ::close(_fd);
+    _fd = -1;
+
+    char name[32];
+    snprintf(name, sizeof(name), "/%020llu" HEV_SERIES_SUFFIX, static_cast<unsigned long long>(start_us));
+    std::string path = _dir + name;
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        logMessage(LOG_ERROR, "Could not create segment %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    hev_series_segment segment;
+    memset(&segment, 0, sizeof(segment));
+    memcpy(segment.magic, "HEVS", 4);
+    segment.layout_version = HEV_SERIES_VERSION;
+    segment.format_version = HEV_FORMAT_VERSION;
+    segment.columns = HEV_SERIES_COLUMNS;
+    segment.start_us = start_us;
+    if (!writeAll(fd, reinterpret_cast<const char *>(&segment), sizeof(segment))) {
+        logMessage(LOG_ERROR, "Could not write segment %s: %s", path.c_str(), strerror(errno));
+        ::close(fd);
+        unlink(path.c_str());
+        return false;
+    }
+    // the new file is only found again after a power cut once its directory entry is synced
+    int dir_fd = ::open(_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        ::close(dir_fd);
+    }
+    _fd = fd;
+    _segment_bytes = sizeof(segment);
+    _written += sizeof(segment);
+    prune();
+    return true;
+}
+
+// oldest segments first, never the one being written
+void SeriesStore::prune()
+{
+    DIR *d = opendir(_dir.c_str());
+    if (d == nullptr)
+        return;
+    std::vector<std::pair<std::string, uint64_t>> segments;
+    uint64_t total = 0;
+    size_t suffix = strlen(HEV_SERIES_SUFFIX);
+    while (dirent *entry = readdir(d)) {
+        size_t length = strlen(entry->d_name);
+        if (length <= suffix || strcmp(entry->d_name + length - suffix, HEV_SERIES_SUFFIX) != 0)
+            continue;
+        std::string path = _dir + "/" + entry->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            continue;
+        segments.push_back(std::make_pair(path, static_cast<uint64_t>(st.st_size)));
+        total += static_cast<uint64_t>(st.st_size);
+    }
+    closedir(d);
+    std::sort(segments.begin(), segments.end());
+    for (size_t i = 0; i + 1 < segments.size() && total > _max_bytes; i++) {
+        if (unlink(segments[i].first.c_str()) != 0)
+            continue;
+        total -= segments[i].second;
+        logMessage(LOG_INFO, "Store over %llu bytes, deleted %s", static_cast<unsigned long long>(_max_bytes),
+                   segments[i].first.c_str());
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef SERIES_STORE_H
+#define SERIES_STORE_H
+
+// Writer side of the time series store (include/HevSeries.h).
+// Samples are encoded into chunks on the event loop thread; the chunks sealed since the
+// last commit are written and fdatasync'ed together by a commit thread at most once every
+// HEV_SERIES_COMMIT_MS, so the SD card sees a few large writes rather than one per sample
+// and the loop never waits on it. A power cut loses at most the last commit interval.
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "HevSeries.h"
+
+// group commit interval, the longest a sample stays in memory only
+#define HEV_SERIES_COMMIT_MS      5000
+// a new segment is started beyond this size, the oldest are deleted to keep the store under its limit
+#define HEV_SERIES_SEGMENT_BYTES  (8 * 1024 * 1024)
+#define HEV_SERIES_MAX_BYTES      (100 * 1024 * 1024)
+// chunks waiting for a card that does not keep up are dropped beyond this
+#define HEV_SERIES_BACKLOG_MAX    (4 * 1024 * 1024)
+
+class EventLoop;
+
+class SeriesStore
+{
+public:
+    SeriesStore(EventLoop &loop);
+    ~SeriesStore();
+
+    // the directory is created if need be, samples go to a new segment
+    bool open(const char *dir, uint64_t max_bytes = HEV_SERIES_MAX_BYTES);
+    // commits what is buffered and waits for it to be on disk
+    void close();
+    bool isOpen() const { return _thread.joinable(); }
+
+    void append(uint64_t time_us, const data_format &data, const std::vector<uint8_t> &alarms);
+    // seals the samples buffered so far and hands them to the commit thread
+    void commit();
+
+private:
+    void scheduleCommit();
+    void seal();
+    void writer();
+    bool startSegment(uint64_t start_us);
+    void prune();
+
+    EventLoop  &_loop;
+    std::string _dir;
+    uint64_t    _max_bytes;
+    uint64_t    _commit_timer;
+
+    // event loop thread: samples of the open chunk, column by column
+    std::vector<int64_t> _columns[HEV_SERIES_COLUMNS];
+    uint64_t    _min_us;
+    uint64_t    _max_us;
+    std::string _sealed;
+    uint64_t    _samples;
+    uint64_t    _dropped;
+
+    // shared with the commit thread
+    std::thread             _thread;
+    std::mutex              _mutex;
+    std::condition_variable _wake;
+    std::string             _pending;
+    bool                    _stopping;
+
+    // commit thread only
+    int         _fd;
+    uint64_t    _segment_bytes;
+    uint64_t    _written;
+    uint64_t    _syncs;
+};
+
+#endif
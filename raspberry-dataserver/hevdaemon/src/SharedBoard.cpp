@@ -0,0 +1,108 @@
+#include "SharedBoard.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "EventLoop.h"
+#include "Log.h"
+
+SharedBoard::SharedBoard()
+{
+    _board = nullptr;
+}
+
+SharedBoard::~SharedBoard()
+{
+    close();
+}
+
+bool SharedBoard::open(const char *name)
+{
+    close();
+    // a fresh segment, readers still mapping the one of a previous run see it go stale
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        logMessage(LOG_ERROR, "Could not create board %s: %s", name, strerror(errno));
+        return false;
+    }
+    void *addr = MAP_FAILED;
+    if (ftruncate(fd, sizeof(hev_board)) == 0)
+        addr = mmap(nullptr, sizeof(hev_board), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+        logMessage(LOG_ERROR, "Could not map board %s: %s", name, strerror(errno));
+        shm_unlink(name);
+        return false;
+    }
+
+    // the segment comes zeroed, the magic goes in last so a reader never sees a half made header
+    _board = static_cast<hev_board *>(addr);
+    _name = name;
+    hev_board_header &header = _board->header;
+    header.layout_version = HEV_BOARD_VERSION;
+    header.format_version = HEV_FORMAT_VERSION;
+    header.ring_samples = HEV_BOARD_RING_SAMPLES;
+    header.sample_size = sizeof(data_format);
+    header.writer_pid = static_cast<uint32_t>(getpid());
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header.magic, "HEVB", 4);
+    logMessage(LOG_INFO, "Publishing latest values on board %s", name);
+    return true;
+}
+
+void SharedBoard::close()
+{
+    if (_board == nullptr)
+        return;
+    munmap(_board, sizeof(hev_board));
+    shm_unlink(_name.c_str());
+    _board = nullptr;
+}
+
+void SharedBoard::beginLatest()
+{
+    // odd while written, readers retry their copy
+    __atomic_store_n(&_board->latest.seq, _board->latest.seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void SharedBoard::endLatest()
+{
+    _board->latest.update_us = EventLoop::getTimeUs();
+    __atomic_store_n(&_board->latest.seq, _board->latest.seq + 1, __ATOMIC_RELEASE);
+}
+
+void SharedBoard::publishSensors(const data_format &data)
+{
+    if (_board == nullptr)
+        return;
+
+    beginLatest();
+    memcpy(&_board->latest.sensors, &data, sizeof(data_format));
+    _board->latest.sensors_valid = 1;
+    endLatest();
+
+    uint64_t index = _board->head;
+    hev_board_sample &slot = _board->ring[index % HEV_BOARD_RING_SAMPLES];
+    __atomic_store_n(&slot.seq, 2 * index + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot.data, &data, sizeof(data_format));
+    __atomic_store_n(&slot.seq, 2 * index + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&_board->head, index + 1, __ATOMIC_RELEASE);
+}
+
+void SharedBoard::publishAlarms(const std::vector<uint8_t> &alarms)
+{
+    if (_board == nullptr)
+        return;
+
+    size_t count = (alarms.size() < HEV_BOARD_ALARMS) ? alarms.size() : HEV_BOARD_ALARMS;
+    beginLatest();
+    memset(_board->latest.alarms, 0, HEV_BOARD_ALARMS);
+    memcpy(_board->latest.alarms, alarms.data(), count);
+    _board->latest.alarm_count = static_cast<uint8_t>(count);
+    endLatest();
+}
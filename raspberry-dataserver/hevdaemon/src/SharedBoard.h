@@ -0,0 +1,36 @@
+#ifndef SHARED_BOARD_H
+#define SHARED_BOARD_H
+
+// Writer side of the latest values board (include/HevBoard.h).
+// Only the event loop thread writes, so publishing never waits on the readers
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "HevBoard.h"
+
+class SharedBoard
+{
+public:
+    SharedBoard();
+    ~SharedBoard();
+
+    // creates the segment, replacing the board of a previous run
+    bool open(const char *name = HEV_BOARD_NAME);
+    void close();
+    bool isOpen() const { return _board != nullptr; }
+
+    // latest sensors, also appended to the ring of samples
+    void publishSensors(const data_format &data);
+    void publishAlarms(const std::vector<uint8_t> &alarms);
+
+private:
+    void beginLatest();
+    void endLatest();
+
+    hev_board  *_board;
+    std::string _name;
+};
+
+#endif
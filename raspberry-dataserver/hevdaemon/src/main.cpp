@@ -0,0 +1,241 @@
+// hevdaemon: data server to manage comms between UIs and LLI,
+// the sockets of hevserver.py on top of the CommsControl library of the controller
+
+#include <dirent.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "CommsControl.h"
+#include "EventLoop.h"
+#include "HevServer.h"
+#include "Log.h"
+#include "Recorder.h"
+#include "Replay.h"
+
+CommsControl comms;
+
+static std::string readSysfs(const std::string &path)
+{
+    std::string value;
+    FILE *file = fopen(path.c_str(), "r");
+    if (file == nullptr)
+        return value;
+    char line[128];
+    if (fgets(line, sizeof(line), file))
+        value = line;
+    fclose(file);
+    while (!value.empty() && (value.back() == '\n' || value.back() == ' '))
+        value.pop_back();
+    return value;
+}
+
+// the arduino serial ports, an ARDUINO manufacturer or a CP210x (10C4:EA60);
+// hevserver.py takes the last one
+static std::vector<std::string> findPorts()
+{
+    std::vector<std::string> ttys;
+    std::vector<std::string> ports;
+    DIR *dir = opendir("/sys/class/tty");
+    if (dir == nullptr)
+        return ports;
+    while (dirent *entry = readdir(dir))
+        ttys.push_back(entry->d_name);
+    closedir(dir);
+    std::sort(ttys.begin(), ttys.end());
+
+    for (auto &tty : ttys) {
+        // device is the usb interface, its parent the usb device
+        std::string usb = "/sys/class/tty/" + tty + "/device/../";
+        std::string manufacturer = readSysfs(usb + "manufacturer");
+        std::string vidpid = readSysfs(usb + "idVendor") + ":" + readSysfs(usb + "idProduct");
+        std::transform(manufacturer.begin(), manufacturer.end(), manufacturer.begin(), ::toupper);
+        std::transform(vidpid.begin(), vidpid.end(), vidpid.begin(), ::toupper);
+        if (manufacturer.find("ARDUINO") != std::string::npos || vidpid == "10C4:EA60")
+            ports.push_back("/dev/" + tty);
+    }
+    return ports;
+}
+
+// a controller to serve, named after its device unless given as NAME=DEVICE
+struct Port {
+    std::string name;
+    std::string path;
+};
+
+static Port getPort(const std::string &arg)
+{
+    Port port;
+    size_t equals = arg.find('=');
+    port.path = (equals == std::string::npos) ? arg : arg.substr(equals + 1);
+    port.name = (equals == std::string::npos) ? arg.substr(arg.rfind('/') + 1) : arg.substr(0, equals);
+    return port;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--port [NAME=]DEVICE ... | --all-ports | --replay FILE [--speed X] [--from S] [--repeat]]\n"
+                    "          [--record FILE] [--store DIR] [--bind IP] [--board NAME | --no-board] [--debug]\n"
+                    "  --port      serial device of a controller, found from its usb ids by default;\n"
+                    "              repeat it to serve several, named after their device or NAME\n"
+                    "  --all-ports serve every controller found from its usb ids rather than the last one\n"
+                    "  --replay    serve a recording instead of a controller\n"
+                    "  --speed     of the replay, 1 for real time (default), 0 as fast as possible\n"
+                    "  --from      seconds into the recording to start the replay at\n"
+                    "  --repeat    start the replay over at the end rather than exit\n"
+                    "  --record    record the serial link to a new file (and FILE.idx)\n"
+                    "  --store     keep every sample in the time series store in DIR,\n"
+                    "              of each of several controllers in DIR/NAME\n"
+                    "  --bind      address of the sockets, 127.0.0.1 by default\n"
+                    "  --board     shared memory board of the latest values, " HEV_BOARD_NAME " by default,\n"
+                    "              of each of several controllers BOARD.NAME\n"
+                    "  --no-board  do not publish the board\n"
+                    "  --debug     log every payload\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<Port> ports;
+    bool all_ports = false;
+    std::string ip = "127.0.0.1";
+    std::string board = HEV_BOARD_NAME;
+    std::string replay_path, record_path, store_dir;
+    double speed = 1, from = 0;
+    bool repeat = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            ports.push_back(getPort(argv[++i]));
+        } else if (strcmp(argv[i], "--all-ports") == 0) {
+            all_ports = true;
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--from") == 0 && i + 1 < argc) {
+            from = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--repeat") == 0) {
+            repeat = true;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) {
+            store_dir = argv[++i];
+        } else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc) {
+            ip = argv[++i];
+        } else if (strcmp(argv[i], "--board") == 0 && i + 1 < argc) {
+            board = argv[++i];
+        } else if (strcmp(argv[i], "--no-board") == 0) {
+            board.clear();
+        } else if (strcmp(argv[i], "--debug") == 0) {
+            setLogLevel(LOG_DEBUG);
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    // a recording is of one link
+    if ((!replay_path.empty() && (!ports.empty() || all_ports)) || (!ports.empty() && all_ports)
+            || (!record_path.empty() && (ports.size() > 1 || all_ports)) || speed < 0 || from < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    // stop cleanly, with the recording and the store flushed and the board removed
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+
+    EventLoop loop;
+    int stop_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    bool stopped = false;
+    loop.add(stop_fd, EPOLLIN, [&](uint32_t) {
+        logMessage(LOG_INFO, "Stopping");
+        stopped = true;
+        loop.stop();
+    });
+
+    // the first controller is on Serial, the link recorded or replayed, any other on a serial of its own
+    HevServer server(loop);
+    std::deque<HardwareSerial> serials;
+    std::deque<CommsControl> links;
+    Replay replay(loop);
+    if (!replay_path.empty()) {
+        int pair[2];
+        if (!replay.open(replay_path.c_str()) || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0)
+            return 1;
+        Serial.attach(pair[0]);
+        ports.push_back(getPort(replay_path));
+        replay.seek(static_cast<uint64_t>(from * 1e6));
+        replay.start(pair[1], speed, repeat, [&]() {
+            stopped = true;
+            loop.stop();
+        });
+        logMessage(LOG_INFO, "Serving data from recording %s", replay_path.c_str());
+    } else {
+        if (ports.empty()) {
+            std::vector<std::string> found = findPorts();
+            if (!all_ports && !found.empty())
+                found.erase(found.begin(), found.end() - 1);
+            for (auto &path : found)
+                ports.push_back(getPort(path));
+        }
+        if (ports.empty()) {
+            logMessage(LOG_ERROR, "Arduino not connected");
+            return 1;
+        }
+        for (size_t i = 0; i < ports.size(); i++) {
+            HardwareSerial *serial = &Serial;
+            if (i > 0) {
+                serials.emplace_back();
+                serial = &serials.back();
+            }
+            if (!serial->open(ports[i].path.c_str())) {
+                logMessage(LOG_ERROR, "Arduino not connected on %s", ports[i].path.c_str());
+                return 1;
+            }
+            logMessage(LOG_INFO, "Serving data from device %s as %s", ports[i].path.c_str(), ports[i].name.c_str());
+        }
+    }
+
+    Recorder recorder(loop);
+    if (!record_path.empty()) {
+        if (!recorder.open(record_path.c_str()))
+            return 1;
+        Serial.setTap([&](bool transmit, const uint8_t *data, size_t size) {
+            recorder.record(transmit ? RECORD_TX : RECORD_RX, data, size);
+        });
+    }
+
+    if (!server.listen(ip.c_str()) || !server.attachSerial(ports[0].name, Serial, comms))
+        return 1;
+    for (size_t i = 1; i < ports.size(); i++) {
+        HardwareSerial &serial = serials[i - 1];
+        links.emplace_back(115200, serial);
+        // CommsControl only begins Serial
+        serial.begin(115200);
+        if (!server.attachSerial(ports[i].name, serial, links.back()))
+            return 1;
+    }
+    if (!store_dir.empty() && !server.openStore(store_dir.c_str()))
+        return 1;
+    // the sockets still serve the UIs without the board
+    if (!board.empty())
+        server.openBoard(board.c_str());
+    server.requestConfiguration();
+
+    // only returns once every serial link is lost, the replay is over or on a signal
+    loop.run();
+    Serial.setTap(nullptr);
+    return stopped ? 0 : 1;
+}
@@ -0,0 +1,618 @@
+// Load generator for the data server (hevdaemon or hevserver.py): K controllers on ptys speaking
+// the real protocol through CommsControl, M UIs on the broadcast socket and requests on the
+// request socket, then the latency from a DATA payload being written to it reaching the UIs,
+// the latency of the requests and the CPU use of the data server.
+//
+//   pio run -e hevload && .pio/build/hevload/program [options] [-- COMMAND ...]
+//
+// The data server is either started with COMMAND, where an argument holding {pty} is given once
+// per controller together with the option just before it:
+//   hevload --controllers 8 -- .pio/build/native/program --port {pty}
+// or started by hand on the ptys printed, and its process given with --pid.
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "CommsControl.h"
+#include "EventLoop.h"
+#include "HevServer.h"
+#include "common.h"
+
+struct Options {
+    int         controllers = 1;
+    double      data_rate = 100;     // DATA per second per controller
+    double      alarm_rate = 0;      // ALARM per second per controller
+    double      ack_drop = 0;        // fraction of the ACKs of commands the controllers never send
+    uint32_t    ack_delay_ms = 0;    // and how long they hold back the others
+    int         clients = 1;         // UIs on the JSON broadcast
+    double      request_rate = 0;    // cmd requests per second, each on a connection of its own
+    double      seconds = 10;
+    double      warmup = 2;
+    std::string ip = "127.0.0.1";
+    pid_t       pid = 0;
+    std::vector<std::string> command;
+};
+
+static uint64_t getCpuUs(clockid_t clock)
+{
+    timespec ts;
+    if (clock_gettime(clock, &ts) != 0)
+        return 0;
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// false once the data server started as a child has exited, e.g. as another one left over holds
+// the ports: the clients would then measure that one, and the child's CPU use as nothing
+static bool isServerRunning(pid_t server)
+{
+    int status;
+    if (waitpid(server, &status, WNOHANG) != server)
+        return true;
+    if (WIFEXITED(status))
+        fprintf(stderr, "the data server exited with status %d\n", WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+        fprintf(stderr, "the data server was killed by signal %d\n", WTERMSIG(status));
+    return false;
+}
+
+// resident memory of a process, in kB
+static long getRssKb(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *status = fopen(path, "r");
+    if (status == nullptr)
+        return 0;
+    char line[256];
+    long rss = 0;
+    while (fgets(line, sizeof(line), status)) {
+        if (sscanf(line, "VmRSS: %ld", &rss) == 1)
+            break;
+    }
+    fclose(status);
+    return rss;
+}
+
+static void printPercentiles(const char *name, std::vector<uint32_t> &values_us)
+{
+    if (values_us.empty()) {
+        printf("%-22s none\n", name);
+        return;
+    }
+    std::sort(values_us.begin(), values_us.end());
+    auto at = [&](double percentile) {
+        return values_us[static_cast<size_t>(percentile / 100 * (values_us.size() - 1))] / 1e3;
+    };
+    printf("%-22s p50 %7.2f  p90 %7.2f  p99 %7.2f  p99.9 %7.2f  max %7.2f ms (%zu)\n", name, at(50), at(90), at(99),
+           at(99.9), at(100), values_us.size());
+}
+
+// the controller's end of a pty, which may hold back or lose the ACKs it writes
+class AckFilter : public Stream
+{
+public:
+    AckFilter(EventLoop &loop, HardwareSerial &serial, double drop, uint32_t delay_ms)
+        : _loop(loop), _serial(serial)
+    {
+        _drop = drop;
+        _delay_ms = delay_ms;
+        acks = 0;
+        dropped = 0;
+    }
+
+    int available() override { return _serial.available(); }
+    int peek() override { return _serial.peek(); }
+    int read() override { return _serial.read(); }
+    int availableForWrite() override { return _serial.availableForWrite(); }
+    size_t write(const uint8_t *buffer, size_t size) override
+    {
+        if (!isAck(buffer, size))
+            return _serial.write(buffer, size);
+        acks++;
+        if (_drop > 0 && rand() < _drop * RAND_MAX) {
+            dropped++;
+            return size;
+        }
+        if (_delay_ms == 0)
+            return _serial.write(buffer, size);
+        std::string frame(reinterpret_cast<const char *>(buffer), size);
+        _loop.addTimer(_delay_ms, [this, frame]() {
+            _serial.write(reinterpret_cast<const uint8_t *>(frame.data()), frame.size());
+            _serial.flushBacklog();
+        });
+        return size;
+    }
+    using Stream::write;
+
+    uint64_t acks;
+    uint64_t dropped;
+
+private:
+    // boundary, address, then the control bytes, the second telling a supervisory frame
+    static bool isAck(const uint8_t *buffer, size_t size)
+    {
+        uint8_t bytes[4];
+        size_t count = 0;
+        for (size_t i = 0; i < size && count < sizeof(bytes); i++) {
+            uint8_t byte = buffer[i];
+            if (byte == COMMS_FRAME_ESCAPE && i + 1 < size)
+                byte = buffer[++i] ^ (1 << COMMS_ESCAPE_BIT_SWAP);
+            bytes[count++] = byte;
+        }
+        return count == sizeof(bytes) && (bytes[3] & COMMS_CONTROL_TYPES) == (COMMS_CONTROL_ACK);
+    }
+
+    EventLoop      &_loop;
+    HardwareSerial &_serial;
+    double          _drop;
+    uint32_t        _delay_ms;
+};
+
+struct Controller {
+    std::string     pty;
+    HardwareSerial *serial;
+    AckFilter      *link;
+    CommsControl   *comms;
+    double          alarm_credit;
+};
+
+// a frame goes out on every payload with the latest values, so a DATA payload is only timed
+// the first time it is seen
+#define HEVLOAD_SEEN 65536
+
+struct BroadcastClient {
+    int         fd;
+    std::string input;
+    std::unordered_set<uint32_t> seen;
+    std::deque<uint32_t> seen_order;
+};
+
+struct Request {
+    int         fd;
+    uint64_t    start_us;
+    std::string reply;
+};
+
+struct Counters {
+    uint64_t data_sent = 0;
+    uint64_t data_full = 0;      // the DATA queue of the controller was full
+    uint64_t alarms_sent = 0;
+    uint64_t alarms_full = 0;
+    uint64_t commands = 0;       // received by the controllers
+    uint64_t samples_seen = 0;   // DATA timestamps seen by the UIs, each UI counted
+    uint64_t requests_acked = 0;
+    uint64_t requests_nacked = 0;
+    uint64_t requests_failed = 0;
+    std::vector<uint32_t> broadcast_us;
+    std::vector<uint32_t> request_us;
+};
+
+static int connectTo(const std::string &ip, uint16_t port, bool blocking)
+{
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &addr.sin_addr) != 1)
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | (blocking ? 0 : SOCK_NONBLOCK), 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [--controllers K] [--rate HZ] [--alarms HZ] [--ack-drop P] [--ack-delay MS]\n"
+                    "          [--clients M] [--requests HZ] [--seconds S] [--warmup S] [--ip IP] [--pid PID | -- COMMAND ...]\n"
+                    "  --controllers simulated controllers, one pty each (1)\n"
+                    "  --rate        DATA payloads per second of each controller (100)\n"
+                    "  --alarms      ALARM payloads per second of each controller, an alarm storm (0)\n"
+                    "  --ack-drop    fraction of the ACKs of commands never sent, so that they are resent (0)\n"
+                    "  --ack-delay   ms the other ACKs are held back (0)\n"
+                    "  --clients     UIs on the JSON broadcast (1)\n"
+                    "  --requests    cmd requests per second on the request socket (0)\n"
+                    "  --seconds     of measurement (10), after --warmup seconds (2)\n"
+                    "  --ip          of the data server's sockets (127.0.0.1)\n"
+                    "  --pid         data server started by hand, for its CPU use\n"
+                    "  COMMAND       data server to start, {pty} in an argument is repeated per controller\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool value = i + 1 < argc;
+        if (arg == "--controllers" && value) {
+            options.controllers = atoi(argv[++i]);
+        } else if (arg == "--rate" && value) {
+            options.data_rate = atof(argv[++i]);
+        } else if (arg == "--alarms" && value) {
+            options.alarm_rate = atof(argv[++i]);
+        } else if (arg == "--ack-drop" && value) {
+            options.ack_drop = atof(argv[++i]);
+        } else if (arg == "--ack-delay" && value) {
+            options.ack_delay_ms = static_cast<uint32_t>(atoi(argv[++i]));
+        } else if (arg == "--clients" && value) {
+            options.clients = atoi(argv[++i]);
+        } else if (arg == "--requests" && value) {
+            options.request_rate = atof(argv[++i]);
+        } else if (arg == "--seconds" && value) {
+            options.seconds = atof(argv[++i]);
+        } else if (arg == "--warmup" && value) {
+            options.warmup = atof(argv[++i]);
+        } else if (arg == "--ip" && value) {
+            options.ip = argv[++i];
+        } else if (arg == "--pid" && value) {
+            options.pid = static_cast<pid_t>(atoi(argv[++i]));
+        } else if (arg == "--") {
+            options.command.assign(argv + i + 1, argv + argc);
+            break;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (options.controllers < 1 || options.data_rate < 0 || options.alarm_rate < 0 || options.clients < 0
+            || options.ack_drop < 0 || options.ack_drop > 1 || options.seconds <= 0
+            || (options.pid != 0 && !options.command.empty())) {
+        usage(argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // the ptys, raw before anything is written as the data server only sets them up once it has opened them
+    EventLoop loop;
+    std::deque<HardwareSerial> serials;
+    std::deque<AckFilter> links;
+    std::deque<CommsControl> comms;
+    std::vector<Controller> controllers;
+    Counters counters;
+    for (int i = 0; i < options.controllers; i++) {
+        int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+            perror("posix_openpt");
+            return 1;
+        }
+        int slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+        termios tio;
+        tcgetattr(slave, &tio);
+        cfmakeraw(&tio);
+        tcsetattr(slave, TCSANOW, &tio);
+        close(slave);
+
+        serials.emplace_back();
+        serials.back().attach(master);
+        links.emplace_back(loop, serials.back(), options.ack_drop, options.ack_delay_ms);
+        comms.emplace_back(115200, links.back());
+        Controller controller;
+        controller.pty = ptsname(master);
+        controller.serial = &serials.back();
+        controller.link = &links.back();
+        controller.comms = &comms.back();
+        controller.alarm_credit = 0;
+        controllers.push_back(controller);
+    }
+    for (size_t i = 0; i < controllers.size(); i++) {
+        Controller *controller = &controllers[i];
+        loop.add(controller->serial->getFd(), EPOLLIN, [controller, &counters](uint32_t) {
+            // commands are ACKed by CommsControl itself, through the filter
+            Payload pl;
+            while (controller->serial->available() > 0) {
+                controller->comms->receiver();
+                while (controller->comms->readPayload(pl)) {
+                    if (pl.getType() == PAYLOAD_TYPE::CMD)
+                        counters.commands++;
+                }
+            }
+            controller->comms->sender();
+            controller->serial->flushBacklog();
+        });
+    }
+
+    pid_t server = options.pid;
+    if (!options.command.empty()) {
+        std::vector<std::string> args;
+        for (size_t i = 0; i < options.command.size(); i++) {
+            const std::string &arg = options.command[i];
+            size_t at = arg.find("{pty}");
+            if (at == std::string::npos) {
+                // the option of a {pty} argument comes with each of its copies
+                if (i + 1 >= options.command.size() || options.command[i + 1].find("{pty}") == std::string::npos
+                        || arg.empty() || arg[0] != '-')
+                    args.push_back(arg);
+                continue;
+            }
+            for (auto &controller : controllers) {
+                if (i > 0 && !options.command[i - 1].empty() && options.command[i - 1][0] == '-')
+                    args.push_back(options.command[i - 1]);
+                args.push_back(arg.substr(0, at) + controller.pty + arg.substr(at + 5));
+            }
+        }
+        server = fork();
+        if (server == 0) {
+            std::vector<char *> exec_args;
+            for (auto &arg : args)
+                exec_args.push_back(const_cast<char *>(arg.c_str()));
+            exec_args.push_back(nullptr);
+            execvp(exec_args[0], exec_args.data());
+            perror(exec_args[0]);
+            _exit(127);
+        }
+    } else if (server > 0 && kill(server, 0) != 0) {
+        fprintf(stderr, "no data server of pid %d: %s\n", server, strerror(errno));
+        return 1;
+    } else if (server == 0) {
+        printf("start the data server on the controllers:");
+        for (auto &controller : controllers)
+            printf(" %s", controller.pty.c_str());
+        printf("\n");
+        fflush(stdout);
+    }
+
+    // the UIs connect once the data server listens
+    std::vector<BroadcastClient> clients;
+    uint64_t connect_until_us = EventLoop::getTimeUs() + static_cast<uint64_t>((options.warmup + 30) * 1e6);
+    while (static_cast<int>(clients.size()) < options.clients && EventLoop::getTimeUs() < connect_until_us) {
+        if (!options.command.empty() && !isServerRunning(server))
+            return 1;
+        int fd = connectTo(options.ip, HEV_PORT_BROADCAST_WEB, true);
+        if (fd < 0) {
+            // keep the controllers going meanwhile, as the data server may wait on them
+            loop.addTimer(50, [&loop]() { loop.stop(); });
+            loop.run();
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        clients.push_back(BroadcastClient());
+        clients.back().fd = fd;
+    }
+    if (static_cast<int>(clients.size()) < options.clients) {
+        fprintf(stderr, "could not connect to %s:%d\n", options.ip.c_str(), HEV_PORT_BROADCAST_WEB);
+        if (!options.command.empty())
+            kill(server, SIGTERM);
+        return 1;
+    }
+    // connected, but perhaps to another data server while the child could not bind
+    if (!options.command.empty() && !isServerRunning(server))
+        return 1;
+
+    bool measuring = false;
+    static const char pattern[] = "\"timestamp\": ";
+    const size_t pattern_size = sizeof(pattern) - 1;
+    for (size_t c = 0; c < clients.size(); c++) {
+        loop.add(clients[c].fd, EPOLLIN, [&, c](uint32_t) {
+            BroadcastClient &client = clients[c];
+            char buffer[65536];
+            ssize_t n;
+            uint32_t now = static_cast<uint32_t>(micros());
+            while ((n = recv(client.fd, buffer, sizeof(buffer), 0)) > 0)
+                client.input.append(buffer, static_cast<size_t>(n));
+            if (n == 0) {
+                loop.remove(client.fd);
+                return;
+            }
+            // the DATA payloads carry the time they were written instead of the controller's millis()
+            size_t keep = client.input.size() > pattern_size ? client.input.size() - pattern_size : 0;
+            size_t pos = 0;
+            while ((pos = client.input.find(pattern, pos)) != std::string::npos) {
+                size_t end = pos + pattern_size;
+                uint32_t timestamp = 0;
+                while (end < client.input.size() && client.input[end] >= '0' && client.input[end] <= '9')
+                    timestamp = timestamp * 10 + static_cast<uint32_t>(client.input[end++] - '0');
+                if (end == client.input.size()) {
+                    keep = pos;
+                    break;
+                }
+                pos = end;
+                keep = end;
+                if (!client.seen.insert(timestamp).second)
+                    continue;
+                client.seen_order.push_back(timestamp);
+                if (client.seen_order.size() > HEVLOAD_SEEN) {
+                    client.seen.erase(client.seen_order.front());
+                    client.seen_order.pop_front();
+                }
+                if (measuring) {
+                    counters.samples_seen++;
+                    counters.broadcast_us.push_back(now - timestamp);
+                }
+            }
+            client.input.erase(0, keep);
+        });
+    }
+
+    // requests, each on a connection of its own as the UIs do
+    std::map<int, Request> requests;
+    std::function<void(int, uint32_t)> onRequest = [&](int fd, uint32_t events) {
+        auto it = requests.find(fd);
+        if (it == requests.end())
+            return;
+        Request &request = it->second;
+        bool done = false, failed = false;
+        if (events & EPOLLOUT) {
+            static const char cmd[] = "{\"type\": \"cmd\", \"cmdtype\": \"GENERAL\", \"cmd\": \"START\", \"param\": null}";
+            failed = send(fd, cmd, sizeof(cmd) - 1, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(cmd) - 1);
+            loop.modify(fd, EPOLLIN);
+        } else {
+            char buffer[4096];
+            ssize_t n;
+            while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+                request.reply.append(buffer, static_cast<size_t>(n));
+            done = (n == 0);
+            failed = (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+        }
+        if (!done && !failed)
+            return;
+        if (measuring) {
+            if (failed) {
+                counters.requests_failed++;
+            } else {
+                bool acked = request.reply.find("\"ack\"") != std::string::npos;
+                acked ? counters.requests_acked++ : counters.requests_nacked++;
+                counters.request_us.push_back(static_cast<uint32_t>(EventLoop::getTimeUs() - request.start_us));
+            }
+        }
+        loop.remove(fd);
+        close(fd);
+        requests.erase(it);
+    };
+    double request_credit = 0;
+
+    // the load, on a 1 ms tick
+    uint64_t start_us = EventLoop::getTimeUs() + static_cast<uint64_t>(options.warmup * 1e6);
+    uint64_t end_us = start_us + static_cast<uint64_t>(options.seconds * 1e6);
+    uint64_t last_us = EventLoop::getTimeUs();
+    double data_credit = 0;
+    clockid_t server_clock;
+    bool server_cpu = server > 0 && clock_getcpuclockid(server, &server_clock) == 0;
+    bool server_lost = false;
+    uint64_t server_start = 0, server_end = 0, self_start = 0, self_end = 0;
+    long rss_kb = 0;
+    uint8_t alarm_code = 1;
+    std::function<void()> tick = [&]() {
+        uint64_t now_us = EventLoop::getTimeUs();
+        double elapsed = (now_us - last_us) / 1e6;
+        last_us = now_us;
+        if (!measuring && now_us >= start_us) {
+            // the CPU clock is of the pid, so it must still be the child's after the warm-up
+            if (!options.command.empty() && !isServerRunning(server)) {
+                server_lost = true;
+                loop.stop();
+                return;
+            }
+            measuring = true;
+            server_start = server_cpu ? getCpuUs(server_clock) : 0;
+            self_start = getCpuUs(CLOCK_PROCESS_CPUTIME_ID);
+        }
+        if (now_us >= end_us) {
+            server_end = server_cpu ? getCpuUs(server_clock) : 0;
+            self_end = getCpuUs(CLOCK_PROCESS_CPUTIME_ID);
+            rss_kb = server > 0 ? getRssKb(server) : 0;
+            loop.stop();
+            return;
+        }
+
+        data_credit += options.data_rate * elapsed;
+        int data = static_cast<int>(data_credit);
+        data_credit -= data;
+        for (auto &controller : controllers) {
+            for (int i = 0; i < data; i++) {
+                data_format payload;
+                payload.timestamp = static_cast<uint32_t>(micros());
+                payload.fsm_state = 5;
+                payload.pressure_buffer = static_cast<uint16_t>(30000 + rand() % 16);
+                payload.pressure_inhale = static_cast<uint16_t>(2000 + rand() % 16);
+                payload.pressure_patient = static_cast<uint16_t>(1500 + rand() % 32);
+                Payload pl;
+                pl.setData(&payload);
+                bool queued = controller.comms->writePayload(pl);
+                if (measuring)
+                    queued ? counters.data_sent++ : counters.data_full++;
+            }
+            controller.alarm_credit += options.alarm_rate * elapsed;
+            while (controller.alarm_credit >= 1) {
+                controller.alarm_credit -= 1;
+                alarm_format alarm;
+                alarm.timestamp = static_cast<uint32_t>(micros());
+                alarm.alarm_type = ALARM_TYPE::HP;
+                alarm.alarm_code = alarm_code;
+                alarm_code = static_cast<uint8_t>(alarm_code % ALARM_CODES::ARDUINO_FAIL + 1);
+                Payload pl;
+                pl.setAlarm(&alarm);
+                bool queued = controller.comms->writePayload(pl);
+                if (measuring)
+                    queued ? counters.alarms_sent++ : counters.alarms_full++;
+            }
+            controller.comms->sender();
+            controller.serial->flushBacklog();
+        }
+
+        request_credit += options.request_rate * elapsed;
+        while (request_credit >= 1) {
+            request_credit -= 1;
+            int fd = connectTo(options.ip, HEV_PORT_REQUEST, false);
+            if (fd < 0) {
+                if (measuring)
+                    counters.requests_failed++;
+                continue;
+            }
+            requests[fd] = Request{fd, now_us, std::string()};
+            loop.add(fd, EPOLLOUT, [fd, &onRequest](uint32_t events) { onRequest(fd, events); });
+        }
+        loop.addTimer(1, tick);
+    };
+    loop.addTimer(1, tick);
+    loop.run();
+    if (server_lost)
+        return 1;
+
+    // the data server sees its controllers go away
+    for (auto &client : clients)
+        close(client.fd);
+    for (auto &request : requests)
+        close(request.first);
+    for (auto &controller : controllers)
+        controller.serial->close();
+    if (!options.command.empty()) {
+        kill(server, SIGTERM);
+        int status;
+        for (int i = 0; i < 200 && waitpid(server, &status, WNOHANG) == 0; i++)
+            usleep(10000);
+        kill(server, SIGKILL);
+        waitpid(server, &status, WNOHANG);
+    }
+
+    uint64_t acks = 0, acks_dropped = 0;
+    for (auto &link : links) {
+        acks += link.acks;
+        acks_dropped += link.dropped;
+    }
+    double seconds = options.seconds;
+    printf("%d controllers, %.0f DATA/s and %.0f ALARM/s each, %d UIs, %.0f requests/s, over %.1f s\n",
+           options.controllers, options.data_rate, options.alarm_rate, options.clients, options.request_rate, seconds);
+    printf("%-22s %.0f DATA/s, %.0f ALARM/s written; %llu DATA and %llu ALARM not queued (queue full)\n", "controllers",
+           counters.data_sent / seconds, counters.alarms_sent / seconds,
+           static_cast<unsigned long long>(counters.data_full), static_cast<unsigned long long>(counters.alarms_full));
+    printf("%-22s %llu commands received, %llu of %llu ACKs dropped\n", "",
+           static_cast<unsigned long long>(counters.commands), static_cast<unsigned long long>(acks_dropped),
+           static_cast<unsigned long long>(acks));
+    double seen = (counters.data_sent && options.clients) ? 100.0 * counters.samples_seen / options.clients / counters.data_sent : 0;
+    printf("%-22s %.1f%% of the DATA seen by each UI\n", "broadcast", seen);
+    printPercentiles("  DATA to UI", counters.broadcast_us);
+    if (options.request_rate > 0) {
+        printf("%-22s %llu ack, %llu nack, %llu failed\n", "requests", static_cast<unsigned long long>(counters.requests_acked),
+               static_cast<unsigned long long>(counters.requests_nacked), static_cast<unsigned long long>(counters.requests_failed));
+        printPercentiles("  request to reply", counters.request_us);
+    }
+    if (server_cpu) {
+        uint64_t cpu_us = server_end - server_start;
+        printf("%-22s %.1f%% cpu, %.1f us per DATA, %.1f MB resident\n", "data server", 100.0 * cpu_us / (seconds * 1e6),
+               counters.data_sent ? static_cast<double>(cpu_us) / counters.data_sent : 0.0, rss_kb / 1024.0);
+    }
+    printf("%-22s %.1f%% cpu\n", "load generator", 100.0 * (self_end - self_start) / (seconds * 1e6));
+    return 0;
+}
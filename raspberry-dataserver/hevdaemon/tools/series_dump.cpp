@@ -0,0 +1,145 @@
+// Export of the time series store (hevdaemon --store DIR) as CSV, database_dump.py for the store:
+//
+//   pio run -e series_dump && .pio/build/series_dump/program DIR [--start_date yyyymmdd-HHMM]
+//       [--end_date yyyymmdd-HHMM] [--columns pressure_inhale,alarms,...] > dump.csv
+//
+// The first column is the local date and time, by default the last day of the store is exported.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+#include "EventLoop.h"
+#include "HevSeries.h"
+
+static bool parseDate(const char *text, uint64_t &time_us)
+{
+    tm local;
+    memset(&local, 0, sizeof(local));
+    const char *end = strptime(text, "%Y%m%d-%H%M", &local);
+    if (end == nullptr || *end != '\0')
+        return false;
+    local.tm_isdst = -1;
+    time_us = static_cast<uint64_t>(mktime(&local)) * 1000000;
+    return true;
+}
+
+static void appendInt(std::string &out, int64_t value)
+{
+    char digits[24];
+    char *p = digits + sizeof(digits);
+    uint64_t number = value < 0 ? static_cast<uint64_t>(0) - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+    do {
+        *--p = static_cast<char>('0' + number % 10);
+        number /= 10;
+    } while (number);
+    if (value < 0)
+        *--p = '-';
+    out.append(p, static_cast<size_t>(digits + sizeof(digits) - p));
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s DIR [--start_date yyyymmdd-HHMM] [--end_date yyyymmdd-HHMM] [--columns NAME,...]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage(argv[0]);
+        return 2;
+    }
+    const char *dir = argv[1];
+    uint64_t from_us = 0, to_us = UINT64_MAX;
+    bool from_given = false;
+    std::vector<int> columns;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--start_date") == 0 && i + 1 < argc && parseDate(argv[i + 1], from_us)) {
+            from_given = true;
+            i++;
+        } else if (strcmp(argv[i], "--end_date") == 0 && i + 1 < argc && parseDate(argv[i + 1], to_us)) {
+            i++;
+        } else if (strcmp(argv[i], "--columns") == 0 && i + 1 < argc) {
+            std::string names = argv[++i];
+            size_t start = 0;
+            while (start <= names.size()) {
+                size_t comma = names.find(',', start);
+                std::string name = names.substr(start, comma == std::string::npos ? std::string::npos : comma - start);
+                int column = hevSeriesColumn(name.c_str());
+                if (column < 0) {
+                    fprintf(stderr, "unknown column %s\n", name.c_str());
+                    return 2;
+                }
+                columns.push_back(column);
+                if (comma == std::string::npos)
+                    break;
+                start = comma + 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (columns.empty()) {
+        for (size_t c = 0; c < HEV_SERIES_COLUMNS; c++)
+            if (c != HEV_SERIES_TIME)
+                columns.push_back(static_cast<int>(c));
+    }
+
+    uint64_t start_us = EventLoop::getTimeUs();
+    HevSeriesReader store;
+    if (!store.open(dir)) {
+        fprintf(stderr, "no store in %s\n", dir);
+        return 1;
+    }
+    if (!from_given && store.getLastUs() > 86400ull * 1000000)
+        from_us = store.getLastUs() - 86400ull * 1000000;
+    HevSeriesColumns samples;
+    store.query(from_us, to_us, samples);
+    uint64_t query_us = EventLoop::getTimeUs() - start_us;
+
+    std::string out = "date";
+    for (int column : columns) {
+        out += ',';
+        out += hev_series_fields[column].name;
+    }
+    out += '\n';
+    // the date only changes once a second, formatted once per second
+    time_t second = -1;
+    char date[32] = "";
+    const std::vector<int64_t> &times = samples.values[HEV_SERIES_TIME];
+    for (size_t row = 0; row < samples.size(); row++) {
+        time_t t = static_cast<time_t>(times[row] / 1000000);
+        if (t != second) {
+            second = t;
+            tm local;
+            localtime_r(&t, &local);
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &local);
+        }
+        out += date;
+        int millis = static_cast<int>(times[row] / 1000 % 1000);
+        out += '.';
+        out += static_cast<char>('0' + millis / 100);
+        out += static_cast<char>('0' + millis / 10 % 10);
+        out += static_cast<char>('0' + millis % 10);
+        for (int column : columns) {
+            out += ',';
+            appendInt(out, samples.values[column][row]);
+        }
+        out += '\n';
+        if (out.size() >= 1 << 20) {
+            fwrite(out.data(), 1, out.size(), stdout);
+            out.clear();
+        }
+    }
+    fwrite(out.data(), 1, out.size(), stdout);
+    fflush(stdout);
+
+    fprintf(stderr, "%zu samples of %llu in %zu chunks, queried in %.1f ms, exported in %.1f ms\n", samples.size(),
+            static_cast<unsigned long long>(store.getSampleCount()), store.getChunkCount(), query_us / 1e3,
+            (EventLoop::getTimeUs() - start_us) / 1e3);
+    return 0;
+}
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+# client of the pipelined request channel of hevdaemon (port 54324):
+# one persistent connection, any number of requests in flight, each answered
+# once the controller has ACKed it (frame layout in hevdaemon/src/RpcServer.h)
+
+import argparse
+import asyncio
+import itertools
+import time
+from struct import Struct
+from typing import Dict, List
+import logging
+from commsConstants import CMD_TYPE, CMD_MAP, ALARM_CODES
+logging.basicConfig(level=logging.INFO,
+                    format='%(asctime)s - %(levelname)s - %(message)s')
+
+RPC_CMD = 1
+RPC_ACK_ALARM = 2
+RPC_STATUS = ["ACKED", "REJECTED", "TIMEOUT"]
+
+
+class HEVRpc(object):
+    _requestStruct = Struct("<HBBIBBHI")
+    _replyStruct = Struct("<HBBII")
+
+    def __init__(self):
+        self._reader = None
+        self._writer = None
+        self._pending = {}      # futures by request id
+        self._ids = itertools.count(1)
+        self._receiver = None
+
+    async def connect(self, ip: str="127.0.0.1", port: int=54324) -> None:
+        self._reader, self._writer = await asyncio.open_connection(ip, port)
+        self._receiver = asyncio.ensure_future(self.receive())
+
+    async def close(self) -> None:
+        self._writer.close()
+        await self._writer.wait_closed()
+        self._receiver.cancel()
+
+    async def receive(self) -> None:
+        try:
+            while True:
+                data = await self._reader.readexactly(self._replyStruct.size)
+                size, kind, status, rid, latency = self._replyStruct.unpack(data)
+                future = self._pending.pop(rid, None)
+                if future is None or future.done():
+                    continue
+                future.set_result({
+                    "id"         : rid,
+                    "status"     : RPC_STATUS[status] if status < len(RPC_STATUS) else status,
+                    "latency_us" : latency,   # from the daemon reading the request to the controller's ACK
+                    "rtt_us"     : int((time.perf_counter() - future.sent) * 1e6)
+                })
+        except (asyncio.IncompleteReadError, ConnectionResetError) as e:
+            for future in self._pending.values():
+                if not future.done():
+                    future.set_exception(ConnectionError("Connection lost with hevdaemon"))
+            self._pending.clear()
+
+    def encode(self, cmdtype: str, cmd: str, param: int=0, device: int=0) -> (int, bytes):
+        # device is the index of the controller in the "devices" reply, 0 for the first
+        rid = next(self._ids) & 0xFFFFFFFF
+        if cmdtype == "ALARM":
+            # unlatch an alarm, as the "alarm" request of the JSON socket
+            frame = self._requestStruct.pack(self._requestStruct.size, RPC_ACK_ALARM, device, rid,
+                                             ALARM_CODES[cmd].value, 0, 0, 0)
+        else:
+            frame = self._requestStruct.pack(self._requestStruct.size, RPC_CMD, device, rid,
+                                             CMD_TYPE[cmdtype].value, CMD_MAP[cmdtype].value[cmd].value, 0,
+                                             int(param or 0))
+        return rid, frame
+
+    async def submit(self, requests: List[Dict]) -> List[Dict]:
+        # {"cmdtype", "cmd", "param", "device"} dicts written in one go, the replies in the same order
+        futures = []
+        frames = b""
+        sent = time.perf_counter()
+        loop = asyncio.get_event_loop()
+        for request in requests:
+            rid, frame = self.encode(request["cmdtype"], request["cmd"], request.get("param", 0),
+                                     request.get("device", 0))
+            future = loop.create_future()
+            future.sent = sent
+            self._pending[rid] = future
+            futures.append(future)
+            frames += frame
+        self._writer.write(frames)
+        await self._writer.drain()
+        return await asyncio.gather(*futures)
+
+    async def send_cmd(self, cmdtype: str, cmd: str, param: int=0, device: int=0) -> Dict:
+        return (await self.submit([{"cmdtype": cmdtype, "cmd": cmd, "param": param, "device": device}]))[0]
+
+
+def percentile(values: List[int], fraction: float) -> int:
+    return sorted(values)[min(len(values) - 1, int(len(values) * fraction))]
+
+
+async def run(count: int, batch: int, cmdtype: str, cmd: str, param: int, device: int) -> None:
+    rpc = HEVRpc()
+    await rpc.connect()
+    replies = []
+    start = time.perf_counter()
+    while len(replies) < count:
+        n = min(batch, count - len(replies))
+        replies += await rpc.submit([{"cmdtype": cmdtype, "cmd": cmd, "param": param, "device": device}] * n)
+    elapsed = time.perf_counter() - start
+    await rpc.close()
+
+    acked = [r for r in replies if r["status"] == "ACKED"]
+    print(f"{len(replies)} requests in batches of {batch}: {len(acked)} ACKed in {elapsed:.2f} s, "
+          f"{len(replies) / elapsed:.0f} requests/s")
+    for name in ["latency_us", "rtt_us"]:
+        values = [r[name] for r in acked]
+        if values:
+            print(f"{name:>10}: median {percentile(values, 0.5)}  90% {percentile(values, 0.9)}  "
+                  f"99% {percentile(values, 0.99)}  max {max(values)}")
+
+
+if __name__ == "__main__":
+    # end to end latency of a harmless command, by default the firmware version read out
+    parser = argparse.ArgumentParser(description='Pipelined requests to hevdaemon')
+    parser.add_argument('--count', type=int, default=100, help='number of requests')
+    parser.add_argument('--batch', type=int, default=10, help='requests written at once')
+    parser.add_argument('--cmdtype', type=str, default='REQUEST_REPORT')
+    parser.add_argument('--cmd', type=str, default='FIRMWARE_VERSION')
+    parser.add_argument('--param', type=int, default=0)
+    parser.add_argument('--device', type=int, default=0, help='index of the controller, in the order served')
+    args = parser.parse_args()
+    asyncio.run(run(args.count, args.batch, args.cmdtype, args.cmd, args.param, args.device))
@@ -11,7 +11,7 @@ import argparse
 import svpi
 import hevfromtxt
 import commsControl
-from commsConstants import PAYLOAD_TYPE, CMD_TYPE, CMD_GENERAL, CMD_SET_TIMEOUT, CMD_SET_MODE, ALARM_CODES, CMD_MAP, CommandFormat
+from commsConstants import PAYLOAD_TYPE, CMD_TYPE, CMD_GENERAL, CMD_SET_TIMEOUT, CMD_SET_MODE, ALARM_CODES, REPORT_TYPE, CMD_MAP, CommandFormat, SettingsFormat, WaveformFormat, SETTINGS_STATUS
 from collections import deque
 from serial.tools import list_ports
 from typing import List
@@ -22,17 +22,36 @@ logging.basicConfig(level=logging.DEBUG,
 class HEVPacketError(Exception):
     pass
 
+# settings that can be changed in one transaction
+SETTINGS_CMD_TYPES = ["SET_TIMEOUT", "SET_THRESHOLD_MIN", "SET_THRESHOLD_MAX"]
+# a transaction is applied at the next breath boundary, allow for a slow breath
+SETTINGS_TIMEOUT = 15 # s
+# size of the inhale waveform table on the controller
+WAVEFORM_POINTS = 32
+# packets queued per broadcast client, the oldest are dropped beyond this
+BROADCAST_QUEUE_PACKETS = 32
+
 class HEVServer(object):
     def __init__(self, lli):
         self._alarms = []
+        self._reports = {}
+        self._settings_txn = 0           # id of the last settings transaction sent
+        self._settings_replies = {}      # controller replies to settings transactions, by txn
+        self._waveform_txn = 0           # id of the last waveform upload sent
+        self._waveform_replies = {}      # controller replies to waveform uploads, by txn
         self._values = None
         self._dblock = threading.Lock()  # make db threadsafe
         self._lli = lli
         self._lli.bind_to(self.polling)
+        # read back the settings in use on the controller rather than assuming them
+        self._lli.writePayload(CommandFormat(cmdType=CMD_TYPE.REQUEST_REPORT.value,
+                                             cmdCode=REPORT_TYPE.CONFIGURATION.value,
+                                             param=0))
 
-        self._broadcasting = True
+        self._broadcast_queues = set()   # one bounded queue of packets per broadcast client
         self._datavalid = None           # something has been received from arduino. placeholder for asyncio.Event()
-        self._dvlock = threading.Lock()  # make datavalid threadsafe
+        self._loop = None                # event loop of the worker thread, owns _datavalid
+        self._dvlock = threading.Lock()  # held until the loop and datavalid exist
         self._dvlock.acquire()           # come up locked to wait for loop
         # start worker thread to send values in background
         worker = threading.Thread(target=self.serve_all, daemon=True)
@@ -42,6 +61,11 @@ class HEVServer(object):
         with self._dblock:
             return f"Alarms: {self._alarms}.\nSensor values: {self._values}"
 
+    def notify(self) -> None:
+        # polling runs on the thread of lli, asyncio.Event is only safe to set from its own loop
+        with self._dvlock:
+            self._loop.call_soon_threadsafe(self._datavalid.set)
+
     def polling(self, payload):
         # get values when we get a callback from commsControl (lli)
         logging.debug(f"Payload received: {payload!r}")
@@ -61,15 +85,27 @@ class HEVServer(object):
                     logging.error(e)
                     self._alarms.append("ARDUINO_FAIL") # assume Arduino is broken
             # let broadcast thread know there is data to send
-            with self._dvlock:
-                self._datavalid.set()
+            self.notify()
         elif payload_type == PAYLOAD_TYPE.DATA:
             # pass data to db
             with self._dblock:
                 self._values = payload.getDict()
             # let broadcast thread know there is data to send
-            with self._dvlock:
-                self._datavalid.set()
+            self.notify()
+        elif payload_type == PAYLOAD_TYPE.REPORT:
+            # keep the latest read out of each report type and code
+            report = payload.getDict()
+            with self._dblock:
+                self._reports[f"{report['reportType']}.{report['reportCode']}"] = report
+            self.notify()
+        elif payload_type == PAYLOAD_TYPE.SETTINGS:
+            # reply to a settings transaction, picked up by the waiting request
+            with self._dblock:
+                self._settings_replies[payload.txn] = payload
+        elif payload_type == PAYLOAD_TYPE.WAVEFORM:
+            # reply to a waveform upload, picked up by the waiting request
+            with self._dblock:
+                self._waveform_replies[payload.txn] = payload
         elif payload_type == PAYLOAD_TYPE.CMD:
             # ignore for the minute
             pass
@@ -84,8 +120,8 @@ class HEVServer(object):
         self._lli.pop_payloadrecv()
             
     async def handle_request(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
-        # listen for queries on the request socket
-        data = await reader.read(300)
+        # listen for queries on the request socket, large enough for a full settings transaction
+        data = await reader.read(4096)
         request = json.loads(data.decode("utf-8"))
 
         # logging
@@ -114,6 +150,12 @@ class HEVServer(object):
                 # processed and sent to controller, send ack to GUI since it's in enum
                 payload = {"type": "ack"}
 
+            elif reqtype == "settings":
+                payload = await self.send_settings(request["settings"])
+
+            elif reqtype == "waveform":
+                payload = await self.send_waveform(request["waveform"])
+
             elif reqtype == "broadcast":
                 # ignore for the minute
                 pass
@@ -123,6 +165,11 @@ class HEVServer(object):
                     # delete alarm if it exists
                     with self._dblock:
                         self._alarms.remove(request["ack"])
+                    # unlatch the alarm on the controller too
+                    command = CommandFormat(cmdType=CMD_TYPE.ACK_ALARM.value,
+                                            cmdCode=ALARM_CODES[request["ack"]].value,
+                                            param=0)
+                    self._lli.writePayload(command)
                     payload = {"type": "ack"}
                 except NameError as e:
                     raise HEVPacketError(f"Alarm could not be removed. May have been removed already. {e}")
@@ -145,42 +192,104 @@ class HEVServer(object):
             await writer.drain()
             writer.close()
 
-    async def handle_broadcast(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
-        # log address
-        addr = writer.get_extra_info("peername")
-        logging.info(f"Broadcasting to {addr!r}")
+    async def send_settings(self, settings) -> dict:
+        # all settings are sent as one transaction, the controller applies them together between two breaths
+        values = []
+        for setting in settings:
+            if setting["cmdtype"] not in SETTINGS_CMD_TYPES:
+                raise HEVPacketError(f"{setting['cmdtype']} can not be set in a settings transaction")
+            values.append((CMD_TYPE[setting["cmdtype"]].value,
+                           CMD_MAP[setting["cmdtype"]].value[setting["cmd"]].value,
+                           setting["param"]))
+
+        with self._dblock:
+            self._settings_txn = (self._settings_txn + 1) % 256
+            txn = self._settings_txn
+            self._settings_replies.pop(txn, None)
+        for frame in SettingsFormat.transaction(txn, values):
+            self._lli.writePayload(frame)
+
+        reply = await self.wait_reply(self._settings_replies, txn, "Settings transaction")
+        # refresh the read backs of what changed
+        for reportType in (REPORT_TYPE.TIMEOUTS, REPORT_TYPE.THRESHOLDS_MIN, REPORT_TYPE.THRESHOLDS_MAX, REPORT_TYPE.CONTROLLER_STATE):
+            self._lli.writePayload(CommandFormat(cmdType=CMD_TYPE.REQUEST_REPORT.value,
+                                                 cmdCode=reportType.value,
+                                                 param=0))
+        return {"type": "ack", "epoch": reply.epoch}
+
+    async def send_waveform(self, waveform) -> dict:
+        # the inhale valve opening over time, swapped in by the controller between two breaths
+        points = [(int(point["time"]), int(point["value"])) for point in waveform]
+        if len(points) > WAVEFORM_POINTS:
+            raise HEVPacketError(f"Waveform of {len(points)} points, at most {WAVEFORM_POINTS} fit")
 
-        while self._broadcasting:
-            # wait for data from serial port
-            try:
-                # set timeout such that there is never pileup
-                await asyncio.wait_for(self._datavalid.wait(), timeout=0.05)
-            except asyncio.TimeoutError:
-                continue
+        with self._dblock:
+            self._waveform_txn = (self._waveform_txn + 1) % 256
+            txn = self._waveform_txn
+            self._waveform_replies.pop(txn, None)
+        for frame in WaveformFormat.upload(txn, points):
+            self._lli.writePayload(frame)
+
+        await self.wait_reply(self._waveform_replies, txn, "Waveform upload")
+        return {"type": "ack"}
+
+    async def wait_reply(self, replies, txn, name):
+        # single reply from the controller once applied, or on rejection
+        deadline = time.time() + SETTINGS_TIMEOUT
+        while time.time() < deadline:
+            with self._dblock:
+                reply = replies.pop(txn, None)
+            if reply is not None:
+                if reply.status == SETTINGS_STATUS.SETTINGS_APPLIED.value:
+                    return reply
+                raise HEVPacketError(f"{name} {txn} rejected: {reply.getDict()['status']}")
+            await asyncio.sleep(0.05)
+        raise HEVPacketError(f"{name} {txn} not applied within {SETTINGS_TIMEOUT} s")
+
+    async def fan_out(self) -> None:
+        # serialise each update once and queue it for every broadcast client
+        while True:
+            await self._datavalid.wait()
+            # reset datavalid, one waiter so that no client misses a wake up
+            self._datavalid.clear()
             # take lock of db and prepare packet
             with self._dblock:
                 values: List[float] = self._values
                 alarms = self._alarms if len(self._alarms) > 0 else None
+                reports = self._reports if len(self._reports) > 0 else None
 
             broadcast_packet = {}
             broadcast_packet["sensors"] = values
             broadcast_packet["alarms"] = alarms # add alarms key/value pair
+            broadcast_packet["reports"] = reports # latest read outs requested with REQUEST_REPORT
 
             logging.debug(f"Send: {json.dumps(broadcast_packet,indent=4)}")
+            packet = json.dumps(broadcast_packet).encode()
 
-            try:
-                writer.write(json.dumps(broadcast_packet).encode())
-                await writer.drain()
-            except (ConnectionResetError, BrokenPipeError):
-                # Connection lost, stop trying to broadcast and free up socket
-                logging.warning(f"Connection lost with {addr!r}")
-                self._broadcasting = False
-            # take control of datavalid and reset it
-            with self._dvlock:
-                self._datavalid.clear()
+            for queue in self._broadcast_queues:
+                if queue.full():
+                    # every packet holds the full state, a slow client only needs the latest
+                    queue.get_nowait()
+                queue.put_nowait(packet)
+
+    async def handle_broadcast(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter) -> None:
+        # log address
+        addr = writer.get_extra_info("peername")
+        logging.info(f"Broadcasting to {addr!r}")
 
-        self._broadcasting = True
-        writer.close()
+        queue = asyncio.Queue(maxsize=BROADCAST_QUEUE_PACKETS)
+        self._broadcast_queues.add(queue)
+        try:
+            while True:
+                packet = await queue.get()
+                writer.write(packet)
+                await writer.drain()
+        except (ConnectionResetError, BrokenPipeError):
+            # Connection lost, stop trying to broadcast and free up socket
+            logging.warning(f"Connection lost with {addr!r}")
+        finally:
+            self._broadcast_queues.discard(queue)
+            writer.close()
 
     async def serve_request(self, ip: str, port: int) -> None:
         server = await asyncio.start_server(
@@ -206,12 +315,13 @@ class HEVServer(object):
 
     async def create_sockets(self) -> None:
         self._datavalid = asyncio.Event() # initially false
+        self._loop = asyncio.get_running_loop()
         self._dvlock.release()
         LOCALHOST = "127.0.0.1"
         b1 = self.serve_broadcast(LOCALHOST, 54320)  # WebUI broadcast
         r1 = self.serve_request(LOCALHOST, 54321)    # joint request socket
         b2 = self.serve_broadcast(LOCALHOST, 54322)  # NativeUI broadcast
-        tasks = [b1, r1, b2]
+        tasks = [self.fan_out(), b1, r1, b2]
         #tasks = [b1, r1]
         await asyncio.gather(*tasks, return_exceptions=True)
 
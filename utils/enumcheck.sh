@@ -1,7 +1,7 @@
 #!/usr/bin/env bash
 set -euo pipefail
 
-for enum in CMD_TYPE CMD_GENERAL CMD_SET_TIMEOUT CMD_SET_MODE ALARM_TYPE ALARM_CODES; do
+for enum in CMD_TYPE CMD_GENERAL CMD_SET_TIMEOUT CMD_SET_VALVE_RAMP VALVE_RAMP_PROFILE CMD_SET_VALVE_LATENCY CMD_SET_MODE ALARM_TYPE ALARM_CODES SETTINGS_STATUS REPORT_TYPE LOOP_STAGE SETTING_UNIT; do
     sed -e "/enum $enum/,/};/!d" -e '/};/d' -e 's/,$//g' -e 's/,\([[:blank:]]*\)\/\/\(.*\)/\1 #\2/g' -e 's@//@#@g' -e "s/enum \([a-zA-Z_]*\).*{/class \1(Enum):/" ../arduino/hev_prototype_v1/src/common.h;
     echo;
 done